@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,10 +8,19 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <resolv.h>
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #define HANDLER_ENTRY(NAME) { #NAME, handle_ ## NAME}
 
@@ -23,6 +33,31 @@ struct Channel_users {
   channel_users *next;
 };
 
+/*A PRIVMSG/NOTICE line as it was relayed to a channel. Lines are shared
+  (refcounted) between the channel's history and any replay in progress, so
+  a replay can go on without holding the history lock.*/
+typedef struct History_line history_line;
+struct History_line {
+  int refs;
+  uint64_t when_ms;
+  int len;
+  char text[];
+};
+
+#define HISTORY_LINES 128
+#define HISTORY_BYTES 32768
+
+/*Ring of a channel's most recent lines, bounded both in number of lines and
+  in bytes of text*/
+typedef struct Channel_history channel_history;
+struct Channel_history {
+  pthread_mutex_t lock;
+  history_line *lines[HISTORY_LINES];
+  int start;
+  int count;
+  int bytes;
+};
+
 /*Linked list struct for list of all available channels, includes channel name, topic, active users, and list of channel_users struct*/
 typedef struct Channel_list channel_list;
 struct Channel_list {
@@ -32,6 +67,7 @@ struct Channel_list {
   int md_moder;
   int md_topic;
   channel_users *users;
+  channel_history *history;
   channel_list *next;
 };
 
@@ -41,6 +77,34 @@ struct Client_channels {
   client_channels* next;
 };
 
+/* IRCv3 capabilities a client can enable with CAP REQ */
+#define CAP_BATCH 1
+#define CAP_ECHO_MESSAGE 2
+#define CAP_MESSAGE_TAGS 4
+#define CAP_SERVER_TIME 8
+/* not a capability; set once a client has sent CAP LS */
+#define CAP_NEGOTIATED 256
+
+struct cap_entry {
+  char* name;
+  int flag;
+};
+
+struct cap_entry caps[] = {
+  { "batch", CAP_BATCH },
+  { "echo-message", CAP_ECHO_MESSAGE },
+  { "message-tags", CAP_MESSAGE_TAGS },
+  { "server-time", CAP_SERVER_TIME },
+};
+int num_caps = sizeof(caps) / sizeof(struct cap_entry);
+
+/* Longest tag section (including '@' and the trailing space) we accept in
+   front of the usual 512-byte message */
+#define MAX_TAGS_LEN 4096
+
+/* Most targets a single PRIVMSG, NOTICE or JOIN may name (TARGMAX) */
+#define MAX_TARGETS 4
+
 /* A user struct to store information about connected users. Will add values as necessary. */
 typedef struct User user;
 struct User {
@@ -48,10 +112,19 @@ struct User {
   char *username;
   char *fullname;
   char *away;
+  char *host; /* fixed at registration */
   int clientID;
   int md_oper;
   int registered;
   client_channels* channels;
+  /* partial line received from the client, kept here (rather than on the
+     connection thread's stack) so it survives a hot restart */
+  char inbuf[MAX_TAGS_LEN + 512];
+  int inlen;
+  int incr;
+  int intags; /* length of the line's tag section, -1 while reading it */
+  int caps;
+  int cap_negotiating; /* registration waits for CAP END */
   user *next;
 };
 
@@ -70,6 +143,8 @@ struct handler_entry
 };
 
 int num_channels=0;
+/*number of history lines replayed to a user joining a channel (-H)*/
+int join_replay = 0;
 /*used to store time server was created*/
 char s_time[32];
 /*mutex lock for list of users*/
@@ -82,13 +157,147 @@ user *head = NULL;
 /*beginning of channel list*/
 channel_list *channels_head=NULL;
 char* password = "";
+char* port = "6667";
+/*loopback socket serving metrics, -1 unless enabled with -m*/
+int adminSocket = -1;
+/*path of our own binary, re-exec'd on hot restart*/
+char exe_path[1024];
+/*client threads hold this for reading while they consume and dispatch
+  input; a hot restart takes it for writing so the tables are quiescent*/
+pthread_rwlock_t dispatch_lock;
+__thread int in_dispatch = 0;
 
 /*function to be run by client threads*/
 void* client_commands(void* args);
 
+/* Metrics. Every thread records into its own shard, so the hot paths never
+   contend: a shard has a single writer, which updates it with relaxed
+   atomic stores, and the admin thread sums all shards when it is scraped.
+   Shards are never freed; when a thread exits its shard is returned to the
+   registry and picked up by the next thread, so counters stay monotonic.
+
+   Durations go into log-linear histograms (two sub-buckets per power of two
+   nanoseconds), in the spirit of HdrHistogram. */
+
+#define MAX_HANDLERS 32
+#define HIST_BUCKETS 72
+
+enum lock_id { LOCK_USERS, LOCK_CHANNELS, LOCK_SEND, LOCK_DISPATCH, NUM_LOCKS };
+const char *lock_names[NUM_LOCKS] = { "users", "channels", "send", "dispatch" };
+
+typedef struct Histogram histogram;
+struct Histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t sum_ns;
+};
+
+typedef struct Metrics_shard metrics_shard;
+struct Metrics_shard {
+  histogram commands[MAX_HANDLERS];
+  histogram lock_wait[NUM_LOCKS];
+  uint64_t unknown_commands;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  int in_use;
+  metrics_shard *next;
+};
+
+metrics_shard *shards_head = NULL;
+pthread_key_t shard_key;
+__thread metrics_shard *my_shard = NULL;
+/*commands currently being executed, across all threads*/
+int commands_in_flight = 0;
+/*command this thread is executing (-1 if none) and when it started*/
+__thread int cur_cmd = -1;
+__thread uint64_t cur_cmd_start;
+
+#define METRIC_ADD(field, n) \
+  __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define METRIC_READ(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void shard_release(void *shard) {
+  __atomic_store_n(&((metrics_shard *) shard)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+metrics_shard *get_shard() {
+  if (my_shard != NULL) return my_shard;
+  metrics_shard *shard;
+  for (shard = __atomic_load_n(&shards_head, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&shard->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+  }
+  if (shard == NULL) {
+    shard = calloc(1, sizeof(metrics_shard));
+    shard->in_use = 1;
+    shard->next = __atomic_load_n(&shards_head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards_head, &shard->next, shard, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+  pthread_setspecific(shard_key, shard);
+  my_shard = shard;
+  return shard;
+}
+
+int hist_bucket(uint64_t ns) {
+  if (ns < 2) return (int) ns;
+  int msb = 63 - __builtin_clzll(ns);
+  int idx = msb * 2 + ((ns >> (msb - 1)) & 1);
+  return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+void hist_record(histogram *h, uint64_t ns) {
+  METRIC_ADD(h->counts[hist_bucket(ns)], 1);
+  METRIC_ADD(h->sum_ns, ns);
+}
+
+/* pthread_mutex_lock() that records how long we waited, if we had to */
+void s_lock(pthread_mutex_t *m, enum lock_id id) {
+  if (pthread_mutex_trylock(m) == 0) return;
+  uint64_t start = now_ns();
+  pthread_mutex_lock(m);
+  hist_record(&get_shard()->lock_wait[id], now_ns() - start);
+}
+
+void s_rdlock(pthread_rwlock_t *l, enum lock_id id) {
+  if (pthread_rwlock_tryrdlock(l) == 0) return;
+  uint64_t start = now_ns();
+  pthread_rwlock_rdlock(l);
+  hist_record(&get_shard()->lock_wait[id], now_ns() - start);
+}
+
+void command_begin(int idx) {
+  __atomic_add_fetch(&commands_in_flight, 1, __ATOMIC_RELAXED);
+  cur_cmd = idx;
+  cur_cmd_start = now_ns();
+}
+
+void command_end() {
+  if (cur_cmd == -1) return;
+  hist_record(&get_shard()->commands[cur_cmd], now_ns() - cur_cmd_start);
+  __atomic_sub_fetch(&commands_in_flight, 1, __ATOMIC_RELAXED);
+  cur_cmd = -1;
+}
+
+/* Terminates the calling client thread, first releasing the dispatch lock if
+   the thread is in the middle of handling a command. */
+void client_exit() {
+  /* e.g. QUIT never returns to its caller */
+  command_end();
+  if (in_dispatch) {
+    in_dispatch = 0;
+    pthread_rwlock_unlock(&dispatch_lock);
+  }
+  pthread_exit(NULL);
+}
+
 
 user* ID_find(int clientSocket) {
-  pthread_mutex_lock(&lock);
+  s_lock(&lock, LOCK_USERS);
   user* user = head;
   while (user != NULL) {
     if (user->clientID == clientSocket) {
@@ -160,7 +369,13 @@ user *userInit(int id) {
   usr->md_oper = 0;
   usr->next = NULL;
   usr->away = NULL;
+  usr->host = NULL;
   usr->channels = NULL;
+  usr->inlen = 0;
+  usr->incr = 0;
+  usr->intags = 0;
+  usr->caps = 0;
+  usr->cap_negotiating = 0;
   return usr;
 }
 
@@ -195,10 +410,73 @@ channel_list *channel_list_init() {
   new->md_topic = 0;
   new->md_moder = 0;
   new->users = NULL;
+  new->history = (channel_history *)calloc(1, sizeof(channel_history));
+  pthread_mutex_init(&new->history->lock, NULL);
   new->next = NULL;
   return new;
 }
 
+void history_line_unref(history_line *line) {
+  if (__atomic_sub_fetch(&line->refs, 1, __ATOMIC_ACQ_REL) == 0) free(line);
+}
+
+/* Appends a line to the channel's history, evicting the oldest lines to
+   stay within HISTORY_LINES and HISTORY_BYTES */
+void history_add(channel_list *chan, const char *text, uint64_t when_ms) {
+  channel_history *h = chan->history;
+  int len = strlen(text);
+  if (len > HISTORY_BYTES) return;
+  history_line *line = malloc(sizeof(history_line) + len + 1);
+  line->refs = 1;
+  line->when_ms = when_ms;
+  line->len = len;
+  memcpy(line->text, text, len + 1);
+
+  pthread_mutex_lock(&h->lock);
+  while (h->count == HISTORY_LINES || (h->count > 0 && h->bytes + len > HISTORY_BYTES)) {
+    history_line *old = h->lines[h->start];
+    h->start = (h->start + 1) % HISTORY_LINES;
+    h->count--;
+    h->bytes -= old->len;
+    history_line_unref(old);
+  }
+  h->lines[(h->start + h->count) % HISTORY_LINES] = line;
+  h->count++;
+  h->bytes += len;
+  pthread_mutex_unlock(&h->lock);
+}
+
+/* Takes a reference to (at most) the latest limit lines, oldest first.
+   Returns how many were stored into out. */
+int history_latest(channel_list *chan, int limit, history_line **out) {
+  channel_history *h = chan->history;
+  int i, n;
+  pthread_mutex_lock(&h->lock);
+  n = limit < h->count ? limit : h->count;
+  for (i = 0; i < n; i++) {
+    out[i] = h->lines[(h->start + h->count - n + i) % HISTORY_LINES];
+    __atomic_add_fetch(&out[i]->refs, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&h->lock);
+  return n;
+}
+
+void history_free(channel_history *h) {
+  int i;
+  if (h == NULL) return;
+  for (i = 0; i < h->count; i++) {
+    history_line_unref(h->lines[(h->start + i) % HISTORY_LINES]);
+  }
+  pthread_mutex_destroy(&h->lock);
+  free(h);
+}
+
+uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /* Frees a user struct from memory */
 void userFree(user* usr) {
   user* temp;
@@ -209,6 +487,7 @@ void userFree(user* usr) {
     free(usr->username);
     free(usr->fullname);
     free(usr->away);
+    free(usr->host);
     while(usr->channels != NULL){
       tmp = usr->channels->next;
       free(usr->channels->channel);
@@ -270,45 +549,433 @@ void psFree(char** ps) {
 
 
 
-void s_send (char* msg, int clientSocket) {
-  pthread_mutex_lock(&mes);
+void s_gethostname (char* serverhostname, int size) {
+  if(gethostname(serverhostname,size*sizeof(char)) == -1) {
+    perror("Host could not be resolved");
+    client_exit();
+  }
+  return;
+}
+
+/*tags of the message being handled, pointing into the connection's input
+  buffer (without the leading '@'); only valid while the handler runs*/
+__thread const char *cur_tags = NULL;
+__thread int cur_tags_len = 0;
+/*batch this thread has open to a client, if any*/
+__thread int batch_sock = -1;
+__thread char batch_ref[16];
+int batch_counter = 0;
+
+/* Writes an IRCv3 server-time value for when_ms (0 meaning now) */
+void format_time_tag(char* out, int size, uint64_t when_ms) {
+  struct tm tm;
+  if (when_ms == 0) when_ms = now_ms();
+  time_t secs = when_ms / 1000;
+  gmtime_r(&secs, &tm);
+  snprintf(out, size, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec, (int) (when_ms % 1000));
+}
+
+/* Sends msg to a client, adding the tags the client has asked for (a batch
+   reference, server-time) unless msg already carries tags, in which case
+   it was built for this client's capabilities by a fanout. when_ms is the
+   time to report, 0 meaning now. */
+void s_send_at (char* msg, int clientSocket, uint64_t when_ms) {
+  char tagged[MAX_TAGS_LEN + 512];
+  s_lock(&mes, LOCK_SEND);
   user* usr = ID_find(clientSocket);
-  printf("sending to %s: %s", usr->nick, msg);
-  if (send(clientSocket, msg, strlen(msg), 0) <= 0)
+  if (msg[0] != '@' && usr != NULL && ((usr->caps & CAP_SERVER_TIME) || batch_sock == clientSocket)) {
+    int n = 0;
+    char sep = '@';
+    if (batch_sock == clientSocket) {
+      n += snprintf(tagged + n, sizeof(tagged) - n, "%cbatch=%s", sep, batch_ref);
+      sep = ';';
+    }
+    if (usr->caps & CAP_SERVER_TIME) {
+      char when[32];
+      format_time_tag(when, sizeof(when), when_ms);
+      n += snprintf(tagged + n, sizeof(tagged) - n, "%ctime=%s", sep, when);
+    }
+    snprintf(tagged + n, sizeof(tagged) - n, " %s", msg);
+    msg = tagged;
+  }
+  ssize_t sent = send(clientSocket, msg, strlen(msg), 0);
+  if (sent <= 0)
     {
       perror("Socket send() failed");
       close(clientSocket);
       pthread_mutex_unlock(&mes);
-      pthread_exit(NULL);
+      client_exit();
     }
+  METRIC_ADD(get_shard()->bytes_out, sent);
   pthread_mutex_unlock(&mes);
   return;
 }
 
-void s_gethostname (char* serverhostname, int size) {
-  if(gethostname(serverhostname,size*sizeof(char)) == -1) {
-    perror("Host could not be resolved");
-    pthread_exit(NULL);
+void s_send (char* msg, int clientSocket) {
+  s_send_at(msg, clientSocket, 0);
+}
+
+/* Opens a batch to a client that supports them; everything sent to that
+   client until batch_end() is tagged with the batch reference */
+void batch_start(int clientSocket, const char* type, const char* param) {
+  user* usr = ID_find(clientSocket);
+  char msg[512];
+  if (usr == NULL || !(usr->caps & CAP_BATCH) || batch_sock != -1) return;
+  snprintf(batch_ref, sizeof(batch_ref), "%x", __atomic_add_fetch(&batch_counter, 1, __ATOMIC_RELAXED));
+  char server[64];
+  s_gethostname(server, 64);
+  snprintf(msg, sizeof(msg), ":%s BATCH +%s %s %s\r\n", server, batch_ref, type, param);
+  s_send(msg, clientSocket);
+  batch_sock = clientSocket;
+}
+
+void batch_end(int clientSocket) {
+  char msg[128];
+  char server[64];
+  if (batch_sock != clientSocket) return;
+  batch_sock = -1;
+  s_gethostname(server, 64);
+  snprintf(msg, sizeof(msg), ":%s BATCH -%s\r\n", server, batch_ref);
+  s_send(msg, clientSocket);
+}
+
+/* One message relayed to many clients. The tagged variants a recipient
+   may need (server-time, the sender's client-only tags, or both) are each
+   serialized at most once per fanout, however many recipients share it. */
+typedef struct Fanout fanout;
+struct Fanout {
+  char* line;
+  uint64_t when_ms;
+  char* variants[4];
+};
+
+void fanout_init(fanout* f, char* line) {
+  f->line = line;
+  f->when_ms = now_ms();
+  memset(f->variants, 0, sizeof(f->variants));
+}
+
+/* Copies the client-only (+) tags of the message being handled into out,
+   separated by ';'. Returns the number of characters written. */
+int client_only_tags(char* out, int size) {
+  const char* p = cur_tags;
+  const char* end = cur_tags + cur_tags_len;
+  int n = 0;
+  while (p != NULL && p < end) {
+    const char* next = memchr(p, ';', end - p);
+    if (next == NULL) next = end;
+    if (*p == '+' && n + (next - p) + 1 < size) {
+      if (n > 0) out[n++] = ';';
+      memcpy(out + n, p, next - p);
+      n += next - p;
+    }
+    p = next + 1;
   }
-  return;
+  out[n] = '\0';
+  return n;
+}
+
+void fanout_send(fanout* f, int clientSocket) {
+  user* usr = ID_find(clientSocket);
+  int v = 0;
+  if (usr == NULL) return;
+  if (usr->caps & CAP_SERVER_TIME) v |= 1;
+  if ((usr->caps & CAP_MESSAGE_TAGS) && cur_tags_len > 0) v |= 2;
+  if (v == 0) {
+    s_send(f->line, clientSocket);
+    return;
+  }
+  if (f->variants[v] == NULL) {
+    char tags[MAX_TAGS_LEN];
+    int n = 0;
+    if (v & 1) {
+      n += snprintf(tags, sizeof(tags), "time=");
+      format_time_tag(tags + n, sizeof(tags) - n, f->when_ms);
+      n = strlen(tags);
+    }
+    if (v & 2) {
+      if (n > 0) tags[n++] = ';';
+      if (client_only_tags(tags + n, sizeof(tags) - n) == 0) {
+        /* nothing to relay after all */
+        if (n > 0) tags[--n] = '\0';
+      }
+    }
+    if (strlen(tags) == 0) {
+      s_send_at(f->line, clientSocket, f->when_ms);
+      return;
+    }
+    f->variants[v] = malloc(strlen(tags) + strlen(f->line) + 3);
+    sprintf(f->variants[v], "@%s %s", tags, f->line);
+  }
+  s_send(f->variants[v], clientSocket);
+}
+
+void fanout_free(fanout* f) {
+  int i;
+  for (i = 0; i < 4; i++) free(f->variants[i]);
+}
+
+/* Reverse DNS. Hostnames are resolved off the connection threads by a small
+   pool of resolver threads: a lookup is queued as soon as a connection is
+   accepted, and registration just takes whatever the cache holds at that
+   point (the numeric address if the lookup hasn't finished), so it never
+   waits on DNS. A name is only used if it is forward-confirmed, i.e. it
+   resolves back to the client's address. Results, including failures, are
+   cached for a while in a bounded LRU keyed on the numeric address. */
+
+#define RESOLVER_THREADS 4
+#define DNS_CACHE_SIZE 1024
+#define DNS_HASH_SIZE 1031
+#define DNS_TTL 600
+#define DNS_NEGATIVE_TTL 60
+
+typedef struct Dns_entry dns_entry;
+struct Dns_entry {
+  char addr[INET6_ADDRSTRLEN];
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char *name; /* NULL if the address has no (confirmed) name */
+  int pending;
+  time_t expires;
+  dns_entry *hnext;
+  dns_entry *lru_prev;
+  dns_entry *lru_next;
+  dns_entry *qnext;
+};
+
+/*set with -d to skip reverse lookups altogether*/
+int resolver_disabled = 0;
+/*set with -N to send lookups to this nameserver instead of the ones in
+  resolv.conf*/
+char *dns_server_arg = NULL;
+struct sockaddr_in dns_server;
+pthread_mutex_t dnslock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t dnscond = PTHREAD_COND_INITIALIZER;
+dns_entry *dns_hash[DNS_HASH_SIZE];
+/*most recently used entry first*/
+dns_entry *dns_lru_head = NULL;
+dns_entry *dns_lru_tail = NULL;
+int dns_entries = 0;
+dns_entry *dns_queue_head = NULL;
+dns_entry *dns_queue_tail = NULL;
+
+unsigned int dns_hash_addr(const char *addr) {
+  unsigned int h = 5381;
+  while (*addr) h = h * 33 + (unsigned char) *addr++;
+  return h % DNS_HASH_SIZE;
+}
+
+void dns_lru_unlink(dns_entry *e) {
+  if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+  else dns_lru_head = e->lru_next;
+  if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+  else dns_lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+void dns_lru_push(dns_entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = dns_lru_head;
+  if (dns_lru_head) dns_lru_head->lru_prev = e;
+  dns_lru_head = e;
+  if (dns_lru_tail == NULL) dns_lru_tail = e;
+}
+
+dns_entry *dns_find(const char *addr) {
+  dns_entry *e;
+  for (e = dns_hash[dns_hash_addr(addr)]; e != NULL; e = e->hnext) {
+    if (!strcmp(e->addr, addr)) return e;
+  }
+  return NULL;
+}
+
+/* Drops least recently used entries (other than pending ones) until the
+   cache is back under DNS_CACHE_SIZE. Called with dnslock held. */
+void dns_evict() {
+  dns_entry *e = dns_lru_tail;
+  while (dns_entries > DNS_CACHE_SIZE && e != NULL) {
+    dns_entry *prev = e->lru_prev;
+    if (!e->pending) {
+      dns_entry **p = &dns_hash[dns_hash_addr(e->addr)];
+      while (*p != e) p = &(*p)->hnext;
+      *p = e->hnext;
+      dns_lru_unlink(e);
+      free(e->name);
+      free(e);
+      dns_entries--;
+    }
+    e = prev;
+  }
+}
+
+/* Reverse-resolves sa and checks that the name maps back to it. Returns a
+   newly allocated hostname, or NULL. Blocks, so only resolver threads call
+   this. */
+char *dns_resolve(struct sockaddr *sa, socklen_t salen, const char *addr) {
+  char name[NI_MAXHOST];
+  char check[INET6_ADDRSTRLEN];
+  struct addrinfo hints, *res, *ai;
+  char *confirmed = NULL;
+
+  if (getnameinfo(sa, salen, name, sizeof(name), NULL, 0, NI_NAMEREQD) != 0) return NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = sa->sa_family;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(name, NULL, &hints, &res) != 0) return NULL;
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, check, sizeof(check), NULL, 0, NI_NUMERICHOST) == 0
+        && !strcmp(check, addr)) {
+      confirmed = strdup(name);
+      break;
+    }
+  }
+  freeaddrinfo(res);
+  return confirmed;
+}
+
+void* resolver_thread(void* args) {
+  dns_entry *e;
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char addr[INET6_ADDRSTRLEN];
+  pthread_detach(pthread_self());
+  /* _res is per thread, so each resolver thread points its own at -N */
+  if (dns_server_arg != NULL && res_init() == 0) {
+    _res.nsaddr_list[0] = dns_server;
+    _res.nscount = 1;
+  }
+  while (1) {
+    pthread_mutex_lock(&dnslock);
+    while (dns_queue_head == NULL) pthread_cond_wait(&dnscond, &dnslock);
+    e = dns_queue_head;
+    dns_queue_head = e->qnext;
+    if (dns_queue_head == NULL) dns_queue_tail = NULL;
+    /* pending entries are never evicted, but copy what we need anyway so
+       the lookup runs without the lock */
+    sa = e->sa;
+    salen = e->salen;
+    snprintf(addr, sizeof(addr), "%s", e->addr);
+    pthread_mutex_unlock(&dnslock);
+
+    char *name = dns_resolve((struct sockaddr *) &sa, salen, addr);
+
+    pthread_mutex_lock(&dnslock);
+    free(e->name);
+    e->name = name;
+    e->expires = time(NULL) + (name != NULL ? DNS_TTL : DNS_NEGATIVE_TTL);
+    e->pending = 0;
+    dns_evict();
+    pthread_mutex_unlock(&dnslock);
+  }
+  return NULL;
+}
+
+/* Parses the -N argument, an IPv4 address with an optional :port.
+   Returns 0 on success. */
+int dns_server_parse(char *arg) {
+  char host[INET_ADDRSTRLEN];
+  char *colon = strchr(arg, ':');
+  int len = colon != NULL ? colon - arg : (int) strlen(arg);
+  if (len >= (int) sizeof(host)) return -1;
+  memcpy(host, arg, len);
+  host[len] = '\0';
+  memset(&dns_server, 0, sizeof(dns_server));
+  dns_server.sin_family = AF_INET;
+  dns_server.sin_port = htons(colon != NULL ? atoi(colon + 1) : NAMESERVER_PORT);
+  if (inet_pton(AF_INET, host, &dns_server.sin_addr) != 1 || dns_server.sin_port == 0) return -1;
+  dns_server_arg = arg;
+  return 0;
+}
+
+int resolver_start() {
+  pthread_t tid;
+  int i;
+  if (resolver_disabled) return 0;
+  for (i = 0; i < RESOLVER_THREADS; i++) {
+    if (pthread_create(&tid, NULL, resolver_thread, NULL) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Gets the numeric address of the client's peer. Returns 0 on success. */
+int peer_addr(int clientSocket, struct sockaddr_storage *sa, socklen_t *salen, char *addr, int size) {
+  *salen = sizeof(*sa);
+  if (getpeername(clientSocket, (struct sockaddr *) sa, salen) != 0) return -1;
+  if (getnameinfo((struct sockaddr *) sa, *salen, addr, size, NULL, 0, NI_NUMERICHOST) != 0) return -1;
+  return 0;
+}
+
+/* Starts resolving the client's hostname in the background, unless the
+   cache already has a fresh answer or a lookup is underway */
+void resolver_prefetch(int clientSocket) {
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char addr[INET6_ADDRSTRLEN];
+  dns_entry *e;
+  if (resolver_disabled || peer_addr(clientSocket, &sa, &salen, addr, sizeof(addr)) != 0) return;
+
+  pthread_mutex_lock(&dnslock);
+  e = dns_find(addr);
+  if (e != NULL) {
+    dns_lru_unlink(e);
+    dns_lru_push(e);
+    if (e->pending || e->expires > time(NULL)) {
+      pthread_mutex_unlock(&dnslock);
+      return;
+    }
+  }
+  else {
+    e = calloc(1, sizeof(dns_entry));
+    snprintf(e->addr, sizeof(e->addr), "%s", addr);
+    unsigned int h = dns_hash_addr(addr);
+    e->hnext = dns_hash[h];
+    dns_hash[h] = e;
+    dns_lru_push(e);
+    dns_entries++;
+  }
+  e->sa = sa;
+  e->salen = salen;
+  e->pending = 1;
+  e->qnext = NULL;
+  if (dns_queue_tail) dns_queue_tail->qnext = e;
+  else dns_queue_head = e;
+  dns_queue_tail = e;
+  dns_evict();
+  pthread_cond_signal(&dnscond);
+  pthread_mutex_unlock(&dnslock);
 }
 
-void s_getpeername (char* clienthostname, int size, int clientSocket) {
-  struct sockaddr_in clientAddr;
-  socklen_t sinSize = sizeof(clientAddr);
-  if(getpeername(clientSocket,(struct sockaddr *) &clientAddr, &sinSize) != 0) {
+/* Writes the client's hostname as currently known: the cached confirmed
+   name if there is one, its numeric address otherwise. Never blocks on
+   DNS. */
+void resolver_host(int clientSocket, char *host, int size) {
+  struct sockaddr_storage sa;
+  socklen_t salen;
+  char addr[INET6_ADDRSTRLEN];
+  dns_entry *e;
+  if (peer_addr(clientSocket, &sa, &salen, addr, sizeof(addr)) != 0) {
     perror("Could not resolve client host");
-    pthread_exit(NULL);
+    client_exit();
   }
-  if(inet_ntop(AF_INET, &clientAddr.sin_addr, clienthostname, size*sizeof(char)) == 0) {
-    perror("Address not valid");
-    pthread_exit(NULL);
+  snprintf(host, size, "%s", addr);
+  if (resolver_disabled) return;
+  pthread_mutex_lock(&dnslock);
+  e = dns_find(addr);
+  if (e != NULL && !e->pending && e->name != NULL && e->expires > time(NULL)) {
+    snprintf(host, size, "%s", e->name);
   }
-  return;
+  pthread_mutex_unlock(&dnslock);
+}
+
+/* A user's hostname: the one fixed at registration, or what's known now */
+void user_host(user *usr, char *host, int size) {
+  if (usr->host != NULL) snprintf(host, size, "%s", usr->host);
+  else resolver_host(usr->clientID, host, size);
 }
 
 channel_list* channel_find(char* name) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   channel_list* chans = channels_head;
   while (chans != NULL) {
     if (chans->channel != NULL) {
@@ -324,7 +991,7 @@ channel_list* channel_find(char* name) {
 }
 
 channel_users* channel_users_find(channel_users* users, int id) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   while (users != NULL) {
     if (users->user_socket == id) {
       pthread_mutex_unlock(&chlock);
@@ -337,7 +1004,7 @@ channel_users* channel_users_find(channel_users* users, int id) {
 }
 
 int in_client_channels(char* name, client_channels* chans) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   while (chans != NULL) {
     if (chans->channel != NULL) {
       if (!(strcmp(chans->channel, name))) {
@@ -352,7 +1019,7 @@ int in_client_channels(char* name, client_channels* chans) {
 }
 
 user* Nick_find(char* nick) {
-  pthread_mutex_lock(&lock);
+  s_lock(&lock, LOCK_USERS);
   user* user = head;
   while (user != NULL) {
     if (user->nick != NULL) {
@@ -371,7 +1038,7 @@ return user;
 
 
 void user_add(user* usr){
-  pthread_mutex_lock(&lock);
+  s_lock(&lock, LOCK_USERS);
   user* user = head;
   if (user != NULL) {
     while (user->next != NULL) {
@@ -387,7 +1054,7 @@ void user_add(user* usr){
 }
 
 void channel_add(channel_list *channel) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   channel_list *head = channels_head;
   if (head != NULL) {
     while (head->next != NULL) {
@@ -403,7 +1070,7 @@ void channel_add(channel_list *channel) {
 }
 
 void channel_user_add(channel_users *channel, channel_users *User) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   if(channel==NULL){
     channel=User;
     pthread_mutex_unlock(&chlock);
@@ -425,7 +1092,7 @@ void channel_user_add(channel_users *channel, channel_users *User) {
 }
 
 void client_channels_add(user *client, client_channels *channel){
-  pthread_mutex_lock(&lock);
+  s_lock(&lock, LOCK_USERS);
   client_channels *user = client->channels;
   if (user != NULL){
     while (user->next != NULL){
@@ -474,6 +1141,16 @@ void errParam(char* cmd, int clientSocket) {
   return;
 }
 
+/* ERR_TOOMANYTARGETS, echoing as much of the target list as fits in the
+   reply */
+void errTooManyTargets(char* server, char* nick, char* list, char* text, int clientSocket) {
+  char msg[512];
+  int room = sizeof(msg) - 1 - snprintf(NULL, 0, ":%s 407 %s  :%s\r\n", server, nick, text);
+  if (room < 0) room = 0;
+  snprintf(msg, sizeof(msg), ":%s 407 %s %.*s :%s\r\n", server, nick, room, list, text);
+  s_send(msg, clientSocket);
+}
+
 int handle_LUSERS(char **ps, int clientSocket) {
   user* client = ID_find(clientSocket);
   char* Nick = client->nick;
@@ -536,13 +1213,11 @@ int handle_MOTD (char** ps, int clientSocket) {
 /* Called once conditions are appropriate for the welcome message to be sent (nick and username established). Assembles necessary info, creates a well-formed welcome message, and sends it to a connected client. */
 void sendWelcome(int clientSocket, user *usr) {
   char serverhostname[64];
-  char clienthostname[64];
   char msg[512];
 
   s_gethostname(serverhostname, 64);
-  s_getpeername(clienthostname, 64, clientSocket);
   
-  snprintf(msg, sizeof(msg), ":%s 001 %s :Welcome to the Internet Relay Network %s!%s@%s\r\n", serverhostname, usr->nick, usr->nick, usr->username, clienthostname);
+  snprintf(msg, sizeof(msg), ":%s 001 %s :Welcome to the Internet Relay Network %s!%s@%s\r\n", serverhostname, usr->nick, usr->nick, usr->username, usr->host);
   s_send(msg, clientSocket);
   snprintf(msg, sizeof(msg), ":%s 002 %s :Your host is %s, running version chirc-0.1\r\n", serverhostname, usr->nick, serverhostname);
   s_send(msg, clientSocket);
@@ -550,6 +1225,13 @@ void sendWelcome(int clientSocket, user *usr) {
   s_send(msg, clientSocket);
   snprintf(msg, sizeof(msg), ":%s 004 %s %s chirc-0.1 ao mtov\r\n", serverhostname, usr->nick, serverhostname);
   s_send(msg, clientSocket);
+  /* Only clients that negotiated capabilities get ISUPPORT, older ones
+     expect LUSERS right after RPL_MYINFO */
+  if (usr->caps & CAP_NEGOTIATED) {
+    snprintf(msg, sizeof(msg), ":%s 005 %s CHANTYPES=# TARGMAX=PRIVMSG:%d,NOTICE:%d,JOIN:%d :are supported by this server\r\n",
+             serverhostname, usr->nick, MAX_TARGETS, MAX_TARGETS, MAX_TARGETS);
+    s_send(msg, clientSocket);
+  }
   
   handle_LUSERS(NULL, clientSocket);
   handle_MOTD(NULL, clientSocket);
@@ -557,6 +1239,17 @@ void sendWelcome(int clientSocket, user *usr) {
   return;
 }
 
+/* Called once both NICK and USER have been received. A client that started
+   capability negotiation isn't registered until it sends CAP END. */
+void completeRegistration(int clientSocket, user *usr) {
+  char host[256];
+  if (usr->cap_negotiating || usr->registered) return;
+  resolver_host(clientSocket, host, sizeof(host));
+  usr->host = strdup(host);
+  usr->registered = 1;
+  sendWelcome(clientSocket, usr);
+}
+
 int handle_NICK(char** ps, int clientSocket) {
   if(ps_count(ps) != 1) {
     errParam("NICK",clientSocket);
@@ -598,8 +1291,7 @@ int handle_NICK(char** ps, int clientSocket) {
       else {
         if (new->username != NULL && new->nick == NULL) {
           new->nick = strdup(ps[0]);
-          new->registered = 1;
-          sendWelcome(clientSocket, new);
+          completeRegistration(clientSocket, new);
         }
         else {
           new->nick = strdup(ps[0]);
@@ -628,8 +1320,7 @@ int handle_USER(char** ps, int clientSocket) {
     if ((new->nick) && (!new->username)) {
       new->username = ps[0];
       new->fullname = ps[3];
-      new->registered = 1;
-      sendWelcome(clientSocket, new);
+      completeRegistration(clientSocket, new);
     }
     
     else {
@@ -646,6 +1337,7 @@ void channel_list_free(channel_list *tbf){
     free(tbf->channel);
     free(tbf->topic);
     channel_users_free(tbf->users);
+    history_free(tbf->history);
     free(tbf);
     tbf = tmp;
   }
@@ -653,7 +1345,7 @@ void channel_list_free(channel_list *tbf){
 }
 
 void channel_users_remove(channel_list* chan, int id) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   channel_users* prevc = NULL;
   channel_users* currc = chan->users;
   while (currc != NULL) {
@@ -674,13 +1366,15 @@ void channel_users_remove(channel_list* chan, int id) {
 }
 
 void channel_list_remove(char* name) {
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   channel_list* prevc = NULL;
   channel_list* currc = channels_head;
   while (currc != NULL) {
     if (!strcmp(currc->channel, name)) {
       if (prevc == NULL) channels_head = currc->next;
       else prevc->next = currc->next;
+      /* channel_list_free frees the whole chain, not just this channel */
+      currc->next = NULL;
       channel_list_free(currc);
       pthread_mutex_unlock(&chlock);
       return;
@@ -692,6 +1386,35 @@ void channel_list_remove(char* name) {
   return;
 }
 
+/* Forgets a user whose connection is gone without a QUIT: unlinks it from
+   the user list and from its channels (dropping those left empty), without
+   notifying anyone. If its descriptor number has already been reused, owner
+   is the user holding it now, whose own channel memberships are kept. */
+void user_remove(user *usr, user *owner) {
+  user *prev = NULL, *curr;
+  client_channels *cchan;
+  channel_list *chan, *next;
+
+  for (cchan = usr->channels; cchan != NULL; cchan = cchan->next) {
+    if (owner != NULL && in_client_channels(cchan->channel, owner->channels)) continue;
+    chan = channel_find(cchan->channel);
+    if (chan != NULL) channel_users_remove(chan, usr->clientID);
+  }
+  s_lock(&lock, LOCK_USERS);
+  for (curr = head; curr != NULL && curr != usr; curr = curr->next) prev = curr;
+  if (curr != NULL) {
+    if (prev == NULL) head = usr->next;
+    else prev->next = usr->next;
+  }
+  pthread_mutex_unlock(&lock);
+  usr->next = NULL;
+  userFree(usr);
+  for (chan = channels_head; chan != NULL; chan = next) {
+    next = chan->next;
+    if (chan->active == 0) channel_list_remove(chan->channel);
+  }
+}
+
 int handle_QUIT (char** ps, int clientSocket) {
   user* usr = ID_find(clientSocket);
   char msg[512];
@@ -732,7 +1455,7 @@ int handle_QUIT (char** ps, int clientSocket) {
         }
         chan = chan->next;
       }
-      pthread_exit(NULL);
+      client_exit();
     }
     prev = curr;
     curr = curr->next;
@@ -740,90 +1463,172 @@ int handle_QUIT (char** ps, int clientSocket) {
   return 1;
 }
 
-int handle_PRIVMSG(char **ps,int clientSocket) {
-  user* find = Nick_find(ps[0]);
-  channel_list *cfind = channel_find(ps[0]);
-  channel_users* cuser;
-  user* sender = ID_find(clientSocket);
-  char serverhostname[64];
+/* Splits a comma-separated target list in place, dropping duplicates.
+   Returns the number of targets, or -1 if there are more than max. */
+int split_targets(char* list, char** targets, int max) {
+  int n = 0, i;
+  char *save, *tok;
+  for (tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    for (i = 0; i < n; i++) {
+      if (!strcmp(targets[i], tok)) break;
+    }
+    if (i < n) continue;
+    if (n == max) return -1;
+    targets[n++] = tok;
+  }
+  return n;
+}
+
+/* Resolves every target with a single pass over each table, so a batch of
+   targets takes each lock once instead of once per lookup */
+void resolve_targets(char** targets, int n, user** users, channel_list** chans) {
+  int i;
+  user* usr;
+  channel_list* chan;
+  for (i = 0; i < n; i++) {
+    if (users != NULL) users[i] = NULL;
+    chans[i] = NULL;
+  }
+  if (users != NULL) {
+    s_lock(&lock, LOCK_USERS);
+    for (usr = head; usr != NULL; usr = usr->next) {
+      if (usr->nick == NULL) continue;
+      for (i = 0; i < n; i++) {
+        if (users[i] == NULL && !strcmp(usr->nick, targets[i])) users[i] = usr;
+      }
+    }
+    pthread_mutex_unlock(&lock);
+  }
+  s_lock(&chlock, LOCK_CHANNELS);
+  for (chan = channels_head; chan != NULL; chan = chan->next) {
+    if (chan->channel == NULL) continue;
+    for (i = 0; i < n; i++) {
+      if (chans[i] == NULL && !strcmp(chan->channel, targets[i])) chans[i] = chan;
+    }
+  }
+  pthread_mutex_unlock(&chlock);
+}
+
+/* Delivers one PRIVMSG/NOTICE line to a single, already resolved, target.
+   NOTICE never generates error replies. */
+void deliver_message(user* sender, char* target, user* find, channel_list* cfind, char* line, int notice, char* serverhostname) {
+  int clientSocket = sender->clientID;
   char msg[512];
-  s_gethostname(serverhostname, 64);
-  int msg_perm = 1;
-  if(find != NULL) {
-    snprintf(msg, sizeof(msg), ":%s!%s@%s PRIVMSG %s :%s\r\n", sender->nick, sender->username, serverhostname, ps[0], ps[1]);
-    s_send(msg, find->clientID);
-    if (find->away != NULL) {
+  channel_users* cuser;
+  fanout f;
+  fanout_init(&f, line);
+  if (find != NULL) {
+    fanout_send(&f, find->clientID);
+    if (sender->caps & CAP_ECHO_MESSAGE) fanout_send(&f, clientSocket);
+    if (!notice && find->away != NULL) {
       snprintf(msg, sizeof(msg), ":%s 301 %s %s :%s\r\n", serverhostname, sender->nick, find->nick, find->away);
       s_send(msg, clientSocket);
     }
   }
   else if (cfind != NULL) {
-    cuser = channel_users_find(cfind->users, sender->clientID);
-    if (cfind->md_moder == 1 && cuser->md_voice != 1 && cuser->md_coper != 1 && sender->md_oper != 1) {
+    int msg_perm = 1;
+    cuser = channel_users_find(cfind->users, clientSocket);
+    if (cfind->md_moder == 1 && (cuser == NULL || (cuser->md_voice != 1 && cuser->md_coper != 1)) && sender->md_oper != 1) {
       msg_perm = 0;
     }
-    if (in_client_channels(ps[0], sender->channels) && msg_perm == 1) {
-      snprintf(msg, sizeof(msg), ":%s!%s@%s PRIVMSG %s :%s\r\n", sender->nick, sender->username, serverhostname, ps[0], ps[1]);
+    if (in_client_channels(target, sender->channels) && msg_perm == 1) {
+      history_add(cfind, line, f.when_ms);
+      /* the sender gets its own NOTICE back, echo-message or not */
       channel_users* recip = cfind->users;
       while (recip != NULL) {
-        if (!(recip->user_socket==clientSocket)){
-        s_send(msg, recip->user_socket);
-      }
+        if (notice || recip->user_socket != clientSocket || (sender->caps & CAP_ECHO_MESSAGE)) {
+          fanout_send(&f, recip->user_socket);
+        }
         recip = recip->next;
       }
     }
-    else {
-      snprintf(msg, sizeof(msg), ":%s 404 %s %s :Cannot send to channel\r\n", serverhostname, sender->nick, ps[0]);
+    else if (!notice) {
+      snprintf(msg, sizeof(msg), ":%s 404 %s %s :Cannot send to channel\r\n", serverhostname, sender->nick, target);
       s_send(msg, clientSocket);
     }
   }
-  else {
-    snprintf(msg, sizeof(msg), ":%s 401 %s %s :No such nick/channel\r\n", serverhostname, sender->nick, ps[0]);
+  else if (!notice) {
+    snprintf(msg, sizeof(msg), ":%s 401 %s %s :No such nick/channel\r\n", serverhostname, sender->nick, target);
     s_send(msg, clientSocket);
   }
-  return 0;
+  fanout_free(&f);
 }
-      
-int handle_NOTICE(char **ps, int clientSocket) {
+
+/* Like snprintf(out, size, "%s%s%s", a, b, c), without the formatting */
+void concat3(char* out, size_t size, const char* a, const char* b, const char* c) {
+  const char* parts[3] = { a, b, c };
+  size_t len = 0, n;
+  int i;
+  for (i = 0; i < 3; i++) {
+    n = strlen(parts[i]);
+    if (len + n > size - 1) n = size - 1 - len;
+    memcpy(out + len, parts[i], n);
+    len += n;
+  }
+  out[len] = '\0';
+}
+
+/* PRIVMSG and NOTICE to a comma-separated list of targets. The message body
+   is formatted once and shared by every target's line. */
+int handle_message(char **ps, int clientSocket, int notice) {
+  char* cmd = notice ? "NOTICE" : "PRIVMSG";
   user* sender = ID_find(clientSocket);
   char serverhostname[64];
-  s_gethostname(serverhostname, 64);
-  int msg_perm = 1;
-  user* find = Nick_find(ps[0]);
-  channel_list *cfind = channel_find(ps[0]);
-  channel_users* cuser;
   char msg[512];
-  snprintf(msg, sizeof(msg), ":%s!%s@%s NOTICE %s :%s\r\n", sender->nick, sender->username, serverhostname, ps[0], ps[1]);
-  if (find != NULL) {
-    s_send(msg, find->clientID);
-    return 0;
+  char prefix[512];
+  char body[512];
+  char target_list[512];
+  char* targets[MAX_TARGETS];
+  user* finds[MAX_TARGETS];
+  channel_list* cfinds[MAX_TARGETS];
+  int n, i;
+  s_gethostname(serverhostname, 64);
+  if (ps[0] == NULL) {
+    if (!notice) errParam(cmd, clientSocket);
+    return 1;
   }
-  if (cfind != NULL) {
-    cuser = channel_users_find(cfind->users, sender->clientID);
-    if (cfind->md_moder == 1 && cuser->md_voice != 1 && cuser->md_coper != 1 && sender->md_oper != 1) {
-      msg_perm = 0;
+  if (ps[1] == NULL) {
+    if (!notice) {
+      snprintf(msg, sizeof(msg), ":%s 412 %s :No text to send\r\n", serverhostname, sender->nick);
+      s_send(msg, clientSocket);
     }
-    if (in_client_channels(ps[0], sender->channels) && msg_perm == 1) {
-      channel_users* recip = cfind->users;
-      while (recip != NULL) {
-        s_send(msg, recip->user_socket);
-        recip = recip->next;
-      }
-      return 0;
+    return 1;
+  }
+  /* split_targets cuts ps[0] up, keep the list as sent for the 407 reply */
+  snprintf(target_list, sizeof(target_list), "%s", ps[0]);
+  if ((n = split_targets(ps[0], targets, MAX_TARGETS)) == -1) {
+    if (!notice) {
+      errTooManyTargets(serverhostname, sender->nick, target_list, "Too many recipients", clientSocket);
     }
+    return 1;
   }
-  return 1;
+  resolve_targets(targets, n, finds, cfinds);
+  snprintf(prefix, sizeof(prefix), ":%s!%s@%s %s ", sender->nick, sender->username, serverhostname, cmd);
+  snprintf(body, sizeof(body), " :%s\r\n", ps[1]);
+  for (i = 0; i < n; i++) {
+    concat3(msg, sizeof(msg), prefix, targets[i], body);
+    deliver_message(sender, targets[i], finds[i], cfinds[i], msg, notice, serverhostname);
+  }
+  return 0;
+}
+
+int handle_PRIVMSG(char **ps,int clientSocket) {
+  return handle_message(ps, clientSocket, 0);
+}
+
+int handle_NOTICE(char **ps, int clientSocket) {
+  return handle_message(ps, clientSocket, 1);
 }
  
 int handle_WHOIS(char **ps,int clientSocket) {
   user* find = Nick_find(ps[0]);
   user* me = ID_find(clientSocket);
   char server[64];
-  char client[64];
+  char client[256];
   char msg[512];
   s_gethostname(server, 64);
   if (find != NULL) {
-    s_getpeername(client, 64, find->clientID);
+    user_host(find, client, sizeof(client));
     snprintf(msg, sizeof(msg), ":%s 311 %s %s ~%s %s * :%s\r\n", server, me->nick, find->nick, find->username, client, find->fullname);
     s_send(msg, clientSocket);
     client_channels *chans = find->channels;
@@ -899,8 +1704,21 @@ char* channel_names(channel_list* chan) {
   return names;
 }
 
-int handle_JOIN(char **ps, int clientSocket) {
-  user *client = ID_find(clientSocket);
+/* Replays up to limit of the channel's latest lines to a client. Only the
+   snapshot is taken under the history lock; sending happens after. */
+void send_history(channel_list* chan, int limit, int clientSocket) {
+  history_line *lines[HISTORY_LINES];
+  int i, n;
+  if (limit > HISTORY_LINES) limit = HISTORY_LINES;
+  n = history_latest(chan, limit, lines);
+  for (i = 0; i < n; i++) {
+    s_send_at(lines[i]->text, clientSocket, lines[i]->when_ms);
+    history_line_unref(lines[i]);
+  }
+}
+
+/* Joins the client to one channel, find being the channel if it exists */
+void join_channel(user *client, char *name, channel_list *find, int clientSocket) {
   char msg[512];
   char server[64];
   s_gethostname(server, 64);
@@ -908,28 +1726,29 @@ int handle_JOIN(char **ps, int clientSocket) {
   //if (client->nick == NULL || client->username == NULL) {
   // snprintf(msg, sizeof(msg), ":%s 451 %s :You have not registered\r\n", server, client->nick);
   //}
-  channel_list *find = channel_find(ps[0]);
   if (find == NULL) {
     num_channels++;
     channel_list *new = channel_list_init();
     channel_users *nuser = channel_users_init();
     nuser->user_socket = clientSocket;
     nuser->md_coper = 1;
-    new->channel = strdup(ps[0]);
+    new->channel = strdup(name);
     new->active = 1;
     new->users = nuser;
     channel_add(new);
     client_channels *mem = client_channels_init();
-    mem->channel = strdup(ps[0]);
+    mem->channel = strdup(name);
     client_channels_add(client, mem);
-    snprintf(msg, sizeof(msg), ":%s!%s@%s JOIN %s\r\n",client->nick,client->username, server, ps[0]);
+    snprintf(msg, sizeof(msg), ":%s!%s@%s JOIN %s\r\n",client->nick,client->username, server, name);
     s_send(msg, clientSocket);
     names = channel_names(new);
+    batch_start(clientSocket, "chirc/names", name);
     snprintf(msg, sizeof(msg),":%s 353 %s %s\r\n",server,client->nick,names);
     free(names);
     s_send(msg,clientSocket);
-    snprintf(msg, sizeof(msg), ":%s 366 %s %s :End of NAMES list\r\n", server, client->nick, ps[0]);
+    snprintf(msg, sizeof(msg), ":%s 366 %s %s :End of NAMES list\r\n", server, client->nick, name);
     s_send(msg, clientSocket);
+    batch_end(clientSocket);
   }
   else if (channel_users_find(find->users, clientSocket) != NULL) {
     //Do nothing?
@@ -940,25 +1759,55 @@ int handle_JOIN(char **ps, int clientSocket) {
     find->active += 1;
     channel_user_add(find->users, new);
     client_channels *mem = client_channels_init();
-    mem->channel = strdup(ps[0]);
+    mem->channel = strdup(name);
     client_channels_add(client, mem);
-    snprintf(msg, sizeof(msg),":%s!%s@%s JOIN %s\r\n",client->nick,client->username,server,ps[0]);
-    channel_list *foo=(channel_find(ps[0]));
-    channel_users *chan=foo->users;
+    snprintf(msg, sizeof(msg),":%s!%s@%s JOIN %s\r\n",client->nick,client->username,server,name);
+    channel_users *chan=find->users;
     while(chan!=NULL){
     s_send(msg,chan->user_socket);
     chan=chan->next;
   }
     if (find->topic != NULL) {
-      snprintf(msg, sizeof(msg), ":%s 332 %s %s :%s\r\n", server, client->nick, ps[0], find->topic);
+      snprintf(msg, sizeof(msg), ":%s 332 %s %s :%s\r\n", server, client->nick, name, find->topic);
       s_send(msg , clientSocket);
     }
     names = channel_names(find);
+    batch_start(clientSocket, "chirc/names", name);
     snprintf(msg , sizeof(msg), ":%s 353 %s %s\r\n", server, client->nick, names);
     free(names);
     s_send(msg, clientSocket);
-    snprintf(msg, sizeof(msg), ":%s 366 %s %s :End of NAMES list\r\n", server, client->nick, ps[0]);
+    snprintf(msg, sizeof(msg), ":%s 366 %s %s :End of NAMES list\r\n", server, client->nick, name);
     s_send(msg, clientSocket);
+    batch_end(clientSocket);
+    if (join_replay > 0) {
+      batch_start(clientSocket, "chathistory", name);
+      send_history(find, join_replay, clientSocket);
+      batch_end(clientSocket);
+    }
+  }
+}
+
+/* JOIN <channel>{,<channel>}; keys aren't supported and are ignored */
+int handle_JOIN(char **ps, int clientSocket) {
+  user *client = ID_find(clientSocket);
+  char server[64];
+  char target_list[512];
+  char* targets[MAX_TARGETS];
+  channel_list* finds[MAX_TARGETS];
+  int n, i;
+  if (ps[0] == NULL) {
+    errParam("JOIN", clientSocket);
+    return 0;
+  }
+  snprintf(target_list, sizeof(target_list), "%s", ps[0]);
+  if ((n = split_targets(ps[0], targets, MAX_TARGETS)) == -1) {
+    s_gethostname(server, 64);
+    errTooManyTargets(server, client->nick, target_list, "Too many channels", clientSocket);
+    return 0;
+  }
+  resolve_targets(targets, n, NULL, finds);
+  for (i = 0; i < n; i++) {
+    join_channel(client, targets[i], finds[i], clientSocket);
   }
   return 0;
 }
@@ -979,7 +1828,7 @@ int handle_PART(char **ps, int clientSocket) {
     s_send(msg, clientSocket);
     return 0;
   }
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   client_channels_remove(client, find->channel);
   channel_users* cuser = find->users;
   while (cuser != NULL) {
@@ -1059,7 +1908,7 @@ int handle_OPER(char **ps, int clientSocket) {
   char msg[512];
   user *client = ID_find(clientSocket);
   if (!strcmp(ps[1], password)) {
-    pthread_mutex_lock(&lock);
+    s_lock(&lock, LOCK_USERS);
     client->md_oper = 1;
     pthread_mutex_unlock(&lock);
     snprintf(msg, sizeof(msg), ":%s 381 %s :You are now an IRC operator\r\n", server, client->nick);
@@ -1104,7 +1953,7 @@ int handle_MODE(char **ps, int clientSocket) {
   if (ct == 2) {
     if (!strcmp(client->nick, ps[0])) {
       if (!strcmp(ps[1], "-o")) {
-        pthread_mutex_lock(&lock);
+        s_lock(&lock, LOCK_USERS);
         client->md_oper = 0;
         pthread_mutex_unlock(&lock);
         snprintf(msg, sizeof(msg), ":%s MODE %s :%s\r\n", client->nick, client->nick, ps[1]);
@@ -1206,7 +2055,7 @@ int handle_MODE(char **ps, int clientSocket) {
 }
 
 char *users_no_channels(){
-  pthread_mutex_lock(&lock);
+  s_lock(&lock, LOCK_USERS);
   char nbuf[512];
   nbuf[0] = '\0';
   strcat(nbuf, "* * :");
@@ -1237,6 +2086,7 @@ int handle_NAMES(char **ps, int clientSocket) {
   }
   channel_list *chan;
   char* cless_names;
+  batch_start(clientSocket, "chirc/names", ct == 0 ? "*" : ps[0]);
   if (ct == 0) {
     chan = channels_head;
     while (chan != NULL) {
@@ -1265,11 +2115,12 @@ int handle_NAMES(char **ps, int clientSocket) {
     snprintf(msg, sizeof(msg),":%s 366 %s %s :End of NAMES list\r\n",server,client->nick,ps[0]);
     s_send(msg,clientSocket);
   }
+  batch_end(clientSocket);
   return 0;
 }
 
 int handle_LIST(char **ps, int clientSocket){
-  pthread_mutex_lock(&chlock);
+  s_lock(&chlock, LOCK_CHANNELS);
   user *find=ID_find(clientSocket);
   char server[64];
   s_gethostname(server,64);
@@ -1354,7 +2205,7 @@ int handle_WHO(char **ps, int clientSocket) {
   char server[64];
   s_gethostname(server, 64);
   char msg[512];
-  char host[64];
+  char host[256];
   char* flags;
   user* usr = head;
   user *client = ID_find(clientSocket);
@@ -1369,7 +2220,7 @@ int handle_WHO(char **ps, int clientSocket) {
         tchans = tchans->next;
       }
       if (shared_chan != 1) { //&& !(usr->clientID == client->clientID)) {
-        s_getpeername(host, 64, usr->clientID);
+        user_host(usr, host, sizeof(host));
         flags = make_who_flags(usr, NULL);
         snprintf(msg, sizeof(msg), ":%s 352 %s %s %s %s %s %s %s :0 %s\r\n", server, client->nick, "*", usr->username, host, server, usr->nick, flags, usr->fullname);
         s_send(msg, clientSocket);
@@ -1392,7 +2243,7 @@ int handle_WHO(char **ps, int clientSocket) {
       cuser = find->users;
       while (cuser != NULL) {
         usr = ID_find(cuser->user_socket);
-        s_getpeername(host, 64, usr->clientID);
+        user_host(usr, host, sizeof(host));
         flags = make_who_flags(usr, find);
         snprintf(msg, sizeof(msg), ":%s 352 %s %s %s %s %s %s %s :0 %s\r\n", server, client->nick, find->channel, usr->username, host, server, usr->nick, flags, usr->fullname);
         s_send(msg, clientSocket);
@@ -1410,6 +2261,114 @@ int handle_WHO(char **ps, int clientSocket) {
   return 1;
 }
 
+/* IRCv3 capability negotiation: CAP LS, LIST, REQ and END */
+int handle_CAP(char **ps, int clientSocket) {
+  char server[64];
+  s_gethostname(server, 64);
+  char msg[512];
+  char list[256];
+  user *client = ID_find(clientSocket);
+  char *nick = client->nick != NULL ? client->nick : "*";
+  int i;
+  if (ps_count(ps) < 1) {
+    errParam("CAP", clientSocket);
+    return 0;
+  }
+  if (!strcmp(ps[0], "LS") || !strcmp(ps[0], "LIST")) {
+    int ls = !strcmp(ps[0], "LS");
+    if (ls) {
+      client->caps |= CAP_NEGOTIATED;
+      if (!client->registered) client->cap_negotiating = 1;
+    }
+    list[0] = '\0';
+    for (i = 0; i < num_caps; i++) {
+      if (!ls && !(client->caps & caps[i].flag)) continue;
+      if (list[0] != '\0') strcat(list, " ");
+      strcat(list, caps[i].name);
+    }
+    snprintf(msg, sizeof(msg), ":%s CAP %s %s :%s\r\n", server, nick, ps[0], list);
+    s_send(msg, clientSocket);
+  }
+  else if (!strcmp(ps[0], "REQ")) {
+    if (ps[1] == NULL) {
+      errParam("CAP", clientSocket);
+      return 0;
+    }
+    if (!client->registered) client->cap_negotiating = 1;
+    /* All or nothing: any unknown capability NAKs the whole request */
+    int add = 0, del = 0, ok = 1;
+    char *req = strdup(ps[1]);
+    char *save, *tok;
+    for (tok = strtok_r(req, " ", &save); tok != NULL; tok = strtok_r(NULL, " ", &save)) {
+      int remove = tok[0] == '-';
+      if (remove) tok++;
+      for (i = 0; i < num_caps; i++) {
+        if (!strcmp(tok, caps[i].name)) break;
+      }
+      if (i == num_caps) {
+        ok = 0;
+        break;
+      }
+      if (remove) del |= caps[i].flag;
+      else add |= caps[i].flag;
+    }
+    free(req);
+    if (ok) client->caps = (client->caps | add) & ~del;
+    snprintf(msg, sizeof(msg), ":%s CAP %s %s :%s\r\n", server, nick, ok ? "ACK" : "NAK", ps[1]);
+    s_send(msg, clientSocket);
+  }
+  else if (!strcmp(ps[0], "END")) {
+    if (client->cap_negotiating) {
+      client->cap_negotiating = 0;
+      if (client->nick != NULL && client->username != NULL) completeRegistration(clientSocket, client);
+    }
+  }
+  else {
+    snprintf(msg, sizeof(msg), ":%s 410 %s %s :Invalid CAP command\r\n", server, nick, ps[0]);
+    s_send(msg, clientSocket);
+  }
+  return 0;
+}
+
+/* CHATHISTORY LATEST <channel> * <limit>, as in the IRCv3 chathistory draft;
+   only the LATEST subcommand is supported */
+int handle_CHATHISTORY(char **ps, int clientSocket) {
+  char server[64];
+  s_gethostname(server, 64);
+  char msg[512];
+  user *client = ID_find(clientSocket);
+  if (ps_count(ps) < 4) {
+    errParam("CHATHISTORY", clientSocket);
+    return 0;
+  }
+  if (strcasecmp(ps[0], "LATEST")) {
+    snprintf(msg, sizeof(msg), ":%s FAIL CHATHISTORY INVALID_PARAMS %s :Unsupported subcommand\r\n", server, ps[0]);
+    s_send(msg, clientSocket);
+    return 0;
+  }
+  channel_list *find = channel_find(ps[1]);
+  if (find == NULL || !in_client_channels(ps[1], client->channels)) {
+    snprintf(msg, sizeof(msg), ":%s FAIL CHATHISTORY INVALID_TARGET LATEST %s :You're not on that channel\r\n", server, ps[1]);
+    s_send(msg, clientSocket);
+    return 0;
+  }
+  if (strcmp(ps[2], "*")) {
+    snprintf(msg, sizeof(msg), ":%s FAIL CHATHISTORY INVALID_PARAMS %s :Only * is supported\r\n", server, ps[2]);
+    s_send(msg, clientSocket);
+    return 0;
+  }
+  int limit = atoi(ps[3]);
+  if (limit <= 0) {
+    snprintf(msg, sizeof(msg), ":%s FAIL CHATHISTORY INVALID_PARAMS %s :Invalid limit\r\n", server, ps[3]);
+    s_send(msg, clientSocket);
+    return 0;
+  }
+  batch_start(clientSocket, "chathistory", find->channel);
+  send_history(find, limit, clientSocket);
+  batch_end(clientSocket);
+  return 0;
+}
+
 struct handler_entry handlers[] = {
   HANDLER_ENTRY(NICK),
   HANDLER_ENTRY(USER),
@@ -1430,13 +2389,26 @@ struct handler_entry handlers[] = {
   HANDLER_ENTRY(LIST),
   HANDLER_ENTRY(AWAY),
   HANDLER_ENTRY(WHO),
+  HANDLER_ENTRY(CHATHISTORY),
+  HANDLER_ENTRY(CAP),
 };
 int num_handlers = sizeof(handlers) / sizeof(struct handler_entry);
 
 /* Expects a well-formed message from the client (minus the '\r\n'). Parses the given command (currently NICK and USER), and updates the given user struct appropriately. */
 int parseMsg(char *msg, int clientSocket) {
-  /* Ignore any prefix */
   printf("message is :%s\n",msg);
+  /* IRCv3 tags are left in place; handlers that relay them read cur_tags */
+  cur_tags = NULL;
+  cur_tags_len = 0;
+  if (msg[0] == '@') {
+    char* end = strchr(msg, ' ');
+    if (end == NULL) return 1;
+    cur_tags = msg + 1;
+    cur_tags_len = end - msg - 1;
+    msg = end + 1;
+    while (msg[0] == ' ') msg++;
+  }
+  /* Ignore any prefix */
   if (msg[0] == ':') {
     char prebuf[511];
     sscanf(msg, "%s", prebuf);
@@ -1469,33 +2441,692 @@ ps[pct] = strdup(pbuf);
 }
 pct++;
       }
+      command_begin(i);
       handlers[i].func(ps, clientSocket);
+      command_end();
       break;
     }
   }
   if (i == num_handlers) {
+    METRIC_ADD(get_shard()->unknown_commands, 1);
     errCmd(cmd,clientSocket);
     return 1;
   }
   return 0;
 }
 
+int write_all(int fd, const void *data, size_t n) {
+  const char *p = data;
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+  return 0;
+}
+
+int read_all(int fd, void *data, size_t n) {
+  char *p = data;
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r == 0) return -1;
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += r;
+    n -= r;
+  }
+  return 0;
+}
+
+/* Renders all metrics in the Prometheus text exposition format */
+
+/* Sums the histogram found at offset within every shard and prints it */
+void render_histogram(FILE *out, const char *name, const char *label, const char *value, size_t offset) {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t sum = 0, cumulative = 0;
+  metrics_shard *shard;
+  int j, k;
+  memset(counts, 0, sizeof(counts));
+  for (shard = __atomic_load_n(&shards_head, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+    histogram *h = (histogram *) ((char *) shard + offset);
+    for (j = 0; j < HIST_BUCKETS; j++) counts[j] += METRIC_READ(h->counts[j]);
+    sum += METRIC_READ(h->sum_ns);
+  }
+  /* Export every other power of two from 1us; a bucket's upper bound of
+     2^k ns is exact since sub-buckets never straddle a power of two */
+  j = 0;
+  for (k = 10; k <= 34; k += 2) {
+    for (; j < 2 * k && j < HIST_BUCKETS; j++) cumulative += counts[j];
+    fprintf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %llu\n", name, label, value, (double) (1ULL << k) / 1e9, (unsigned long long) cumulative);
+  }
+  for (; j < HIST_BUCKETS; j++) cumulative += counts[j];
+  fprintf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", name, label, value, (unsigned long long) cumulative);
+  fprintf(out, "%s_sum{%s=\"%s\"} %.9f\n", name, label, value, sum / 1e9);
+  fprintf(out, "%s_count{%s=\"%s\"} %llu\n", name, label, value, (unsigned long long) cumulative);
+}
+
+void metrics_render(FILE *out) {
+  metrics_shard *shard;
+  int i, conns = 0, sendq = 0, recvq = 0, q;
+  uint64_t unknown = 0, bytes_in = 0, bytes_out = 0;
+  user *usr;
+
+  for (shard = __atomic_load_n(&shards_head, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+    unknown += METRIC_READ(shard->unknown_commands);
+    bytes_in += METRIC_READ(shard->bytes_in);
+    bytes_out += METRIC_READ(shard->bytes_out);
+  }
+
+  fprintf(out, "# HELP chirc_command_duration_seconds Time spent executing each command handler.\n");
+  fprintf(out, "# TYPE chirc_command_duration_seconds histogram\n");
+  for (i = 0; i < num_handlers; i++) {
+    render_histogram(out, "chirc_command_duration_seconds", "command", handlers[i].name, offsetof(metrics_shard, commands[i]));
+  }
+
+  fprintf(out, "# HELP chirc_lock_wait_seconds Time spent blocked on a contended lock.\n");
+  fprintf(out, "# TYPE chirc_lock_wait_seconds histogram\n");
+  for (i = 0; i < NUM_LOCKS; i++) {
+    render_histogram(out, "chirc_lock_wait_seconds", "lock", lock_names[i], offsetof(metrics_shard, lock_wait[i]));
+  }
+
+  fprintf(out, "# HELP chirc_unknown_commands_total Commands rejected with ERR_UNKNOWNCOMMAND.\n");
+  fprintf(out, "# TYPE chirc_unknown_commands_total counter\n");
+  fprintf(out, "chirc_unknown_commands_total %llu\n", (unsigned long long) unknown);
+  fprintf(out, "# HELP chirc_received_bytes_total Bytes read from clients.\n");
+  fprintf(out, "# TYPE chirc_received_bytes_total counter\n");
+  fprintf(out, "chirc_received_bytes_total %llu\n", (unsigned long long) bytes_in);
+  fprintf(out, "# HELP chirc_sent_bytes_total Bytes written to clients.\n");
+  fprintf(out, "# TYPE chirc_sent_bytes_total counter\n");
+  fprintf(out, "chirc_sent_bytes_total %llu\n", (unsigned long long) bytes_out);
+
+  /* chirc has no queues of its own; what backs up under load is the
+     kernel's per-socket buffers, so report those */
+  s_lock(&lock, LOCK_USERS);
+  for (usr = head; usr != NULL; usr = usr->next) {
+    conns++;
+    if (ioctl(usr->clientID, SIOCOUTQ, &q) == 0) sendq += q;
+    if (ioctl(usr->clientID, SIOCINQ, &q) == 0) recvq += q;
+  }
+  pthread_mutex_unlock(&lock);
+
+  fprintf(out, "# HELP chirc_connections Open client connections.\n");
+  fprintf(out, "# TYPE chirc_connections gauge\n");
+  fprintf(out, "chirc_connections %d\n", conns);
+  fprintf(out, "# HELP chirc_channels Channels currently formed.\n");
+  fprintf(out, "# TYPE chirc_channels gauge\n");
+  fprintf(out, "chirc_channels %d\n", num_channels);
+  fprintf(out, "# HELP chirc_commands_in_flight Commands currently being executed.\n");
+  fprintf(out, "# TYPE chirc_commands_in_flight gauge\n");
+  fprintf(out, "chirc_commands_in_flight %d\n", __atomic_load_n(&commands_in_flight, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP chirc_send_queue_bytes Bytes queued in client sockets' send buffers.\n");
+  fprintf(out, "# TYPE chirc_send_queue_bytes gauge\n");
+  fprintf(out, "chirc_send_queue_bytes %d\n", sendq);
+  fprintf(out, "# HELP chirc_receive_queue_bytes Bytes waiting in client sockets' receive buffers.\n");
+  fprintf(out, "# TYPE chirc_receive_queue_bytes gauge\n");
+  fprintf(out, "chirc_receive_queue_bytes %d\n", recvq);
+}
+
+/* Serves metrics_render() over HTTP to whoever connects to the admin
+   socket, which only listens on the loopback interface */
+void* admin_thread(void* args) {
+  int adminSocket = *(int *) args;
+  int conn;
+  char req[1024];
+  pthread_detach(pthread_self());
+  while (1) {
+    if ((conn = accept4(adminSocket, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+      if (errno != EINTR) perror("Admin socket accept() failed");
+      continue;
+    }
+    /* The request itself doesn't matter, every path gets the metrics */
+    struct timeval tv = { 1, 0 };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    recv(conn, req, sizeof(req), 0);
+
+    char *body = NULL;
+    size_t bodylen = 0;
+    FILE *out = open_memstream(&body, &bodylen);
+    metrics_render(out);
+    fclose(out);
+    char hdr[128];
+    snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", bodylen);
+    if (write_all(conn, hdr, strlen(hdr)) == 0) write_all(conn, body, bodylen);
+    free(body);
+    close(conn);
+  }
+  return NULL;
+}
+
+int open_admin_socket(char *admin_port) {
+  struct sockaddr_in addr;
+  int yes = 1;
+  int adminSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (adminSocket == -1) {
+    perror("Could not open admin socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(atoi(admin_port));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(adminSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+  if (bind(adminSocket, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(adminSocket, 5) == -1) {
+    perror("Admin socket bind() failed");
+    close(adminSocket);
+    return -1;
+  }
+  return adminSocket;
+}
+
+/* Hot restart. On SIGUSR2 the server waits until no client thread is
+   dispatching a command, serializes the user and channel tables (including
+   each connection's partially received line), and exec's a fresh copy of
+   the binary. The listening socket and every client socket are passed to
+   the new process over a UNIX socketpair with SCM_RIGHTS, followed by the
+   serialized state. Once the new process acknowledges that it has rebuilt
+   its tables, the old one exits; if anything goes wrong before that, the
+   old process simply resumes service. */
+
+#define HR_MAGIC 0x63687263
+#define HR_VERSION 5
+#define HR_FDS_PER_MSG 200
+
+typedef struct Hr_buf hr_buf;
+struct Hr_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  int err;
+};
+
+void hr_put(hr_buf *b, const void *src, size_t n) {
+  if (b->len + n > b->cap) {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n) cap *= 2;
+    b->data = realloc(b->data, cap);
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, src, n);
+  b->len += n;
+}
+
+void hr_put_int(hr_buf *b, int v) {
+  hr_put(b, &v, sizeof(v));
+}
+
+/* Strings are length-prefixed; -1 encodes NULL */
+void hr_put_str(hr_buf *b, const char *str) {
+  if (str == NULL) {
+    hr_put_int(b, -1);
+    return;
+  }
+  int len = strlen(str);
+  hr_put_int(b, len);
+  hr_put(b, str, len);
+}
+
+void hr_get(hr_buf *b, void *dst, size_t n) {
+  if (b->err || b->pos + n > b->len) {
+    b->err = 1;
+    memset(dst, 0, n);
+    return;
+  }
+  memcpy(dst, b->data + b->pos, n);
+  b->pos += n;
+}
+
+int hr_get_int(hr_buf *b) {
+  int v;
+  hr_get(b, &v, sizeof(v));
+  return v;
+}
+
+char* hr_get_str(hr_buf *b) {
+  int len = hr_get_int(b);
+  if (len < 0 || b->err) return NULL;
+  if (b->pos + len > b->len) {
+    b->err = 1;
+    return NULL;
+  }
+  char *str = malloc(len + 1);
+  hr_get(b, str, len);
+  str[len] = '\0';
+  return str;
+}
+
+/* Sends fds[0..n) in batches, each carried by a single byte of payload */
+int hr_send_fds(int chan, int *fds, int n) {
+  int sent = 0;
+  while (sent < n) {
+    int batch = n - sent > HR_FDS_PER_MSG ? HR_FDS_PER_MSG : n - sent;
+    char cbuf[CMSG_SPACE(HR_FDS_PER_MSG * sizeof(int))];
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    memset(cbuf, 0, sizeof(cbuf));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(batch * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds + sent, batch * sizeof(int));
+    if (sendmsg(chan, &mh, 0) != 1) return -1;
+    sent += batch;
+  }
+  return 0;
+}
+
+int hr_recv_fds(int chan, int *fds, int n) {
+  int got = 0;
+  while (got < n) {
+    int batch = n - got > HR_FDS_PER_MSG ? HR_FDS_PER_MSG : n - got;
+    char cbuf[CMSG_SPACE(HR_FDS_PER_MSG * sizeof(int))];
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+    /* Client sockets only cross a later exec through another handoff */
+    if (recvmsg(chan, &mh, MSG_CMSG_CLOEXEC) != 1) return -1;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (cm == NULL || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(batch * sizeof(int))) return -1;
+    memcpy(fds + got, CMSG_DATA(cm), batch * sizeof(int));
+    got += batch;
+  }
+  return 0;
+}
+
+int hr_fd_index(int *fds, int n, int fd) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (fds[i] == fd) return i;
+  }
+  return -1;
+}
+
+/* Drops the users that have no connection to hand over: those whose
+   descriptor is closed, and those whose descriptor number was reused by a
+   newer connection (users are appended, so the last one is the newest).
+   Must be called with dispatch_lock held for writing. */
+void hr_reap_stale() {
+  user *usr, *next, *newer;
+
+  for (usr = head; usr != NULL; usr = next) {
+    next = usr->next;
+    for (newer = next; newer != NULL; newer = newer->next) {
+      if (newer->clientID == usr->clientID) break;
+    }
+    if (newer != NULL || fcntl(usr->clientID, F_GETFD) == -1) {
+      user_remove(usr, newer);
+    }
+  }
+}
+
+/* Serializes the server state into b and collects the descriptors to hand
+   over into fds (listening socket first). Must be called with dispatch_lock
+   held for writing. Returns the number of descriptors. */
+int hr_serialize(hr_buf *b, int serverSocket, int **fdsp) {
+  int nusers = 0, nchans = 0, nfds = 1, i;
+  user *usr;
+  channel_list *chan;
+  channel_users *cuser;
+  client_channels *cchan;
+
+  /* Every user left owns exactly one live descriptor */
+  hr_reap_stale();
+  for (usr = head; usr != NULL; usr = usr->next) nusers++;
+  int *fds = malloc((nusers + 2) * sizeof(int));
+  fds[0] = serverSocket;
+  if (adminSocket != -1) fds[nfds++] = adminSocket;
+  for (usr = head; usr != NULL; usr = usr->next) {
+    if (hr_fd_index(fds, nfds, usr->clientID) == -1) fds[nfds++] = usr->clientID;
+  }
+
+  hr_put_int(b, HR_MAGIC);
+  hr_put_int(b, HR_VERSION);
+  hr_put_str(b, s_time);
+  hr_put_int(b, num_channels);
+  hr_put_int(b, nfds);
+  hr_put(b, fds, nfds * sizeof(int));
+  hr_put_int(b, hr_fd_index(fds, nfds, adminSocket));
+
+  hr_put_int(b, nusers);
+  for (usr = head; usr != NULL; usr = usr->next) {
+    hr_put_int(b, usr->clientID);
+    hr_put_str(b, usr->nick);
+    hr_put_str(b, usr->username);
+    hr_put_str(b, usr->fullname);
+    hr_put_str(b, usr->away);
+    hr_put_int(b, usr->md_oper);
+    hr_put_int(b, usr->registered);
+    hr_put_int(b, usr->inlen);
+    hr_put_int(b, usr->incr);
+    hr_put(b, usr->inbuf, usr->inlen);
+    hr_put_int(b, usr->intags);
+    hr_put_int(b, usr->caps);
+    hr_put_int(b, usr->cap_negotiating);
+    hr_put_str(b, usr->host);
+    i = 0;
+    for (cchan = usr->channels; cchan != NULL; cchan = cchan->next) i++;
+    hr_put_int(b, i);
+    for (cchan = usr->channels; cchan != NULL; cchan = cchan->next) {
+      hr_put_str(b, cchan->channel);
+    }
+  }
+
+  for (chan = channels_head; chan != NULL; chan = chan->next) nchans++;
+  hr_put_int(b, nchans);
+  for (chan = channels_head; chan != NULL; chan = chan->next) {
+    hr_put_str(b, chan->channel);
+    hr_put_str(b, chan->topic);
+    hr_put_int(b, chan->active);
+    hr_put_int(b, chan->md_moder);
+    hr_put_int(b, chan->md_topic);
+    i = 0;
+    for (cuser = chan->users; cuser != NULL; cuser = cuser->next) i++;
+    hr_put_int(b, i);
+    for (cuser = chan->users; cuser != NULL; cuser = cuser->next) {
+      hr_put_int(b, cuser->user_socket);
+      hr_put_int(b, cuser->md_voice);
+      hr_put_int(b, cuser->md_coper);
+    }
+    channel_history *h = chan->history;
+    hr_put_int(b, h->count);
+    for (i = 0; i < h->count; i++) {
+      history_line *line = h->lines[(h->start + i) % HISTORY_LINES];
+      hr_put(b, &line->when_ms, sizeof(line->when_ms));
+      hr_put_str(b, line->text);
+    }
+  }
+
+  *fdsp = fds;
+  return nfds;
+}
+
+/* Rebuilds the user and channel tables from b, translating the old process'
+   descriptor numbers (oldfds) into the ones we received (newfds). Returns 0
+   on success. */
+int hr_deserialize(hr_buf *b, int version, int *oldfds, int *newfds, int nfds) {
+  int nusers, nchans, n, i, j;
+
+  nusers = hr_get_int(b);
+  for (i = 0; i < nusers && !b->err; i++) {
+    int idx = hr_fd_index(oldfds, nfds, hr_get_int(b));
+    user *usr = userInit(idx > 0 ? newfds[idx] : -1);
+    usr->nick = hr_get_str(b);
+    usr->username = hr_get_str(b);
+    usr->fullname = hr_get_str(b);
+    usr->away = hr_get_str(b);
+    usr->md_oper = hr_get_int(b);
+    usr->registered = hr_get_int(b);
+    usr->inlen = hr_get_int(b);
+    usr->incr = hr_get_int(b);
+    if (usr->inlen < 0 || usr->inlen > (int) sizeof(usr->inbuf)) {
+      b->err = 1;
+      usr->inlen = 0;
+    }
+    hr_get(b, usr->inbuf, usr->inlen);
+    if (version >= 4) {
+      usr->intags = hr_get_int(b);
+      usr->caps = hr_get_int(b);
+      usr->cap_negotiating = hr_get_int(b);
+    }
+    if (version >= 5) usr->host = hr_get_str(b);
+    n = hr_get_int(b);
+    for (j = 0; j < n && !b->err; j++) {
+      client_channels *mem = client_channels_init();
+      mem->channel = hr_get_str(b);
+      client_channels_add(usr, mem);
+    }
+    if (usr->clientID == -1) {
+      userFree(usr);
+      continue;
+    }
+    /* Older binaries could hand over stale users sharing a descriptor with
+       a newer one (which comes later); only the newest is kept */
+    user *stale = ID_find(usr->clientID);
+    if (stale != NULL) user_remove(stale, NULL);
+    user_add(usr);
+  }
+
+  nchans = hr_get_int(b);
+  for (i = 0; i < nchans && !b->err; i++) {
+    channel_list *chan = channel_list_init();
+    channel_users *tail = NULL;
+    chan->channel = hr_get_str(b);
+    chan->topic = hr_get_str(b);
+    chan->active = hr_get_int(b);
+    chan->md_moder = hr_get_int(b);
+    chan->md_topic = hr_get_int(b);
+    n = hr_get_int(b);
+    for (j = 0; j < n && !b->err; j++) {
+      int idx = hr_fd_index(oldfds, nfds, hr_get_int(b));
+      channel_users *cuser = channel_users_init();
+      cuser->md_voice = hr_get_int(b);
+      cuser->md_coper = hr_get_int(b);
+      /* skip members whose connection did not make it across, and those
+         left behind by a stale user (see above) */
+      user *member = idx > 0 ? ID_find(newfds[idx]) : NULL;
+      if (member == NULL || !in_client_channels(chan->channel, member->channels)
+          || channel_users_find(chan->users, newfds[idx]) != NULL) {
+        free(cuser);
+        chan->active--;
+        continue;
+      }
+      cuser->user_socket = newfds[idx];
+      if (tail == NULL) chan->users = cuser;
+      else tail->next = cuser;
+      tail = cuser;
+    }
+    n = version >= 3 ? hr_get_int(b) : 0;
+    for (j = 0; j < n && !b->err; j++) {
+      uint64_t when_ms;
+      hr_get(b, &when_ms, sizeof(when_ms));
+      char *text = hr_get_str(b);
+      if (text != NULL) history_add(chan, text, when_ms);
+      free(text);
+    }
+    channel_add(chan);
+  }
+  return b->err ? -1 : 0;
+}
+
+/* Hands the server over to a freshly exec'd binary. Returns only if the
+   restart failed, in which case this process keeps serving. */
+void hot_restart(int serverSocket) {
+  hr_buf b;
+  int *fds = NULL;
+  int nfds, i, sv[2];
+  char ack;
+  pid_t pid;
+
+  memset(&b, 0, sizeof(b));
+  pthread_rwlock_wrlock(&dispatch_lock);
+  printf("hot restart: handing over to %s\n", exe_path);
+  nfds = hr_serialize(&b, serverSocket, &fds);
+
+  /* Only the handoff channel may leak into the new process */
+  for (i = 0; i < nfds; i++) {
+    fcntl(fds[i], F_SETFD, fcntl(fds[i], F_GETFD) | FD_CLOEXEC);
+  }
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+    perror("hot restart: socketpair() failed");
+    goto fail;
+  }
+  /* the child's end must stay open across exec */
+  fcntl(sv[1], F_SETFD, 0);
+
+  char chanarg[16], replayarg[16];
+  snprintf(chanarg, sizeof(chanarg), "%d", sv[1]);
+  snprintf(replayarg, sizeof(replayarg), "%d", join_replay);
+  char *args[13] = { exe_path, "-p", port, "-o", password, "-H", replayarg, "-R", chanarg };
+  int nargs = 9;
+  if (resolver_disabled) args[nargs++] = "-d";
+  if (dns_server_arg != NULL) {
+    args[nargs++] = "-N";
+    args[nargs++] = dns_server_arg;
+  }
+  args[nargs] = NULL;
+  fflush(stdout);
+  fflush(stderr);
+  if ((pid = fork()) == -1) {
+    perror("hot restart: fork() failed");
+    close(sv[0]);
+    close(sv[1]);
+    goto fail;
+  }
+  if (pid == 0) {
+    execv(exe_path, args);
+    _exit(127);
+  }
+  close(sv[1]);
+
+  unsigned int bloblen = b.len;
+  if (write_all(sv[0], &nfds, sizeof(nfds)) == -1
+      || hr_send_fds(sv[0], fds, nfds) == -1
+      || write_all(sv[0], &bloblen, sizeof(bloblen)) == -1
+      || write_all(sv[0], b.data, b.len) == -1
+      || read_all(sv[0], &ack, 1) == -1) {
+    fprintf(stderr, "hot restart: new process did not take over, resuming\n");
+    close(sv[0]);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    goto fail;
+  }
+
+  printf("hot restart: process %d took over\n", (int) pid);
+  fflush(stdout);
+  _exit(0);
+
+ fail:
+  free(fds);
+  free(b.data);
+  pthread_rwlock_unlock(&dispatch_lock);
+}
+
+/* Counterpart of hot_restart() run by the new process: receives descriptors
+   and state over chan and rebuilds the tables. The client connections that
+   were handed over are stored in clientfds (nclients of them), each with
+   exactly one user. Returns the listening socket, or -1 on failure. */
+int hot_restart_resume(int chan, int **clientfds, int *nclients) {
+  hr_buf b;
+  int nfds, *oldfds, *newfds, serverSocket, i;
+  unsigned int bloblen;
+
+  int version, admin_idx = -1;
+
+  memset(&b, 0, sizeof(b));
+  if (read_all(chan, &nfds, sizeof(nfds)) == -1 || nfds < 1) return -1;
+  newfds = malloc(nfds * sizeof(int));
+  oldfds = malloc(nfds * sizeof(int));
+  if (hr_recv_fds(chan, newfds, nfds) == -1
+      || read_all(chan, &bloblen, sizeof(bloblen)) == -1) {
+    free(newfds);
+    free(oldfds);
+    return -1;
+  }
+  b.data = malloc(bloblen);
+  b.len = bloblen;
+  if (read_all(chan, b.data, bloblen) == -1 || hr_get_int(&b) != HR_MAGIC) goto fail;
+  /* accept state from older binaries too, that's the point */
+  version = hr_get_int(&b);
+  if (version < 1 || version > HR_VERSION) goto fail;
+  char *created = hr_get_str(&b);
+  if (created != NULL) {
+    snprintf(s_time, sizeof(s_time), "%s", created);
+    free(created);
+  }
+  num_channels = hr_get_int(&b);
+  if (hr_get_int(&b) != nfds) goto fail;
+  hr_get(&b, oldfds, nfds * sizeof(int));
+  if (version >= 2) admin_idx = hr_get_int(&b);
+  if (hr_deserialize(&b, version, oldfds, newfds, nfds) == -1) goto fail;
+
+  serverSocket = newfds[0];
+  if (admin_idx > 0 && admin_idx < nfds) adminSocket = newfds[admin_idx];
+  *clientfds = malloc(nfds * sizeof(int));
+  *nclients = 0;
+  for (i = 1; i < nfds; i++) {
+    if (i == admin_idx) continue;
+    if (ID_find(newfds[i]) != NULL) (*clientfds)[(*nclients)++] = newfds[i];
+    else close(newfds[i]);
+  }
+  free(newfds);
+  free(oldfds);
+  free(b.data);
+  if (write_all(chan, "k", 1) == -1) return -1;
+  close(chan);
+  return serverSocket;
+
+ fail:
+  free(newfds);
+  free(oldfds);
+  free(b.data);
+  return -1;
+}
+
+/* Waits for SIGUSR2, which requests a hot restart */
+void* restart_signal_thread(void* args) {
+  int serverSocket = *(int *) args;
+  sigset_t set;
+  int sig;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  pthread_detach(pthread_self());
+  while (1) {
+    if (sigwait(&set, &sig) == 0 && sig == SIGUSR2) {
+      hot_restart(serverSocket);
+    }
+  }
+  return NULL;
+}
+
+int start_client_thread(int clientSocket) {
+  pthread_t client_thread;
+  struct workerArgs *wa;
+  wa=malloc(sizeof(struct workerArgs));
+  wa->socket=clientSocket;
+  if(pthread_create(&client_thread,NULL,client_commands,wa)!=0)
+    {
+      perror("Could not create a client thread");
+      free(wa);
+      return -1;
+    }
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
   time_t servertime;
-  int serverSocket;
+  static int serverSocket;
   int clientSocket;
-  pthread_t client_thread;
+  pthread_t restart_thread;
   struct addrinfo hints, *res;
-  struct sockaddr_storage *clientAddr;
-  socklen_t sinSize = sizeof(struct sockaddr_storage);
-  struct workerArgs *wa;
+  struct sockaddr_storage clientAddr;
+  socklen_t sinSize;
   int yes = 1;
+  int resume_chan = -1;
+  int *resumed_fds = NULL, nresumed = 0, i;
+  char *admin_port = NULL;
+  pthread_t metrics_thread;
   /* Parse command line arguments. */
   int opt;
-  char *port = "6667";
   
-  while ((opt = getopt(argc, argv, "p:o:h")) != -1)
+  while ((opt = getopt(argc, argv, "p:o:m:H:dN:R:h")) != -1)
     switch (opt)
       {
       case 'p':
@@ -1503,97 +3134,175 @@ port = strdup(optarg);
 break;
       case 'o':
 password = strdup(optarg);
+break;
+      case 'm':
+admin_port = strdup(optarg);
+break;
+      case 'H':
+join_replay = atoi(optarg);
+break;
+      case 'd':
+resolver_disabled = 1;
+break;
+      case 'N':
+if (dns_server_parse(optarg) != 0) {
+  printf("ERROR: Bad nameserver address %s\n", optarg);
+  exit(-1);
+}
+break;
+      case 'R':
+resume_chan = atoi(optarg);
 break;
       default:
 printf("ERROR: Unknown option -%c\n", opt);
 exit(-1);
       }
-  memset(&hints, 0, sizeof( hints));
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  
-  if (getaddrinfo(NULL, port, &hints, &res) != 0) {
-    perror("getaddrinfo() failed");
-    pthread_exit(NULL);
-  }
 
-  /* Listen for client connection. */
-  serverSocket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-  if(serverSocket == -1) {
-    perror("Could not open socket");
-    exit(-1);
-  }
-  if(setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-    perror("Socket setsockopt() failed");
-    close(serverSocket);
-    exit(-1);
+  ssize_t exe_len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+  if (exe_len == -1) {
+    snprintf(exe_path, sizeof(exe_path), "%s", argv[0]);
   }
-  if(bind(serverSocket, res->ai_addr, res->ai_addrlen) == -1) {
-    perror("Socket bind() failed");
-    close(serverSocket);
-    exit(-1);
-  }
-  if (listen(serverSocket, 5) == -1) {
-    perror("Socket listen() failed");
-    close(serverSocket);
-
+  else {
+    exe_path[exe_len] = '\0';
   }
 
-  time(&servertime);
-  ctime(&servertime);
-  sprintf(s_time, "%s", ctime(&servertime));
-  s_time[strlen(s_time) - 1] = '\0'; // Get rid of newline at end of the string
-  
   if (pthread_mutex_init(&lock, NULL) != 0) {
     perror("Mutex init failed");
-    close(serverSocket);
     exit(-1);
   }
 
-
   if (pthread_mutex_init(&chlock, NULL) != 0) {
     perror("Channel mutex init failed");
-    close(serverSocket);
     exit(-1);
   }
 
   if (pthread_mutex_init(&mes, NULL) != 0) {
     perror("message mutex init failed");
-    close(serverSocket);
     exit(-1);
   }
 
+  if (num_handlers > MAX_HANDLERS) {
+    fprintf(stderr, "MAX_HANDLERS is too small\n");
+    exit(-1);
+  }
+  pthread_key_create(&shard_key, shard_release);
+
+  /* Writer preference, so a pending hot restart isn't starved by traffic */
+  pthread_rwlockattr_t rwattr;
+  pthread_rwlockattr_init(&rwattr);
+  pthread_rwlockattr_setkind_np(&rwattr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  if (pthread_rwlock_init(&dispatch_lock, &rwattr) != 0) {
+    perror("dispatch lock init failed");
+    exit(-1);
+  }
+  pthread_rwlockattr_destroy(&rwattr);
+
+  if (resume_chan != -1) {
+    /* We are the new half of a hot restart */
+    if ((serverSocket = hot_restart_resume(resume_chan, &resumed_fds, &nresumed)) == -1) {
+      fprintf(stderr, "Could not resume from hot restart\n");
+      exit(-1);
+    }
+  }
+  else {
+    memset(&hints, 0, sizeof( hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+  
+    if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+      perror("getaddrinfo() failed");
+      pthread_exit(NULL);
+    }
+
+    /* Listen for client connection. */
+    serverSocket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(serverSocket == -1) {
+      perror("Could not open socket");
+      exit(-1);
+    }
+    if(setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+      perror("Socket setsockopt() failed");
+      close(serverSocket);
+      exit(-1);
+    }
+    if(bind(serverSocket, res->ai_addr, res->ai_addrlen) == -1) {
+      perror("Socket bind() failed");
+      close(serverSocket);
+      exit(-1);
+    }
+    if (listen(serverSocket, 5) == -1) {
+      perror("Socket listen() failed");
+      close(serverSocket);
+
+    }
+
+    time(&servertime);
+    ctime(&servertime);
+    sprintf(s_time, "%s", ctime(&servertime));
+    s_time[strlen(s_time) - 1] = '\0'; // Get rid of newline at end of the string
+  }
+  /* accept() only after poll() says so, see below */
+  fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+
   sigset_t new;
   sigemptyset (&new);
   sigaddset(&new, SIGPIPE);
+  sigaddset(&new, SIGUSR2);
   if (pthread_sigmask(SIG_BLOCK, &new, NULL) != 0) {
     perror("Unable to mask SIGPIPE");
     exit(-1);
   }
 
+  if (admin_port != NULL && adminSocket == -1) {
+    adminSocket = open_admin_socket(admin_port);
+  }
+  if (adminSocket != -1 && pthread_create(&metrics_thread, NULL, admin_thread, &adminSocket) != 0) {
+    perror("Could not create admin thread");
+    exit(-1);
+  }
+
+  if (resolver_start() != 0) {
+    perror("Could not create resolver threads");
+    exit(-1);
+  }
+
+  if (pthread_create(&restart_thread, NULL, restart_signal_thread, &serverSocket) != 0) {
+    perror("Could not create restart thread");
+    exit(-1);
+  }
+
+  /* Connections handed over by a hot restart get their threads back, one
+     per descriptor */
+  for (i = 0; i < nresumed; i++) {
+    start_client_thread(resumed_fds[i]);
+  }
+  free(resumed_fds);
+
   while(1) {
-    clientAddr=malloc(sinSize);
+    /* As with client threads, a connection is only accepted under the
+       dispatch lock so a hot restart never strands one mid-accept */
+    struct pollfd pfd = { serverSocket, POLLIN, 0 };
+    if (poll(&pfd, 1, -1) == -1) continue;
+    s_rdlock(&dispatch_lock, LOCK_DISPATCH);
+    sinSize = sizeof(clientAddr);
     if((clientSocket = accept(serverSocket, (struct sockaddr *) &clientAddr, &sinSize)) == -1)
       {
-free(clientAddr);
-perror("Socket accept() failed");
-close(serverSocket);
+pthread_rwlock_unlock(&dispatch_lock);
+if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+  perror("Socket accept() failed");
 continue;
       } 
 
-    wa=malloc(sizeof(struct workerArgs));
-    wa->socket=clientSocket;
-    if(pthread_create(&client_thread,NULL,client_commands,wa)!=0)
+    user_add(userInit(clientSocket));
+    resolver_prefetch(clientSocket);
+    if (start_client_thread(clientSocket) != 0)
       {
-perror("Could not create a client thread");
-free(clientAddr);
-free(wa);
+pthread_rwlock_unlock(&dispatch_lock);
 close(clientSocket);
 pthread_exit(NULL);
-
-
       }
+    pthread_rwlock_unlock(&dispatch_lock);
   }
   pthread_mutex_destroy(&lock);
   pthread_mutex_destroy(&chlock);
@@ -1603,58 +3312,82 @@ pthread_exit(NULL);
 void* client_commands(void* args){
   struct workerArgs* wa;
   int clientSocket;
-  int bufct=0;
-  int flag=0;
   int nbytes;
   char buffer[20]; // buffer for reading from client
   wa = (struct workerArgs*) args;
   clientSocket = wa->socket;
+  free(wa);
 
   pthread_detach(pthread_self());
-  user* new = userInit(clientSocket);
-  user_add(new);
+  user* new = ID_find(clientSocket);
 
   while(1) {
+    /* Wait for input without holding the dispatch lock, then take the
+       lock before consuming it so that a hot restart never loses bytes
+       that have been read but not yet parsed. */
+    struct pollfd pfd = { clientSocket, POLLIN, 0 };
+    if (poll(&pfd, 1, -1) == -1) continue;
+    s_rdlock(&dispatch_lock, LOCK_DISPATCH);
+    in_dispatch = 1;
+
     /* Recieve message from client. */
-    nbytes=recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+    nbytes=recv(clientSocket, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
     if (nbytes == 0)
       {
 perror("Server closed the connection");
+/* forget the user before the descriptor number can be reused */
+user_remove(new, NULL);
 close(clientSocket);
-pthread_exit(NULL);
+client_exit();
       }
     else if (nbytes == -1)
       {
+if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+  in_dispatch = 0;
+  pthread_rwlock_unlock(&dispatch_lock);
+  continue;
+}
 perror("Socket recv() failed");
+user_remove(new, NULL);
 close(clientSocket);
-pthread_exit(NULL);
+client_exit();
       }
     else
       {
+METRIC_ADD(get_shard()->bytes_in, nbytes);
 buffer[nbytes] = '\0'; // tack on a '\0' so we can treat the buffer like a string
       }
 
-    char buf[511];
-    int i;
+    char* buf = new->inbuf;
+    int i, limit;
     for (i = 0; i < nbytes; i++) {
-      buf[bufct] = buffer[i];
-      if (buf[bufct] == '\r') flag = 1;
-      if (buf[bufct] == '\n' && flag) {
-buf[bufct-1] = '\0';
+      buf[new->inlen] = buffer[i];
+      if (buf[new->inlen] == '\r') new->incr = 1;
+      if (buf[new->inlen] == '\n' && new->incr) {
+buf[new->inlen-1] = '\0';
 parseMsg(buf, clientSocket);
-bufct = 0;
-flag = 0;
+new->inlen = 0;
+new->incr = 0;
+new->intags = 0;
 continue;
       }
-      if (bufct == 509) {
-buf[bufct+1] = '\0';
+      /* A tag section doesn't count against the 512-byte message limit */
+      if (new->inlen == 0 && buf[0] == '@') new->intags = -1;
+      else if (new->intags == -1 && buf[new->inlen] == ' ') new->intags = new->inlen + 1;
+      if (new->intags == -1) limit = MAX_TAGS_LEN - 1;
+      else limit = new->intags + 509;
+      if (new->inlen == limit) {
+buf[new->inlen+1] = '\0';
 parseMsg(buf, clientSocket);
-bufct = 0;
-flag = 0;
+new->inlen = 0;
+new->incr = 0;
+new->intags = 0;
 continue;
       }
-      bufct++;
+      new->inlen++;
     }
+    in_dispatch = 0;
+    pthread_rwlock_unlock(&dispatch_lock);
   }
   return 0;
 }
@@ -9,6 +9,12 @@ import test_unknown
 import test_channel
 import test_modes
 import test_robustness
+import test_hot_restart
+import test_metrics
+import test_history
+import test_cap
+import test_multi_target
+import test_dns
 
 alltests = unittest.TestSuite([
                                unittest.TestLoader().loadTestsFromModule(test_connection),
@@ -19,7 +25,13 @@ alltests = unittest.TestSuite([
                                unittest.TestLoader().loadTestsFromModule(test_unknown),
                                unittest.TestLoader().loadTestsFromModule(test_channel),
                                unittest.TestLoader().loadTestsFromModule(test_modes),
-                               unittest.TestLoader().loadTestsFromModule(test_robustness)
+                               unittest.TestLoader().loadTestsFromModule(test_robustness),
+                               unittest.TestLoader().loadTestsFromModule(test_hot_restart),
+                               unittest.TestLoader().loadTestsFromModule(test_metrics),
+                               unittest.TestLoader().loadTestsFromModule(test_history),
+                               unittest.TestLoader().loadTestsFromModule(test_cap),
+                               unittest.TestLoader().loadTestsFromModule(test_multi_target),
+                               unittest.TestLoader().loadTestsFromModule(test_dns)
                                ])
 
 DEBUG = False
\ No newline at end of file
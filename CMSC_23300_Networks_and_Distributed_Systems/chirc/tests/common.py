@@ -81,7 +81,21 @@ class IRCMessage(object):
         
         self._s = s[:-2]
         
-        fields = self._s.split(" ")
+        # IRCv3 message tags, if any, come before the prefix
+        self.tags = {}
+        line = self._s
+        if line[0] == "@":
+            if not " " in line:
+                raise MessageNotWellFormedException()
+            tags, line = line[1:].split(" ", 1)
+            for tag in tags.split(";"):
+                if "=" in tag:
+                    k, v = tag.split("=", 1)
+                else:
+                    k, v = tag, None
+                self.tags[k] = v
+        
+        fields = line.split(" ")
         
         if len(fields) < 2:
             raise MessageNotWellFormedException()
@@ -167,7 +181,7 @@ class ChircTestCase(unittest.TestCase):
         tries = 3
 
         while tries > 0:
-            self.chirc_proc = subprocess.Popen([os.path.abspath(ChircTestCase.CHIRC_EXE), "-p", `self.port`, "-o", OPER_PASSWD], stdout=stdout, stderr=stderr, cwd = self.tmpdir)
+            self.chirc_proc = subprocess.Popen([os.path.abspath(ChircTestCase.CHIRC_EXE), "-p", `self.port`, "-o", OPER_PASSWD] + self.chirc_args(), stdout=stdout, stderr=stderr, cwd = self.tmpdir)
             rc = self.chirc_proc.poll()        
             if rc != None:
                 self.fail("chirc process failed to start. rc = %i" % rc)
@@ -179,6 +193,10 @@ class ChircTestCase(unittest.TestCase):
             
         self.clients = []
         
+    def chirc_args(self):
+        # Extra command-line arguments, for tests of optional features
+        return []
+
     def tearDown(self):
         for c in self.clients:
             self.disconnect_client(c)
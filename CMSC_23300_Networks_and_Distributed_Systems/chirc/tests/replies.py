@@ -2,6 +2,7 @@ RPL_WELCOME = "001"
 RPL_YOURHOST = "002"
 RPL_CREATED = "003"
 RPL_MYINFO = "004"
+RPL_ISUPPORT = "005"
 RPL_LUSERCLIENT = "251"
 RPL_LUSEROP = "252"
 RPL_LUSERUNKNOWN = "253"
@@ -32,12 +33,16 @@ RPL_YOUREOPER = "381"
 ERR_NOSUCHNICK = "401"
 ERR_NOSUCHCHANNEL = "403"
 ERR_CANNOTSENDTOCHAN = "404"
+ERR_TOOMANYTARGETS = "407"
+ERR_INVALIDCAPCMD = "410"
+ERR_NOTEXTTOSEND = "412"
 ERR_UNKNOWNCOMMAND = "421"
 ERR_NOMOTD = "422"
 ERR_NICKNAMEINUSE = "433"
 ERR_USERNOTINCHANNEL = "441"
 ERR_NOTONCHANNEL = "442"
 ERR_NOTREGISTERED = "451"
+ERR_NEEDMOREPARAMS = "461"
 ERR_ALREADYREGISTRED = "462"
 ERR_PASSWDMISMATCH = "464"
 ERR_UNKNOWNMODE = "472"
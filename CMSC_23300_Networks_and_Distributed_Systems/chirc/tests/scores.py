@@ -47,3 +47,11 @@ PROJ_1C.add_category("NAMES", "NAMES", 5)
 PROJ_1C.add_category("LIST", "LIST", 5)
 PROJ_1C.add_category("WHO", "WHO", 5)
 PROJ_1C.add_category("UPDATE_1B", "UPDATE_1B", 5)
+
+# Server features beyond the project specification (not graded)
+PROJ_1C.add_category("HOT_RESTART", "Hot restart", 0)
+PROJ_1C.add_category("METRICS", "Metrics", 0)
+PROJ_1C.add_category("HISTORY", "Channel history", 0)
+PROJ_1C.add_category("CAP", "IRCv3 capabilities", 0)
+PROJ_1C.add_category("MULTI_TARGET", "Multiple targets", 0)
+PROJ_1C.add_category("DNS", "Reverse DNS", 0)
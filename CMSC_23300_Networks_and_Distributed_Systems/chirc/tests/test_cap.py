@@ -0,0 +1,169 @@
+import tests.replies as replies
+import re
+from tests.common import ChircTestCase, ChircClient, ReplyTimeoutException
+from tests.scores import score
+
+SERVER_TIME_RE = r"^\d{4}-\d{2}-\d{2}T\d{2}:\d{2}:\d{2}\.\d{3}Z$"
+
+class CAP(ChircTestCase):
+
+    def _cap_connect_user(self, nick, username, caps):
+        client = self.get_client()
+
+        client.send_cmd("CAP LS 302")
+        self.get_message(client, expect_cmd = "CAP", expect_nparams = 3,
+                         expect_short_params = ["*", "LS"],
+                         long_param_re = "batch echo-message message-tags server-time")
+
+        client.send_cmd("CAP REQ :%s" % caps)
+        self.get_message(client, expect_cmd = "CAP", expect_nparams = 3,
+                         expect_short_params = ["*", "ACK"], long_param_re = caps)
+
+        # Registration waits for CAP END
+        client.send_cmd("NICK %s" % nick)
+        client.send_cmd("USER %s * * :%s" % (nick, username))
+        self.assertRaises(ReplyTimeoutException, self.get_reply, client)
+
+        client.send_cmd("CAP END")
+        self._test_welcome_messages(client, nick)
+        self.get_reply(client, expect_code = replies.RPL_ISUPPORT, expect_nick = nick)
+        self._test_lusers(client, nick)
+        self._test_motd(client, nick)
+
+        return client
+
+    def _test_server_time(self, msg):
+        self.assertIn("time", msg.tags, "Expected a server-time tag: %s" % msg._s)
+        self.assertIsNotNone(re.match(SERVER_TIME_RE, msg.tags["time"]),
+                             "Malformed server-time tag: %s" % msg._s)
+
+    @score(category="CAP")
+    def test_cap_negotiation(self):
+        client = self._cap_connect_user("user1", "User One", "echo-message batch")
+
+        client.send_cmd("CAP LIST")
+        self.get_message(client, expect_cmd = "CAP", expect_nparams = 3,
+                         expect_short_params = ["user1", "LIST"], long_param_re = "batch echo-message")
+
+        # An unknown capability NAKs the whole request
+        client.send_cmd("CAP REQ :server-time foo")
+        self.get_message(client, expect_cmd = "CAP", expect_nparams = 3,
+                         expect_short_params = ["user1", "NAK"], long_param_re = "server-time foo")
+
+        client.send_cmd("CAP REQ :-batch")
+        self.get_message(client, expect_cmd = "CAP", expect_nparams = 3,
+                         expect_short_params = ["user1", "ACK"], long_param_re = "-batch")
+
+        client.send_cmd("CAP LIST")
+        self.get_message(client, expect_cmd = "CAP", expect_nparams = 3,
+                         expect_short_params = ["user1", "LIST"], long_param_re = "echo-message")
+
+        client.send_cmd("CAP FOO")
+        self.get_reply(client, expect_code = replies.ERR_INVALIDCAPCMD, expect_nick = "user1",
+                       expect_short_params = ["FOO"])
+
+    @score(category="CAP")
+    def test_cap_no_negotiation(self):
+        # Clients that never send CAP see no tags and no ISUPPORT
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._cap_connect_user("user2", "User Two", "server-time")
+
+        client2.send_cmd("PRIVMSG user1 :Hello")
+        msg = self.get_message(client1, expect_cmd = "PRIVMSG", expect_nparams = 2,
+                               expect_short_params = ["user1"], long_param_re = "Hello")
+        self.assertEqual(msg.tags, {}, "Expected no tags: %s" % msg._s)
+
+    @score(category="CAP")
+    def test_cap_server_time(self):
+        client1 = self._cap_connect_user("user1", "User One", "server-time")
+        client2 = self._connect_user("user2", "User Two")
+
+        client2.send_cmd("PRIVMSG user1 :Hello")
+        msg = self.get_message(client1, expect_cmd = "PRIVMSG", expect_nparams = 2,
+                               expect_short_params = ["user1"], long_param_re = "Hello")
+        self._test_server_time(msg)
+
+        # Replies from the server are stamped too
+        client1.send_cmd("PING")
+        msg = self.get_message(client1, expect_cmd = "PONG", expect_nparams = 1)
+        self._test_server_time(msg)
+
+    @score(category="CAP")
+    def test_cap_echo_message(self):
+        client1 = self._cap_connect_user("user1", "User One", "echo-message")
+        client2 = self._connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #test")
+        self._test_join(client1, "user1", "#test")
+        client2.send_cmd("JOIN #test")
+        self._test_join(client2, "user2", "#test")
+        self._test_relayed_join(client1, from_nick="user2", channel="#test")
+
+        client1.send_cmd("PRIVMSG #test :Hello")
+        self._test_relayed_privmsg(client2, from_nick="user1", recip="#test", msg="Hello")
+        self._test_relayed_privmsg(client1, from_nick="user1", recip="#test", msg="Hello")
+
+        client1.send_cmd("PRIVMSG user2 :Hi")
+        self._test_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Hi")
+        self._test_relayed_privmsg(client1, from_nick="user1", recip="user2", msg="Hi")
+
+        # Without echo-message, the sender does not see its own PRIVMSG
+        client2.send_cmd("PRIVMSG #test :Hello back")
+        self._test_relayed_privmsg(client1, from_nick="user2", recip="#test", msg="Hello back")
+        self.assertRaises(ReplyTimeoutException, self.get_reply, client2)
+
+    @score(category="CAP")
+    def test_cap_message_tags(self):
+        client1 = self._cap_connect_user("user1", "User One", "message-tags")
+        client2 = self._cap_connect_user("user2", "User Two", "message-tags")
+        client3 = self._connect_user("user3", "User Three")
+
+        for client, nick in ((client1, "user1"), (client2, "user2"), (client3, "user3")):
+            client.send_cmd("JOIN #test")
+            self._test_join(client, nick, "#test")
+        self._test_relayed_join(client1, from_nick="user2", channel="#test")
+        self._test_relayed_join(client1, from_nick="user3", channel="#test")
+        self._test_relayed_join(client2, from_nick="user3", channel="#test")
+
+        # Only client-only (+) tags are relayed, and only to clients that
+        # enabled message-tags
+        client1.send_cmd("@+example.com/foo=bar;label=abc PRIVMSG #test :Tagged")
+        msg = self.get_message(client2, expect_cmd = "PRIVMSG", expect_nparams = 2,
+                               expect_short_params = ["#test"], long_param_re = "Tagged")
+        self.assertEqual(msg.tags, {"+example.com/foo": "bar"}, "Expected only the client-only tag: %s" % msg._s)
+        msg = self.get_message(client3, expect_cmd = "PRIVMSG", expect_nparams = 2,
+                               expect_short_params = ["#test"], long_param_re = "Tagged")
+        self.assertEqual(msg.tags, {}, "Expected no tags: %s" % msg._s)
+
+    @score(category="CAP")
+    def test_cap_batch(self):
+        client1 = self._cap_connect_user("user1", "User One", "batch")
+        client2 = self._connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #test")
+        start = self.get_message(client1, expect_cmd = "JOIN", expect_nparams = 1, expect_short_params = ["#test"])
+        self.assertEqual(start.tags, {}, "Expected JOIN outside the batch: %s" % start._s)
+
+        # The NAMES reply is wrapped in a batch
+        start = self.get_message(client1, expect_cmd = "BATCH", expect_nparams = 3,
+                                 expect_short_params = [None, "chirc/names", "#test"])
+        self.assertEqual(start.params[0][0], "+", "Expected a batch to start: %s" % start._s)
+        ref = start.params[0][1:]
+        for code in (replies.RPL_NAMREPLY, replies.RPL_ENDOFNAMES):
+            msg = self.get_reply(client1, expect_code = code, expect_nick = "user1")
+            self.assertEqual(msg.tags.get("batch"), ref, "Expected batch=%s: %s" % (ref, msg._s))
+        self.get_message(client1, expect_cmd = "BATCH", expect_nparams = 1, expect_short_params = ["-" + ref])
+
+        # Clients without the capability get a plain reply
+        client2.send_cmd("JOIN #test")
+        self._test_join(client2, "user2", "#test")
+        self._test_relayed_join(client1, from_nick="user2", channel="#test")
+
+        # Each batch gets a new reference
+        client1.send_cmd("NAMES #test")
+        start = self.get_message(client1, expect_cmd = "BATCH", expect_nparams = 3,
+                                 expect_short_params = [None, "chirc/names", "#test"])
+        self.assertNotEqual(start.params[0][1:], ref, "Expected a new batch reference: %s" % start._s)
+        ref = start.params[0][1:]
+        self._test_names(client1, "user1", expect_channel = "#test", expect_names = ["@user1", "user2"])
+        self.get_message(client1, expect_cmd = "BATCH", expect_nparams = 1, expect_short_params = ["-" + ref])
@@ -0,0 +1,193 @@
+import tests.replies as replies
+import socket
+import struct
+import telnetlib
+import threading
+import time
+from tests.common import ChircTestCase, ChircClient, ReplyTimeoutException, CouldNotConnectException
+from tests.scores import score
+
+# 127.0.0.2 and 127.0.0.3 are not in /etc/hosts, so reverse lookups of
+# connections from them go to the nameserver
+NAMED_ADDR = "127.0.0.2"
+UNNAMED_ADDR = "127.0.0.3"
+NAME = "stub.example.com"
+
+class StubDNSServer(object):
+    # Answers PTR queries for NAMED_ADDR with NAME (and A queries for NAME
+    # with NAMED_ADDR) after a delay, and everything else with NXDOMAIN
+
+    def __init__(self, delay = 0.0):
+        self.delay = delay
+        self.queries = {}
+        self.answered = {}
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.settimeout(0.1)
+        self.port = self.sock.getsockname()[1]
+        self.running = True
+        self.thread = threading.Thread(target = self._serve)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def stop(self):
+        self.running = False
+        self.thread.join()
+        self.sock.close()
+
+    def _encode_name(self, name):
+        return "".join([chr(len(l)) + l for l in name.split(".")]) + "\0"
+
+    def _serve(self):
+        while self.running:
+            try:
+                query, addr = self.sock.recvfrom(512)
+            except socket.timeout:
+                continue
+            t = threading.Thread(target = self._answer, args = (query, addr))
+            t.daemon = True
+            t.start()
+
+    def _answer(self, query, addr):
+        qid, = struct.unpack("!H", query[:2])
+        labels = []
+        p = 12
+        while ord(query[p]) != 0:
+            labels.append(query[p + 1:p + 1 + ord(query[p])])
+            p += 1 + ord(query[p])
+        qtype, = struct.unpack("!H", query[p + 1:p + 3])
+        question = query[12:p + 5]
+        name = ".".join(labels).lower()
+        self.queries[name] = self.queries.get(name, 0) + 1
+
+        ptr = ".".join(reversed(NAMED_ADDR.split("."))) + ".in-addr.arpa"
+        if name == ptr and qtype == 12:
+            rdata = self._encode_name(NAME)
+        elif name == NAME and qtype == 1:
+            rdata = socket.inet_aton(NAMED_ADDR)
+        else:
+            rdata = None
+
+        time.sleep(self.delay)
+        if rdata is None:
+            reply = struct.pack("!HHHHHH", qid, 0x8183, 1, 0, 0, 0) + question
+        else:
+            reply = struct.pack("!HHHHHH", qid, 0x8180, 1, 1, 0, 0) + question
+            reply += struct.pack("!HHHIH", 0xc00c, qtype, 1, 60, len(rdata)) + rdata
+        self.sock.sendto(reply, addr)
+        self.answered[name] = self.answered.get(name, 0) + 1
+
+    def ptr_queries(self, addr):
+        return self.queries.get(".".join(reversed(addr.split("."))) + ".in-addr.arpa", 0)
+
+    def wait_answered(self, addr, timeout = 5.0):
+        name = ".".join(reversed(addr.split("."))) + ".in-addr.arpa"
+        deadline = time.time() + timeout
+        while self.answered.get(name, 0) == 0 and time.time() < deadline:
+            time.sleep(0.05)
+        # the forward lookup that confirms the name
+        time.sleep(0.2 + self.delay)
+
+
+class SourceChircClient(ChircClient):
+    # A client whose connection comes from a given loopback address
+
+    def __init__(self, source, port, msg_timeout):
+        self.host = "127.0.0.1"
+        self.port = port
+        self.msg_timeout = msg_timeout
+        self.client = telnetlib.Telnet()
+
+        tries = 3
+
+        while tries > 0:
+            try:
+                self.client.sock = socket.create_connection(("127.0.0.1", port), 1, (source, 0))
+                break
+            except Exception, e:
+                tries -= 1
+                time.sleep(0.1)
+
+        if tries == 0:
+            raise CouldNotConnectException()
+
+
+class StubDNSTestCase(ChircTestCase):
+
+    DNS_DELAY = 0.0
+
+    def setUp(self):
+        self.dns = StubDNSServer(self.DNS_DELAY)
+        ChircTestCase.setUp(self)
+
+    def tearDown(self):
+        try:
+            ChircTestCase.tearDown(self)
+        finally:
+            self.dns.stop()
+
+    def chirc_args(self):
+        return ["-N", "127.0.0.1:%i" % self.dns.port]
+
+    def _connect_from(self, source, nick):
+        client = SourceChircClient(source, self.port, self.MESSAGE_TIMEOUT)
+        self.clients.append(client)
+        client.send_cmd("NICK %s" % nick)
+        client.send_cmd("USER %s * * :%s" % (nick, nick))
+        r = self._test_welcome_messages(client, nick)
+        self._test_lusers(client, nick)
+        self._test_motd(client, nick)
+        return r[0].params[1].split("@")[-1]
+
+
+class ReverseDNS(StubDNSTestCase):
+
+    @score(category="DNS")
+    def test_dns_cache(self):
+        self._connect_from(NAMED_ADDR, "user1")
+        self.dns.wait_answered(NAMED_ADDR)
+
+        for i in range(2, 5):
+            host = self._connect_from(NAMED_ADDR, "user%i" % i)
+            self.assertEqual(host, NAME, "Expected host %s, got %s" % (NAME, host))
+
+        self.assertEqual(self.dns.ptr_queries(NAMED_ADDR), 1,
+                         "Expected one lookup, got %i" % self.dns.ptr_queries(NAMED_ADDR))
+
+    @score(category="DNS")
+    def test_dns_negative_cache(self):
+        self._connect_from(UNNAMED_ADDR, "user1")
+        self.dns.wait_answered(UNNAMED_ADDR)
+
+        host = self._connect_from(UNNAMED_ADDR, "user2")
+        self.assertEqual(host, UNNAMED_ADDR, "Expected host %s, got %s" % (UNNAMED_ADDR, host))
+        self.assertEqual(self.dns.ptr_queries(UNNAMED_ADDR), 1,
+                         "Expected one lookup, got %i" % self.dns.ptr_queries(UNNAMED_ADDR))
+
+
+class SlowReverseDNS(StubDNSTestCase):
+
+    DNS_DELAY = 2.0
+
+    @score(category="DNS")
+    def test_dns_slow(self):
+        # Registration completes (within MESSAGE_TIMEOUT) while the lookup
+        # is still underway, with the numeric address as the host
+        start = time.time()
+        host = self._connect_from(NAMED_ADDR, "user1")
+        self.assertLess(time.time() - start, self.DNS_DELAY, "Registration waited for DNS")
+        self.assertEqual(host, NAMED_ADDR, "Expected host %s, got %s" % (NAMED_ADDR, host))
+
+        # Other clients are not held up either
+        client = self.get_client()
+        client.send_cmd("NICK user2")
+        client.send_cmd("USER user2 * * :User Two")
+        self._test_welcome_messages(client, "user2")
+
+        # Once the lookup finishes, later connections get the name from
+        # the cache
+        self.dns.wait_answered(NAMED_ADDR)
+        host = self._connect_from(NAMED_ADDR, "user3")
+        self.assertEqual(host, NAME, "Expected host %s, got %s" % (NAME, host))
+        self.assertEqual(self.dns.ptr_queries(NAMED_ADDR), 1,
+                         "Expected one lookup, got %i" % self.dns.ptr_queries(NAMED_ADDR))
@@ -0,0 +1,98 @@
+import tests.replies as replies
+import time
+from tests.common import ChircTestCase, ChircClient, ReplyTimeoutException
+from tests.scores import score
+
+class CHATHISTORY(ChircTestCase):
+
+    def _send_channel_msgs(self, users, sender, channel, msgs):
+        for msg in msgs:
+            users[sender].send_cmd("PRIVMSG %s :%s" % (channel, msg))
+            for nick in users:
+                if nick != sender:
+                    self._test_relayed_privmsg(users[nick], from_nick=sender, recip=channel, msg=msg)
+
+    @score(category="HISTORY")
+    def test_chathistory_latest(self):
+        users = self._channels_connect({ "#test": ("@user1", "user2") })
+        self._send_channel_msgs(users, "user1", "#test", ["Message %i" % i for i in range(5)])
+
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 3")
+        for i in range(2, 5):
+            self._test_relayed_privmsg(users["user2"], from_nick="user1", recip="#test", msg="Message %i" % i)
+        self.assertRaises(ReplyTimeoutException, self.get_reply, users["user2"])
+
+        # Asking for more than there is
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 100")
+        for i in range(5):
+            self._test_relayed_privmsg(users["user2"], from_nick="user1", recip="#test", msg="Message %i" % i)
+        self.assertRaises(ReplyTimeoutException, self.get_reply, users["user2"])
+
+    @score(category="HISTORY")
+    def test_chathistory_evict(self):
+        users = self._channels_connect({ "#test": ("@user1",) })
+
+        # Only the latest 128 lines are kept
+        for i in range(140):
+            users["user1"].send_cmd("PRIVMSG #test :Message %i" % i)
+        users["user1"].send_cmd("PING")
+        self.get_message(users["user1"], expect_cmd = "PONG", expect_nparams = 1)
+
+        users["user1"].send_cmd("CHATHISTORY LATEST #test * 1000")
+        for i in range(12, 140):
+            self._test_relayed_privmsg(users["user1"], from_nick="user1", recip="#test", msg="Message %i" % i)
+        self.assertRaises(ReplyTimeoutException, self.get_reply, users["user1"])
+
+    @score(category="HISTORY")
+    def test_chathistory_errors(self):
+        users = self._channels_connect({ "#test": ("@user1",),
+                                           None: ("user2",) })
+        users["user1"].send_cmd("PRIVMSG #test :Secret")
+
+        users["user2"].send_cmd("CHATHISTORY LATEST #test * 10")
+        self.get_message(users["user2"], expect_cmd = "FAIL", expect_nparams = 5,
+                         expect_short_params = ["CHATHISTORY", "INVALID_TARGET", "LATEST", "#test"])
+
+        users["user1"].send_cmd("CHATHISTORY BEFORE #test * 10")
+        self.get_message(users["user1"], expect_cmd = "FAIL", expect_nparams = 4,
+                         expect_short_params = ["CHATHISTORY", "INVALID_PARAMS", "BEFORE"])
+
+        users["user1"].send_cmd("CHATHISTORY LATEST #test * 0")
+        self.get_message(users["user1"], expect_cmd = "FAIL", expect_nparams = 4,
+                         expect_short_params = ["CHATHISTORY", "INVALID_PARAMS", "0"])
+
+        users["user1"].send_cmd("CHATHISTORY LATEST #test")
+        self.get_reply(users["user1"], expect_code = replies.ERR_NEEDMOREPARAMS, expect_nick = "user1",
+                       expect_nparams = 2, expect_short_params = ["CHATHISTORY"])
+
+
+class JoinReplay(ChircTestCase):
+
+    def chirc_args(self):
+        return ["-H", "2"]
+
+    @score(category="HISTORY")
+    def test_join_replay(self):
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._connect_user("user2", "User Two")
+
+        client1.send_cmd("JOIN #test")
+        self._test_join(client1, "user1", "#test")
+        for i in range(3):
+            client1.send_cmd("PRIVMSG #test :Message %i" % i)
+        client1.send_cmd("PING")
+        self.get_message(client1, expect_cmd = "PONG", expect_nparams = 1)
+
+        # The latest lines are replayed after the NAMES reply
+        client2.send_cmd("JOIN #test")
+        self._test_join(client2, "user2", "#test")
+        self._test_relayed_join(client1, from_nick="user2", channel="#test")
+        for i in range(1, 3):
+            self._test_relayed_privmsg(client2, from_nick="user1", recip="#test", msg="Message %i" % i)
+        self.assertRaises(ReplyTimeoutException, self.get_reply, client2)
+
+        # NOTICEs are part of the history too
+        client2.send_cmd("NOTICE #test :A notice")
+        self._test_relayed_notice(client1, from_nick="user2", recip="#test", msg="A notice")
+        client2.send_cmd("CHATHISTORY LATEST #test * 1")
+        self._test_relayed_notice(client2, from_nick="user2", recip="#test", msg="A notice")
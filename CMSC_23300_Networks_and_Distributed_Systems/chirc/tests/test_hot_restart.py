@@ -0,0 +1,143 @@
+import tests.replies as replies
+import os
+import signal
+import time
+from tests.common import ChircTestCase, ChircClient, ReplyTimeoutException
+from tests.scores import score
+
+class ResumedChirc(object):
+    # Stands in for the Popen object of the process that took over after a
+    # hot restart (which is not our child), so tearDown can still kill it
+
+    def __init__(self, pid):
+        self.pid = pid
+
+    def poll(self):
+        try:
+            state = open("/proc/%i/stat" % self.pid).read().split(")")[-1].split()[0]
+        except IOError:
+            return 0
+        if state in ("Z", "X"):
+            return 0
+        return None
+
+    def kill(self):
+        try:
+            os.kill(self.pid, signal.SIGKILL)
+        except OSError:
+            pass
+
+    def wait(self):
+        while self.poll() is None:
+            time.sleep(0.01)
+        return 0
+
+
+class HotRestart(ChircTestCase):
+
+    def _threads(self, pid):
+        return len(os.listdir("/proc/%i/task" % pid))
+
+    def _find_resumed(self, old_pid):
+        exe = os.path.realpath(ChircTestCase.CHIRC_EXE)
+        for pid in os.listdir("/proc"):
+            if not pid.isdigit() or int(pid) == old_pid:
+                continue
+            try:
+                args = open("/proc/%s/cmdline" % pid).read().split("\0")
+            except IOError:
+                continue
+            if os.path.realpath(args[0]) == exe and "-R" in args and `self.port` in args:
+                return int(pid)
+        return None
+
+    def _hot_restart(self):
+        old_pid = self.chirc_proc.pid
+        os.kill(old_pid, signal.SIGUSR2)
+
+        # The old process exits (cleanly) once the new one has taken over
+        rc = self.chirc_proc.wait()
+        self.assertEqual(rc, 0, "chirc did not hand over to a new process. rc = %i" % rc)
+
+        new_pid = self._find_resumed(old_pid)
+        self.assertIsNotNone(new_pid, "Could not find the process that took over")
+        self.chirc_proc = ResumedChirc(new_pid)
+
+        # Give it time to start its client threads
+        time.sleep(0.2)
+        return new_pid
+
+    def _ping(self, client):
+        client.send_cmd("PING")
+        self.get_message(client, expect_cmd = "PONG", expect_nparams = 1)
+
+    @score(category="HOT_RESTART")
+    def test_hot_restart_state(self):
+        users = self._channels_connect({ "#test": ("@user1", "user2") })
+
+        # A line that is only half received when the restart happens
+        users["user1"].send_raw("PRIVMSG user2 :Hel")
+        time.sleep(0.1)
+
+        self._hot_restart()
+
+        users["user1"].send_raw("lo there\r\n")
+        self._test_relayed_privmsg(users["user2"], from_nick="user1", recip="user2", msg="Hello there")
+
+        users["user2"].send_cmd("PRIVMSG #test :Still here")
+        self._test_relayed_privmsg(users["user1"], from_nick="user2", recip="#test", msg="Still here")
+
+        users["user1"].send_cmd("NAMES #test")
+        self._test_names(users["user1"], "user1", expect_channel = "#test", expect_names = ["@user1", "user2"])
+
+        client = self.get_client()
+        client.send_cmd("NICK user1")
+        self.get_reply(client, expect_code = replies.ERR_NICKNAMEINUSE, expect_nick = "*",
+                       expect_nparams = 2, expect_short_params = ["user1"])
+
+    @score(category="HOT_RESTART")
+    def test_hot_restart_disconnected(self):
+        users = self._channels_connect({ "#test": ("@user1", "user2", "user3"),
+                                           None: ("user4",) })
+
+        # Connections that go away without a QUIT, and whose descriptor
+        # numbers are then reused by new connections
+        self.disconnect_client(users.pop("user3"))
+        self.disconnect_client(users.pop("user4"))
+        time.sleep(0.1)
+        users["user5"] = self._connect_user("user5", "User Five")
+        users["user6"] = self._connect_user("user6", "User Six")
+
+        old_threads = self._threads(self.chirc_proc.pid)
+        new_pid = self._hot_restart()
+
+        # One thread per connection, just like before
+        self.assertEqual(self._threads(new_pid), old_threads,
+                         "Expected %i threads after the restart, not %i" % (old_threads, self._threads(new_pid)))
+
+        # Each connection is read by exactly one thread
+        for i in range(5):
+            for nick in sorted(users):
+                self._ping(users[nick])
+
+        users["user1"].send_cmd("NAMES #test")
+        self._test_names(users["user1"], "user1", expect_channel = "#test", expect_names = ["@user1", "user2"])
+
+        # The nicks of the users that went away are free again
+        self._connect_user("user3", "User Three")
+        self._connect_user("user4", "User Four")
+
+    @score(category="HOT_RESTART")
+    def test_hot_restart_twice(self):
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._connect_user("user2", "User Two")
+
+        self._hot_restart()
+        self._hot_restart()
+
+        client1.send_cmd("PRIVMSG user2 :Hello")
+        self._test_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Hello")
+
+        client3 = self._connect_user("user3", "User Three")
+        client3.send_cmd("PRIVMSG user1 :Hi")
+        self._test_relayed_privmsg(client1, from_nick="user3", recip="user1", msg="Hi")
@@ -0,0 +1,102 @@
+import tests.replies as replies
+import time
+import urllib2
+from tests.common import ChircTestCase, ChircClient, ReplyTimeoutException
+from tests.scores import score
+
+class Metrics(ChircTestCase):
+
+    def chirc_args(self):
+        return ["-m", `self.port + 1`]
+
+    def _scrape(self):
+        tries = 3
+        while True:
+            try:
+                body = urllib2.urlopen("http://127.0.0.1:%i/metrics" % (self.port + 1), timeout = 1).read()
+                break
+            except Exception, e:
+                tries -= 1
+                if tries == 0:
+                    raise
+                time.sleep(0.1)
+
+        metrics = {}
+        for line in body.split("\n"):
+            if line == "" or line[0] == "#":
+                continue
+            name, value = line.rsplit(" ", 1)
+            metrics[name] = float(value)
+        return metrics
+
+    def _command_count(self, metrics, cmd):
+        return metrics['chirc_command_duration_seconds_count{command="%s"}' % cmd]
+
+    @score(category="METRICS")
+    def test_metrics_commands(self):
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._connect_user("user2", "User Two")
+
+        for i in range(3):
+            client1.send_cmd("PRIVMSG user2 :Hello")
+            self._test_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Hello")
+
+        client1.send_cmd("VERSION")
+        self.get_reply(client1, expect_code = replies.ERR_UNKNOWNCOMMAND, expect_nick = "user1",
+                       expect_nparams = 2, expect_short_params = ["VERSION"])
+
+        metrics = self._scrape()
+
+        self.assertEqual(self._command_count(metrics, "NICK"), 2)
+        self.assertEqual(self._command_count(metrics, "USER"), 2)
+        self.assertEqual(self._command_count(metrics, "PRIVMSG"), 3)
+        self.assertEqual(self._command_count(metrics, "JOIN"), 0)
+        self.assertEqual(metrics["chirc_unknown_commands_total"], 1)
+        self.assertGreater(metrics["chirc_received_bytes_total"], 0)
+        self.assertGreater(metrics["chirc_sent_bytes_total"], 0)
+        self.assertEqual(metrics["chirc_commands_in_flight"], 0)
+
+    @score(category="METRICS")
+    def test_metrics_histogram(self):
+        client1 = self._connect_user("user1", "User One")
+
+        for i in range(10):
+            client1.send_cmd("PING")
+            self.get_message(client1, expect_cmd = "PONG", expect_nparams = 1)
+
+        metrics = self._scrape()
+
+        # Buckets are cumulative, and the last one holds every observation
+        buckets = sorted([(float(name.split('le="')[1].split('"')[0]), value)
+                          for name, value in metrics.items()
+                          if name.startswith('chirc_command_duration_seconds_bucket{command="PING"')])
+        self.assertGreater(len(buckets), 2)
+        for (le1, count1), (le2, count2) in zip(buckets, buckets[1:]):
+            self.assertLessEqual(count1, count2, "Bucket le=%g has more observations than le=%g" % (le1, le2))
+        self.assertEqual(buckets[-1][0], float("inf"))
+        self.assertEqual(buckets[-1][1], 10)
+        self.assertEqual(self._command_count(metrics, "PING"), 10)
+        self.assertGreater(metrics['chirc_command_duration_seconds_sum{command="PING"}'], 0)
+
+    @score(category="METRICS")
+    def test_metrics_gauges(self):
+        users = self._channels_connect({ "#test1": ("@user1", "user2"),
+                                         "#test2": ("@user3",) })
+
+        metrics = self._scrape()
+        self.assertEqual(metrics["chirc_connections"], 3)
+        self.assertEqual(metrics["chirc_channels"], 2)
+
+        users["user3"].send_cmd("QUIT")
+        self.disconnect_client(users["user3"])
+        time.sleep(0.1)
+
+        metrics = self._scrape()
+        self.assertEqual(metrics["chirc_connections"], 2)
+
+        # Connections that go away without a QUIT are not counted either
+        self.disconnect_client(users["user2"])
+        time.sleep(0.1)
+
+        metrics = self._scrape()
+        self.assertEqual(metrics["chirc_connections"], 1)
@@ -0,0 +1,85 @@
+import tests.replies as replies
+from tests.common import ChircTestCase, ChircClient, ReplyTimeoutException
+from tests.scores import score
+
+class MultiTarget(ChircTestCase):
+
+    @score(category="MULTI_TARGET")
+    def test_privmsg_targets(self):
+        users = self._channels_connect({ "#test": ("@user1", "user2"),
+                                           None: ("user3", "user4") })
+
+        users["user3"].send_cmd("PRIVMSG user4,user1 :Hello")
+        self._test_relayed_privmsg(users["user4"], from_nick="user3", recip="user4", msg="Hello")
+        self._test_relayed_privmsg(users["user1"], from_nick="user3", recip="user1", msg="Hello")
+
+        # Channels and nicks can be mixed, and each line names its own target
+        users["user1"].send_cmd("PRIVMSG #test,user3 :Hi all")
+        self._test_relayed_privmsg(users["user2"], from_nick="user1", recip="#test", msg="Hi all")
+        self._test_relayed_privmsg(users["user3"], from_nick="user1", recip="user3", msg="Hi all")
+        self.assertRaises(ReplyTimeoutException, self.get_reply, users["user1"])
+
+    @score(category="MULTI_TARGET")
+    def test_privmsg_duplicate_targets(self):
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._connect_user("user2", "User Two")
+
+        client1.send_cmd("PRIVMSG user2,user2,user2 :Once")
+        self._test_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Once")
+        self.assertRaises(ReplyTimeoutException, self.get_reply, client2)
+
+    @score(category="MULTI_TARGET")
+    def test_privmsg_nosuchnick(self):
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._connect_user("user2", "User Two")
+
+        client1.send_cmd("PRIVMSG user3,user2 :Hello")
+        self.get_reply(client1, expect_code = replies.ERR_NOSUCHNICK, expect_nick = "user1",
+                       expect_nparams = 2, expect_short_params = ["user3"])
+        self._test_relayed_privmsg(client2, from_nick="user1", recip="user2", msg="Hello")
+
+    @score(category="MULTI_TARGET")
+    def test_privmsg_too_many_targets(self):
+        users = self._channels_connect({ None: ("user1", "user2", "user3", "user4", "user5", "user6") })
+
+        targets = "user2,user3,user4,user5,user6"
+        users["user1"].send_cmd("PRIVMSG %s :Hello" % targets)
+        self.get_reply(users["user1"], expect_code = replies.ERR_TOOMANYTARGETS, expect_nick = "user1",
+                       expect_nparams = 2, expect_short_params = [targets])
+        for nick in ("user2", "user3", "user4", "user5", "user6"):
+            self.assertRaises(ReplyTimeoutException, self.get_reply, users[nick])
+
+        # NOTICE never gets an error reply
+        users["user1"].send_cmd("NOTICE %s :Hello" % targets)
+        self.assertRaises(ReplyTimeoutException, self.get_reply, users["user1"])
+
+    @score(category="MULTI_TARGET")
+    def test_privmsg_no_text(self):
+        client1 = self._connect_user("user1", "User One")
+        client2 = self._connect_user("user2", "User Two")
+
+        client1.send_cmd("PRIVMSG user2")
+        self.get_reply(client1, expect_code = replies.ERR_NOTEXTTOSEND, expect_nick = "user1",
+                       expect_nparams = 1)
+
+        client1.send_cmd("PRIVMSG user1,user2")
+        self.get_reply(client1, expect_code = replies.ERR_NOTEXTTOSEND, expect_nick = "user1",
+                       expect_nparams = 1)
+        self.assertRaises(ReplyTimeoutException, self.get_reply, client2)
+
+    @score(category="MULTI_TARGET")
+    def test_join_targets(self):
+        client1 = self._connect_user("user1", "User One")
+
+        client1.send_cmd("JOIN #test1,#test2")
+        self._test_join(client1, "user1", "#test1")
+        self._test_join(client1, "user1", "#test2")
+
+        client1.send_cmd("PART #test1")
+        self._test_relayed_part(client1, from_nick="user1", channel="#test1", msg=None)
+
+        targets = "#a,#b,#c,#d,#e"
+        client1.send_cmd("JOIN %s" % targets)
+        self.get_reply(client1, expect_code = replies.ERR_TOOMANYTARGETS, expect_nick = "user1",
+                       expect_nparams = 2, expect_short_params = [targets])
+        self.assertRaises(ReplyTimeoutException, self.get_reply, client1)
@@ -8,7 +8,8 @@
  *  characteristics:
  *
  *  - When the buffer is created, it is created with a specific
- *    capacity, and that capacity cannot be extended later on.
+ *    capacity. That capacity can be increased later on (see
+ *    circular_buffer_grow), but never decreased.
  *
  *  - The buffer is used to store a stream of bytes, with a known
  *    initial sequence number. For example, if the initial sequence
@@ -136,6 +137,7 @@
 
 #include <stdint.h>
 #include <pthread.h>
+#include <sys/uio.h>
 #include "chitcp/types.h"
 
 #ifndef BUFFER_H_
@@ -144,16 +146,35 @@
 #define BUFFER_NONBLOCKING (0)
 #define BUFFER_BLOCKING (1)
 
+/* Buffer types (see circular_buffer_init) */
+#define BUFFER_LOCKED (0)
+#define BUFFER_SPSC (1)
+
+#define BUFFER_CACHE_LINE (64)
+
 
 /*
- * The provided buffer implementation will allow your TCP implementation
- * to work with short data streams (less than 32KB) but will fail for
- * streams larger than that.
- *
- * In particular, the provided implementation does not implement a
- * circular buffer structure, and simply hardcodes a large static
- * array (regardless of what buffer capacity is specified) that
- * does not wrap around. The provided implementation is also non-blocking.
+ * In a BUFFER_LOCKED buffer, all fields are protected by "lock".
+ * Blocked readers sleep on cv_not_empty and blocked writers on
+ * cv_not_full; rw_pending counts the threads currently blocked inside
+ * the buffer, and circular_buffer_close waits on cv_idle until that
+ * count drops to zero.
+ *
+ * A BUFFER_SPSC buffer does not use start, end, n_bytes, seq_start
+ * or seq_end. Instead, "head" and "tail" count the total number of
+ * bytes ever written and read; head is only written by the producer
+ * and tail only by the consumer, so neither side needs the lock.
+ * Each index lives on its own cache line, next to the other fields
+ * its owner writes: a cached copy of the opposite index, and a flag
+ * telling the other side it is asleep on the condition variables.
+ * The lock is taken only to go to sleep or to wake a sleeper.
+ *
+ * data, mask and maxsize are the writer's view of the ring. When the
+ * writer grows the buffer, it moves the unread bytes to a new ring and
+ * leaves the old one in "retired"; the reader keeps using its own view
+ * (rdata, rmask, rmaxsize), which still holds every byte it can see,
+ * until its next read switches it to the new ring and frees the old
+ * one. The writer does not grow the buffer again until that happens.
  */
 typedef struct circular_buffer
 {
@@ -171,8 +192,32 @@ typedef struct circular_buffer
     uint32_t rw_pending;
     uint32_t closing;
 
+    int type;
+    uint32_t mask;
+
     pthread_mutex_t lock;
-    
+    pthread_cond_t cv_not_empty;
+    pthread_cond_t cv_not_full;
+    pthread_cond_t cv_idle;
+
+    /* BUFFER_SPSC only */
+    uint8_t pad0[BUFFER_CACHE_LINE];
+
+    uint32_t head;
+    uint32_t tail_cache;
+    uint32_t writer_waiting;
+    uint8_t *retired;
+
+    uint8_t pad1[BUFFER_CACHE_LINE];
+
+    uint32_t tail;
+    uint32_t head_cache;
+    uint32_t reader_waiting;
+    uint8_t *rdata;
+    uint32_t rmask;
+    uint32_t rmaxsize;
+
+    uint8_t pad2[BUFFER_CACHE_LINE];
 } circular_buffer_t;
 
 
@@ -185,17 +230,51 @@ typedef struct circular_buffer
  *
  * maxsize: The maximum capacity of the buffer
  *
+ * type: BUFFER_LOCKED for a buffer that any number of threads can
+ *       read and write, or BUFFER_SPSC for a lock-free buffer with
+ *       exactly one writer thread and one reader thread (reads
+ *       and peeks from any other thread only get a best-effort
+ *       snapshot). The capacity of a BUFFER_SPSC buffer is rounded
+ *       up to a power of two.
+ *
  * Returns:
  *  - CHITCP_OK: Buffer created correctly
  *  - CHITCP_ENOMEM: Could not allocate memory for buffer
+ *  - CHITCP_EINVAL: Invalid buffer type
+ *
+ */
+int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize, int type);
+
+
+/*
+ * circular_buffer_grow - Increases the capacity of the buffer
+ *
+ * Moves the contents of the buffer to a larger ring. Does nothing if
+ * the buffer can already hold "maxsize" bytes. In a BUFFER_SPSC buffer,
+ * only the writer thread may call this function, and the new capacity
+ * is rounded up to a power of two.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * maxsize: The new capacity of the buffer
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffer grown correctly (or already large enough)
+ *  - CHITCP_ENOMEM: Could not allocate memory for the new ring
+ *  - CHITCP_EINVAL: maxsize is too large
+ *  - CHITCP_EWOULDBLOCK: (BUFFER_SPSC only) The reader has not yet
+ *    switched to the ring from the previous call; try again later.
  *
  */
-int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize);
+int circular_buffer_grow(circular_buffer_t *buf, uint32_t maxsize);
 
 
 /*
  * circular_buffer_set_seq_initial - Set the initial sequence number
  *
+ * The first unread byte in the buffer (if any) will have
+ * sequence number "seq_initial".
+ *
  * buf: circular_buffer_t struct
  *
  * seq_initial: Initial sequence number
@@ -221,9 +300,11 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
  * the buffer. If the buffer is empty and "blocking"
  * is false, CHITCP_EWOULDBLOCK is returned.
  *
- * If the buffer is closed (using circular_buffer_close)
- * while the function is blocked, the function returns
- * zero immediately.
+ * If the buffer is closed (using circular_buffer_close),
+ * any data left in the buffer can still be read. Once the
+ * buffer is closed and empty, the function returns zero
+ * immediately (including if it was blocked when the buffer
+ * was closed).
  *
  * buf: circular_buffer_t struct
  *
@@ -236,7 +317,7 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
  * Returns:
  *  - Number of bytes read, or
  *
- *  - 0 if the buffer was closed.
+ *  - 0 if the buffer is closed and empty.
  *
  *  - CHITCP_EWOULDBLOCK: Non-blocking read requested, but function
  *    would have to block.
@@ -255,6 +336,55 @@ int circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, boo
 int circular_buffer_peek(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking);
 
 
+/*
+ * circular_buffer_peek_iov - Peek data from the buffer without copying it
+ *
+ * Fills "iov" with (at most two) pointers into the buffer's storage
+ * that cover up to "len" bytes, starting "offset" bytes past the
+ * first unread byte. Two entries are needed when the data wraps
+ * around the end of the buffer. This function never blocks.
+ *
+ * The memory pointed to by "iov" remains valid, and is not
+ * overwritten by writers, until those bytes are removed from the
+ * buffer with circular_buffer_read or circular_buffer_commit. For
+ * this reason, only the thread that reads from the buffer should
+ * call this function.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * offset: Number of unread bytes to skip.
+ *
+ * len: Maximum number of bytes to return.
+ *
+ * iov: Array of two iovec structs.
+ *
+ * Returns:
+ *  - Number of iovec entries filled in (0, 1 or 2). Zero means
+ *    there are no bytes past "offset".
+ *
+ */
+int circular_buffer_peek_iov(circular_buffer_t *buf, uint32_t offset, uint32_t len, struct iovec iov[2]);
+
+
+/*
+ * circular_buffer_commit - Remove data from the buffer without copying it
+ *
+ * Same as a non-blocking circular_buffer_read with a NULL destination:
+ * discards at most "len" bytes from the start of the buffer. Normally
+ * used after the data returned by circular_buffer_peek_iov has been
+ * consumed.
+ *
+ * buf: circular_buffer_t struct
+ *
+ * len: Maximum number of bytes to remove.
+ *
+ * Returns:
+ *  - Number of bytes removed (zero if the buffer was empty)
+ *
+ */
+int circular_buffer_commit(circular_buffer_t *buf, uint32_t len);
+
+
 /*
  * circular_buffer_write - Write data into the buffer
  *
@@ -355,7 +485,14 @@ int circular_buffer_available(circular_buffer_t *buf);
  * (with circular_buffer_write returning the number
  * of bytes written before the buffer was closed)
  * and all pending reads return immediately (with
- * circular_buffer_read returning zero.
+ * circular_buffer_read returning zero). Data already in
+ * the buffer can still be read after it has been closed,
+ * so the reader sees an end-of-file only once it has
+ * consumed everything that was written. This function
+ * returns once all those threads have left the buffer.
+ *
+ * Closing does not release the buffer's memory; call
+ * circular_buffer_free for that.
  *
  * buf: circular_buffer_t struct
  *
@@ -42,6 +42,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include "chitcp/types.h"
 
 
 /*
@@ -157,14 +158,20 @@ typedef struct tcphdr
 /* Size in bytes of a TCP header with no options */
 #define TCP_HEADER_NOOPTIONS_SIZE (sizeof(tcphdr_t))
 
+/* Maximum size in bytes of a TCP header (data offset of 15) */
+#define TCP_HEADER_MAX_SIZE (15 * sizeof(uint32_t))
+
+/* Returns size in bytes of the packet's TCP header, including options */
+#define TCP_HEADER_SIZE(p) (((tcphdr_t *) (p)->raw)->doff * sizeof(uint32_t))
+
 /* Returns pointer to header */
 #define TCP_PACKET_HEADER(p) ((tcphdr_t*) (p)->raw)
 
 /* Returns pointer to the start of the packet's payload */
-#define TCP_PAYLOAD_START(p) ((p)->raw + (((tcphdr_t *) (p)->raw)->doff * sizeof(uint32_t)))
+#define TCP_PAYLOAD_START(p) ((p)->raw + TCP_HEADER_SIZE(p))
 
 /* Returns length of TCP packet's payload */
-#define TCP_PAYLOAD_LEN(p) ((p)->length - (((tcphdr_t *) (p)->raw)->doff * sizeof(uint32_t)))
+#define TCP_PAYLOAD_LEN(p) ((p)->length - TCP_HEADER_SIZE(p))
 
 /* Convenience macros to access the fields in the header,
  * using the nomenclature in RFC 793 */
@@ -185,6 +192,113 @@ typedef struct tcphdr
 #define SEG_UP(p) (chitcp_ntohs(TCP_PACKET_HEADER(p)->urp))
 
 
+/*
+ *
+ *  TCP Options
+ *
+ */
+
+/* Option kinds (RFC 793, 2018, 7323) */
+#define TCP_OPTION_EOL              (0)  /* End of option list */
+#define TCP_OPTION_NOP              (1)  /* No operation (padding) */
+#define TCP_OPTION_MSS              (2)  /* Maximum segment size */
+#define TCP_OPTION_WSCALE           (3)  /* Window scale */
+#define TCP_OPTION_SACK_PERMITTED   (4)  /* SACK permitted (SYN only) */
+#define TCP_OPTION_SACK             (5)  /* Selective acknowledgement */
+
+/* Maximum size in bytes of the options in a TCP header */
+#define TCP_OPTIONS_MAX_SIZE (TCP_HEADER_MAX_SIZE - TCP_HEADER_NOOPTIONS_SIZE)
+
+/* Maximum number of blocks in a SACK option. Each block takes eight
+ * bytes, and the option itself (kind and length) two more, so at most
+ * four fit in the option space (three, if we also sent timestamps). */
+#define TCP_SACK_MAX_BLOCKS (4)
+
+/* Largest shift count allowed in a window scale option (RFC 7323,
+ * section 2.3), which makes for windows of up to 1 GiB */
+#define TCP_WSCALE_MAX (14)
+
+/* A SACK block: the peer has received [left, right) */
+typedef struct tcp_sack_block
+{
+    uint32_t left;
+    uint32_t right;
+} tcp_sack_block_t;
+
+/* The options we know about, in host byte order. Options that are not
+ * supported are skipped when parsing. */
+typedef struct tcp_options
+{
+    bool_t mss_ok;          /* Maximum segment size option present (SYN only) */
+    uint16_t mss;           /* The peer's MSS */
+    bool_t wscale_ok;       /* Window scale option present (SYN only) */
+    uint8_t wscale;         /* Its shift count */
+    bool_t sack_permitted;
+    int nsack;
+    tcp_sack_block_t sack[TCP_SACK_MAX_BLOCKS];
+} tcp_options_t;
+
+
+/*
+ * chitcp_tcp_options_parse - Parses the options in a TCP header.
+ *
+ * packet: Pointer to packet.
+ *
+ * options: Pointer to tcp_options_t variable where the options will be
+ *          stored. Options not present in the header are zeroed out.
+ *
+ * Returns:
+ *  - CHITCP_OK: Options parsed successfully (including when there are no options)
+ *  - CHITCP_EINVAL: The data offset or one of the options is malformed
+ */
+int chitcp_tcp_options_parse(const tcp_packet_t *packet, tcp_options_t *options);
+
+
+/*
+ * chitcp_tcp_packet_create_options - Initializes a tcp_packet_t struct with
+ *                                    TCP options and a payload.
+ *
+ * Like chitcp_tcp_packet_create, but the header is followed by the
+ * options in "options" (padded to a multiple of four bytes), and the
+ * data offset field is set accordingly.
+ *
+ * packet: Pointer to unitialized tcp_packet_t variable.
+ *
+ * options: Options to include in the header. If NULL, the header will
+ *          have no options.
+ *
+ * payload: Pointer to payload. The payload will be DEEP COPIED to the packet.
+ *
+ * payload_len: Size of the payload in number of bytes.
+ *
+ * Returns: the size in bytes of the TCP packet.
+ */
+int  chitcp_tcp_packet_create_options(tcp_packet_t *packet, const tcp_options_t *options,
+                                      const uint8_t* payload, uint16_t payload_len);
+
+
+/*
+ * chitcp_tcp_packet_fill_options - Writes a TCP header with options and
+ *                                  a payload into an existing buffer.
+ *
+ * Like chitcp_tcp_packet_create_options, but the packet is written to
+ * packet->raw, which must already have room for TCP_HEADER_MAX_SIZE +
+ * payload_len bytes, instead of being allocated.
+ *
+ * packet: Pointer to tcp_packet_t variable, with "raw" pointing to the buffer.
+ *
+ * options: Options to include in the header (NULL for none).
+ *
+ * payload: Pointer to payload. The payload will be DEEP COPIED to the packet.
+ *
+ * payload_len: Size of the payload in number of bytes.
+ *
+ * Returns: the size in bytes of the TCP packet.
+ */
+int  chitcp_tcp_packet_fill_options(tcp_packet_t *packet, const tcp_options_t *options,
+                                    const uint8_t* payload, uint16_t payload_len);
+
+
 /*
  *
  *  chiTCP Header
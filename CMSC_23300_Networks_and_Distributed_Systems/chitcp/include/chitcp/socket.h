@@ -56,6 +56,24 @@
 #include <arpa/inet.h>
 #include <errno.h>
 
+/* Options for chisocket_setsockopt. At level SOL_SOCKET, SO_SNDBUF and
+ * SO_RCVBUF (int: buffer size in bytes) are supported; they must be set
+ * before the connection is established. Setting SO_RCVBUF turns off
+ * receive window autotuning.
+ *
+ * At level IPPROTO_TCP, the following are supported. They have
+ * the same values as in <netinet/tcp.h> (which can't be included
+ * along with chiTCP's own TCP header definitions) */
+#ifndef TCP_NODELAY
+#define TCP_NODELAY     1   /* int: if non-zero, disables Nagle's algorithm */
+#endif
+#ifndef TCP_MAXSEG
+#define TCP_MAXSEG      2   /* int: largest segment payload to send or receive (set before connecting) */
+#endif
+#ifndef TCP_CONGESTION
+#define TCP_CONGESTION  13  /* char[]: congestion control algorithm ("newreno", "cubic") */
+#endif
+
 extern int chisocket_socket(int domain, int type, int protocol);
 extern int chisocket_bind(int sockfd, struct sockaddr *addr, socklen_t addrlen);
 extern int chisocket_listen(int sockfd, int backlog);
@@ -64,6 +82,7 @@ extern int chisocket_accept(int sockfd, struct sockaddr* addr, socklen_t *addrle
 extern int chisocket_close(int sockfd);
 extern ssize_t chisocket_recv(int sockfd, void *buffer, size_t length, int flags);
 extern ssize_t chisocket_send(int sockfd, const void *buffer, size_t length, int flags);
+extern int chisocket_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen);
 
 #endif  /* __CHITCP_SOCKET_H__ */
 
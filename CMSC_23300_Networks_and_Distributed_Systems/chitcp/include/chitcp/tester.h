@@ -84,6 +84,36 @@ int chitcp_tester_client_set_debug(chitcp_tester_t* tester, debug_event_handler
 
 
 
+/*
+ * chitcp_tester_server_set_buffers - Sets the server's buffer sizes
+ *
+ * Sets the SO_SNDBUF and SO_RCVBUF options (see socket.h) on the server
+ * socket as soon as it is created, so they apply to the connection it
+ * accepts.
+ *
+ * tester: Tester data structure
+ *
+ * sndbuf: Send buffer size, in bytes (0 to use the default)
+ *
+ * rcvbuf: Receive buffer size, in bytes (0 to use the default)
+ *
+ * Returns:
+ *  - CHITCP_OK: Buffer sizes set correctly
+ */
+int chitcp_tester_server_set_buffers(chitcp_tester_t* tester, int sndbuf, int rcvbuf);
+
+
+
+/*
+ * chitcp_tester_client_set_buffers - Sets the client's buffer sizes
+ *
+ * Same as chitcp_tester_server_set_buffers, but for the client socket
+ * (before it connects)
+ */
+int chitcp_tester_client_set_buffers(chitcp_tester_t* tester, int sndbuf, int rcvbuf);
+
+
+
 /*
  * chitcp_tester_server_wait_for_state - Wait for server socket to reach TCP state
  *
@@ -0,0 +1,327 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Congestion control benchmark.
+ *
+ *  Opens several connections through a running chiTCP daemon and sends
+ *  the same amount of data over each of them at the same time. The
+ *  network is emulated with the debug API: every segment the senders
+ *  put on the wire goes through a shared token bucket (the bottleneck
+ *  link), and is dropped if the bucket is empty or, with probability
+ *  LOSS, at random. With a rate of 0, the link is as fast as the real
+ *  connection between the daemons.
+ *
+ *  Reports the throughput of each flow, the aggregate throughput (in
+ *  bytes and in packets per second), and Jain's fairness index over the
+ *  bytes each flow had delivered when the first one finished. The
+ *  algorithm being benchmarked is the daemon's (see chitcpd -C).
+ *
+ *  The segment size can be capped with -s (TCP_MAXSEG) to measure how
+ *  it affects throughput. For example, with a single flow and no
+ *  bottleneck:
+ *
+ *    cc-bench -f 1 -n 16777216 -r 0 -s 536
+ *    cc-bench -f 1 -n 16777216 -r 0
+ *
+ *  Every packet goes through the debug API to be counted, so the
+ *  figures are lower than what the daemon can do on its own, but they
+ *  are comparable between runs.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "chitcp/socket.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/types.h"
+#include "chitcp/addr.h"
+#include "chitcp/utils.h"
+
+const char* USAGE = "cc-bench [-p PORT] [-f FLOWS] [-n BYTES] [-r PACKETS_PER_SEC] [-b BURST] [-l LOSS] [-s MSS]";
+
+#define MAX_FLOWS (16)
+#define CHUNK_SIZE (4096)
+
+typedef struct flow
+{
+    int sockfd;
+    int nbytes;
+    int received;
+    struct timespec done;
+} flow_t;
+
+/* Bottleneck link, shared by all the flows */
+static struct
+{
+    pthread_mutex_t lock;
+    double rate;            /* Packets per second (0 for no limit) */
+    double burst;           /* Bucket depth, in packets */
+    double tokens;
+    struct timespec last;
+    double loss;
+    unsigned int seed;
+    int sent, dropped;
+} bottleneck_link = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_mutex_t lock_flows = PTHREAD_MUTEX_INITIALIZER;
+static flow_t flows[MAX_FLOWS];
+static int nflows = 2;
+static int first_done = -1;
+static int snapshot[MAX_FLOWS];
+static struct timespec start;
+
+
+static double elapsed(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+enum chitcpd_debug_response bottleneck_handler(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    enum chitcpd_debug_response r = DBG_RESP_NONE;
+    struct timespec now;
+
+    if (event_flag != DBG_EVT_OUTGOING_PACKET)
+        return DBG_RESP_NONE;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&bottleneck_link.lock);
+    bottleneck_link.tokens += elapsed(&bottleneck_link.last, &now) * bottleneck_link.rate;
+    if (bottleneck_link.tokens > bottleneck_link.burst)
+        bottleneck_link.tokens = bottleneck_link.burst;
+    bottleneck_link.last = now;
+
+    bottleneck_link.sent++;
+    if ((bottleneck_link.rate > 0 && bottleneck_link.tokens < 1) ||
+        (double) rand_r(&bottleneck_link.seed) / RAND_MAX < bottleneck_link.loss)
+    {
+        bottleneck_link.dropped++;
+        r = DBG_RESP_DROP;
+    }
+    else
+        bottleneck_link.tokens -= 1;
+    pthread_mutex_unlock(&bottleneck_link.lock);
+
+    return r;
+}
+
+void *flow_send(void *args)
+{
+    flow_t *flow = args;
+    uint8_t buf[CHUNK_SIZE];
+    int nbytes;
+
+    memset(buf, 'x', CHUNK_SIZE);
+    for (int sent = 0; sent < flow->nbytes; sent += nbytes)
+    {
+        nbytes = flow->nbytes - sent < CHUNK_SIZE ? flow->nbytes - sent : CHUNK_SIZE;
+        if (chitcp_socket_send(flow->sockfd, buf, nbytes) == -1)
+        {
+            perror("Could not send data");
+            exit(-1);
+        }
+    }
+
+    return NULL;
+}
+
+void *flow_recv(void *args)
+{
+    flow_t *flow = args;
+    uint8_t buf[CHUNK_SIZE];
+    int nbytes;
+
+    while (flow->received < flow->nbytes)
+    {
+        nbytes = chisocket_recv(flow->sockfd, buf, CHUNK_SIZE, 0);
+        if (nbytes <= 0)
+            break;
+
+        pthread_mutex_lock(&lock_flows);
+        flow->received += nbytes;
+        pthread_mutex_unlock(&lock_flows);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &flow->done);
+
+    /* Take a snapshot of every flow's progress when the first one
+     * finishes: up to this point, they were all competing */
+    pthread_mutex_lock(&lock_flows);
+    if (first_done == -1)
+    {
+        first_done = flow - flows;
+        for (int i = 0; i < nflows; i++)
+            snapshot[i] = flows[i].received;
+    }
+    pthread_mutex_unlock(&lock_flows);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int server_socket;
+    flow_t clients[MAX_FLOWS];
+    struct sockaddr_in server_addr, client_addr;
+    socklen_t addrlen;
+    pthread_t senders[MAX_FLOWS], receivers[MAX_FLOWS];
+    char *port = "7777";
+    int nbytes = 256 * 1024;
+    int mss = 0;
+    double total = 0, sum = 0, sum_squares = 0, secs;
+    int opt;
+
+    bottleneck_link.rate = 200;
+    bottleneck_link.burst = 20;
+    bottleneck_link.loss = 0;
+
+    while ((opt = getopt(argc, argv, "p:f:n:r:b:l:s:")) != -1)
+        switch (opt)
+        {
+        case 'p':
+            port = strdup(optarg);
+            break;
+        case 'f':
+            nflows = atoi(optarg);
+            break;
+        case 'n':
+            nbytes = atoi(optarg);
+            break;
+        case 'r':
+            bottleneck_link.rate = atof(optarg);
+            break;
+        case 'b':
+            bottleneck_link.burst = atof(optarg);
+            break;
+        case 'l':
+            bottleneck_link.loss = atof(optarg);
+            break;
+        case 's':
+            mss = atoi(optarg);
+            break;
+        default:
+            printf("Unknown option: -%c\n", opt);
+            printf("%s\n", USAGE);
+            exit(1);
+        }
+
+    if (nflows < 1 || nflows > MAX_FLOWS)
+    {
+        printf("The number of flows must be between 1 and %i\n", MAX_FLOWS);
+        exit(1);
+    }
+
+    if (chitcp_addr_construct("localhost", port, &server_addr))
+    {
+        perror("Could not construct address");
+        exit(-1);
+    }
+
+    server_socket = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (server_socket == -1 ||
+        (mss && chisocket_setsockopt(server_socket, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(int)) == -1) ||
+        chisocket_bind(server_socket, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1 ||
+        chisocket_listen(server_socket, MAX_FLOWS) == -1)
+    {
+        perror("Could not set up server socket");
+        exit(-1);
+    }
+
+    bottleneck_link.seed = time(NULL);
+    bottleneck_link.tokens = bottleneck_link.burst;
+    clock_gettime(CLOCK_MONOTONIC, &bottleneck_link.last);
+
+    for (int i = 0; i < nflows; i++)
+    {
+        clients[i].sockfd = chisocket_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        clients[i].nbytes = nbytes;
+        if (clients[i].sockfd == -1)
+        {
+            perror("Could not create socket");
+            exit(-1);
+        }
+
+        if (mss && chisocket_setsockopt(clients[i].sockfd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(int)) == -1)
+        {
+            perror("Could not set the segment size");
+            exit(-1);
+        }
+
+        if (chitcpd_debug(clients[i].sockfd, DBG_EVT_OUTGOING_PACKET, bottleneck_handler) != CHITCP_OK)
+        {
+            perror("Could not set up emulated link");
+            exit(-1);
+        }
+
+        if (chisocket_connect(clients[i].sockfd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == -1)
+        {
+            perror("Could not connect to socket");
+            exit(-1);
+        }
+
+        flows[i].nbytes = nbytes;
+        flows[i].received = 0;
+        addrlen = sizeof(client_addr);
+        flows[i].sockfd = chisocket_accept(server_socket, (struct sockaddr *) &client_addr, &addrlen);
+        if (flows[i].sockfd == -1)
+        {
+            perror("Could not accept connection");
+            exit(-1);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nflows; i++)
+    {
+        pthread_create(&receivers[i], NULL, flow_recv, &flows[i]);
+        pthread_create(&senders[i], NULL, flow_send, &clients[i]);
+    }
+
+    for (int i = 0; i < nflows; i++)
+    {
+        pthread_join(senders[i], NULL);
+        pthread_join(receivers[i], NULL);
+    }
+
+    if (bottleneck_link.rate > 0)
+        printf("Link: %.0f packets/s, burst %.0f, loss %.3f. ",
+               bottleneck_link.rate, bottleneck_link.burst, bottleneck_link.loss);
+    else
+        printf("Link: unlimited, loss %.3f. ", bottleneck_link.loss);
+    printf("Sent %i packets, dropped %i (%.1f%%)\n",
+           bottleneck_link.sent, bottleneck_link.dropped,
+           100.0 * bottleneck_link.dropped / bottleneck_link.sent);
+
+    for (int i = 0; i < nflows; i++)
+    {
+        secs = elapsed(&start, &flows[i].done);
+        total += flows[i].received;
+        sum += snapshot[i];
+        sum_squares += (double) snapshot[i] * snapshot[i];
+        printf("Flow %2i: %8i bytes in %7.3fs (%8.2f KB/s)\n", i, flows[i].received, secs, flows[i].received / secs / 1024);
+    }
+
+    secs = 0;
+    for (int i = 0; i < nflows; i++)
+        if (elapsed(&start, &flows[i].done) > secs)
+            secs = elapsed(&start, &flows[i].done);
+
+    printf("Aggregate: %.2f KB/s (%.2f MB/s), %.0f packets/s\n",
+           total / secs / 1024, total / secs / 1e6, bottleneck_link.sent / secs);
+    printf("Fairness (Jain's index when flow %i finished): %.3f\n", first_done,
+           sum_squares > 0 ? sum * sum / (nflows * sum_squares) : 1.0);
+
+    for (int i = 0; i < nflows; i++)
+    {
+        chisocket_close(clients[i].sockfd);
+        chisocket_close(flows[i].sockfd);
+    }
+    chisocket_close(server_socket);
+
+    return 0;
+}
@@ -72,13 +72,13 @@ enum chitcpd_debug_response chitcpd_debug_breakpoint(serverinfo_t *si, int sockf
         return DBG_RESP_NONE;
     }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         return DBG_RESP_NONE;
     }
 
-    entry = &si->chisocket_table[sockfd];
+    entry = SOCKET_ENTRY(si, sockfd);
 
     /* Complicated synchronization is necessary to ensure that the debug
      * monitor is not destroyed while other threads are waiting to write
@@ -170,7 +170,7 @@ enum chitcpd_debug_response chitcpd_debug_breakpoint(serverinfo_t *si, int sockf
         /* Remove this debug monitor from the socket table */
         for (int i=0; i < si->chisocket_table_size; i++)
         {
-            chisocketentry_t *e = &si->chisocket_table[i];
+            chisocketentry_t *e = SOCKET_ENTRY(si, i);
             if (e->available) continue;
 
             pthread_mutex_lock(&e->lock_debug_monitor);
@@ -44,7 +44,7 @@
 #include "chitcp/debug_api.h"
 
 /* Macro for getting a sockfd from a pointer in the socket table */
-#define ptr_to_fd(si, entry) ((int) (((char *)entry - (char *)si->chisocket_table) / sizeof(chisocketentry_t)))
+#define ptr_to_fd(si, entry) SOCKET_NO(si, entry)
 
 /*
  * chitcpd_debug_breakpoint - An easy interface for adding a breakpoint to
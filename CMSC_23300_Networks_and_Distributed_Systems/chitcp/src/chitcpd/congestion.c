@@ -0,0 +1,321 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Congestion control algorithms: NewReno (RFC 5681) and CUBIC (RFC 8312)
+ *
+ *  Both algorithms share slow start and differ in how they grow the
+ *  window during congestion avoidance and how much they shrink it
+ *  when a loss is detected. The loss recovery itself (what gets
+ *  retransmitted and when) is done in tcp.c.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include "serverinfo.h"
+#include "congestion.h"
+
+
+/* ssthresh starts out "arbitrarily high" (RFC 5681, section 3.1) */
+#define TCP_SSTHRESH_INFINITE (UINT32_MAX)
+
+/* CUBIC constants (RFC 8312, section 5) */
+#define CUBIC_C (0.4)
+#define CUBIC_BETA (0.7)
+
+
+/* Initial window (RFC 3390): min(4*SMSS, max(2*SMSS, 4380 bytes)) */
+static uint32_t chitcpd_congestion_initial_window(tcp_data_t *tcp_data)
+{
+    uint32_t smss = tcp_data->SMSS;
+
+    if (smss * 4 < 4380)
+        return smss * 4;
+    return smss * 2 > 4380 ? smss * 2 : 4380;
+}
+
+static uint32_t chitcpd_congestion_flight_size(tcp_data_t *tcp_data)
+{
+    return tcp_data->SND_NXT - tcp_data->SND_UNA;
+}
+
+/*
+ * Growing the window only makes sense if it is actually what limits
+ * the sender. Otherwise (e.g., when the application doesn't have
+ * enough data to send, or the peer's window is smaller) cwnd would
+ * keep growing without ever having been tested by the network.
+ */
+static bool_t chitcpd_congestion_cwnd_limited(tcp_data_t *tcp_data)
+{
+    uint32_t flight_size = chitcpd_congestion_flight_size(tcp_data);
+
+    /* In slow start, cwnd doubles every RTT, so it is enough for
+     * half of it to have been in use */
+    if (tcp_data->cwnd < tcp_data->ssthresh)
+        return flight_size >= tcp_data->cwnd / 2;
+
+    return flight_size + tcp_data->SMSS >= tcp_data->cwnd;
+}
+
+/*
+ * Slow start (RFC 5681, section 3.1): cwnd grows by at most one
+ * segment per ACK, which doubles it every round trip.
+ */
+static void chitcpd_congestion_slow_start(tcp_data_t *tcp_data, uint32_t acked)
+{
+    tcp_data->cwnd += acked < tcp_data->SMSS ? acked : tcp_data->SMSS;
+}
+
+/* ssthresh after a loss, when it is based on the amount of data in
+ * flight (RFC 5681, equation 4) */
+static uint32_t chitcpd_congestion_halve(tcp_data_t *tcp_data)
+{
+    uint32_t half = chitcpd_congestion_flight_size(tcp_data) / 2;
+
+    return half > 2 * tcp_data->SMSS ? half : 2 * tcp_data->SMSS;
+}
+
+
+/*
+ *  NewReno
+ */
+
+static void chitcpd_newreno_init(tcp_data_t *tcp_data)
+{
+    tcp_data->cwnd = chitcpd_congestion_initial_window(tcp_data);
+    tcp_data->ssthresh = TCP_SSTHRESH_INFINITE;
+    tcp_data->bytes_acked = 0;
+}
+
+/*
+ * In congestion avoidance, cwnd grows by one segment once a full
+ * window's worth of data has been acknowledged (appropriate byte
+ * counting, RFC 5681 section 3.1 and RFC 3465).
+ */
+static void chitcpd_newreno_on_ack(tcp_data_t *tcp_data, uint32_t acked)
+{
+    if (!chitcpd_congestion_cwnd_limited(tcp_data))
+        return;
+
+    if (tcp_data->cwnd < tcp_data->ssthresh)
+    {
+        chitcpd_congestion_slow_start(tcp_data, acked);
+        return;
+    }
+
+    tcp_data->bytes_acked += acked;
+    if (tcp_data->bytes_acked >= tcp_data->cwnd)
+    {
+        tcp_data->bytes_acked -= tcp_data->cwnd;
+        tcp_data->cwnd += tcp_data->SMSS;
+    }
+}
+
+static void chitcpd_newreno_on_loss(tcp_data_t *tcp_data)
+{
+    tcp_data->ssthresh = chitcpd_congestion_halve(tcp_data);
+    tcp_data->cwnd = tcp_data->ssthresh;
+    tcp_data->bytes_acked = 0;
+}
+
+static void chitcpd_newreno_on_rto(tcp_data_t *tcp_data)
+{
+    tcp_data->ssthresh = chitcpd_congestion_halve(tcp_data);
+    tcp_data->cwnd = tcp_data->SMSS;
+    tcp_data->bytes_acked = 0;
+}
+
+const tcp_congestion_ops_t tcp_congestion_newreno =
+{
+    .name = "newreno",
+    .init = chitcpd_newreno_init,
+    .on_ack = chitcpd_newreno_on_ack,
+    .on_loss = chitcpd_newreno_on_loss,
+    .on_rto = chitcpd_newreno_on_rto
+};
+
+
+/*
+ *  CUBIC
+ *
+ *  After a loss, the window follows a cubic function of the time
+ *  elapsed since the loss, W(t) = C*(t-K)^3 + W_max, which is concave
+ *  while approaching the window at which the loss happened (W_max)
+ *  and convex when probing beyond it. Since the growth depends on time
+ *  and not on the rate at which ACKs arrive, flows with different
+ *  RTTs get a fairer share of the bottleneck than with NewReno.
+ */
+
+static double chitcpd_cubic_elapsed(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void chitcpd_cubic_init(tcp_data_t *tcp_data)
+{
+    tcp_data->cwnd = chitcpd_congestion_initial_window(tcp_data);
+    tcp_data->ssthresh = TCP_SSTHRESH_INFINITE;
+    tcp_data->bytes_acked = 0;
+    memset(&tcp_data->cubic, 0, sizeof(tcp_cubic_t));
+}
+
+static void chitcpd_cubic_on_ack(tcp_data_t *tcp_data, uint32_t acked)
+{
+    tcp_cubic_t *cubic = &tcp_data->cubic;
+    struct timespec now;
+    double cwnd, t, target, increase;
+
+    if (!chitcpd_congestion_cwnd_limited(tcp_data))
+        return;
+
+    if (tcp_data->cwnd < tcp_data->ssthresh)
+    {
+        chitcpd_congestion_slow_start(tcp_data, acked);
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    cwnd = (double) tcp_data->cwnd / tcp_data->SMSS;
+
+    /* First ACK in congestion avoidance since the last loss:
+     * start a new epoch */
+    if (!cubic->in_epoch)
+    {
+        cubic->epoch_start = now;
+        cubic->in_epoch = TRUE;
+        if (cwnd < cubic->W_max)
+        {
+            cubic->K = cbrt((cubic->W_max - cwnd) / CUBIC_C);
+            cubic->origin = cubic->W_max;
+        }
+        else
+        {
+            cubic->K = 0;
+            cubic->origin = cwnd;
+        }
+        cubic->W_est = cwnd;
+        tcp_data->bytes_acked = 0;
+    }
+
+    /* Window the cubic function gives one RTT from now (RFC 8312,
+     * section 4.1), never more than 1.5 times the current one */
+    t = chitcpd_cubic_elapsed(&cubic->epoch_start, &now) + tcp_data->SRTT / 1e6;
+    target = cubic->origin + CUBIC_C * (t - cubic->K) * (t - cubic->K) * (t - cubic->K);
+    if (target > 1.5 * cwnd)
+        target = 1.5 * cwnd;
+
+    /* If Reno would have a larger window, use that instead
+     * (TCP-friendly region, RFC 8312 section 4.2) */
+    cubic->W_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ((double) acked / tcp_data->SMSS) / cwnd;
+    if (cubic->W_est > target)
+        target = cubic->W_est;
+
+    if (target <= cwnd)
+        return;
+
+    /* cwnd grows by (target - cwnd) / cwnd segments for every
+     * segment acknowledged. bytes_acked carries over the fraction
+     * of a segment that has not been added yet. */
+    increase = (target - cwnd) / cwnd * acked + tcp_data->bytes_acked;
+    tcp_data->cwnd += ((uint32_t) increase / tcp_data->SMSS) * tcp_data->SMSS;
+    tcp_data->bytes_acked = (uint32_t) increase % tcp_data->SMSS;
+}
+
+/* Multiplicative decrease, with fast convergence (RFC 8312, sections
+ * 4.5 and 4.6): if the window didn't get back to W_max before this
+ * loss, a new flow is probably competing with us, so release some
+ * bandwidth by remembering a smaller W_max. */
+static void chitcpd_cubic_reduce(tcp_data_t *tcp_data)
+{
+    tcp_cubic_t *cubic = &tcp_data->cubic;
+    double cwnd = (double) tcp_data->cwnd / tcp_data->SMSS;
+
+    if (cwnd < cubic->W_max)
+        cubic->W_max = cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        cubic->W_max = cwnd;
+
+    tcp_data->ssthresh = tcp_data->cwnd * CUBIC_BETA;
+    if (tcp_data->ssthresh < 2 * tcp_data->SMSS)
+        tcp_data->ssthresh = 2 * tcp_data->SMSS;
+
+    cubic->in_epoch = FALSE;
+    tcp_data->bytes_acked = 0;
+}
+
+static void chitcpd_cubic_on_loss(tcp_data_t *tcp_data)
+{
+    chitcpd_cubic_reduce(tcp_data);
+    tcp_data->cwnd = tcp_data->ssthresh;
+}
+
+static void chitcpd_cubic_on_rto(tcp_data_t *tcp_data)
+{
+    chitcpd_cubic_reduce(tcp_data);
+    tcp_data->cwnd = tcp_data->SMSS;
+}
+
+const tcp_congestion_ops_t tcp_congestion_cubic =
+{
+    .name = "cubic",
+    .init = chitcpd_cubic_init,
+    .on_ack = chitcpd_cubic_on_ack,
+    .on_loss = chitcpd_cubic_on_loss,
+    .on_rto = chitcpd_cubic_on_rto
+};
+
+
+static const tcp_congestion_ops_t *tcp_congestion_algorithms[] =
+{
+    &tcp_congestion_newreno,
+    &tcp_congestion_cubic
+};
+
+#define NUM_CONGESTION_ALGORITHMS (sizeof(tcp_congestion_algorithms) / sizeof(tcp_congestion_ops_t *))
+
+const tcp_congestion_ops_t *chitcpd_congestion_find(const char *name)
+{
+    for (int i = 0; i < NUM_CONGESTION_ALGORITHMS; i++)
+        if (!strcmp(tcp_congestion_algorithms[i]->name, name))
+            return tcp_congestion_algorithms[i];
+
+    return NULL;
+}
+
+void chitcpd_congestion_init(tcp_data_t *tcp_data, const tcp_congestion_ops_t *cc)
+{
+    tcp_data->cc = cc ? cc : TCP_CONGESTION_DEFAULT;
+    tcp_data->cc->init(tcp_data);
+}
@@ -0,0 +1,124 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Pluggable congestion control.
+ *
+ *  Each socket has a congestion window (cwnd) and a slow start
+ *  threshold (ssthresh), stored in its tcp_data_t, and a pointer to
+ *  the congestion control algorithm that manages them. tcp.c never
+ *  modifies cwnd or ssthresh itself; it calls the algorithm's hooks
+ *  when an ACK acknowledges new data, when a loss is detected
+ *  through duplicate ACKs, and when the retransmission timer expires.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef CONGESTION_H_
+#define CONGESTION_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "chitcp/types.h"
+
+struct tcp_data;
+
+/* Congestion control algorithm. All hooks are called from the
+ * socket's TCP thread. */
+typedef struct tcp_congestion_ops
+{
+    /* Name used to select the algorithm (e.g., "newreno") */
+    const char *name;
+
+    /* Sets the initial cwnd and ssthresh */
+    void (*init)(struct tcp_data *tcp_data);
+
+    /* An ACK has acknowledged "acked" bytes of new data. Called
+     * before SND.UNA is updated, so SND.NXT - SND.UNA is still the
+     * amount of data that was in flight when the ACK arrived. */
+    void (*on_ack)(struct tcp_data *tcp_data, uint32_t acked);
+
+    /* A segment has been detected as lost through duplicate ACKs
+     * and is about to be fast retransmitted */
+    void (*on_loss)(struct tcp_data *tcp_data);
+
+    /* The retransmission timer has expired for a segment that had
+     * only been sent once */
+    void (*on_rto)(struct tcp_data *tcp_data);
+} tcp_congestion_ops_t;
+
+/* CUBIC state (RFC 8312). Windows are in segments. */
+typedef struct tcp_cubic
+{
+    double W_max;                   /* Window before the last reduction */
+    double K;                       /* Time to get back to W_max (secs) */
+    double origin;                  /* Window at the top of the cubic curve */
+    double W_est;                   /* Window Reno would have (TCP-friendly region) */
+    struct timespec epoch_start;    /* Start of the current avoidance epoch */
+    bool_t in_epoch;
+} tcp_cubic_t;
+
+extern const tcp_congestion_ops_t tcp_congestion_newreno;
+extern const tcp_congestion_ops_t tcp_congestion_cubic;
+
+/* Maximum length of an algorithm's name */
+#define TCP_CONGESTION_NAME_MAX (16)
+
+/* Algorithm used when none has been selected */
+#define TCP_CONGESTION_DEFAULT (&tcp_congestion_newreno)
+
+
+/*
+ * chitcpd_congestion_find - Look up a congestion control algorithm
+ *
+ * name: Name of the algorithm ("newreno" or "cubic")
+ *
+ * Returns: the algorithm, or NULL if there is no algorithm with that name.
+ *
+ */
+const tcp_congestion_ops_t *chitcpd_congestion_find(const char *name);
+
+
+/*
+ * chitcpd_congestion_init - Set up a socket's congestion control
+ *
+ * tcp_data: TCP data of the socket
+ *
+ * cc: Algorithm to use. If NULL, TCP_CONGESTION_DEFAULT is used.
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_congestion_init(struct tcp_data *tcp_data, const tcp_congestion_ops_t *cc);
+
+#endif /* CONGESTION_H_ */
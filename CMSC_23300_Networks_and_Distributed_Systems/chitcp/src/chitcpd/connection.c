@@ -54,12 +54,84 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "handlers.h"
 #include "connection.h"
 #include "chitcp/chitcpd.h"
 #include "chitcp/addr.h"
 #include "chitcp/log.h"
 #include "breakpoint.h"
+#include "packet_pool.h"
+
+/* From <netinet/tcp.h>, which can't be included along with chiTCP's
+ * own TCP header definitions */
+#ifndef TCP_NODELAY
+#define TCP_NODELAY 1
+#endif
+#ifndef TCP_MAXSEG
+#define TCP_MAXSEG 2
+#endif
+
+/*
+ * chitcpd_connection_deliver - Deliver a TCP packet received over a connection
+ *
+ * si: Server info
+ *
+ * payload: The TCP packet, as received (i.e., what follows the chiTCP header)
+ *
+ * payload_len: Length of the TCP packet
+ *
+ * local_addr, peer_addr: Addresses of the connection
+ *
+ * Returns: Nothing. The packet is copied into a pooled buffer (see
+ *          packet_pool.h), which is either handed over to the socket
+ *          the packet is for, or freed. If no buffer can be allocated,
+ *          the packet is dropped.
+ *
+ */
+static void chitcpd_connection_deliver(serverinfo_t *si, uint8_t *payload, uint16_t payload_len,
+                                       struct sockaddr *local_addr, struct sockaddr *peer_addr)
+{
+    tcp_packet_t *packet;
+    int ret;
+
+    packet = chitcpd_packet_alloc(payload_len);
+    if (packet == NULL)
+    {
+        /* Same as if it had been lost on the network */
+        chilog(WARNING, "Could not allocate a received TCP packet. Dropping it.");
+        return;
+    }
+    memcpy(packet->raw, payload, payload_len);
+
+    if (payload_len < TCP_HEADER_NOOPTIONS_SIZE ||
+        TCP_HEADER_SIZE(packet) < TCP_HEADER_NOOPTIONS_SIZE ||
+        TCP_HEADER_SIZE(packet) > payload_len)
+    {
+        /* The TCP header (with its options) must fit in the packet */
+        chilog(WARNING, "Received a TCP packet with a malformed header (%i bytes). Dropping it.", payload_len);
+        chitcpd_packet_free(packet);
+        return;
+    }
+
+    chilog(TRACE, "chiTCP packet contains a TCP payload");
+
+    /* Print the packet to the log */
+    chilog_tcp(TRACE, packet, LOG_INBOUND);
+
+    /* chitcpd_recv_tcp_packet does the heavy lifting of getting the
+     * packet to the right socket */
+    ret = chitcpd_recv_tcp_packet(si, packet, local_addr, peer_addr);
+
+    if(ret != CHITCP_OK)
+    {
+        /* TODO: Should send some sort of ICMP-ish message back to peer.
+         * For now, we just silently drop the packet */
+        chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
+        chitcpd_packet_free(packet);
+    }
+}
 
 /*
  * chitcpd_connection_thread_func - Connection thread function
@@ -67,6 +139,14 @@
  * This thread is spawned from chitcpd_server_network_thread_func
  * (in server.c) each time a peer connects to the chiTCP daemon.
  *
+ * Data is read from the connection in chunks of up to
+ * CONNECTION_RECV_BUFFER_SIZE bytes, which can contain many chiTCP
+ * frames (when the peer has several sockets sending over the same
+ * connection, or is sending small segments). Every complete frame
+ * in the buffer is processed before reading again, and a frame that
+ * is cut short is moved to the front of the buffer, to be completed
+ * by the next read.
+ *
  * args: arguments (connection_thread_args_t)
  *
  * Returns: Nothing.
@@ -82,19 +162,27 @@ void* chitcpd_connection_thread_func(void *args)
     tcpconnentry_t *connection = cta->connection;
     struct sockaddr_storage local_addr, peer_addr;
     chitcphdr_t chitcp_header;
-    uint8_t buf[1000];
     uint16_t payload_len;
-    int ret;
+    uint8_t *buf;
+    size_t start = 0, end = 0;
     /* Get the local and peer addresses */
     socklen_t lsize, psize;
     lsize = psize = sizeof(struct sockaddr_storage);
     getsockname(connection->realsocket_recv, (struct sockaddr*) &local_addr, &lsize);
     getpeername(connection->realsocket_recv, (struct sockaddr*) &peer_addr, &psize);
 
+    buf = malloc(CONNECTION_RECV_BUFFER_SIZE);
+    if (buf == NULL)
+    {
+        chilog(ERROR, "Could not allocate receive buffer for fd %d", connection->realsocket_recv);
+        close(connection->realsocket_recv);
+        pthread_exit(NULL);
+    }
+
     do
     {
-        /* Receive a chiTCP header */
-        nbytes = recv(connection->realsocket_recv, &chitcp_header, sizeof(chitcphdr_t), 0);
+        /* Receive as much as is available (and fits in the buffer) */
+        nbytes = recv(connection->realsocket_recv, buf + end, CONNECTION_RECV_BUFFER_SIZE - end, 0);
         if (nbytes == 0)
         {
             // Server closed the connection
@@ -103,76 +191,62 @@ void* chitcpd_connection_thread_func(void *args)
         }
         else if (nbytes == -1)
         {
+            if (errno == EINTR)
+                continue;
             chilog(ERROR, "Socket recv() failed on fd %d: %s", connection->realsocket_recv,
                     strerror(errno));
             close(connection->realsocket_recv);
-            pthread_exit(NULL);
+            done = 1;
         }
         else
         {
-            chilog(TRACE, "Received a chiTCP header.");
-            chilog_chitcp(TRACE, (uint8_t *)&chitcp_header, LOG_INBOUND);
-
-            /* Inspect the chiTCP header to determine ho w to proceed */
-
-            payload_len = chitcp_ntohs(chitcp_header.payload_len);
+            end += nbytes;
 
-            if(chitcp_header.proto == CHITCP_PROTO_TCP)
+            /* Process every complete frame in the buffer */
+            while (!done && end - start >= sizeof(chitcphdr_t))
             {
-                /* This means the header will be following by a TCP packet */
+                memcpy(&chitcp_header, buf + start, sizeof(chitcphdr_t));
 
-                /* Receive the packet */
-                nbytes = recv(connection->realsocket_recv, buf, payload_len, 0);
-                if (nbytes == 0)
+                /* Inspect the chiTCP header to determine how to proceed */
+                if(chitcp_header.proto != CHITCP_PROTO_TCP)
                 {
-                    // Server closed the connection
+                    chilog(ERROR, "Received a chiTCP with an unknown payload type (proto=%i)", chitcp_header.proto);
                     close(connection->realsocket_recv);
                     done = 1;
+                    break;
                 }
-                else if (nbytes == -1)
-                {
-                    chilog(ERROR, "Socket recv() failed on fd %d: %s",
-                            connection->realsocket_recv,
-                            strerror(errno));
-                    close(connection->realsocket_recv);
-                    pthread_exit(NULL);
-                }
-                else
-                {
-                    chilog(TRACE, "chiTCP packet contains a TCP payload");
-
-                    /* Allocate memory for received TCP packet */
-                    tcp_packet_t *packet = malloc(sizeof(tcp_packet_t));
-                    packet->raw = malloc(payload_len);
-                    memcpy(packet->raw, buf, payload_len);
-                    packet->length = payload_len;
-
-                    /* Print the packet to the log */
-                    chilog_tcp(TRACE, packet, LOG_INBOUND);
-
-                    /* chitcpd_recv_tcp_packet does the heavy lifting of getting the
-                     * packet to the right socket */
-                    ret = chitcpd_recv_tcp_packet(si, packet, (struct sockaddr*) &local_addr, (struct sockaddr*) &peer_addr);
-
-                    if(ret != CHITCP_OK)
-                    {
-                        /* TODO: Should send some sort of ICMP-ish message back to peer.
-                         * For now, we just silently drop the packet */
-                        chilog(WARNING, "Received a packet but did not find a socket to deliver it to (in real TCP, a ICMP message would be sent back to peer)");
-                    }
-                }
+
+                /* This means the header will be following by a TCP packet */
+                payload_len = chitcp_ntohs(chitcp_header.payload_len);
+                if (end - start < sizeof(chitcphdr_t) + payload_len)
+                    break;
+
+                chilog(TRACE, "Received a chiTCP header.");
+                chilog_chitcp(TRACE, (uint8_t *)&chitcp_header, LOG_INBOUND);
+
+                chitcpd_connection_deliver(si, buf + start + sizeof(chitcphdr_t), payload_len,
+                                           (struct sockaddr*) &local_addr, (struct sockaddr*) &peer_addr);
+
+                start += sizeof(chitcphdr_t) + payload_len;
             }
-            else
+
+            /* Move whatever is left (the start of the next frame) to the
+             * front of the buffer. The buffer can hold the largest
+             * possible frame, so there is always room for the rest. */
+            if (start == end)
+                start = end = 0;
+            else if (start > 0)
             {
-                chilog(ERROR, "Received a chiTCP with an unknown payload type (proto=%i)", chitcp_header.proto);
-                close(connection->realsocket_recv);
-                done = 1;
+                memmove(buf, buf + start, end - start);
+                end -= start;
+                start = 0;
             }
-
         }
     }
     while (!done);
 
+    free(buf);
+
     pthread_exit(NULL);
 }
 
@@ -197,11 +271,11 @@ tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr)
     /* Find connection in connection table table */
     for(int i=0; i < si->connection_table_size; i++)
     {
-        if(!si->connection_table[i].available)
+        if(!CONNECTION_ENTRY(si, i)->available)
         {
-            if(chitcp_addr_cmp(addr, (struct sockaddr *) &si->connection_table[i].peer_addr) == 0)
+            if(chitcp_addr_cmp(addr, (struct sockaddr *) &CONNECTION_ENTRY(si, i)->peer_addr) == 0)
             {
-                ret = &si->connection_table[i];
+                ret = CONNECTION_ENTRY(si, i);
                 break;
             }
         }
@@ -212,9 +286,53 @@ tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr)
 }
 
 
+/*
+ * chitcpd_grow_connection_table - Add a segment to the connection table
+ *
+ * Must be called with the connection table locked.
+ *
+ * si: Server info
+ *
+ * Returns:
+ *  - CHITCP_OK: The table has CONNECTION_SEGMENT_SIZE more (available) entries
+ *  - CHITCP_ENOMEM: The table can't grow any further
+ *
+ */
+static int chitcpd_grow_connection_table(serverinfo_t *si)
+{
+    uint32_t segment = si->connection_table_size / CONNECTION_SEGMENT_SIZE;
+    tcpconnentry_t *entries;
+
+    if(si->connection_table_size + CONNECTION_SEGMENT_SIZE > si->connection_table_max)
+        return CHITCP_ENOMEM;
+
+    entries = calloc(CONNECTION_SEGMENT_SIZE, sizeof(tcpconnentry_t));
+    if(entries == NULL)
+        return CHITCP_ENOMEM;
+
+    for(int i=0; i < CONNECTION_SEGMENT_SIZE; i++)
+    {
+        entries[i].available = TRUE;
+        pthread_mutex_init(&entries[i].lock_send, NULL);
+        pthread_cond_init(&entries[i].cv_send, NULL);
+    }
+
+    /* The network thread walks the table without locking it, so the
+     * segment must be in place before the entries are counted */
+    si->connection_segments[segment] = entries;
+    __sync_synchronize();
+    si->connection_table_size += CONNECTION_SEGMENT_SIZE;
+
+    return CHITCP_OK;
+}
+
+
 /*
  * chitcpd_get_available_connection_entry - Find an avalable slot in the connection table
  *
+ * The table grows (one segment at a time) when all of its entries
+ * are in use. The returned entry is marked as not available.
+ *
  * si: Server info
  *
  * Returns: Pointer to available entry in connection table.
@@ -225,15 +343,26 @@ tcpconnentry_t* chitcpd_get_available_connection_entry(serverinfo_t *si)
 {
     tcpconnentry_t *ret = NULL;
 
-    /* Find matching slot in socket table */
+    pthread_mutex_lock(&si->lock_connection_table);
+
+    /* Find available slot in connection table */
     for(int i=0; i < si->connection_table_size; i++)
     {
-        if(si->connection_table[i].available)
+        if(CONNECTION_ENTRY(si, i)->available)
         {
-            return &si->connection_table[i];
+            ret = CONNECTION_ENTRY(si, i);
+            break;
         }
     }
 
+    if(ret == NULL && chitcpd_grow_connection_table(si) == CHITCP_OK)
+        ret = CONNECTION_ENTRY(si, si->connection_table_size - CONNECTION_SEGMENT_SIZE);
+
+    if(ret != NULL)
+        ret->available = FALSE;
+
+    pthread_mutex_unlock(&si->lock_connection_table);
+
     return ret;
 }
 
@@ -294,6 +423,7 @@ tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* add
      * connect() below, otherwise there is a race condition.) */
     connection->realsocket_recv = -1;
 
+    chitcpd_connection_set_nodelay(connection->realsocket_send);
     connect(connection->realsocket_send, (struct sockaddr*) &connection->peer_addr, addrsize);
 
     /* Create connection thread */
@@ -342,6 +472,66 @@ int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connectio
     return CHITCP_OK;
 }
 
+/*
+ * chitcpd_connection_set_nodelay - Disables Nagle's algorithm on a real TCP socket
+ *
+ * chiTCP decides when its segments are sent (and runs its own Nagle's
+ * algorithm and delayed ACKs), so the real connection should deliver
+ * them right away, instead of holding a segment back until the
+ * previous one is acknowledged.
+ *
+ * realsocket: Real TCP socket
+ *
+ * Returns:
+ *  - CHITCP_OK: Option set
+ *  - CHITCP_ESOCKET: setsockopt() failed
+ *
+ */
+int chitcpd_connection_set_nodelay(socket_t realsocket)
+{
+    int yes = 1;
+
+    if (setsockopt(realsocket, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(int)) == -1)
+    {
+        chilog(WARNING, "Could not set TCP_NODELAY on fd %d: %s", realsocket, strerror(errno));
+        return CHITCP_ESOCKET;
+    }
+
+    return CHITCP_OK;
+}
+
+/*
+ * chitcpd_connection_mss - Largest TCP payload worth sending through a connection
+ *
+ * Each chiTCP packet travels through the real TCP connection behind a
+ * chiTCP header. The MSS is chosen so that a packet, even with a TCP
+ * header full of options, fits in a single segment of the real
+ * connection (whose own MSS comes from the path MTU: about 1460 bytes
+ * on Ethernet, and almost 64KB on loopback).
+ *
+ * connection: Connection entry (may be NULL)
+ *
+ * Returns: the MSS, between TCP_MSS and TCP_MSS_MAX.
+ *
+ */
+uint16_t chitcpd_connection_mss(tcpconnentry_t *connection)
+{
+    int real_mss;
+    socklen_t optlen = sizeof(int);
+
+    if (connection == NULL ||
+        getsockopt(connection->realsocket_send, IPPROTO_TCP, TCP_MAXSEG, &real_mss, &optlen) == -1)
+        return TCP_MSS;
+
+    real_mss -= (int) (sizeof(chitcphdr_t) + TCP_HEADER_MAX_SIZE);
+    if (real_mss < TCP_MSS)
+        return TCP_MSS;
+    if (real_mss > TCP_MSS_MAX)
+        return TCP_MSS_MAX;
+
+    return real_mss;
+}
+
 /*
  * chitcpd_add_connection - Add a connection to the connection table.
  *
@@ -394,6 +584,178 @@ tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_sen
     return ret;
 }
 
+/*
+ * chitcpd_sendmsg_all - Write an entire iovec array to a socket
+ *
+ * Retries after partial writes, adjusting "iov" in place.
+ *
+ * flags: Flags for sendmsg() (e.g., MSG_MORE)
+ *
+ * Returns: Number of bytes written, or -1 on error.
+ *
+ */
+static int chitcpd_sendmsg_all(socket_t realsocket, struct iovec *iov, int iovcnt, int flags)
+{
+    struct msghdr msg;
+    ssize_t nbytes;
+    int nwritten = 0;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+
+    while (iovcnt > 0)
+    {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        nbytes = sendmsg(realsocket, &msg, flags | MSG_NOSIGNAL);
+        if (nbytes <= 0)
+        {
+            if (nbytes == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        nwritten += nbytes;
+
+        /* Skip over the fully-written entries */
+        while (iovcnt > 0 && (size_t) nbytes >= iov->iov_len)
+        {
+            nbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *) iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+
+    return nwritten;
+}
+
+/*
+ * chitcpd_connection_write_batch - Write a batch of frames
+ *
+ * Takes as many frames from the head of the connection's transmit
+ * queue as fit in CONNECTION_SEND_BATCH_IOV iovecs (but always at least
+ * one), and writes them with a single sendmsg() (unless it is a partial
+ * write). If there are more frames left in the queue, the socket is
+ * told (with MSG_MORE) that more data is coming, so the kernel can pack
+ * the frames into full-sized segments.
+ *
+ * Must be called with lock_send held, by the thread that is sending.
+ * The lock is released while writing to the socket.
+ *
+ */
+static void chitcpd_connection_write_batch(tcpconnentry_t *connection)
+{
+    struct iovec iov[CONNECTION_SEND_BATCH_IOV];
+    tcpconnframe_t *first, *last, *frame;
+    int iovcnt = 0, nwritten, flags = 0;
+    size_t length = 0;
+
+    first = last = connection->send_head;
+    for (frame = first; frame != NULL; frame = frame->next)
+    {
+        if (frame != first && iovcnt + frame->iovcnt > CONNECTION_SEND_BATCH_IOV)
+            break;
+
+        memcpy(&iov[iovcnt], frame->iov, frame->iovcnt * sizeof(struct iovec));
+        iovcnt += frame->iovcnt;
+        length += frame->length;
+        last = frame;
+    }
+
+    connection->send_head = last->next;
+    if (connection->send_head == NULL)
+        connection->send_tail = NULL;
+    else
+        flags |= MSG_MORE;
+    last->next = NULL;
+
+    pthread_mutex_unlock(&connection->lock_send);
+    nwritten = chitcpd_sendmsg_all(connection->realsocket_send, iov, iovcnt, flags);
+    pthread_mutex_lock(&connection->lock_send);
+
+    if (nwritten != -1)
+        assert(nwritten == length);
+
+    for (frame = first; frame != NULL; frame = frame->next)
+    {
+        frame->status = (nwritten == -1) ? -1 : frame->length;
+        frame->done = TRUE;
+    }
+}
+
+/*
+ * chitcpd_connection_send - Send a chiTCP frame over a connection
+ *
+ * The frame is added to the connection's transmit queue. If no other
+ * thread is writing to the connection's socket, this thread writes
+ * out the queue (its own frame and whatever other threads have queued
+ * in the meantime) in batches until its own frame has been sent, and
+ * then hands the socket over to one of the waiting threads, if any.
+ * Otherwise, it waits for some other thread to send the frame.
+ *
+ * Either way, frames are never interleaved on the socket, and the
+ * function does not return until the frame has been written, so the
+ * buffers it points to only need to be valid until then.
+ *
+ * connection: Connection
+ *
+ * iov: The frame (chiTCP header, TCP packet and payload). The array
+ *      itself may be modified.
+ *
+ * iovcnt: Number of entries in iov (at most CONNECTION_SEND_BATCH_IOV)
+ *
+ * Returns: Number of bytes written, or -1 on error.
+ *
+ */
+int chitcpd_connection_send(tcpconnentry_t *connection, struct iovec *iov, int iovcnt)
+{
+    tcpconnframe_t frame;
+
+    assert(iovcnt <= CONNECTION_SEND_BATCH_IOV);
+
+    frame.iov = iov;
+    frame.iovcnt = iovcnt;
+    frame.length = 0;
+    for (int i = 0; i < iovcnt; i++)
+        frame.length += iov[i].iov_len;
+    frame.done = FALSE;
+    frame.status = -1;
+    frame.next = NULL;
+
+    pthread_mutex_lock(&connection->lock_send);
+
+    if (connection->send_tail)
+        connection->send_tail->next = &frame;
+    else
+        connection->send_head = &frame;
+    connection->send_tail = &frame;
+
+    while (!frame.done)
+    {
+        if (connection->sending)
+        {
+            pthread_cond_wait(&connection->cv_send, &connection->lock_send);
+            continue;
+        }
+
+        connection->sending = TRUE;
+        while (!frame.done)
+            chitcpd_connection_write_batch(connection);
+        connection->sending = FALSE;
+
+        /* Wake up the threads whose frames were just sent, as well as
+         * the ones that are still waiting (one of which will take over) */
+        pthread_cond_broadcast(&connection->cv_send);
+    }
+
+    pthread_mutex_unlock(&connection->lock_send);
+
+    return frame.status;
+}
+
 /*
  * chitcpd_send_tcp_packet - Sends a TCP packet over chiTCP
  *
@@ -401,34 +763,65 @@ tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_sen
  *
  * sock: Socket table entry
  *
- * tcp_packet: TCP packet to send
+ * tcp_packet: TCP packet to send (allocated from the packet pool,
+ *             see packet_pool.h)
  *
  * Returns: Number of bytes of data (excluding packet headers) sent
  *
  */
 int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet)
 {
+    return chitcpd_send_tcp_packet_iov(si, sock, tcp_packet, NULL, 0);
+}
+
+/*
+ * chitcpd_send_tcp_packet_iov - Sends a TCP packet over chiTCP, with its
+ *                               payload given as a scatter/gather list
+ *
+ * The chiTCP header is written into the headroom in front of the
+ * packet, and sent along with the TCP header (and any payload already
+ * in tcp_packet) and the payload iovecs in a single frame (see
+ * chitcpd_connection_send), so the payload can be sent straight out
+ * of a socket's send buffer (see circular_buffer_peek_iov) without
+ * first being copied into a packet.
+ *
+ * si: Serverinfo struct
+ *
+ * sock: Socket table entry
+ *
+ * tcp_packet: TCP packet to send, allocated from the packet pool (see
+ *             packet_pool.h). Normally contains just the header.
+ *
+ * payload: Additional payload to append to tcp_packet (may be NULL)
+ *
+ * payload_iovcnt: Number of entries in payload
+ *
+ * Returns: Number of bytes of data (excluding the chiTCP header) sent
+ *
+ */
+int chitcpd_send_tcp_packet_iov(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet,
+                                const struct iovec *payload, int payload_iovcnt)
+{
+    size_t payload_len = 0;
+
+    for (int i = 0; i < payload_iovcnt; i++)
+        payload_len += payload[i].iov_len;
+
     enum chitcpd_debug_response r = chitcpd_debug_breakpoint(si, ptr_to_fd(si, sock), DBG_EVT_OUTGOING_PACKET, -1);
-    
+
     if (r == DBG_RESP_DROP)
     {
         chilog(TRACE, "chitcpd_send_tcp_packet: dropping the packet");
-        return tcp_packet->length; /* fake that the packet was sent */
+        return tcp_packet->length + payload_len; /* fake that the packet was sent */
     }
     tcpconnentry_t *connection = sock->socket_state.active.realtcpconn;
 
-    /* Allocate memory for the chiTCP header and the TCP packet */
-    uint8_t *full_packet = calloc(sizeof(chitcphdr_t) + tcp_packet->length, 1);
-
-
-    /* Create the chiTCP header */
-    chitcphdr_t *header = (chitcphdr_t *) full_packet;
-    header->payload_len = chitcp_htons(tcp_packet->length);
+    /* Create the chiTCP header, right in front of the TCP packet */
+    chitcphdr_t *header = (chitcphdr_t *) chitcpd_packet_headroom(tcp_packet);
+    memset(header, 0, sizeof(chitcphdr_t));
+    header->payload_len = chitcp_htons(tcp_packet->length + payload_len);
     header->proto = CHITCP_PROTO_TCP;
 
-    /* Copy the packet */
-    memcpy(full_packet + sizeof(chitcphdr_t), tcp_packet->raw, tcp_packet->length);
-
     /* Print the chiTCP header and the full TCP packet */
     chilog(TRACE, "Sending a chiTCP packet with a TCP payload.");
     chilog(TRACE, "chiTCP Header:");
@@ -436,28 +829,26 @@ int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet
 
     chilog(TRACE, "TCP payload:");
     chilog_tcp(TRACE, tcp_packet, LOG_OUTBOUND);
-
-    /* Send the chiTCP header and the TCP packet */
-    int nbytes, nleft, nwritten = 0;
-
-    uint8_t *buf = full_packet;
-    nleft = sizeof(chitcphdr_t) + tcp_packet->length;
-
-    /* TODO: Possible race condition if multiple TCP threads want to send
-     * at the same time *and* this send() doesn't send the entire packet */
-    while ( nleft > 0 ) {
-        if ( (nbytes = send(connection->realsocket_send, buf, nleft, 0)) <= 0 ) {
-            return -1;
-        }
-        nleft -= nbytes;
-        buf += nbytes;
-        nwritten += nbytes;
-    }
-    assert(nwritten == sizeof(chitcphdr_t) + tcp_packet->length);
-
-    free(full_packet);
-
-    return tcp_packet->length;
+    for (int i = 0; i < payload_iovcnt; i++)
+        chilog_hex(TRACE, payload[i].iov_base, payload[i].iov_len);
+
+    /* Send the chiTCP header, the TCP packet and the payload */
+    struct iovec iov[1 + payload_iovcnt];
+    int nwritten;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(chitcphdr_t) + tcp_packet->length;
+    for (int i = 0; i < payload_iovcnt; i++)
+        iov[1 + i] = payload[i];
+
+    /* Other TCP threads may be sending over the same connection, so this
+     * goes through the connection's transmit queue */
+    nwritten = chitcpd_connection_send(connection, iov, 1 + payload_iovcnt);
+    if (nwritten == -1)
+        return -1;
+    assert(nwritten == sizeof(chitcphdr_t) + tcp_packet->length + payload_len);
+
+    return tcp_packet->length + payload_len;
 }
 
 /* chitcpd_enqueue_packet - helper function for chitcpd_recv_tcp_packet
@@ -562,11 +953,22 @@ static void chitcpd_enqueue_packet(serverinfo_t *si, chisocketentry_t *entry, tc
 
     if (r == DBG_RESP_WITHHOLD || r == DBG_RESP_DUPLICATE)
     {
-        /* Put the packet on the socket's withheld_packets queue */
-        chilog(TRACE, "chitcpd_enqueue_packet: withholding a copy");
-        pthread_mutex_lock(&socket_state->tcp_data.lock_withheld_packets);
-        list_append(&socket_state->tcp_data.withheld_packets, tcp_packet);
-        pthread_mutex_unlock(&socket_state->tcp_data.lock_withheld_packets);
+        /* Put the packet on the socket's withheld_packets queue. When
+         * duplicating, the TCP thread will free the other copy. */
+        tcp_packet_t *withheld_packet = tcp_packet;
+        if (r == DBG_RESP_DUPLICATE)
+        {
+            withheld_packet = chitcpd_packet_copy(tcp_packet);
+        }
+
+        /* If the copy can't be allocated, the packet is only enqueued */
+        if (withheld_packet != NULL)
+        {
+            chilog(TRACE, "chitcpd_enqueue_packet: withholding a copy");
+            pthread_mutex_lock(&socket_state->tcp_data.lock_withheld_packets);
+            list_append(&socket_state->tcp_data.withheld_packets, withheld_packet);
+            pthread_mutex_unlock(&socket_state->tcp_data.lock_withheld_packets);
+        }
     }
 
     if (r == DBG_RESP_DRAW_WITHHELD)
@@ -603,8 +1005,8 @@ static void chitcpd_enqueue_packet(serverinfo_t *si, chisocketentry_t *entry, tc
 
     if (r == DBG_RESP_DROP)
     {
-        /* Nothing actually happens */
         chilog(TRACE, "chitcpd_enqueue_packet: dropping the packet");
+        chitcpd_packet_free(tcp_packet);
     }
 }
 
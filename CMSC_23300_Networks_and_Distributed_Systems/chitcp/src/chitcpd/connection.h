@@ -41,9 +41,18 @@
 #ifndef CONNECTION_H_
 #define CONNECTION_H_
 
+#include <sys/uio.h>
 #include "serverinfo.h"
 #include "chitcp/packet.h"
 
+/* Maximum number of iovecs written to a connection's real socket in a
+ * single system call (see chitcpd_connection_send) */
+#define CONNECTION_SEND_BATCH_IOV (64)
+
+/* Size of a connection thread's receive buffer. It must be able to hold
+ * the largest possible chiTCP frame (see chitcpd_connection_thread_func) */
+#define CONNECTION_RECV_BUFFER_SIZE (128 * 1024)
+
 typedef struct connection_thread_args
 {
     serverinfo_t *si;
@@ -56,8 +65,13 @@ tcpconnentry_t* chitcpd_get_connection(serverinfo_t *si, struct sockaddr* addr);
 tcpconnentry_t* chitcpd_create_connection(serverinfo_t *si, struct sockaddr* addr);
 tcpconnentry_t* chitcpd_add_connection(serverinfo_t *si, socket_t realsocket_send, socket_t realsocket_recv, struct sockaddr* addr);
 int chitcpd_create_connection_thread(serverinfo_t *si, tcpconnentry_t* connection);
+int chitcpd_connection_set_nodelay(socket_t realsocket);
+uint16_t chitcpd_connection_mss(tcpconnentry_t *connection);
+int chitcpd_connection_send(tcpconnentry_t *connection, struct iovec *iov, int iovcnt);
 
 int chitcpd_send_tcp_packet(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet);
+int chitcpd_send_tcp_packet_iov(serverinfo_t *si, chisocketentry_t *sock, tcp_packet_t* tcp_packet,
+                                const struct iovec *payload, int payload_iovcnt);
 int chitcpd_recv_tcp_packet(serverinfo_t *si, tcp_packet_t* tcp_packet, struct sockaddr *local_realaddr, struct sockaddr *peer_realaddr);
 
 #endif /* CONNECTION_H_ */
@@ -54,6 +54,7 @@
 #include "tcp_thread.h"
 #include "breakpoint.h"
 #include "tcp.h"
+#include "packet_pool.h"
 
 /* Dispatch table */
 
@@ -74,6 +75,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS);
 HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE);
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SETSOCKOPT);
 
 /* Handling DEBUG requires a slightly modified prototype */
 int chitcpd_handle_CHITCPD_MSG_CODE__DEBUG(serverinfo_t *si, ChitcpdMsg *req, ChitcpdMsg *resp_outer, ChitcpdResp *resp_inner, int client_sockfd);
@@ -90,7 +92,8 @@ handler_function handlers[] =
     HANDLER_ENTRY(CHITCPD_MSG_CODE__CLOSE),
     HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_STATE),
     HANDLER_ENTRY(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS),
-    HANDLER_ENTRY(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__WAIT_FOR_STATE),
+    HANDLER_ENTRY(CHITCPD_MSG_CODE__SETSOCKOPT)
 };
 
 static char *code_strs[] =
@@ -108,7 +111,8 @@ static char *code_strs[] =
     "RESP",
     "DEBUG",
     "DEBUG_EVENT",
-    "WAIT_FOR_STATE"
+    "WAIT_FOR_STATE",
+    "SETSOCKOPT"
 };
 
 static inline char *handler_code_string (int code)
@@ -241,7 +245,7 @@ void* chitcpd_handler_dispatch(void *args)
 
     for(int i=0; i < si->chisocket_table_size; i++)
     {
-        chisocketentry_t *entry = &si->chisocket_table[i];
+        chisocketentry_t *entry = SOCKET_ENTRY(si, i);
         if(!entry->available && entry->creator_thread == pthread_self())
         {
             chilog(DEBUG, "Freeing socket %i", i);
@@ -276,7 +280,7 @@ int chitcpd_handle_CHITCPD_MSG_CODE__DEBUG(serverinfo_t *si, ChitcpdMsg *req, Ch
     sockfd = req->debug_args->sockfd;
     event_flags = req->debug_args->event_flags;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         resp_inner->ret = -1;
@@ -297,7 +301,7 @@ int chitcpd_handle_CHITCPD_MSG_CODE__DEBUG(serverinfo_t *si, ChitcpdMsg *req, Ch
     pthread_mutex_init(&debug_mon->lock_sockfd, NULL);
     debug_mon->sockfd = client_sockfd;
 
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
     pthread_mutex_lock(&entry->lock_debug_monitor);
     if (entry->debug_monitor != NULL)
     {
@@ -362,9 +366,9 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SOCKET)
 
     if(ret == CHITCP_OK)
     {
-        si->chisocket_table[socket_index].domain = domain;
-        si->chisocket_table[socket_index].type = type;
-        si->chisocket_table[socket_index].protocol = protocol;
+        SOCKET_ENTRY(si, socket_index)->domain = domain;
+        SOCKET_ENTRY(si, socket_index)->type = type;
+        SOCKET_ENTRY(si, socket_index)->protocol = protocol;
 
         resp->ret = socket_index;
         resp->error_code = 0;
@@ -400,14 +404,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND)
     addrlen = req->addr.len;
     addr = (struct sockaddr*) req->addr.data;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
 
     if(entry->tcp_state != CLOSED)
     {
@@ -433,7 +437,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND)
         goto done;
     }
 
-    if (port > si->port_table_size)
+    if (port >= si->port_table_size)
     {
         chilog(ERROR, "Invalid port specified: %i", port);
         ret = -1;
@@ -441,7 +445,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND)
         goto done;
     }
 
-    if (si->port_table[port] != NULL)
+    if (chitcpd_reserve_port(si, port, entry) != CHITCP_OK)
     {
         chilog(ERROR, "Port is already taken: %i", port);
         ret = -1;
@@ -463,8 +467,6 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__BIND)
     chitcp_addr_set_any((struct sockaddr *) &entry->remote_addr);
     chitcp_set_addr_port((struct sockaddr *) &entry->remote_addr, 0);
 
-    si->port_table[port] = entry;
-
     ret = 0;
 
 done:
@@ -495,14 +497,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__LISTEN)
     sockfd = req->sockfd;
     backlog = req->backlog;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
 
     if(entry->tcp_state != CLOSED)
     {
@@ -515,8 +517,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__LISTEN)
     /* Update the socket to reflect that this will be a passive socket */
     passive_chisocket_state_t *socket_state;
 
-    si->chisocket_table[sockfd].actpas_type = SOCKET_PASSIVE;
-    socket_state = &si->chisocket_table[sockfd].socket_state.passive;
+    entry->actpas_type = SOCKET_PASSIVE;
+    socket_state = &entry->socket_state.passive;
     entry->tcp_state = LISTEN;
 
     socket_state->backlog = backlog;
@@ -554,7 +556,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
 
     sockfd = req->sockfd;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
@@ -562,7 +564,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
         goto done;
     }
 
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
     passive_chisocket_state_t *socket_state = &entry->socket_state.passive;
     pending_connection_t *pending_connection;
 
@@ -603,7 +605,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
     }
 
     /* Initialize the socket entry */
-    chisocketentry_t *active_entry = &si->chisocket_table[socket_index];
+    chisocketentry_t *active_entry = SOCKET_ENTRY(si, socket_index);
     active_chisocket_state_t *active_socket_state = &active_entry->socket_state.active;
     struct sockaddr* local_addr = (struct sockaddr*) &pending_connection->local_addr;
     struct sockaddr* remote_addr = (struct sockaddr*) &pending_connection->remote_addr;
@@ -611,6 +613,23 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
     active_entry->domain = entry->domain;
     active_entry->type = entry->type;
     active_entry->protocol = entry->protocol;
+    active_entry->nodelay = entry->nodelay;
+    active_entry->congestion_control = entry->congestion_control;
+    active_entry->maxseg = entry->maxseg;
+    active_entry->sndbuf = entry->sndbuf;
+    active_entry->rcvbuf = entry->rcvbuf;
+
+    /* Allocate the socket's buffers. If we can't, the connection is
+     * dropped (the peer will eventually give up on it) */
+    if(chitcpd_tcp_init_buffers(active_entry) != CHITCP_OK)
+    {
+        chitcpd_free_socket_entry(si, active_entry);
+        chitcpd_packet_free(pending_connection->initial_packet);
+        free(pending_connection);
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
 
     active_entry->actpas_type = SOCKET_ACTIVE;
     active_socket_state->parent_socket = entry;
@@ -629,6 +648,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
 
     memcpy(&active_entry->local_addr, local_addr, sizeof(struct sockaddr_storage));
     memcpy(&active_entry->remote_addr, remote_addr, sizeof(struct sockaddr_storage));
+    chitcpd_hash_socket(si, active_entry);
 
     enum chitcpd_debug_response r =
         chitcpd_debug_breakpoint(si, sockfd, DBG_EVT_PENDING_CONNECTION, socket_index);
@@ -668,16 +688,29 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__ACCEPT)
         chilog(TRACE, "accept() initial packet: enqueueing a copy");
         list_append(&active_socket_state->tcp_data.pending_packets, pending_connection->initial_packet);
     }
-    if (r == DBG_RESP_WITHHOLD || r == DBG_RESP_DUPLICATE)
+    if (r == DBG_RESP_WITHHOLD)
     {
         chilog(TRACE, "accept() initial packet: withholding a copy");
         list_append(&active_socket_state->tcp_data.withheld_packets, pending_connection->initial_packet);
     }
-    /* otherwise r == DBG_RESP_DROP and we do nothing */
+    else if (r == DBG_RESP_DUPLICATE)
+    {
+        /* The TCP thread will free the copy we just enqueued. If the
+         * copy can't be allocated, the packet is only enqueued. */
+        tcp_packet_t *withheld_packet = chitcpd_packet_copy(pending_connection->initial_packet);
+
+        if (withheld_packet != NULL)
+        {
+            chilog(TRACE, "accept() initial packet: withholding a copy");
+            list_append(&active_socket_state->tcp_data.withheld_packets, withheld_packet);
+        }
+    }
+    else if (r == DBG_RESP_DROP)
+        chitcpd_packet_free(pending_connection->initial_packet);
     pthread_mutex_unlock(&active_socket_state->tcp_data.lock_pending_packets);
 
     /* Start TCP thread */
-    chitcpd_tcp_start_thread(si, &si->chisocket_table[socket_index]);
+    chitcpd_tcp_start_thread(si, SOCKET_ENTRY(si, socket_index));
 
     pthread_mutex_lock(&active_entry->lock_tcp_state);
     if (r == DBG_RESP_NONE || r == DBG_RESP_DUPLICATE || r == DBG_RESP_DRAW_WITHHELD)
@@ -740,7 +773,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
     addrlen = req->addr.len;
     memcpy(&addr, req->addr.data, addrlen);
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
@@ -750,7 +783,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
 
     tcpconnentry_t *connection;
     active_chisocket_state_t *socket_state;
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
     int port;
 
     if(entry->tcp_state != CLOSED)
@@ -771,8 +804,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
         connection = chitcpd_create_connection(si, (struct sockaddr*) &addr);
     }
 
-    /* Find available ephemeral port */
-    port = chitcpd_find_ephemeral_port(si);
+    /* Find available ephemeral port (and take it) */
+    port = chitcpd_find_ephemeral_port(si, entry);
 
     if(port == -1)
     {
@@ -781,8 +814,17 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
         goto done;
     }
 
+    /* Allocate the socket's buffers */
+    if(chitcpd_tcp_init_buffers(entry) != CHITCP_OK)
+    {
+        chitcpd_release_port(si, port, entry);
+        ret = -1;
+        error_code = ENOMEM;
+        goto done;
+    }
+
     /* Initialize socket entry */
-    entry = &si->chisocket_table[sockfd];
+    entry = SOCKET_ENTRY(si, sockfd);
     entry->actpas_type = SOCKET_ACTIVE;
     socket_state = &entry->socket_state.active;
 
@@ -808,12 +850,11 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CONNECT)
     /* Copy remote address */
     memcpy(&entry->remote_addr,  &addr, sizeof(struct sockaddr_storage));
 
-    /* Update port table */
-    si->port_table[port] = entry;
+    chitcpd_hash_socket(si, entry);
 
 
     /* Start socket thread */
-    chitcpd_tcp_start_thread(si, &si->chisocket_table[sockfd]);
+    chitcpd_tcp_start_thread(si, SOCKET_ENTRY(si, sockfd));
 
     /* Signal the TCP thread to let it know that the application
      * has produced a CONNECT event. This will trigger a three-way
@@ -878,14 +919,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__SEND)
         goto done;
     }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
 
     if(entry->tcp_state == CLOSED)
     {
@@ -979,14 +1020,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
         goto done;
     }
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
 
     if(entry->tcp_state == CLOSED)
     {
@@ -1017,8 +1058,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__RECV)
     tcp_data_t *tcp_data;
     int nbytes;
 
-    socket_state = &si->chisocket_table[sockfd].socket_state.active;
-    tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
+    socket_state = &entry->socket_state.active;
+    tcp_data = &entry->socket_state.active.tcp_data;
 
     resp->buf.data = malloc(length);
     nbytes = circular_buffer_read(&tcp_data->recv, resp->buf.data, length, BUFFER_BLOCKING);
@@ -1089,14 +1130,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__CLOSE)
 
     sockfd = req->sockfd;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
 
     if(entry->tcp_state == CLOSED)
     {
@@ -1243,7 +1284,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE)
 
     sockfd = req->sockfd;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available || si->chisocket_table[sockfd].actpas_type != SOCKET_ACTIVE)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available || SOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
@@ -1263,8 +1304,8 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_STATE)
 
     chitcpd_socket_state__init(resp->socket_state);
 
-    resp->socket_state->tcp_state = si->chisocket_table[sockfd].tcp_state;
-    tcp_data_t *tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
+    resp->socket_state->tcp_state = SOCKET_ENTRY(si, sockfd)->tcp_state;
+    tcp_data_t *tcp_data = &SOCKET_ENTRY(si, sockfd)->socket_state.active.tcp_data;
     resp->socket_state->iss = tcp_data->ISS;
     resp->socket_state->irs = tcp_data->IRS;
     resp->socket_state->snd_una = tcp_data->SND_UNA;
@@ -1300,7 +1341,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS)
 
     sockfd = req->sockfd;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available || si->chisocket_table[sockfd].actpas_type != SOCKET_ACTIVE)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available || SOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
@@ -1320,7 +1361,7 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__GET_SOCKET_BUFFER_CONTENTS)
         {
             chitcpd_socket_buffer_contents__init(resp->socket_buffer_contents);
 
-            tcp_data_t *tcp_data = &si->chisocket_table[sockfd].socket_state.active.tcp_data;
+            tcp_data_t *tcp_data = &SOCKET_ENTRY(si, sockfd)->socket_state.active.tcp_data;
 
             ret = 0;
 
@@ -1380,14 +1421,14 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
     sockfd = req->sockfd;
     tcp_state = req->tcp_state;
 
-    if(sockfd < 0 || sockfd >= si->chisocket_table_size || si->chisocket_table[sockfd].available || si->chisocket_table[sockfd].actpas_type != SOCKET_ACTIVE)
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available || SOCKET_ENTRY(si, sockfd)->actpas_type != SOCKET_ACTIVE)
     {
         chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
         ret = -1;
         error_code = EBADF;
         goto done;
     }
-    chisocketentry_t *entry = &si->chisocket_table[sockfd];
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
 
     if(!IS_VALID_TCP_STATE(tcp_state))
     {
@@ -1416,3 +1457,169 @@ HANDLER_FUNCTION(CHITCPD_MSG_CODE__WAIT_FOR_STATE)
 
     return CHITCP_OK;
 }
+
+
+/* Handler for chisocket_setsockopt() */
+HANDLER_FUNCTION(CHITCPD_MSG_CODE__SETSOCKOPT)
+{
+    chisocket_t sockfd;
+    int ret, error_code = 0;
+    ChitcpdSetsockoptArgs *req;
+    char name[TCP_CONGESTION_NAME_MAX + 1];
+    const tcp_congestion_ops_t *cc;
+
+    chilog(TRACE, ">>> Entering handler for CHITCPD_MSG_CODE__SETSOCKOPT");
+
+    /* Unpack request */
+    assert(req_msg->setsockopt_args != NULL);
+    req = req_msg->setsockopt_args;
+
+    sockfd = req->sockfd;
+
+    if(sockfd < 0 || sockfd >= si->chisocket_table_size || SOCKET_ENTRY(si, sockfd)->available)
+    {
+        chilog(ERROR, "Not a valid chisocket descriptor: %i", sockfd);
+        ret = -1;
+        error_code = EBADF;
+        goto done;
+    }
+    chisocketentry_t *entry = SOCKET_ENTRY(si, sockfd);
+
+    if(req->level != SOL_SOCKET && req->level != IPPROTO_TCP)
+    {
+        chilog(ERROR, "Unsupported socket option level: %i", req->level);
+        ret = -1;
+        error_code = ENOPROTOOPT;
+        goto done;
+    }
+
+    if(req->level == SOL_SOCKET && (req->optname == SO_SNDBUF || req->optname == SO_RCVBUF))
+    {
+        int size;
+
+        if(req->optval.len < sizeof(int))
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+
+        /* The buffers are allocated when the TCP thread starts */
+        if(entry->actpas_type == SOCKET_ACTIVE)
+        {
+            ret = -1;
+            error_code = EISCONN;
+            goto done;
+        }
+
+        size = *((int *) req->optval.data);
+        if(size < TCP_BUFFER_MIN)
+            size = TCP_BUFFER_MIN;
+        else if(size > TCP_BUFFER_MAX)
+            size = TCP_BUFFER_MAX;
+
+        if(req->optname == SO_SNDBUF)
+            entry->sndbuf = size;
+        else
+            entry->rcvbuf = size;
+    }
+    else if(req->level == IPPROTO_TCP && req->optname == TCP_NODELAY)
+    {
+        if(req->optval.len < sizeof(int))
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+
+        entry->nodelay = *((int *) req->optval.data) != 0;
+
+        /* Anything Nagle's algorithm was holding back can go out now */
+        if(entry->nodelay && (entry->tcp_state == ESTABLISHED || entry->tcp_state == CLOSE_WAIT))
+        {
+            active_chisocket_state_t *socket_state = &entry->socket_state.active;
+
+            pthread_mutex_lock(&socket_state->lock_event);
+            socket_state->flags.app_send = 1;
+            pthread_cond_signal(&socket_state->cv_event);
+            pthread_mutex_unlock(&socket_state->lock_event);
+        }
+    }
+    else if(req->level == IPPROTO_TCP && req->optname == TCP_MAXSEG)
+    {
+        int mss;
+
+        if(req->optval.len < sizeof(int))
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+
+        /* The MSS is advertised in the SYN */
+        if(entry->actpas_type == SOCKET_ACTIVE)
+        {
+            ret = -1;
+            error_code = EISCONN;
+            goto done;
+        }
+
+        mss = *((int *) req->optval.data);
+        if(mss < TCP_MSS)
+            mss = TCP_MSS;
+        else if(mss > TCP_MSS_MAX)
+            mss = TCP_MSS_MAX;
+
+        entry->maxseg = mss;
+    }
+    else if(req->level == IPPROTO_TCP && req->optname == TCP_CONGESTION)
+    {
+        if(req->optval.len == 0 || req->optval.len > TCP_CONGESTION_NAME_MAX)
+        {
+            ret = -1;
+            error_code = EINVAL;
+            goto done;
+        }
+
+        memcpy(name, req->optval.data, req->optval.len);
+        name[req->optval.len] = '\0';
+
+        cc = chitcpd_congestion_find(name);
+        if(cc == NULL)
+        {
+            chilog(ERROR, "Unknown congestion control algorithm: %s", name);
+            ret = -1;
+            error_code = ENOENT;
+            goto done;
+        }
+
+        /* The algorithm is set up when the TCP thread starts (on
+         * connect() or accept()), and can't be switched afterwards */
+        if(entry->actpas_type == SOCKET_ACTIVE)
+        {
+            ret = -1;
+            error_code = EISCONN;
+            goto done;
+        }
+
+        entry->congestion_control = cc;
+    }
+    else
+    {
+        chilog(ERROR, "Unsupported socket option: %i", req->optname);
+        ret = -1;
+        error_code = ENOPROTOOPT;
+        goto done;
+    }
+
+    ret = 0;
+
+ done:
+    /* Create response */
+    resp->ret = ret;
+    resp->error_code = error_code;
+
+    chilog(TRACE, "<<< Exiting handler for CHITCPD_MSG_CODE__SETSOCKOPT");
+
+    return CHITCP_OK;
+}
@@ -67,6 +67,8 @@ int main(int argc, char *argv[])
     int opt;
     char *port = NULL;
     char *usocket = NULL;
+    char *congestion = NULL;
+    bool_t sack_disabled = FALSE;
     int verbosity = 0;
 
     /* Stop SIGPIPE from messing with our sockets */
@@ -79,7 +81,7 @@ int main(int argc, char *argv[])
     }
 
     /* Process command-line arguments */
-    while ((opt = getopt(argc, argv, "p:s:vh")) != -1)
+    while ((opt = getopt(argc, argv, "p:s:C:Svh")) != -1)
         switch (opt)
         {
         case 'p':
@@ -88,11 +90,17 @@ int main(int argc, char *argv[])
         case 's':
             usocket = strdup(optarg);
             break;
+        case 'C':
+            congestion = strdup(optarg);
+            break;
+        case 'S':
+            sack_disabled = TRUE;
+            break;
         case 'v':
             verbosity++;
             break;
         case 'h':
-            printf("Usage: chitcpd [-p PORT] [-s UNIX_SOCKET] [(-v|-vv|-vvv)]\n");
+            printf("Usage: chitcpd [-p PORT] [-s UNIX_SOCKET] [-C newreno|cubic] [-S] [(-v|-vv|-vvv)]\n");
             exit(0);
         default:
             printf("ERROR: Unknown option -%c\n", opt);
@@ -132,6 +140,17 @@ int main(int argc, char *argv[])
     /* Set values in serverinfo */
     si->server_port = chitcp_htons(atoi(port));
     si->server_socket_path = usocket;
+    si->sack_disabled = sack_disabled;
+
+    if(congestion)
+    {
+        si->congestion_control = chitcpd_congestion_find(congestion);
+        if(!si->congestion_control)
+        {
+            fprintf(stderr, "Unknown congestion control algorithm: %s\n", congestion);
+            exit(-1);
+        }
+    }
 
     /* Run the daemon */
     rc = chitcpd_server_init(si);
@@ -0,0 +1,284 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Packet buffer pool (see packet_pool.h)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "packet_pool.h"
+#include "chitcp/log.h"
+
+#define PACKET_POOL_NSIZES (2)
+#define PACKET_POOL_UNPOOLED (-1)
+
+typedef struct packet_buffer packet_buffer_t;
+
+struct packet_buffer
+{
+    /* Must be the first member, so a packet can be converted
+     * back into its buffer */
+    tcp_packet_t packet;
+
+    /* Free list */
+    packet_buffer_t *next;
+
+    /* Index into packet_pool_sizes (or PACKET_POOL_UNPOOLED) */
+    int size;
+
+    /* Headroom, followed by the packet */
+    uint8_t data[];
+};
+
+typedef struct packet_pool_list
+{
+    packet_buffer_t *head;
+    int count;
+} packet_pool_list_t;
+
+static const size_t packet_pool_sizes[PACKET_POOL_NSIZES] = { PACKET_POOL_SMALL, PACKET_POOL_LARGE };
+
+/* Shared pool */
+static packet_pool_list_t shared_pool[PACKET_POOL_NSIZES];
+static pthread_mutex_t lock_shared_pool = PTHREAD_MUTEX_INITIALIZER;
+
+/* Each thread's free buffers (packet_pool_list_t[PACKET_POOL_NSIZES]),
+ * which are moved to the shared pool when the thread exits */
+static pthread_once_t thread_pool_key_init = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_pool_key;
+
+
+static void packet_pool_push(packet_pool_list_t *list, packet_buffer_t *buf)
+{
+    buf->next = list->head;
+    list->head = buf;
+    list->count++;
+}
+
+static packet_buffer_t *packet_pool_pop(packet_pool_list_t *list)
+{
+    packet_buffer_t *buf = list->head;
+
+    if (buf != NULL)
+    {
+        list->head = buf->next;
+        list->count--;
+    }
+
+    return buf;
+}
+
+/* Moves up to "n" buffers from one list to another */
+static void packet_pool_move(packet_pool_list_t *from, packet_pool_list_t *to, int n)
+{
+    packet_buffer_t *buf;
+
+    while (n-- > 0 && (buf = packet_pool_pop(from)) != NULL)
+        packet_pool_push(to, buf);
+}
+
+/* Returns every buffer in "pool" to the shared pool (or to the system,
+ * if the shared pool is full) */
+static void packet_pool_flush(packet_pool_list_t *pool)
+{
+    packet_buffer_t *buf;
+
+    pthread_mutex_lock(&lock_shared_pool);
+    for (int i = 0; i < PACKET_POOL_NSIZES; i++)
+    {
+        packet_pool_move(&pool[i], &shared_pool[i], PACKET_POOL_SHARED_MAX - shared_pool[i].count);
+        while ((buf = packet_pool_pop(&pool[i])) != NULL)
+            free(buf);
+    }
+    pthread_mutex_unlock(&lock_shared_pool);
+}
+
+static void thread_pool_destructor(void *mem)
+{
+    packet_pool_flush((packet_pool_list_t *) mem);
+    free(mem);
+}
+
+static void create_thread_pool_key()
+{
+    pthread_key_create(&thread_pool_key, thread_pool_destructor);
+}
+
+/* Returns the calling thread's pool, creating it if needed (NULL if
+ * there is no memory for it) */
+static packet_pool_list_t *packet_pool_thread(void)
+{
+    packet_pool_list_t *pool;
+
+    pthread_once(&thread_pool_key_init, create_thread_pool_key);
+
+    pool = pthread_getspecific(thread_pool_key);
+    if (pool == NULL)
+    {
+        pool = calloc(PACKET_POOL_NSIZES, sizeof(packet_pool_list_t));
+        if (pool == NULL)
+        {
+            chilog(CRITICAL, "Could not allocate the thread's packet pool");
+            return NULL;
+        }
+        pthread_setspecific(thread_pool_key, pool);
+    }
+
+    return pool;
+}
+
+
+/* See packet_pool.h */
+tcp_packet_t *chitcpd_packet_alloc(size_t length)
+{
+    packet_pool_list_t *pool;
+    packet_buffer_t *buf = NULL;
+    int size;
+
+    for (size = 0; size < PACKET_POOL_NSIZES && length > packet_pool_sizes[size]; size++)
+        ;
+
+    if (size == PACKET_POOL_NSIZES)
+    {
+        buf = malloc(sizeof(packet_buffer_t) + PACKET_HEADROOM + length);
+        if (buf == NULL)
+        {
+            chilog(CRITICAL, "Could not allocate a %zu-byte packet", length);
+            return NULL;
+        }
+        buf->size = PACKET_POOL_UNPOOLED;
+    }
+    else
+    {
+        pool = packet_pool_thread();
+        if (pool == NULL)
+            return NULL;
+
+        if (pool[size].head == NULL)
+        {
+            pthread_mutex_lock(&lock_shared_pool);
+            packet_pool_move(&shared_pool[size], &pool[size], PACKET_POOL_BATCH);
+            pthread_mutex_unlock(&lock_shared_pool);
+        }
+
+        buf = packet_pool_pop(&pool[size]);
+        if (buf == NULL)
+        {
+            buf = malloc(sizeof(packet_buffer_t) + PACKET_HEADROOM + packet_pool_sizes[size]);
+            if (buf == NULL)
+            {
+                chilog(CRITICAL, "Could not allocate a %zu-byte packet", length);
+                return NULL;
+            }
+            buf->size = size;
+        }
+    }
+
+    buf->packet.raw = buf->data + PACKET_HEADROOM;
+    buf->packet.length = length;
+
+    return &buf->packet;
+}
+
+/* See packet_pool.h */
+tcp_packet_t *chitcpd_packet_copy(const tcp_packet_t *packet)
+{
+    tcp_packet_t *copy = chitcpd_packet_alloc(packet->length);
+
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy->raw, packet->raw, packet->length);
+
+    return copy;
+}
+
+/* See packet_pool.h */
+void chitcpd_packet_free(tcp_packet_t *packet)
+{
+    packet_buffer_t *buf = (packet_buffer_t *) packet;
+    packet_pool_list_t *pool;
+    int size, n;
+
+    if (packet == NULL)
+        return;
+
+    size = buf->size;
+    if (size == PACKET_POOL_UNPOOLED)
+    {
+        free(buf);
+        return;
+    }
+
+    /* Without a pool of our own, the buffer goes straight to the
+     * shared pool (or, if that is full, back to the system) */
+    pool = packet_pool_thread();
+    if (pool == NULL)
+    {
+        pthread_mutex_lock(&lock_shared_pool);
+        if (shared_pool[size].count < PACKET_POOL_SHARED_MAX)
+        {
+            packet_pool_push(&shared_pool[size], buf);
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&lock_shared_pool);
+
+        free(buf);
+        return;
+    }
+
+    packet_pool_push(&pool[size], buf);
+
+    /* Too many free buffers: a batch goes to the shared pool (or, if
+     * that is full, back to the system) */
+    if (pool[size].count > PACKET_POOL_THREAD_MAX)
+    {
+        pthread_mutex_lock(&lock_shared_pool);
+        n = PACKET_POOL_SHARED_MAX - shared_pool[size].count;
+        packet_pool_move(&pool[size], &shared_pool[size], n < PACKET_POOL_BATCH ? n : PACKET_POOL_BATCH);
+        pthread_mutex_unlock(&lock_shared_pool);
+
+        while (pool[size].count > PACKET_POOL_THREAD_MAX)
+            free(packet_pool_pop(&pool[size]));
+    }
+}
+
+/* See packet_pool.h */
+uint8_t *chitcpd_packet_headroom(tcp_packet_t *packet)
+{
+    return packet->raw - PACKET_HEADROOM;
+}
@@ -0,0 +1,134 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Packet buffer pool.
+ *
+ *  Every TCP packet the daemon sends or receives is stored in a buffer
+ *  from this pool. Buffers reserve PACKET_HEADROOM bytes in front of
+ *  the packet, so the chiTCP header can be written right before it, and
+ *  the two sent with no extra allocation or copying (see
+ *  chitcpd_send_tcp_packet_iov in connection.c).
+ *
+ *  Buffers come in two sizes: small ones, for packets that are (mostly)
+ *  headers, like ACKs and the segments built by the TCP thread (whose
+ *  payload is sent straight from the send buffer), and large ones, for
+ *  full-sized segments received from the network. Larger packets still
+ *  get a buffer, but it is allocated and freed on the spot.
+ *
+ *  Each thread keeps a few free buffers of each size for itself, so
+ *  most allocations and frees don't even need a lock. Since packets are
+ *  usually freed by a different thread than the one that allocated them
+ *  (e.g., a connection thread receives a packet, and a TCP thread frees
+ *  it), a thread that accumulates too many buffers moves a batch of them
+ *  to a shared pool, from which threads that run out take a batch.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PACKET_POOL_H_
+#define PACKET_POOL_H_
+
+#include "chitcp/packet.h"
+#include "tcp.h"
+
+/* Room reserved in front of every packet */
+#define PACKET_HEADROOM (sizeof(chitcphdr_t))
+
+/* Largest packets (TCP header and payload) held by small and large
+ * buffers, respectively. A small buffer fits any TCP header, plus a
+ * few bytes (e.g., a zero window probe). */
+#define PACKET_POOL_SMALL (128)
+#define PACKET_POOL_LARGE (TCP_HEADER_MAX_SIZE + TCP_MSS_MAX)
+
+/* Free buffers (of each size) a thread can keep for itself, and number
+ * of buffers moved to or from the shared pool at once */
+#define PACKET_POOL_THREAD_MAX (32)
+#define PACKET_POOL_BATCH (16)
+
+/* Free buffers (of each size) kept in the shared pool. Beyond this,
+ * buffers are returned to the system. */
+#define PACKET_POOL_SHARED_MAX (1024)
+
+
+/*
+ * chitcpd_packet_alloc - Allocate a packet
+ *
+ * The contents of the packet are uninitialized.
+ *
+ * length: Size in bytes of the packet (TCP header and payload)
+ *
+ * Returns: A packet, with "length" bytes in packet->raw, and
+ *          PACKET_HEADROOM bytes available before them (see
+ *          chitcpd_packet_headroom), or NULL if there is no memory
+ *          for it
+ *
+ */
+tcp_packet_t *chitcpd_packet_alloc(size_t length);
+
+
+/*
+ * chitcpd_packet_copy - Allocate a copy of a packet
+ *
+ * packet: Packet to copy (which must have been allocated with
+ *         chitcpd_packet_alloc)
+ *
+ * Returns: A new packet, with the same contents (or NULL, if there is
+ *          no memory for it)
+ *
+ */
+tcp_packet_t *chitcpd_packet_copy(const tcp_packet_t *packet);
+
+
+/*
+ * chitcpd_packet_free - Return a packet to the pool
+ *
+ * packet: Packet allocated with chitcpd_packet_alloc (or NULL)
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_packet_free(tcp_packet_t *packet);
+
+
+/*
+ * chitcpd_packet_headroom - Space reserved in front of a packet
+ *
+ * packet: Packet allocated with chitcpd_packet_alloc
+ *
+ * Returns: Pointer to the PACKET_HEADROOM bytes right before packet->raw
+ *
+ */
+uint8_t *chitcpd_packet_headroom(tcp_packet_t *packet);
+
+#endif /* PACKET_POOL_H_ */
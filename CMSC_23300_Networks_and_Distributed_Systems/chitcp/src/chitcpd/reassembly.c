@@ -0,0 +1,178 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Reassembly queue for out-of-order segments (see reassembly.h)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "serverinfo.h"
+#include "reassembly.h"
+#include "chitcp/log.h"
+
+#define BLOCK_END(block) ((block)->seq + (block)->len)
+
+void chitcpd_reassembly_init(tcp_reassembly_t *rq)
+{
+    list_init(&rq->blocks);
+    rq->bytes = 0;
+    rq->insertions = 0;
+    rq->fin = FALSE;
+}
+
+void chitcpd_reassembly_free(tcp_reassembly_t *rq)
+{
+    while (!list_empty(&rq->blocks))
+        free(list_fetch(&rq->blocks));
+    list_destroy(&rq->blocks);
+    rq->bytes = 0;
+}
+
+void chitcpd_reassembly_insert(tcp_reassembly_t *rq, uint32_t seq, const uint8_t *data, uint32_t len)
+{
+    tcp_reassembly_block_t *block, *merged;
+    uint32_t start = seq, end = seq + len;
+    unsigned int first, last, nblocks = list_size(&rq->blocks);
+
+    if (len == 0)
+        return;
+
+    rq->insertions++;
+
+    /* Skip the blocks that end before the new data (and don't even
+     * touch it) */
+    for (first = 0; first < nblocks; first++)
+    {
+        block = list_get_at(&rq->blocks, first);
+        if (SEQ_GEQ(BLOCK_END(block), seq))
+            break;
+    }
+
+    /* Blocks [first, last) overlap or are adjacent to the new data,
+     * and will be merged with it */
+    for (last = first; last < nblocks; last++)
+    {
+        block = list_get_at(&rq->blocks, last);
+        if (SEQ_GT(block->seq, seq + len))
+            break;
+        if (SEQ_LT(block->seq, start))
+            start = block->seq;
+        if (SEQ_GT(BLOCK_END(block), end))
+            end = BLOCK_END(block);
+    }
+
+    /* Nothing new (a retransmission of data we already have) */
+    if (last - first == 1)
+    {
+        block = list_get_at(&rq->blocks, first);
+        if (block->seq == start && BLOCK_END(block) == end)
+        {
+            block->updated = rq->insertions;
+            return;
+        }
+    }
+
+    /* No room for another block. Data closer to RCV.NXT will be useful
+     * sooner, so we will make room by dropping the last block, unless
+     * the new data is the one that would go last. */
+    if (first == last && nblocks >= TCP_REASSEMBLY_MAX_BLOCKS && first == nblocks)
+        return;
+
+    /* If we are out of memory, the segment is dropped (the sender will
+     * have to retransmit it), and the queue is left as it was */
+    merged = malloc(sizeof(tcp_reassembly_block_t) + (end - start));
+    if (merged == NULL)
+    {
+        chilog(CRITICAL, "Could not allocate a %u-byte reassembly block", end - start);
+        return;
+    }
+
+    if (first == last && nblocks >= TCP_REASSEMBLY_MAX_BLOCKS)
+    {
+        block = list_get_at(&rq->blocks, nblocks - 1);
+        rq->bytes -= block->len;
+        list_delete_at(&rq->blocks, nblocks - 1);
+        free(block);
+    }
+
+    merged->seq = start;
+    merged->len = end - start;
+    merged->updated = rq->insertions;
+    memcpy(merged->data + (seq - start), data, len);
+
+    for (unsigned int i = first; i < last; i++)
+    {
+        block = list_get_at(&rq->blocks, first);
+        memcpy(merged->data + (block->seq - start), block->data, block->len);
+        rq->bytes -= block->len;
+        list_delete_at(&rq->blocks, first);
+        free(block);
+    }
+
+    list_insert_at(&rq->blocks, merged, first);
+    rq->bytes += merged->len;
+}
+
+int chitcpd_reassembly_release(tcp_reassembly_t *rq, uint32_t *rcv_nxt, circular_buffer_t *buf)
+{
+    tcp_reassembly_block_t *block;
+    uint32_t offset;
+    int nbytes, released = 0;
+
+    while (!list_empty(&rq->blocks))
+    {
+        block = list_get_at(&rq->blocks, 0);
+        if (SEQ_GT(block->seq, *rcv_nxt))
+            break;
+
+        if (SEQ_GT(BLOCK_END(block), *rcv_nxt))
+        {
+            offset = *rcv_nxt - block->seq;
+            nbytes = circular_buffer_write(buf, block->data + offset, block->len - offset, BUFFER_NONBLOCKING);
+            if (nbytes > 0)
+            {
+                *rcv_nxt += nbytes;
+                released += nbytes;
+            }
+        }
+
+        rq->bytes -= block->len;
+        list_delete_at(&rq->blocks, 0);
+        free(block);
+    }
+
+    return released;
+}
@@ -0,0 +1,154 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Reassembly queue for out-of-order segments.
+ *
+ *  Data that arrives ahead of RCV.NXT is held here, as a sorted list
+ *  of non-overlapping, non-adjacent blocks (overlapping or adjacent
+ *  data is coalesced into a single block), until the gap in front of
+ *  it is filled and it can be released into the receive buffer.
+ *
+ *  Only data within the receive window is queued, so the queue never
+ *  holds more bytes than the window, and the number of blocks is
+ *  limited to TCP_REASSEMBLY_MAX_BLOCKS.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef REASSEMBLY_H_
+#define REASSEMBLY_H_
+
+#include <stdint.h>
+#include "simclist.h"
+#include "chitcp/types.h"
+#include "chitcp/buffer.h"
+
+/* Maximum number of separate blocks (i.e., of holes in the sequence
+ * space) we keep track of. Limits the bookkeeping overhead when the
+ * peer sends many tiny out-of-order segments. */
+#define TCP_REASSEMBLY_MAX_BLOCKS (32)
+
+/* A contiguous run of out-of-order data */
+typedef struct tcp_reassembly_block
+{
+    uint32_t seq;
+    uint32_t len;
+    uint32_t updated;   /* Value of "insertions" when data was last added to it */
+    uint8_t data[];
+} tcp_reassembly_block_t;
+
+typedef struct tcp_reassembly
+{
+    /* Blocks (tcp_reassembly_block_t), in sequence number order */
+    list_t blocks;
+
+    /* Total number of bytes held */
+    uint32_t bytes;
+
+    /* Number of calls to chitcpd_reassembly_insert. Lets us tell which
+     * blocks were updated most recently (e.g., for SACK, see sack.h) */
+    uint32_t insertions;
+
+    /* A FIN that arrived ahead of RCV.NXT */
+    bool_t fin;
+    uint32_t fin_seq;
+} tcp_reassembly_t;
+
+
+/*
+ * chitcpd_reassembly_init - Initialize an empty reassembly queue
+ *
+ * rq: Reassembly queue
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_reassembly_init(tcp_reassembly_t *rq);
+
+
+/*
+ * chitcpd_reassembly_free - Free all the data held in a reassembly queue
+ *
+ * rq: Reassembly queue
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_reassembly_free(tcp_reassembly_t *rq);
+
+
+/*
+ * chitcpd_reassembly_insert - Queue out-of-order data
+ *
+ * The caller is responsible for only queueing data that is within the
+ * receive window. If the data would need a new block and the queue
+ * already has TCP_REASSEMBLY_MAX_BLOCKS blocks, the block furthest
+ * from RCV.NXT (which may be the new data) is discarded. If there is
+ * no memory for the new data, it is discarded, and the queue is left
+ * unchanged.
+ *
+ * rq: Reassembly queue
+ *
+ * seq: Sequence number of the first byte of data
+ *
+ * data: Data
+ *
+ * len: Number of bytes of data
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_reassembly_insert(tcp_reassembly_t *rq, uint32_t seq, const uint8_t *data, uint32_t len);
+
+
+/*
+ * chitcpd_reassembly_release - Release in-sequence data
+ *
+ * Writes the queued data that starts at rcv_nxt (if any) into the
+ * receive buffer, and discards any queued data before it.
+ *
+ * rq: Reassembly queue
+ *
+ * rcv_nxt: In: the next sequence number expected. Out: the next sequence
+ *          number expected after releasing the data.
+ *
+ * buf: Receive buffer. It must have room for the released data (which
+ *      is the case as long as only data within the window was queued).
+ *
+ * Returns: the number of bytes written to the receive buffer.
+ *
+ */
+int chitcpd_reassembly_release(tcp_reassembly_t *rq, uint32_t *rcv_nxt, circular_buffer_t *buf);
+
+#endif /* REASSEMBLY_H_ */
@@ -0,0 +1,153 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Selective acknowledgements (see sack.h)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "serverinfo.h"
+#include "sack.h"
+
+/* See sack.h */
+int chitcpd_sack_blocks(const tcp_reassembly_t *rq, tcp_sack_block_t *blocks, int max)
+{
+    tcp_reassembly_block_t *block, *newest;
+    bool_t reported[TCP_REASSEMBLY_MAX_BLOCKS] = { FALSE };
+    unsigned int nblocks = list_size(&rq->blocks), newest_pos = 0;
+    int n;
+
+    for (n = 0; n < max && n < nblocks; n++)
+    {
+        newest = NULL;
+        for (unsigned int i = 0; i < nblocks; i++)
+        {
+            block = list_get_at(&rq->blocks, i);
+            if (!reported[i] && (newest == NULL || (int32_t) (block->updated - newest->updated) > 0))
+            {
+                newest = block;
+                newest_pos = i;
+            }
+        }
+
+        reported[newest_pos] = TRUE;
+        blocks[n].left = newest->seq;
+        blocks[n].right = newest->seq + newest->len;
+    }
+
+    return n;
+}
+
+/* See sack.h */
+bool_t chitcpd_sack_update(tcp_data_t *tcp_data, const tcp_sack_block_t *blocks, int nblocks)
+{
+    list_t *queue = &tcp_data->retransmission_queue;
+    unsigned int nsegments = list_size(queue);
+    tcp_segment_t *segment;
+    uint32_t sacked_bytes = 0, sacked_segments = 0;
+    bool_t updated = FALSE;
+
+    for (int b = 0; b < nblocks; b++)
+    {
+        /* Blocks that don't make sense, and D-SACK blocks (RFC 2883),
+         * which report data that has already been acknowledged */
+        if (SEQ_GEQ(blocks[b].left, blocks[b].right) ||
+            SEQ_LT(blocks[b].left, tcp_data->SND_UNA) ||
+            SEQ_GT(blocks[b].right, tcp_data->SND_NXT))
+            continue;
+
+        for (unsigned int i = 0; i < nsegments; i++)
+        {
+            segment = list_get_at(queue, i);
+            if (SEQ_GEQ(segment->seq, blocks[b].right))
+                break;
+
+            if (!segment->sacked && segment->len > 0 &&
+                SEQ_GEQ(segment->seq, blocks[b].left) &&
+                SEQ_LEQ(segment->seq + segment->len, blocks[b].right))
+            {
+                segment->sacked = TRUE;
+                updated = TRUE;
+            }
+        }
+    }
+
+    for (unsigned int i = 0; i < nsegments; i++)
+    {
+        segment = list_get_at(queue, i);
+        if (segment->sacked)
+        {
+            sacked_bytes += segment->len;
+            sacked_segments++;
+        }
+    }
+
+    /* A segment is lost if enough of what was sent after it has
+     * made it to the peer */
+    for (unsigned int i = 0; i < nsegments && sacked_segments > 0; i++)
+    {
+        segment = list_get_at(queue, i);
+        if (segment->sacked)
+        {
+            sacked_bytes -= segment->len;
+            sacked_segments--;
+        }
+        else if (sacked_segments >= TCP_DUPTHRESH || sacked_bytes > (TCP_DUPTHRESH - 1) * tcp_data->SMSS)
+            segment->lost = TRUE;
+    }
+
+    return updated;
+}
+
+/* See sack.h */
+uint32_t chitcpd_sack_pipe(tcp_data_t *tcp_data)
+{
+    list_t *queue = &tcp_data->retransmission_queue;
+    tcp_segment_t *segment;
+    uint32_t pipe = 0;
+
+    for (unsigned int i = 0; i < list_size(queue); i++)
+    {
+        segment = list_get_at(queue, i);
+        if (segment->sacked)
+            continue;
+
+        if (!segment->lost)
+            pipe += TCP_SEGMENT_END(segment) - segment->seq;
+        if (segment->retransmitted)
+            pipe += TCP_SEGMENT_END(segment) - segment->seq;
+    }
+
+    return pipe;
+}
@@ -0,0 +1,118 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Selective acknowledgements (RFC 2018).
+ *
+ *  On the receiving side, the blocks of out-of-order data held in the
+ *  reassembly queue are reported to the peer in a SACK option on every
+ *  ACK, most recently updated block first.
+ *
+ *  On the sending side, the SACK blocks the peer reports are recorded
+ *  in a scoreboard (the "sacked" and "lost" flags of the segments in
+ *  the retransmission queue), which tcp.c uses to resend only the
+ *  segments that are actually missing, all in the same round trip,
+ *  following the loss recovery algorithm in RFC 6675.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SACK_H_
+#define SACK_H_
+
+#include <stdint.h>
+#include "chitcp/types.h"
+#include "chitcp/packet.h"
+#include "reassembly.h"
+
+struct tcp_data;
+
+
+/*
+ * chitcpd_sack_blocks - Generate the SACK blocks to send to the peer
+ *
+ * The first block is the one that was updated most recently (i.e., the
+ * one that contains the segment that triggered the ACK), followed by
+ * the others in order of how recently they were updated, as suggested
+ * in RFC 2018, section 4.
+ *
+ * rq: Reassembly queue
+ *
+ * blocks: Array where the blocks will be stored
+ *
+ * max: Maximum number of blocks to generate
+ *
+ * Returns: the number of blocks stored in "blocks"
+ *
+ */
+int chitcpd_sack_blocks(const tcp_reassembly_t *rq, tcp_sack_block_t *blocks, int max);
+
+
+/*
+ * chitcpd_sack_update - Update the scoreboard with the peer's SACK blocks
+ *
+ * Marks the segments in the retransmission queue that are covered by
+ * a block as SACKed, and then marks as lost every segment that has at
+ * least TCP_DUPTHRESH SACKed segments (or more than
+ * (TCP_DUPTHRESH - 1) * SMSS SACKed bytes) after it (the IsLost
+ * test in RFC 6675, section 4). Segments are never unmarked. Blocks
+ * outside [SND.UNA, SND.NXT] are ignored.
+ *
+ * tcp_data: TCP data of the socket
+ *
+ * blocks: SACK blocks from the peer
+ *
+ * nblocks: Number of blocks
+ *
+ * Returns: TRUE if any segment was SACKed for the first time,
+ *          FALSE otherwise.
+ *
+ */
+bool_t chitcpd_sack_update(struct tcp_data *tcp_data, const tcp_sack_block_t *blocks, int nblocks);
+
+
+/*
+ * chitcpd_sack_pipe - Estimate the number of bytes in flight
+ *
+ * As defined in RFC 6675, section 4: segments that have been neither
+ * SACKed nor deemed lost count as in flight, and so do the ones that
+ * have been retransmitted during the current recovery.
+ *
+ * tcp_data: TCP data of the socket
+ *
+ * Returns: the estimate, in bytes
+ *
+ */
+uint32_t chitcpd_sack_pipe(struct tcp_data *tcp_data);
+
+#endif /* SACK_H_ */
@@ -112,51 +112,71 @@ typedef struct network_thread_args
 int chitcpd_server_init(serverinfo_t *si)
 {
     /* TODO: Make this configurable */
-    si->chisocket_table_size = DEFAULT_MAX_SOCKETS;
+    if (si->chisocket_table_max == 0)
+        si->chisocket_table_max = DEFAULT_MAX_SOCKETS;
+    if (si->connection_table_max == 0)
+        si->connection_table_max = DEFAULT_MAX_CONNECTIONS;
     si->port_table_size = DEFAULT_MAX_PORTS;
-    si->connection_table_size = DEFAULT_MAX_CONNECTIONS;
     si->ephemeral_port_start = DEFAULT_EPHEMERAL_PORT_START;
 
-    /* Initialize chisocket table */
+    /* Initialize chisocket table. Only the array of pointers to the
+     * segments is allocated now (see chitcpd_allocate_socket) */
     pthread_mutex_init(&si->lock_chisocket_table, NULL);
-    si->chisocket_table = calloc(si->chisocket_table_size, sizeof(chisocketentry_t));
+    si->chisocket_table_size = 0;
+    si->chisocket_free_head = -1;
+    si->chisocket_segments = calloc((si->chisocket_table_max + CHISOCKET_SEGMENT_SIZE - 1) / CHISOCKET_SEGMENT_SIZE,
+                                    sizeof(chisocketentry_t*));
 
-    if(si->chisocket_table == NULL)
+    if(si->chisocket_segments == NULL)
     {
         perror("Could not initialize chisocket table");
         return CHITCP_ENOMEM;
     }
 
-    for(int i=0; i< si->chisocket_table_size; i++)
-    {
-        pthread_mutex_init(&si->chisocket_table[i].lock_debug_monitor, NULL);
-        si->chisocket_table[i].available = TRUE;
-    }
-
 
-    /* Initialize connection table */
+    /* Initialize connection table (likewise, see
+     * chitcpd_get_available_connection_entry) */
     pthread_mutex_init(&si->lock_connection_table, NULL);
-    si->connection_table = calloc(si->connection_table_size, sizeof(tcpconnentry_t));
+    si->connection_table_size = 0;
+    si->connection_segments = calloc((si->connection_table_max + CONNECTION_SEGMENT_SIZE - 1) / CONNECTION_SEGMENT_SIZE,
+                                     sizeof(tcpconnentry_t*));
 
-    if(si->connection_table == NULL)
+    if(si->connection_segments == NULL)
     {
         perror("Could not initialize connection table");
         return CHITCP_ENOMEM;
     }
 
-    for(int i=0; i< si->connection_table_size; i++)
-        si->connection_table[i].available = TRUE;
+    /* Initialize connection hash table */
+    pthread_mutex_init(&si->lock_socket_hash, NULL);
+    si->socket_hash_size = SOCKET_HASH_INITIAL_SIZE;
+    si->socket_hash_count = 0;
+    si->socket_hash = calloc(si->socket_hash_size, sizeof(chisocketentry_t*));
+
+    if(si->socket_hash == NULL)
+    {
+        perror("Could not initialize connection hash table");
+        return CHITCP_ENOMEM;
+    }
 
     /* Initialize port table */
-    /* This is an array of pointers, and they are all set to NULL */
-    si->port_table = calloc(si->port_table_size, sizeof(chisocketentry_t*));
+    /* Pages of the port table are allocated when a port in them is
+     * first taken (see chitcpd_reserve_port), so they all start as NULL */
+    memset(si->port_pages, 0, sizeof(si->port_pages));
+
+    pthread_mutex_init(&si->lock_port_table, NULL);
+    si->port_bitmap = calloc((si->port_table_size + 63) / 64, sizeof(uint64_t));
 
-    if(si->port_table == NULL)
+    if(si->port_bitmap == NULL)
     {
-        perror("Could not initialize port table");
+        perror("Could not initialize port bitmap");
         return CHITCP_ENOMEM;
     }
 
+    chitcpd_timer_wheel_init(&si->timers);
+    if (si->msl == 0)
+        si->msl = TCP_MSL;
+
     pthread_mutex_init(&si->lock_state, NULL);
     pthread_cond_init(&si->cv_state, NULL);
 
@@ -174,6 +194,13 @@ int chitcpd_server_start(serverinfo_t *si)
     pthread_cond_broadcast(&si->cv_state);
     pthread_mutex_unlock(&si->lock_state);
 
+    /* Start timer thread */
+    rc = chitcpd_timer_wheel_start(&si->timers);
+    if(rc != 0)
+    {
+        return rc;
+    }
+
     /* Start server thread */
     rc = chitcpd_server_start_thread(si);
     if(rc != 0)
@@ -225,6 +252,7 @@ int chitcpd_server_wait(serverinfo_t *si)
     /* TODO: Retrieve return values */
     pthread_join(si->server_thread, NULL);
     pthread_join(si->network_thread, NULL);
+    chitcpd_timer_wheel_stop(&si->timers);
 
     pthread_mutex_lock(&si->lock_state);
     si->state = CHITCPD_STATE_STOPPED;
@@ -270,9 +298,27 @@ int chitcpd_server_stop(serverinfo_t *si)
 
 int chitcpd_server_free(serverinfo_t *si)
 {
-    free(si->chisocket_table);
-    free(si->connection_table);
-    free(si->port_table);
+    for(uint32_t i=0; i < si->chisocket_table_size; i += CHISOCKET_SEGMENT_SIZE)
+        free(si->chisocket_segments[i / CHISOCKET_SEGMENT_SIZE]);
+    free(si->chisocket_segments);
+
+    for(uint32_t i=0; i < si->connection_table_size; i++)
+    {
+        pthread_mutex_destroy(&CONNECTION_ENTRY(si, i)->lock_send);
+        pthread_cond_destroy(&CONNECTION_ENTRY(si, i)->cv_send);
+    }
+    for(uint32_t i=0; i < si->connection_table_size; i += CONNECTION_SEGMENT_SIZE)
+        free(si->connection_segments[i / CONNECTION_SEGMENT_SIZE]);
+    free(si->connection_segments);
+
+    for(int i=0; i < DEFAULT_MAX_PORTS / PORT_TABLE_PAGE_SIZE; i++)
+        free(si->port_pages[i]);
+    free(si->port_bitmap);
+    pthread_mutex_destroy(&si->lock_port_table);
+    free(si->socket_hash);
+    pthread_mutex_destroy(&si->lock_socket_hash);
+
+    chitcpd_timer_wheel_free(&si->timers);
 
     pthread_mutex_destroy(&si->lock_state);
     pthread_cond_destroy(&si->cv_state);
@@ -578,6 +624,8 @@ void* chitcpd_server_network_thread_func(void *args)
         chitcp_addr_str((struct sockaddr *) &client_addr, addr_str, sizeof(addr_str));
         chilog(INFO, "TCP connection received from %s", addr_str);
 
+        chitcpd_connection_set_nodelay(realsocket);
+
         /* Check whether the connection already exists. */
         connection = chitcpd_get_connection(si, (struct sockaddr *) &client_addr);
         if (connection != NULL)
@@ -633,7 +681,7 @@ void* chitcpd_server_network_thread_func(void *args)
      * corresponding connection threads. */
     for(int i=0; i < si->connection_table_size; i++)
     {
-        connection = &si->connection_table[i];
+        connection = CONNECTION_ENTRY(si, i);
         if(!connection->available)
         {
             shutdown(connection->realsocket_recv, SHUT_RDWR);
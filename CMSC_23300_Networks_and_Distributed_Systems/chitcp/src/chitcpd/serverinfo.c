@@ -40,6 +40,7 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include "serverinfo.h"
@@ -47,6 +48,7 @@
 #include "chitcp/debug_api.h"
 #include "chitcp/log.h"
 #include "breakpoint.h"
+#include "packet_pool.h"
 
 
 
@@ -73,15 +75,38 @@ void chitcpd_set_header_ports(chisocketentry_t *entry, tcphdr_t *header)
 
 /* See serverinfo.h */
 int chitcpd_tcp_packet_create(chisocketentry_t *entry, tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len)
+{
+    return chitcpd_tcp_packet_create_options(entry, packet, NULL, payload, payload_len);
+}
+
+/* See serverinfo.h */
+int chitcpd_tcp_packet_create_options(chisocketentry_t *entry, tcp_packet_t *packet, const tcp_options_t *options,
+                                      const uint8_t* payload, uint16_t payload_len)
 {
     int packet_len;
 
-    packet_len = chitcp_tcp_packet_create(packet, payload, payload_len);
+    packet_len = chitcp_tcp_packet_create_options(packet, options, payload, payload_len);
     chitcpd_set_header_ports(entry, TCP_PACKET_HEADER(packet));
 
     return packet_len;
 }
 
+/* See serverinfo.h */
+tcp_packet_t *chitcpd_tcp_packet_alloc(chisocketentry_t *entry, const tcp_options_t *options,
+                                       const uint8_t* payload, uint16_t payload_len)
+{
+    tcp_packet_t *packet;
+
+    packet = chitcpd_packet_alloc(TCP_HEADER_MAX_SIZE + payload_len);
+    if (packet == NULL)
+        return NULL;
+
+    chitcp_tcp_packet_fill_options(packet, options, payload, payload_len);
+    chitcpd_set_header_ports(entry, TCP_PACKET_HEADER(packet));
+
+    return packet;
+}
+
 /* See serverinfo.h */
 void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_state_t newstate)
 {
@@ -104,6 +129,45 @@ void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_sta
     }
 }
 
+/* Adds a segment to the socket table, and makes its entries available.
+ * Must be called with the socket table locked.
+ *
+ * Returns: CHITCP_OK, or CHITCP_ENOMEM if the table is as large as it
+ *          can be (or the segment can't be allocated)
+ */
+static int chitcpd_grow_socket_table(serverinfo_t *si)
+{
+    uint32_t first = si->chisocket_table_size;
+    chisocketentry_t *segment;
+
+    if(first + CHISOCKET_SEGMENT_SIZE > si->chisocket_table_max)
+        return CHITCP_ENOMEM;
+
+    segment = calloc(CHISOCKET_SEGMENT_SIZE, sizeof(chisocketentry_t));
+    if(segment == NULL)
+        return CHITCP_ENOMEM;
+
+    for(int i = 0; i < CHISOCKET_SEGMENT_SIZE; i++)
+    {
+        pthread_mutex_init(&segment[i].lock_debug_monitor, NULL);
+        segment[i].available = TRUE;
+        segment[i].sockfd = first + i;
+        segment[i].next_free = (i + 1 < CHISOCKET_SEGMENT_SIZE) ? (int) (first + i + 1) : si->chisocket_free_head;
+    }
+
+    si->chisocket_segments[first / CHISOCKET_SEGMENT_SIZE] = segment;
+
+    /* Threads that look up sockets without locking the table must see
+     * the segment before they see the new size */
+    __sync_synchronize();
+    si->chisocket_table_size = first + CHISOCKET_SEGMENT_SIZE;
+    si->chisocket_free_head = first;
+
+    chilog(DEBUG, "Socket table grown to %u entries", si->chisocket_table_size);
+
+    return CHITCP_OK;
+}
+
 /* See serverinfo.h */
 int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
 {
@@ -112,17 +176,18 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
 
     pthread_mutex_lock(&si->lock_chisocket_table);
 
-    /* Find available slot in socket table */
-    for(int i=0; i < si->chisocket_table_size; i++)
+    if(si->chisocket_free_head == -1)
+        chitcpd_grow_socket_table(si);
+
+    /* Take the first entry in the list of available entries */
+    if(si->chisocket_free_head != -1)
     {
-        if(si->chisocket_table[i].available)
-        {
-            si->chisocket_table[i].available = FALSE;
+        *socket_index = si->chisocket_free_head;
+        entry = SOCKET_ENTRY(si, *socket_index);
+        si->chisocket_free_head = entry->next_free;
 
-            entry = &si->chisocket_table[i];
-            *socket_index = i;
-            break;
-        }
+        entry->available = FALSE;
+        entry->next_free = -1;
     }
     pthread_mutex_unlock(&si->lock_chisocket_table);
 
@@ -139,6 +204,10 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
 
         entry->actpas_type = SOCKET_UNINITIALIZED;
         entry->tcp_state = CLOSED;
+        entry->nodelay = FALSE;
+        entry->congestion_control = NULL;
+        entry->sndbuf = 0;
+        entry->rcvbuf = 0;
 
         pthread_mutex_init(&entry->lock_tcp_state, NULL);
         pthread_cond_init(&entry->cv_tcp_state, NULL);
@@ -152,6 +221,7 @@ int chitcpd_allocate_socket(serverinfo_t *si, int *socket_index)
 /* See serverinfo.h */
 int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
 {
+    int sockfd;
     uint16_t port;
     struct sockaddr *addr;
 
@@ -169,6 +239,18 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
 
         circular_buffer_free(&tcp_data->send);
         circular_buffer_free(&tcp_data->recv);
+        chitcpd_reassembly_free(&tcp_data->reassembly);
+        while (!list_empty(&tcp_data->retransmission_queue))
+            free(list_fetch(&tcp_data->retransmission_queue));
+        list_destroy(&tcp_data->retransmission_queue);
+        while (tcp_data->spare_segments != NULL)
+        {
+            tcp_segment_t *segment = tcp_data->spare_segments;
+            tcp_data->spare_segments = segment->next_spare;
+            free(segment);
+        }
+        while (!list_empty(&tcp_data->pending_packets))
+            chitcpd_packet_free(list_fetch(&tcp_data->pending_packets));
         list_destroy(&tcp_data->pending_packets);
         pthread_mutex_destroy(&tcp_data->lock_pending_packets);
         pthread_cond_destroy(&tcp_data->cv_pending_packets);
@@ -181,105 +263,335 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry)
     pthread_mutex_destroy(&entry->lock_tcp_state);
     pthread_cond_destroy(&entry->cv_tcp_state);
 
-    /* Mark local port as available */
+    chitcpd_unhash_socket(si, entry);
+
+    /* Mark local port as available (unless the port belongs to the
+     * listening socket this socket was accepted from) */
     addr = (struct sockaddr*) &entry->local_addr;
-    if ((port = chitcp_ntohs(chitcp_get_addr_port(addr))) >= 0)
-        si->port_table[port] = NULL;
+    port = chitcp_ntohs(chitcp_get_addr_port(addr));
+    chitcpd_release_port(si, port, entry);
 
+    sockfd = entry->sockfd;
     memset(entry, 0, sizeof(chisocketentry_t));
+    entry->sockfd = sockfd;
 
+    /* Put the entry back in the list of available entries */
+    pthread_mutex_lock(&si->lock_chisocket_table);
     entry->available = TRUE;
+    entry->next_free = si->chisocket_free_head;
+    si->chisocket_free_head = SOCKET_NO(si, entry);
+    pthread_mutex_unlock(&si->lock_chisocket_table);
+
+    return CHITCP_OK;
+}
+
+/* See serverinfo.h */
+chisocketentry_t *chitcpd_port_owner(serverinfo_t *si, uint16_t port)
+{
+    chisocketentry_t **page = si->port_pages[port / PORT_TABLE_PAGE_SIZE];
+
+    return page ? page[port % PORT_TABLE_PAGE_SIZE] : NULL;
+}
+
+/* Assigns a (free) port to a socket, allocating the port's page of the
+ * port table if necessary. Must be called with the port table locked.
+ *
+ * Returns: CHITCP_OK, or CHITCP_ENOMEM if the page can't be allocated
+ */
+static int chitcpd_take_port(serverinfo_t *si, uint16_t port, chisocketentry_t *entry)
+{
+    chisocketentry_t ***page = &si->port_pages[port / PORT_TABLE_PAGE_SIZE];
+
+    if(*page == NULL)
+    {
+        *page = calloc(PORT_TABLE_PAGE_SIZE, sizeof(chisocketentry_t*));
+        if(*page == NULL)
+            return CHITCP_ENOMEM;
+    }
+
+    (*page)[port % PORT_TABLE_PAGE_SIZE] = entry;
+    si->port_bitmap[port / 64] |= 1ULL << (port % 64);
 
     return CHITCP_OK;
 }
 
 /* See serverinfo.h */
-int chitcpd_find_ephemeral_port(serverinfo_t *si)
+int chitcpd_reserve_port(serverinfo_t *si, uint16_t port, chisocketentry_t *entry)
 {
-    uint16_t port = -1;
+    int ret = CHITCP_EINVAL;
+
+    pthread_mutex_lock(&si->lock_port_table);
+    if(chitcpd_port_owner(si, port) == NULL)
+        ret = chitcpd_take_port(si, port, entry);
+    pthread_mutex_unlock(&si->lock_port_table);
 
-    for(int i = si->ephemeral_port_start; i < si->port_table_size; i++)
+    return ret;
+}
+
+/* See serverinfo.h */
+void chitcpd_release_port(serverinfo_t *si, uint16_t port, chisocketentry_t *entry)
+{
+    pthread_mutex_lock(&si->lock_port_table);
+    if(chitcpd_port_owner(si, port) == entry)
     {
-        if(si->port_table[i] == NULL)
+        si->port_pages[port / PORT_TABLE_PAGE_SIZE][port % PORT_TABLE_PAGE_SIZE] = NULL;
+        si->port_bitmap[port / 64] &= ~(1ULL << (port % 64));
+    }
+    pthread_mutex_unlock(&si->lock_port_table);
+}
+
+/* The first free port in [from, to), or -1 if there is none. Must be
+ * called with the port table locked. */
+static int chitcpd_find_free_port(serverinfo_t *si, uint32_t from, uint32_t to)
+{
+    uint32_t port = from;
+    uint64_t free_ports;
+
+    while(port < to)
+    {
+        /* Free ports in this word, from "port" onwards */
+        free_ports = ~si->port_bitmap[port / 64] & (~0ULL << (port % 64));
+        if(free_ports != 0)
         {
-            port = i;
-            break;
+            port = (port & ~63u) + __builtin_ctzll(free_ports);
+            return port < to ? (int) port : -1;
         }
+        port = (port & ~63u) + 64;
+    }
+
+    return -1;
+}
+
+/* See serverinfo.h */
+int chitcpd_find_ephemeral_port(serverinfo_t *si, chisocketentry_t *entry)
+{
+    uint32_t start, nports;
+    int port;
+
+    if(si->ephemeral_port_start >= si->port_table_size)
+        return -1;
+
+    nports = si->port_table_size - si->ephemeral_port_start;
+    start = si->ephemeral_port_start + rand() % nports;
+
+    pthread_mutex_lock(&si->lock_port_table);
+
+    port = chitcpd_find_free_port(si, start, si->port_table_size);
+    if(port == -1)
+        port = chitcpd_find_free_port(si, si->ephemeral_port_start, start);
+
+    if(port != -1)
+    {
+        assert(chitcpd_port_owner(si, port) == NULL);
+        if(chitcpd_take_port(si, port, entry) != CHITCP_OK)
+            port = -1;
     }
 
+    pthread_mutex_unlock(&si->lock_port_table);
+
     return port;
 }
 
+/* The finalizer from MurmurHash3, which mixes all the bits of h */
+static uint32_t chitcpd_hash_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
 
-/* See serverinfo.h */
-/* This implementation is based on the implementation of in_pcblookup in
- * TCP/IP Illustrated, Volume 2.
- */
-chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, bool_t exact_match_only)
+/* The hash of a socket covers its local port and its remote address and
+ * port, but not its local address: sockets created by connect() are
+ * bound to the ANY address (see the CONNECT handler), and must be found
+ * no matter which local address the packet was sent to. */
+static uint32_t chitcpd_socket_hash(struct sockaddr *local_addr, struct sockaddr *remote_addr)
 {
-    assert(local_addr->sa_family == AF_INET || local_addr->sa_family == AF_INET6);
-    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
-    assert(local_addr->sa_family == remote_addr->sa_family);
+    uint32_t h;
 
-    int max_nwildcards = 3;
-    chisocketentry_t *match = NULL;
-    for(int i=0; i < si->chisocket_table_size; i++)
+    if (remote_addr->sa_family == AF_INET)
+        h = ((struct sockaddr_in *) remote_addr)->sin_addr.s_addr;
+    else
     {
-        chisocketentry_t *this_entry = &si->chisocket_table[i];
-        int nwildcards = 0;
+        uint32_t *words = (uint32_t *) &((struct sockaddr_in6 *) remote_addr)->sin6_addr;
+        h = words[0] ^ words[1] ^ words[2] ^ words[3];
+    }
 
-        if(this_entry->available)
-            continue;
+    /* The address is mixed before the ports are added, so that they
+     * can't cancel each other out */
+    h = chitcpd_hash_mix(h);
+    h ^= ((uint32_t) chitcp_get_addr_port(local_addr) << 16) | chitcp_get_addr_port(remote_addr);
 
-        /* If the families differ, this is not the socket we're looking for */
-        if(local_addr->sa_family != this_entry->local_addr.ss_family)
-            continue;
+    return chitcpd_hash_mix(h);
+}
 
-        if(remote_addr->sa_family != this_entry->remote_addr.ss_family)
-            continue;
+static uint32_t chitcpd_socket_bucket(serverinfo_t *si, chisocketentry_t *entry)
+{
+    return chitcpd_socket_hash((struct sockaddr *) &entry->local_addr,
+                               (struct sockaddr *) &entry->remote_addr) & (si->socket_hash_size - 1);
+}
 
-        /* Check whether the local ports match */
-        if(chitcp_addr_port_cmp(local_addr, (struct sockaddr *) &this_entry->local_addr))
-            continue;
+/* Doubles the number of buckets. Must be called with the table locked. */
+static void chitcpd_socket_hash_grow(serverinfo_t *si)
+{
+    chisocketentry_t **old_hash = si->socket_hash;
+    uint32_t old_size = si->socket_hash_size;
+    chisocketentry_t **new_hash;
+    chisocketentry_t *entry, *next;
 
-        /* Check whether the local address matches, accounting for
-         * the fact that the socket could have a wildcard local address */
-        if(chitcp_addr_is_any((struct sockaddr *) &this_entry->local_addr))
-        {
-            if(!chitcp_addr_is_any(local_addr))
-                nwildcards++;
-        }
-        else
-        {
-            if(chitcp_addr_is_any(local_addr))
-                nwildcards++;
-            else if (chitcp_addr_cmp(local_addr, (struct sockaddr *) &this_entry->local_addr))
-                continue;
-        }
+    new_hash = calloc(2 * old_size, sizeof(chisocketentry_t*));
+    if (new_hash == NULL)
+        return; /* Keep going with longer chains */
 
-        /* Likewise for the remote address, but checking the ports too */
-        if(chitcp_addr_is_any((struct sockaddr *) &this_entry->remote_addr))
-        {
-            if(!chitcp_addr_is_any(remote_addr))
-                nwildcards++;
-        }
-        else
+    si->socket_hash = new_hash;
+    si->socket_hash_size = 2 * old_size;
+
+    for (uint32_t i = 0; i < old_size; i++)
+        for (entry = old_hash[i]; entry != NULL; entry = next)
         {
-            if(chitcp_addr_is_any(remote_addr))
-                nwildcards++;
-            else if (chitcp_addr_cmp(remote_addr, (struct sockaddr *) &this_entry->remote_addr) ||
-                     chitcp_addr_port_cmp(remote_addr, (struct sockaddr *) &this_entry->remote_addr))
-                continue;
+            uint32_t bucket = chitcpd_socket_bucket(si, entry);
+
+            next = entry->hash_next;
+            entry->hash_next = new_hash[bucket];
+            new_hash[bucket] = entry;
         }
 
-        /* If we're looking for an exact match only, we're not
-         * interested in matches with wildcards */
-        if(nwildcards > 0 && exact_match_only)
+    free(old_hash);
+}
+
+/* See serverinfo.h */
+void chitcpd_hash_socket(serverinfo_t *si, chisocketentry_t *entry)
+{
+    uint32_t bucket;
+
+    pthread_mutex_lock(&si->lock_socket_hash);
+
+    if (!entry->hashed)
+    {
+        if (si->socket_hash_count >= si->socket_hash_size)
+            chitcpd_socket_hash_grow(si);
+
+        bucket = chitcpd_socket_bucket(si, entry);
+        entry->hash_next = si->socket_hash[bucket];
+        si->socket_hash[bucket] = entry;
+        entry->hashed = TRUE;
+        si->socket_hash_count++;
+    }
+
+    pthread_mutex_unlock(&si->lock_socket_hash);
+}
+
+/* See serverinfo.h */
+void chitcpd_unhash_socket(serverinfo_t *si, chisocketentry_t *entry)
+{
+    chisocketentry_t **p;
+
+    pthread_mutex_lock(&si->lock_socket_hash);
+
+    if (entry->hashed)
+    {
+        for (p = &si->socket_hash[chitcpd_socket_bucket(si, entry)]; *p != NULL; p = &(*p)->hash_next)
+            if (*p == entry)
+            {
+                *p = entry->hash_next;
+                break;
+            }
+
+        entry->hash_next = NULL;
+        entry->hashed = FALSE;
+        si->socket_hash_count--;
+    }
+
+    pthread_mutex_unlock(&si->lock_socket_hash);
+}
+
+/* Checks whether a socket matches a pair of addresses.
+ *
+ * Returns: -1 if it doesn't. Otherwise, the number of wildcard addresses
+ *          (in either the socket or the pair of addresses) needed for
+ *          the match.
+ *
+ * This is based on the implementation of in_pcblookup in TCP/IP
+ * Illustrated, Volume 2.
+ */
+static int chitcpd_socket_match(chisocketentry_t *entry, struct sockaddr *local_addr, struct sockaddr *remote_addr)
+{
+    int nwildcards = 0;
+
+    if(entry->available)
+        return -1;
+
+    /* If the families differ, this is not the socket we're looking for */
+    if(local_addr->sa_family != entry->local_addr.ss_family)
+        return -1;
+
+    if(remote_addr->sa_family != entry->remote_addr.ss_family)
+        return -1;
+
+    /* Check whether the local ports match */
+    if(chitcp_addr_port_cmp(local_addr, (struct sockaddr *) &entry->local_addr))
+        return -1;
+
+    /* Check whether the local address matches, accounting for
+     * the fact that the socket could have a wildcard local address */
+    if(chitcp_addr_is_any((struct sockaddr *) &entry->local_addr))
+    {
+        if(!chitcp_addr_is_any(local_addr))
+            nwildcards++;
+    }
+    else
+    {
+        if(chitcp_addr_is_any(local_addr))
+            nwildcards++;
+        else if (chitcp_addr_cmp(local_addr, (struct sockaddr *) &entry->local_addr))
+            return -1;
+    }
+
+    /* Likewise for the remote address, but checking the ports too */
+    if(chitcp_addr_is_any((struct sockaddr *) &entry->remote_addr))
+    {
+        if(!chitcp_addr_is_any(remote_addr))
+            nwildcards++;
+    }
+    else
+    {
+        if(chitcp_addr_is_any(remote_addr))
+            nwildcards++;
+        else if (chitcp_addr_cmp(remote_addr, (struct sockaddr *) &entry->remote_addr) ||
+                 chitcp_addr_port_cmp(remote_addr, (struct sockaddr *) &entry->remote_addr))
+            return -1;
+    }
+
+    return nwildcards;
+}
+
+/* See serverinfo.h */
+chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, bool_t exact_match_only)
+{
+    assert(local_addr->sa_family == AF_INET || local_addr->sa_family == AF_INET6);
+    assert(remote_addr->sa_family == AF_INET || remote_addr->sa_family == AF_INET6);
+    assert(local_addr->sa_family == remote_addr->sa_family);
+
+    int max_nwildcards = 3, nwildcards;
+    chisocketentry_t *match = NULL, *entry;
+    uint16_t port;
+
+    /* Connected sockets */
+    pthread_mutex_lock(&si->lock_socket_hash);
+    entry = si->socket_hash[chitcpd_socket_hash(local_addr, remote_addr) & (si->socket_hash_size - 1)];
+    for (; entry != NULL; entry = entry->hash_next)
+    {
+        nwildcards = chitcpd_socket_match(entry, local_addr, remote_addr);
+
+        if(nwildcards < 0 || (nwildcards > 0 && exact_match_only))
             continue;
 
         if(nwildcards < max_nwildcards)
         {
-            match = this_entry;
+            match = entry;
             max_nwildcards = nwildcards;
 
             /* If we have an exact match, we've found what we're
@@ -288,6 +600,22 @@ chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local
                 break;
         }
     }
+    pthread_mutex_unlock(&si->lock_socket_hash);
+
+    if(max_nwildcards == 0)
+        return match;
+
+    /* The socket bound to the port (a listening socket, if the packet
+     * is the start of a new connection) */
+    port = chitcp_ntohs(chitcp_get_addr_port(local_addr));
+    entry = chitcpd_port_owner(si, port);
+    if(entry != NULL)
+    {
+        nwildcards = chitcpd_socket_match(entry, local_addr, remote_addr);
+
+        if(nwildcards >= 0 && nwildcards < max_nwildcards && !(nwildcards > 0 && exact_match_only))
+            match = entry;
+    }
 
     return match;
 }
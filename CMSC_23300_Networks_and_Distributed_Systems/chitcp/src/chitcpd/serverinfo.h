@@ -44,6 +44,7 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <pthread.h>
 
 #include "simclist.h"
@@ -52,13 +53,45 @@
 #include "chitcp/packet.h"
 #include "chitcp/debug_api.h"
 
-#define DEFAULT_MAX_SOCKETS (1024u)
+#define DEFAULT_MAX_SOCKETS (1u << 20)
 #define DEFAULT_MAX_PORTS (65536u)
-#define DEFAULT_MAX_CONNECTIONS (1024u)
+#define DEFAULT_MAX_CONNECTIONS (1u << 16)
 #define DEFAULT_EPHEMERAL_PORT_START (49152u)
 
+/* The socket and connection tables are split into segments of
+ * this many entries, which are only allocated when needed (see
+ * chitcpd_allocate_socket). Entries never move, so pointers to them
+ * (and socket descriptors) stay valid as the tables grow. */
+#define CHISOCKET_SEGMENT_SIZE (256u)
+#define CONNECTION_SEGMENT_SIZE (16u)
+
+/* Likewise, the port table is split into pages of this many ports */
+#define PORT_TABLE_PAGE_SIZE (256u)
+
+/* Initial number of buckets in the connection hash table (see
+ * chitcpd_hash_socket). It doubles whenever there are more connected
+ * sockets than buckets. */
+#define SOCKET_HASH_INITIAL_SIZE (256u)
+
 typedef struct chisocketentry chisocketentry_t;
 
+/* A chiTCP frame (chiTCP header, TCP packet and payload) waiting to be
+ * written to a connection's real socket. Frames live in the stack of
+ * the thread that is sending them, which waits until they are written
+ * (see chitcpd_connection_send in connection.c) */
+typedef struct tcpconnframe
+{
+    struct iovec *iov;
+    int iovcnt;
+    size_t length;
+
+    /* Set by whichever thread writes the frame */
+    bool_t done;
+    int status;
+
+    struct tcpconnframe *next;
+} tcpconnframe_t;
+
 /* Represents single TCP connection between chiTCP daemons */
 typedef struct tcpconnentry
 {
@@ -78,6 +111,17 @@ typedef struct tcpconnentry
     /* Peer chiTCP daemon */
     struct sockaddr_storage peer_addr;
 
+    /* Transmit queue. Several TCP threads can share a connection, but
+     * only one of them (the one that finds "sending" set to FALSE)
+     * writes to realsocket_send at a time, sending its own frame and
+     * any frames queued by other threads in as few system calls as
+     * possible. */
+    tcpconnframe_t *send_head;
+    tcpconnframe_t *send_tail;
+    bool_t sending;
+    pthread_mutex_t lock_send;
+    pthread_cond_t cv_send;
+
 } tcpconnentry_t;
 
 
@@ -113,7 +157,8 @@ typedef struct active_chisocket_state
                     app_recv:1,     /* Application has read data from the buffer */
                     net_recv:1,     /* Data has arrived through the network */
                     app_close:1,    /* Application has requested the connection be closed */
-                    cleanup:1;      /* Socket must release all its resources */
+                    cleanup:1,      /* Socket must release all its resources */
+                    timeout:1;      /* One of the socket's timers has expired */
         };
         uint8_t raw;
     } flags;
@@ -158,6 +203,13 @@ typedef struct chisocketentry
     /* Is this entry available? */
     bool_t available;
 
+    /* If it is, the next available entry (see chitcpd_allocate_socket) */
+    int next_free;
+
+    /* Position of this entry in the socket table (i.e., its socket
+     * descriptor) */
+    int sockfd;
+
     /* Socket domain
      * Only AF_INET and AF_INET6 are supported. */
     int domain;
@@ -174,6 +226,11 @@ typedef struct chisocketentry
     struct sockaddr_storage local_addr;
     struct sockaddr_storage remote_addr;
 
+    /* Is this socket in the connection hash table and, if so, the next
+     * socket in its bucket (see chitcpd_hash_socket) */
+    bool_t hashed;
+    struct chisocketentry *hash_next;
+
     /* TCP state (CLOSED, SYN_SENT, LISTEN, etc.) */
     tcp_state_t tcp_state;
     pthread_mutex_t lock_tcp_state;
@@ -182,6 +239,14 @@ typedef struct chisocketentry
     /* Socket type: active or passive */
     socket_type_t actpas_type;
 
+    /* Socket options (see the SETSOCKOPT handler). Sockets returned
+     * by accept() inherit them from the listening socket. */
+    bool_t nodelay;     /* TCP_NODELAY: disables Nagle's algorithm */
+    const tcp_congestion_ops_t *congestion_control;  /* TCP_CONGESTION (NULL for the daemon's default) */
+    uint32_t sndbuf;    /* SO_SNDBUF (0 for the default) */
+    uint32_t rcvbuf;    /* SO_RCVBUF (0 to autotune the receive window) */
+    uint16_t maxseg;    /* TCP_MAXSEG (0 for what the real connection can carry) */
+
     /* Thread that created this entry */
     pthread_t creator_thread;
 
@@ -218,6 +283,55 @@ typedef struct chisocketentry
  */
 int chitcpd_tcp_packet_create(chisocketentry_t *entry, tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len);
 
+
+/*
+ * chitcpd_tcp_packet_create_options - Convenience function to create a TCP
+ *                                     packet with options for a specific
+ *                                     socket entry
+ *
+ * Same as chitcpd_tcp_packet_create, but the header will include the
+ * options in "options" (see chitcp_tcp_packet_create_options).
+ *
+ * entry: Socket entry
+ *
+ * packet: Pointer to unitialized tcp_packet_t variable.
+ *
+ * options: Options to include in the header (NULL for none)
+ *
+ * payload: Pointer to payload. The payload will be DEEP COPIED to the packet.
+ *
+ * payload_len: Size of the payload in number of bytes.
+ *
+ * Returns: the size in bytes of the TCP packet.
+ *
+ */
+int chitcpd_tcp_packet_create_options(chisocketentry_t *entry, tcp_packet_t *packet, const tcp_options_t *options,
+                                      const uint8_t* payload, uint16_t payload_len);
+
+
+/*
+ * chitcpd_tcp_packet_alloc - Creates a TCP packet for a specific socket
+ *                            entry in a buffer from the packet pool
+ *
+ * Same as chitcpd_tcp_packet_create_options, but the packet is
+ * allocated from the packet pool (see packet_pool.h), so it can be
+ * sent with chitcpd_send_tcp_packet.
+ *
+ * entry: Socket entry
+ *
+ * options: Options to include in the header (NULL for none)
+ *
+ * payload: Pointer to payload. The payload will be DEEP COPIED to the packet.
+ *
+ * payload_len: Size of the payload in number of bytes.
+ *
+ * Returns: the packet, which must be freed with chitcpd_packet_free
+ *          (or NULL, if it could not be allocated).
+ *
+ */
+tcp_packet_t *chitcpd_tcp_packet_alloc(chisocketentry_t *entry, const tcp_options_t *options,
+                                       const uint8_t* payload, uint16_t payload_len);
+
 /* State of the chiTCP daemon */
 typedef enum
 {
@@ -252,27 +366,74 @@ typedef struct serverinfo
     pthread_t network_thread;
     socket_t network_socket;
 
-    /* Connections to other chiTCP daemons */
-    uint16_t connection_table_size;
-    tcpconnentry_t *connection_table;
+    /* Connections to other chiTCP daemons, in segments of
+     * CONNECTION_SEGMENT_SIZE entries (see CONNECTION_ENTRY).
+     * connection_table_size is the number of entries allocated so
+     * far, and can grow up to connection_table_max. */
+    uint32_t connection_table_size;
+    uint32_t connection_table_max;
+    tcpconnentry_t **connection_segments;
     pthread_mutex_t lock_connection_table;
 
-    /* Socket table */
-    uint16_t chisocket_table_size;
-    chisocketentry_t *chisocket_table;
+    /* Socket table, in segments of CHISOCKET_SEGMENT_SIZE entries
+     * (see SOCKET_ENTRY). chisocket_table_size is the number of
+     * entries allocated so far, and can grow up to chisocket_table_max.
+     * The available entries form a list (through their next_free
+     * field) that starts at chisocket_free_head (-1 if there are no
+     * available entries). */
+    uint32_t chisocket_table_size;
+    uint32_t chisocket_table_max;
+    chisocketentry_t **chisocket_segments;
+    int chisocket_free_head;
     pthread_mutex_t lock_chisocket_table;
 
-    /* Table of pointers to socket entries.
+    /* Table of pointers to socket entries, in pages of
+     * PORT_TABLE_PAGE_SIZE ports (pages where no port has
+     * ever been taken are NULL; see chitcpd_port_owner).
      * If an entry is NULL, the port is available.
      * If not NULL, it contains a pointer to the socket that
-     * is assigned to that port. */
+     * is assigned to that port. This is also where incoming
+     * packets that don't belong to a connection find the
+     * listening socket they are for (see chitcpd_lookup_socket). */
     uint32_t port_table_size;
     uint16_t ephemeral_port_start;
-    chisocketentry_t **port_table;
+    chisocketentry_t **port_pages[DEFAULT_MAX_PORTS / PORT_TABLE_PAGE_SIZE];
+
+    /* One bit per port, set if the port is taken, so that free
+     * ephemeral ports can be found 64 at a time */
+    uint64_t *port_bitmap;
+    pthread_mutex_t lock_port_table;
+
+    /* Connected sockets, hashed by local port and remote address and
+     * port (see chitcpd_hash_socket) */
+    chisocketentry_t **socket_hash;
+    uint32_t socket_hash_size;
+    uint32_t socket_hash_count;
+    pthread_mutex_t lock_socket_hash;
+
+    /* Congestion control algorithm used by new sockets.
+     * If NULL, TCP_CONGESTION_DEFAULT is used. */
+    const tcp_congestion_ops_t *congestion_control;
+
+    /* If TRUE, new sockets neither offer nor accept SACK (and recover
+     * from losses with NewReno's fast recovery, RFC 6582) */
+    bool_t sack_disabled;
+
+    /* Timers for all the sockets, and the thread that services them */
+    chitcpd_timer_wheel_t timers;
+
+    /* Maximum segment lifetime, in microseconds (see TCP_MSL) */
+    uint32_t msl;
 
 } serverinfo_t;
 
-#define SOCKET_NO(si, entry) ((int) (entry - si->chisocket_table))
+#define SOCKET_NO(si, entry) ((entry)->sockfd)
+
+/* Entry "i" of the socket table and of the connection table. Must be
+ * less than chisocket_table_size (or connection_table_size): the
+ * sizes are only increased once the new segments are in place. */
+#define SOCKET_ENTRY(si, i) (&(si)->chisocket_segments[(i) / CHISOCKET_SEGMENT_SIZE][(i) % CHISOCKET_SEGMENT_SIZE])
+#define CONNECTION_ENTRY(si, i) (&(si)->connection_segments[(i) / CONNECTION_SEGMENT_SIZE][(i) % CONNECTION_SEGMENT_SIZE])
 
 /*
  * chitcpd_update_tcp_state - Updates the TCP state of a socket
@@ -292,6 +453,9 @@ void chitcpd_update_tcp_state(serverinfo_t *si, chisocketentry_t *entry, tcp_sta
 /*
  * chitcpd_allocate_socket - Allocate a socket entry
  *
+ * If there are no available entries, the socket table grows by one
+ * segment (unless it has reached chisocket_table_max entries).
+ *
  * si: Server info
  *
  * socket_entry: Output parameter with the index of the allocated entry
@@ -319,17 +483,127 @@ int chitcpd_free_socket_entry(serverinfo_t *si, chisocketentry_t *entry);
 
 
 /*
- * chitcpd_find_ephemeral_port - Find an ephemeral port
+ * chitcpd_reserve_port - Assign a port to a socket
+ *
+ * si: Server info
+ *
+ * port: Port
+ *
+ * entry: Socket entry
+ *
+ * Returns:
+ *   - CHITCP_OK: The port has been assigned to the socket
+ *   - CHITCP_EINVAL: The port is already taken
+ *
+ */
+int chitcpd_reserve_port(serverinfo_t *si, uint16_t port, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_port_owner - Get the socket a port is assigned to
+ *
+ * si: Server info
+ *
+ * port: Port
+ *
+ * Returns: The socket, or NULL if the port is available
+ *
+ */
+chisocketentry_t *chitcpd_port_owner(serverinfo_t *si, uint16_t port);
+
+
+/*
+ * chitcpd_release_port - Make a socket's port available again
+ *
+ * Does nothing if the port is not assigned to the socket (e.g., if
+ * the socket was created by accept(), and shares its port with the
+ * listening socket).
  *
  * si: Server info
  *
+ * port: Port
+ *
+ * entry: Socket entry
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_release_port(serverinfo_t *si, uint16_t port, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_find_ephemeral_port - Find an ephemeral port, and assign it to
+ *                               a socket
+ *
+ * The search starts at a random port in the ephemeral range, and
+ * wraps around (RFC 6056, algorithm 1), so ports are not reused
+ * any sooner than they have to be, and are harder to guess.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
  * Returns: -1 if no ephemeral ports are available.
  *          Otherwise, the port number.
  *
  */
-int chitcpd_find_ephemeral_port(serverinfo_t *si);
+int chitcpd_find_ephemeral_port(serverinfo_t *si, chisocketentry_t *entry);
 
 
+/*
+ * chitcpd_hash_socket - Add a connected socket to the connection hash table
+ *
+ * Must be called once the socket's local and remote addresses are set
+ * (when connecting, or when accepting a connection), so that
+ * chitcpd_lookup_socket can find it without looking through the whole
+ * socket table. The socket is removed from the table when it is
+ * freed (see chitcpd_free_socket_entry).
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_hash_socket(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_unhash_socket - Remove a socket from the connection hash table
+ *
+ * Does nothing if the socket is not in the table.
+ *
+ * si: Server info
+ *
+ * entry: Socket entry
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_unhash_socket(serverinfo_t *si, chisocketentry_t *entry);
+
+
+/*
+ * chitcpd_lookup_socket - Find the socket an incoming packet is for
+ *
+ * Connected sockets are looked up in the connection hash table and,
+ * failing that, the socket bound to the local port (normally a
+ * listening socket) is considered. If more than one socket matches,
+ * the one with the fewest wildcard addresses wins.
+ *
+ * si: Server info
+ *
+ * local_addr: Local address and port
+ *
+ * remote_addr: Remote address and port
+ *
+ * exact_match_only: If TRUE, only sockets whose local and remote
+ *                   addresses match exactly are considered
+ *
+ * Returns: The socket, or NULL if no socket matches
+ *
+ */
 chisocketentry_t* chitcpd_lookup_socket(serverinfo_t *si, struct sockaddr *local_addr, struct sockaddr *remote_addr, bool_t exact_match_only);
 
 
@@ -60,7 +60,7 @@
  *  Copyright (c) 2013-2014, The University of Chicago
  *  All rights reserved.
  *
- *  Redistribution and use in source and binary forms, with or withsend
+ *  Redistribution and use in source and binary forms, with or without
  *  modification, are permitted provided that the following conditions are met:
  *
  *  - Redistributions of source code must retain the above copyright notice,
@@ -72,7 +72,7 @@
  *
  *  - Neither the name of The University of Chicago nor the names of its
  *    contributors may be used to endorse or promote products derived from this
- *    software withsend specific prior written permission.
+ *    software without specific prior written permission.
  *
  *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
  *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
@@ -83,7 +83,7 @@
  *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
  *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
  *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
- *  ARISING IN ANY WAY send OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  *  POSSIBILITY OF SUCH DAMAGE.
  *
  */
@@ -93,690 +93,1448 @@
 #include "serverinfo.h"
 #include "connection.h"
 #include "tcp.h"
+#include "sack.h"
+#include "packet_pool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-//#include <semaphore.h>
-
-//sem_t s;
-int closing_state = 0;
-int fin_state = 0;
-
-list_t* pending_packets;
-
-tcp_packet_t *handle_packet_arrival(chisocketentry_t *entry){
-  tcp_data_t *data = &entry->socket_state.active.tcp_data;
-  tcp_packet_t *packet;
-  pthread_mutex_lock(&data->lock_pending_packets);
-  packet = list_fetch(&data->pending_packets);
-  pthread_mutex_unlock(&data->lock_pending_packets);
-  chilog_tcp(CRITICAL, packet, LOG_OUTBOUND);
-
-  return packet;
-}
-
-void send_fin(serverinfo_t *si, chisocketentry_t *entry) {
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-      
-      tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-      tcphdr_t *header;
-      chitcpd_tcp_packet_create(entry, new, NULL, 0);
-      header = TCP_PACKET_HEADER(new);
-      printf("made header\n");
-      header->seq = chitcp_htonl(data->SND_NXT);
-      header->ack_seq = chitcp_htonl(data->RCV_NXT);
-      header->ack = (1);
-      header->fin= (1);
-      header->win = chitcp_htons(data->RCV_WND);
-      printf("init header\n");
-      chitcpd_send_tcp_packet(si, entry, new);
-      chilog_tcp(CRITICAL, new, LOG_OUTBOUND);
-      chitcp_tcp_packet_free(new);
-  return;
+#include <time.h>
+
+
+/*
+ *  Timers
+ *
+ *  Each connection has four timers in the daemon's timer wheel (see
+ *  timer.h), which raise a TIMEOUT event when they fire: the
+ *  retransmission timer; the persist timer, which runs while the peer
+ *  is advertising a zero window (see chitcpd_tcp_persist); the delayed
+ *  ACK timer (see chitcpd_tcp_delay_ack); and the TIME_WAIT timer.
+ */
+
+/* Microseconds from "from" to "to" (zero if "to" is earlier) */
+static uint64_t chitcpd_tcp_usecs_between(const struct timespec *from, const struct timespec *to)
+{
+    int64_t usecs = (int64_t) (to->tv_sec - from->tv_sec) * 1000000 +
+                    (to->tv_nsec - from->tv_nsec) / 1000;
+
+    return usecs > 0 ? usecs : 0;
 }
 
-int chitcpd_tcp_state_handle_CLOSED(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+static void chitcpd_tcp_timer_arm(tcp_data_t *tcp_data, uint32_t usecs)
+{
+    chitcpd_timer_arm(&tcp_data->rto_timer, usecs);
+}
+
+static void chitcpd_tcp_timer_disarm(tcp_data_t *tcp_data)
+{
+    chitcpd_timer_cancel(&tcp_data->rto_timer);
+}
+
+/*
+ * The persist timer starts at the current RTO, and doubles with each
+ * probe (up to TCP_RTO_MAX) until the peer opens its window. This
+ * backoff is kept apart from the RTO's: a probe that only gets back
+ * another zero window was not lost, so it is no reason to slow down
+ * retransmissions, or to reduce the congestion window.
+ */
+static void chitcpd_tcp_persist_arm(tcp_data_t *tcp_data)
+{
+    uint64_t usecs = (uint64_t) tcp_data->RTO << tcp_data->persist_backoff;
+
+    chitcpd_timer_arm(&tcp_data->persist_timer, usecs < TCP_RTO_MAX ? usecs : TCP_RTO_MAX);
+}
+
+static void chitcpd_tcp_persist_stop(tcp_data_t *tcp_data)
+{
+    chitcpd_timer_cancel(&tcp_data->persist_timer);
+    tcp_data->persist_backoff = 0;
+}
+
+/*
+ * Enters TIME_WAIT. The connection is closed for good when the
+ * TIME_WAIT timer fires, 2*MSL later (RFC 793, page 22).
+ */
+static void chitcpd_tcp_time_wait(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    chitcpd_update_tcp_state(si, entry, TIME_WAIT);
+    chitcpd_timer_arm(&tcp_data->time_wait_timer, 2 * si->msl);
+}
+
+/*
+ * Sets the RTO from the current RTT estimate, discarding any backoff
+ */
+static void chitcpd_tcp_set_rto(tcp_data_t *tcp_data)
 {
-  if (event == APPLICATION_CONNECT)
+    if (!tcp_data->rtt_measured)
     {
-      //sem_init(&s, 0, 1);
+        tcp_data->RTO = TCP_RTO_INITIAL;
+        return;
+    }
+
+    tcp_data->RTO = tcp_data->SRTT + 4 * tcp_data->RTTVAR;
+    if (tcp_data->RTO < TCP_RTO_MIN)
+        tcp_data->RTO = TCP_RTO_MIN;
+    if (tcp_data->RTO > TCP_RTO_MAX)
+        tcp_data->RTO = TCP_RTO_MAX;
+}
 
-      tcp_data_t *data = &entry->socket_state.active.tcp_data;
-      tcp_packet_t *packet = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-      tcphdr_t *header;
-      srand(837);
+/*
+ * Updates SRTT, RTTVAR and RTO with a new round-trip time
+ * measurement, as specified in RFC 6298, section 2.
+ */
+static void chitcpd_tcp_update_rto(tcp_data_t *tcp_data, uint32_t rtt)
+{
+    uint32_t delta;
 
-      chitcpd_tcp_packet_create(entry, packet, NULL, 0);
-      header = TCP_PACKET_HEADER(packet);
-      data->ISS = rand() % 1000;
-      header->seq = chitcp_htonl(data->ISS);
-      header->syn = (1);
-      header->win = chitcp_htons(TCP_BUFFER_SIZE);
-      data->SND_UNA = (data->ISS);
-      data->SND_NXT = (data->ISS + 1);
-      data->RCV_WND = (TCP_BUFFER_SIZE);
-      chilog_tcp(CRITICAL, packet, LOG_OUTBOUND);       
-      chitcpd_send_tcp_packet(si, entry, packet);
-      chitcp_tcp_packet_free(packet);
-      chitcpd_update_tcp_state(si, entry, SYN_SENT);
+    if (rtt > TCP_RTO_MAX)
+        rtt = TCP_RTO_MAX;
 
-      return CHITCP_OK ;
+    if (!tcp_data->rtt_measured)
+    {
+        tcp_data->SRTT = rtt;
+        tcp_data->RTTVAR = rtt / 2;
+        tcp_data->rtt_measured = TRUE;
     }
-  else if (event == CLEANUP)
+    else
     {
-      chitcpd_free_socket_entry(si, entry);
+        delta = tcp_data->SRTT > rtt ? tcp_data->SRTT - rtt : rtt - tcp_data->SRTT;
+        tcp_data->RTTVAR = (3 * tcp_data->RTTVAR + delta) / 4;
+        tcp_data->SRTT = (7 * tcp_data->SRTT + rtt) / 8;
     }
-  else
-    chilog(WARNING, "In CLOSED state, received unexpected event.");
 
-  return CHITCP_OK;
+    chitcpd_tcp_set_rto(tcp_data);
 }
 
-int chitcpd_tcp_state_handle_LISTEN(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+
+/*
+ *  Windows
+ */
+
+/*
+ * The receive window: the free space in the receive buffer, but never
+ * so much that more than rcvbuf bytes would be waiting in it for the
+ * application.
+ */
+static uint32_t chitcpd_tcp_rcv_window(tcp_data_t *tcp_data)
 {
-  if (event == PACKET_ARRIVAL)
-    {
-      tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
-      tcp_packet_t *arrived = handle_packet_arrival(entry);
-      tcphdr_t *ar_header;
-      srand(47);
-
-      ar_header = TCP_PACKET_HEADER(arrived);
-      tcp_data->RCV_WND = (TCP_BUFFER_SIZE);
-      if (ar_header->ack) {
-        chilog(ERROR, "Bad ACK");
-      }
-      else  if(ar_header->syn) {
-        tcp_data->RCV_NXT = (SEG_SEQ(arrived) + 1);
-        tcp_data->IRS = (SEG_SEQ(arrived));
-        tcp_data->ISS = rand() % 1000;
-        tcp_data->SND_WND = SEG_WND(arrived);
-
-        tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-        tcphdr_t *header;
-        chitcpd_tcp_packet_create(entry, new, NULL, 0);
-        header = TCP_PACKET_HEADER(new);
-        header->seq = chitcp_htonl(tcp_data->ISS);
-        header->ack_seq = chitcp_htonl(tcp_data->RCV_NXT);
-        header->win = chitcp_htons(tcp_data->RCV_WND);
-        header->syn = (1);
-        header->ack = (1);
-        tcp_data->SND_NXT = tcp_data->ISS + 1;
-        tcp_data->SND_UNA = tcp_data->ISS;
-        //circular_buffer_write(&tcp_data->recv, TCP_PAYLOAD_START(arrived), TCP_PAYLOAD_LEN(arrived), FALSE);
-        chitcpd_send_tcp_packet(si,entry,new);
+    uint32_t count = circular_buffer_count(&tcp_data->recv);
+    uint32_t available = circular_buffer_available(&tcp_data->recv);
+
+    if (count >= tcp_data->rcvbuf)
+        return 0;
+
+    return available < tcp_data->rcvbuf - count ? available : tcp_data->rcvbuf - count;
+}
+
+/*
+ * The window advertised in an incoming segment, in bytes. The window
+ * field of a SYN is never scaled (RFC 7323, section 2.2).
+ */
+static uint32_t chitcpd_tcp_seg_wnd(tcp_data_t *tcp_data, tcp_packet_t *packet)
+{
+    if (TCP_PACKET_HEADER(packet)->syn)
+        return SEG_WND(packet);
+
+    return (uint32_t) SEG_WND(packet) << tcp_data->snd_wscale;
+}
+
+/*
+ * Called with the options in the peer's SYN. We never send segments
+ * larger than the peer's MSS (or TCP_MSS, if it didn't send one), nor
+ * larger than the ones we are willing to receive ourselves, which were
+ * sized for the real connection. The initial congestion window depends
+ * on the segment size (RFC 5681, section 3.1), so congestion control
+ * is set up again now that we know it.
+ */
+static void chitcpd_tcp_negotiate_mss(tcp_data_t *tcp_data, tcp_options_t *options)
+{
+    uint32_t mss = options->mss_ok && options->mss > 0 ? options->mss : TCP_MSS;
 
-        chilog_tcp(CRITICAL, new, LOG_OUTBOUND);            
-        chitcpd_update_tcp_state(si,entry, SYN_RCVD);
-        chitcp_tcp_packet_free(arrived);
-        chitcp_tcp_packet_free(new);
+    tcp_data->SMSS = mss < tcp_data->RMSS ? mss : tcp_data->RMSS;
 
-        return CHITCP_OK ;
-      }
+    chitcpd_congestion_init(tcp_data, tcp_data->cc);
+}
+
+/*
+ * Called with the options in the peer's SYN. Windows are only scaled
+ * if both SYNs carry the window scale option (our SYN always does,
+ * and our SYN/ACK only if the peer's SYN did).
+ */
+static void chitcpd_tcp_negotiate_wscale(tcp_data_t *tcp_data, tcp_options_t *options)
+{
+    tcp_data->wscale_ok = options->wscale_ok;
+
+    if (options->wscale_ok)
+        tcp_data->snd_wscale = options->wscale < TCP_WSCALE_MAX ? options->wscale : TCP_WSCALE_MAX;
+    else
+    {
+        tcp_data->snd_wscale = 0;
+        tcp_data->rcv_wscale = 0;
     }
-  else
-    chilog(WARNING, "In LISTEN state, received unexpected event.");
+}
 
-  return CHITCP_OK;
+/*
+ * Receive buffer autotuning, along the lines of Dynamic Right-Sizing
+ * (as done by Linux). Called whenever RCV.NXT advances.
+ *
+ * The receiver does not know the round-trip time, but the time it takes
+ * for RCV.NXT to reach the right edge of a window we advertised is an
+ * upper bound on it (a sender that is keeping up can't take longer than
+ * one RTT to fill it). Once per such RTT, we look at how much data came
+ * in: if that is more than half of rcvbuf, the window may be what is
+ * holding the sender back, so rcvbuf is grown to twice that amount
+ * (leaving room for the sender to keep growing its congestion window).
+ */
+static void chitcpd_tcp_rcvbuf_adjust(tcp_data_t *tcp_data)
+{
+    struct timespec now;
+    uint32_t sample, received, capacity, rcvbuf;
+
+    if (tcp_data->rcvbuf_locked)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (!tcp_data->rcv_rtt_measuring || SEQ_GEQ(tcp_data->RCV_NXT, tcp_data->rcv_rtt_seq))
+    {
+        if (tcp_data->rcv_rtt_measuring)
+        {
+            sample = chitcpd_tcp_usecs_between(&tcp_data->rcv_rtt_time, &now);
+            if (sample == 0)
+                sample = 1;
+
+            /* Samples can only overestimate the RTT, so a smaller one
+             * is taken as is */
+            if (tcp_data->rcv_rtt == 0 || sample < tcp_data->rcv_rtt)
+                tcp_data->rcv_rtt = sample;
+            else
+                tcp_data->rcv_rtt = (7 * tcp_data->rcv_rtt + sample) / 8;
+        }
+        else
+        {
+            tcp_data->rcv_space_seq = tcp_data->RCV_NXT;
+            tcp_data->rcv_space_time = now;
+        }
+
+        tcp_data->rcv_rtt_measuring = TRUE;
+        tcp_data->rcv_rtt_seq = tcp_data->RCV_NXT + tcp_data->RCV_WND;
+        tcp_data->rcv_rtt_time = now;
+    }
+
+    if (tcp_data->rcv_rtt == 0 ||
+        chitcpd_tcp_usecs_between(&tcp_data->rcv_space_time, &now) < tcp_data->rcv_rtt)
+        return;
+
+    received = tcp_data->RCV_NXT - tcp_data->rcv_space_seq;
+    capacity = circular_buffer_capacity(&tcp_data->recv);
+
+    if (received > tcp_data->rcvbuf / 2 && tcp_data->rcvbuf < TCP_BUFFER_MAX)
+    {
+        rcvbuf = received < TCP_BUFFER_MAX / 2 ? 2 * received : TCP_BUFFER_MAX;
+
+        /* The receive buffer only holds as much as the window has
+         * needed so far. If it can't grow right now (the socket's
+         * reader hasn't picked up the last new ring yet, or we're out
+         * of memory), the window stops at what it can hold. */
+        if (rcvbuf > capacity && circular_buffer_grow(&tcp_data->recv, rcvbuf) != CHITCP_OK)
+            rcvbuf = capacity;
+
+        if (rcvbuf > tcp_data->rcvbuf)
+        {
+            tcp_data->rcvbuf = rcvbuf;
+            chilog(DEBUG, "Receive buffer grown to %u bytes (%u bytes received in %uus)",
+                   tcp_data->rcvbuf, received, tcp_data->rcv_rtt);
+        }
+    }
+
+    tcp_data->rcv_space_seq = tcp_data->RCV_NXT;
+    tcp_data->rcv_space_time = now;
 }
 
-int chitcpd_tcp_state_handle_SYN_RCVD(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+
+/*
+ *  Sending segments
+ */
+
+/*
+ * Sends a single segment starting at sequence number "seq". If len > 0,
+ * the payload is taken directly from the send buffer (which must
+ * contain it). Every segment but our initial SYN carries an ACK.
+ *
+ * SYNs carry our MSS. Our SYN always offers window scaling and SACK;
+ * our SYN/ACK only what the peer's SYN did.
+ * Once SACK has been agreed on, every ACK reports the out-of-order
+ * data we are holding (RFC 2018, section 4).
+ *
+ * Since every segment acknowledges everything received so far, sending
+ * one takes care of any ACK we were delaying.
+ */
+static int chitcpd_tcp_send_segment(serverinfo_t *si, chisocketentry_t *entry,
+                                    uint32_t seq, uint32_t len, bool_t syn, bool_t fin)
 {
-  if (event == PACKET_ARRIVAL) {
     tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    tcp_data->SND_WND = SEG_WND(arrived);
-
-    if((SEG_SEQ(arrived) == tcp_data->RCV_NXT) ||
-      ((tcp_data->RCV_NXT <= SEG_SEQ(arrived)) && (SEG_SEQ(arrived) < (tcp_data->RCV_NXT + tcp_data->RCV_WND))) ||
-      ((tcp_data->RCV_NXT <= (SEG_SEQ(arrived) + SEG_LEN(arrived) - 1)) && ((SEG_SEQ(arrived) + SEG_LEN(arrived) - 1) < (tcp_data->RCV_NXT + tcp_data->RCV_WND)))) {
-      if(ar_header->ack) {
-        if((tcp_data->SND_UNA <= SEG_ACK(arrived)) && (SEG_ACK(arrived) <= tcp_data->SND_NXT)) {
-          tcp_data->SND_UNA = tcp_data->SND_NXT;   
-          chitcpd_update_tcp_state(si, entry, ESTABLISHED);
-
-          return CHITCP_OK ;
-        }
-        else chilog(ERROR, "segment acknowledgement not acceptable");
-      }
-    }     
-    else {
-      chilog(ERROR,"segment not acceptable");
-    }
-    chitcp_tcp_packet_free(arrived);
-
-    return CHITCP_OK ;   
-  }
-  else
-    chilog(WARNING, "In SYN_RCVD state, received unexpected event.");
-
-  return CHITCP_OK;
-}
-
-int chitcpd_tcp_state_handle_SYN_SENT(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event) { 
-  int ack_check = 0;
-  if (event == PACKET_ARRIVAL) {
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    data->SND_WND = SEG_WND(arrived);
-
-    if(ar_header->ack){
-      if ((SEG_ACK(arrived) <= data->ISS) || (SEG_ACK(arrived) > data->SND_NXT)) {
-          chilog(ERROR, "incorrect seg.ack");
-          chitcp_tcp_packet_free(arrived);
-          return CHITCP_OK;
-      }
-      if ((data->SND_UNA <= SEG_ACK(arrived)) && (SEG_ACK(arrived) <= data->SND_NXT)){
-        ack_check=1;
-      }
-    }
-    if(((ar_header->syn)&&(ack_check))||((!ar_header->ack)&&(ar_header->syn))) {
-      data->RCV_NXT = (SEG_SEQ(arrived) + 1);
-      data->IRS = SEG_SEQ(arrived);
-      if(ar_header->ack){
-        data->SND_UNA = SEG_ACK(arrived);
-      }
-      if (data->SND_UNA > data->ISS){
-        tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-        tcphdr_t *header;
-        chitcpd_tcp_packet_create(entry, new, NULL, 0);
-        header = TCP_PACKET_HEADER(new);
-        header->seq = chitcp_htonl(data->SND_NXT);
-        header->ack_seq = chitcp_htonl(data->RCV_NXT);
-        header->ack = (1);                    
-        header->win = chitcp_htons(data->RCV_WND);
-        chilog_tcp(CRITICAL, new, LOG_OUTBOUND);                     
-        chitcpd_send_tcp_packet(si, entry, new);
-        chitcpd_update_tcp_state(si, entry, ESTABLISHED);
-        chitcp_tcp_packet_free(arrived);
-        chitcp_tcp_packet_free(new);
-
-        return CHITCP_OK ;
-      }
-      else { 
-        tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-        tcphdr_t *header;
-        chitcpd_tcp_packet_create(entry, new, NULL, 0);
-        header = TCP_PACKET_HEADER(new);
-        header->seq = chitcp_htonl(data->ISS);
-        header->ack_seq = chitcp_htonl(data->RCV_NXT);
-        header->syn = (1);
-        header->ack = (1);
-        header->win = chitcp_htons(data->RCV_WND);
-        chilog_tcp(CRITICAL, new, LOG_OUTBOUND);                
-        chitcpd_send_tcp_packet(si, entry, new);
-        chitcpd_update_tcp_state(si, entry, SYN_RCVD);
-        chitcp_tcp_packet_free(arrived);
-        chitcp_tcp_packet_free(new);
+    tcp_packet_t *packet;
+    tcp_options_t options;
+    tcphdr_t *header;
+    struct iovec payload[2];
+    bool_t ack;
+    uint32_t window, shift;
+    int iovcnt = 0, rc;
+
+    ack = entry->tcp_state != CLOSED && entry->tcp_state != LISTEN && entry->tcp_state != SYN_SENT;
 
-        return CHITCP_OK ;
-      }
+    memset(&options, 0, sizeof(tcp_options_t));
+    if (syn)
+    {
+        options.mss_ok = TRUE;
+        options.mss = tcp_data->RMSS;
+        options.wscale_ok = ack ? tcp_data->wscale_ok : TRUE;
+        options.wscale = tcp_data->rcv_wscale;
+        options.sack_permitted = ack ? tcp_data->sack_permitted : !si->sack_disabled;
     }
-    else{
-      chilog(ERROR,"no syn set");
-      chitcp_tcp_packet_free(arrived);
-      return CHITCP_OK;
+    else if (ack && tcp_data->sack_permitted)
+        options.nsack = chitcpd_sack_blocks(&tcp_data->reassembly, options.sack, TCP_SACK_MAX_BLOCKS);
+
+    /* Without a packet, the segment is as good as lost on the network
+     * (and, if it carries anything, will be retransmitted) */
+    packet = chitcpd_tcp_packet_alloc(entry, &options, NULL, 0);
+    if (packet == NULL)
+        return CHITCP_ENOMEM;
+    header = TCP_PACKET_HEADER(packet);
+
+    header->seq = chitcp_htonl(seq);
+    header->syn = syn;
+    header->fin = fin;
+
+    if (ack)
+    {
+        header->ack = 1;
+        header->ack_seq = chitcp_htonl(tcp_data->RCV_NXT);
+
+        if (tcp_data->delack_segments > 0)
+            chitcpd_timer_cancel(&tcp_data->delack_timer);
+        tcp_data->delack_segments = 0;
     }
-  } 
-  else
-    chilog(WARNING, "In SYN_SENT state, received unexpected event.");
 
-  return CHITCP_OK;
+    /* The window is scaled down (rounding down, so we never advertise
+     * space we don't have), except in SYNs */
+    shift = syn ? 0 : tcp_data->rcv_wscale;
+    window = chitcpd_tcp_rcv_window(tcp_data) >> shift;
+    if (window > UINT16_MAX)
+        window = UINT16_MAX;
+    header->win = chitcp_htons(window);
+    tcp_data->RCV_WND = window << shift;
+
+    if (len > 0)
+        iovcnt = circular_buffer_peek_iov(&tcp_data->send,
+                                          seq - (uint32_t) circular_buffer_first(&tcp_data->send),
+                                          len, payload);
+
+    rc = chitcpd_send_tcp_packet_iov(si, entry, packet, payload, iovcnt);
+    chitcpd_packet_free(packet);
+
+    return rc < 0 ? CHITCP_ESOCKET : CHITCP_OK;
 }
 
-int chitcpd_tcp_state_handle_ESTABLISHED(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+static int chitcpd_tcp_send_ack(serverinfo_t *si, chisocketentry_t *entry)
 {
-  if (event == APPLICATION_SEND) {
-    //*
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    //if (circular_buffer_count(&data->send) != 0) sem_trywait(&s);
-    uint8_t buf[TCP_MSS];
-    uint32_t wnd = data->SND_WND;
-    uint32_t payload_sz = circular_buffer_count(&data->send);
-    while (wnd != 0 && payload_sz != 0) {
-      //printf("WND = %u, payload_sz = %u\n", wnd, payload_sz);
-      if (payload_sz > TCP_MSS)
-        payload_sz = TCP_MSS;
-      if (payload_sz > data->SND_WND)
-        payload_sz = data->SND_WND;
-
-      circular_buffer_read(&data->send, buf, payload_sz, FALSE);
-      data->SND_NXT += payload_sz;
-      
-      tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-      tcphdr_t *header;
-      chitcpd_tcp_packet_create(entry, new, buf, payload_sz);
-      header = TCP_PACKET_HEADER(new);
-      header->seq = chitcp_htonl(data->SND_NXT);
-      header->ack_seq = chitcp_htonl(data->RCV_NXT);
-      header->ack = (1);                    
-      header->win = chitcp_htons(data->RCV_WND);
-
-      chitcpd_send_tcp_packet(si,entry,new);
-      chitcp_tcp_packet_free(new);
-
-      wnd -= payload_sz;
-      payload_sz = circular_buffer_count(&data->send);
-    }
-    //if (circular_buffer_count(&data->send) == 0) sem_post(&s);
-    if (circular_buffer_count(&data->send) == 0 && closing_state == 1) {
-      send_fin(si, entry);
-      chitcpd_update_tcp_state(si, entry, LAST_ACK);
-    }
-    else if (circular_buffer_count(&data->send) == 0 && fin_state == 1) {
-      send_fin(si, entry);
-      chitcpd_update_tcp_state(si, entry, FIN_WAIT_1);
-    }
-    else {}
-    return CHITCP_OK;
-      //*/
-  }
-  else if (event == PACKET_ARRIVAL)
-    { 
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    if(ar_header->fin){
-      //data->RCV_NXT++; 
-          printf("I don' wanna!\n");
-          tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-          tcphdr_t *header;
-          chitcpd_tcp_packet_create(entry, new, NULL, 0);
-          header = TCP_PACKET_HEADER(new);
-          header->seq = chitcp_htonl(data->SND_NXT);
-          header->ack_seq = chitcp_htonl(data->RCV_NXT);
-          header->ack = (1);
-          header->win = chitcp_htons(data->RCV_WND);
-          chitcpd_send_tcp_packet(si, entry, new);
-          chitcp_tcp_packet_free(new);
-          chitcp_tcp_packet_free(arrived);
-          chitcpd_update_tcp_state(si, entry, CLOSE_WAIT);
-          circular_buffer_close(&data->recv);
-          return CHITCP_OK;
-    }
-    if ((data->RCV_NXT <= SEG_SEQ(arrived)) && (SEG_SEQ(arrived) < (data->RCV_NXT + data->RCV_WND))) {//(((SEG_SEQ(arrived) == data->RCV_NXT)) || ((data->RCV_NXT <= SEG_SEQ(arrived)) && (SEG_SEQ(arrived) < (data->RCV_NXT + data->RCV_WND)))){
-      if (!ar_header->ack) {
-        chilog(ERROR,"drop segment and return");
-        return CHITCP_OK;
-      }
-      if (SEG_ACK(arrived) < data->SND_UNA) {
-        printf("in duplicate conditional");
-        chilog(ERROR,"Ignore duplicate packet");
-        chitcp_tcp_packet_free(arrived);
-        return CHITCP_OK ;
-      }
-      if ((data->SND_UNA < SEG_ACK(arrived)) && (SEG_ACK(arrived) <= data->SND_NXT)) {
-        data->SND_UNA = SEG_ACK(arrived);
-      }
-     
-      if(SEG_ACK(arrived) > data->SND_NXT){
-        chilog(ERROR,"acked something not yet sent");
-          return CHITCP_OK ;
-        }
-        else {
-          if(TCP_PAYLOAD_LEN(arrived)==0){
-            chitcp_tcp_packet_free(arrived);
-            return CHITCP_OK;
-          }
-          printf("in %d\n", 2);
-          data->SND_WND = SEG_WND(arrived);
-          tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-          tcphdr_t *header;
-          chitcpd_tcp_packet_create(entry, new, NULL, 0);
-          header = TCP_PACKET_HEADER(new);
-          header->seq = chitcp_htonl(data->SND_NXT);
-          header->ack_seq = chitcp_htonl(data->RCV_NXT);
-          header->ack = (1);
-          header->win = chitcp_htons(data->RCV_WND);
-
-          circular_buffer_write(&data->recv, TCP_PAYLOAD_START(arrived), TCP_PAYLOAD_LEN(arrived),TRUE);
-          data->RCV_NXT += TCP_PAYLOAD_LEN(arrived);
-          data->RCV_WND = circular_buffer_available(&data->recv);
-          chilog_tcp(CRITICAL, new, LOG_OUTBOUND);                
-          chitcpd_send_tcp_packet(si, entry, new);
-          chitcp_tcp_packet_free(arrived);
-          chitcp_tcp_packet_free(new);
-        }
-      }
-      else {
-        chilog(ERROR,"segment not acceptable");
-      }
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    return chitcpd_tcp_send_segment(si, entry, tcp_data->SND_NXT, 0, FALSE, FALSE);
+}
+
+/*
+ * Called after processing an incoming segment, once we have had the
+ * chance to send data (which would have carried the ACK). If in-sequence
+ * data is still unacknowledged, sends the ACK once TCP_DELACK_SEGMENTS
+ * data segments have arrived, and otherwise makes sure it will be sent
+ * when the delayed ACK timer expires.
+ */
+static void chitcpd_tcp_delay_ack(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    if (tcp_data->delack_segments == 0)
+        return;
+
+    /* The timer may also have fired before we got around to handling it */
+    if (tcp_data->delack_segments >= TCP_DELACK_SEGMENTS || chitcpd_timer_expired(&tcp_data->delack_timer))
+        chitcpd_tcp_send_ack(si, entry);
+    else if (!chitcpd_timer_pending(&tcp_data->delack_timer))
+        chitcpd_timer_arm(&tcp_data->delack_timer, TCP_DELACK_TIMEOUT);
+}
+
+/*
+ * Segments that leave the retransmission queue are kept for reuse, so
+ * that, once the window has been filled, sending new segments doesn't
+ * need to allocate memory.
+ */
+static tcp_segment_t *chitcpd_tcp_segment_alloc(tcp_data_t *tcp_data)
+{
+    tcp_segment_t *segment = tcp_data->spare_segments;
+
+    if (segment == NULL)
+        return malloc(sizeof(tcp_segment_t));
+
+    tcp_data->spare_segments = segment->next_spare;
+    return segment;
+}
+
+static void chitcpd_tcp_segment_free(tcp_data_t *tcp_data, tcp_segment_t *segment)
+{
+    segment->next_spare = tcp_data->spare_segments;
+    tcp_data->spare_segments = segment;
+}
+
+/*
+ * Sends a new segment at SND.NXT and adds it to the retransmission
+ * queue. The retransmission timer is started if this is the only
+ * segment in flight (RFC 6298, section 5.1).
+ *
+ * Returns CHITCP_ENOMEM, without sending anything, if there is no
+ * memory for the retransmission queue entry. The data stays in the
+ * send buffer, and SND.NXT where it was, so it can be sent later.
+ */
+static int chitcpd_tcp_transmit(serverinfo_t *si, chisocketentry_t *entry,
+                                uint32_t len, bool_t syn, bool_t fin)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_segment_t *segment = chitcpd_tcp_segment_alloc(tcp_data);
+
+    if (segment == NULL)
+    {
+        chilog(CRITICAL, "Could not allocate a retransmission queue entry");
+        return CHITCP_ENOMEM;
     }
-  else if (event == APPLICATION_RECEIVE)
+
+    segment->seq = tcp_data->SND_NXT;
+    segment->len = len;
+    segment->syn = syn;
+    segment->fin = fin;
+    segment->transmissions = 1;
+    segment->sacked = FALSE;
+    segment->lost = FALSE;
+    segment->retransmitted = FALSE;
+
+    chitcpd_tcp_send_segment(si, entry, segment->seq, len, syn, fin);
+    clock_gettime(CLOCK_MONOTONIC, &segment->sent);
+
+    if (list_empty(&tcp_data->retransmission_queue))
+        chitcpd_tcp_timer_arm(tcp_data, tcp_data->RTO);
+    list_append(&tcp_data->retransmission_queue, segment);
+
+    tcp_data->SND_NXT += len + syn + fin;
+
+    return CHITCP_OK;
+}
+
+/*
+ * The amount of data we may have in flight: the smaller of the peer's
+ * window and the congestion window.
+ */
+static uint32_t chitcpd_tcp_usable_window(tcp_data_t *tcp_data)
+{
+    return tcp_data->cwnd < tcp_data->SND_WND ? tcp_data->cwnd : tcp_data->SND_WND;
+}
+
+/*
+ * The amount of data that is actually in the network. Without SACK,
+ * we assume that each duplicate ACK means a segment has left the
+ * network. During fast recovery, this has the same effect as NewReno's
+ * window inflation (RFC 6582) without touching cwnd; before it, it lets
+ * us send a new segment for each of the first TCP_DUPTHRESH - 1
+ * duplicate ACKs (limited transmit, RFC 3042), so a small window can
+ * still produce enough duplicate ACKs to trigger a fast retransmit.
+ * With SACK, the estimate during fast recovery comes from the
+ * scoreboard instead (the "pipe" in RFC 6675).
+ */
+static uint32_t chitcpd_tcp_in_flight(tcp_data_t *tcp_data)
+{
+    uint32_t unacked = tcp_data->SND_NXT - tcp_data->SND_UNA;
+    uint32_t left = tcp_data->dupacks * tcp_data->SMSS;
+
+    if (tcp_data->fast_recovery && tcp_data->sack_permitted)
+        return chitcpd_sack_pipe(tcp_data);
+    if (!tcp_data->fast_recovery && tcp_data->dupacks >= TCP_DUPTHRESH)
+        left = (TCP_DUPTHRESH - 1) * tcp_data->SMSS;
+
+    return left < unacked ? unacked - left : 0;
+}
+
+/*
+ * Sends as much data from the send buffer as the send and congestion
+ * windows allow, in segments of at most SMSS bytes. Once all the data
+ * has been sent, and if the application has closed the connection,
+ * sends our FIN.
+ *
+ * Unless the socket has TCP_NODELAY set, less than SMSS bytes of
+ * buffered data are held back while there is unacknowledged data
+ * (Nagle's algorithm, RFC 896 and RFC 1122, section 4.2.3.4), so that
+ * an application that writes a few bytes at a time sends them in one
+ * segment per round trip, instead of one segment per write. They go
+ * out when the ACK arrives, when the application has written enough
+ * for a full segment, or when it closes the socket. (Segments that
+ * are small only because of the windows are not held back.)
+ *
+ * During fast recovery, the congestion window is compared with the
+ * estimate from chitcpd_tcp_in_flight, so new data keeps flowing
+ * while the lost segments are being resent.
+ */
+static void chitcpd_tcp_output(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    uint32_t buffered_end, in_flight, unacked, len;
+
+    if (tcp_data->fin_sent)
+        return;
+
+    in_flight = chitcpd_tcp_in_flight(tcp_data);
+
+    /* Sequence number following the last byte written by the application */
+    buffered_end = circular_buffer_first(&tcp_data->send) + circular_buffer_count(&tcp_data->send);
+
+    while (SEQ_LT(tcp_data->SND_NXT, buffered_end))
     {
-      tcp_data_t *data = &entry->socket_state.active.tcp_data;
-      data->RCV_WND = circular_buffer_available(&data->recv);
+        unacked = tcp_data->SND_NXT - tcp_data->SND_UNA;
+        if (in_flight >= tcp_data->cwnd || unacked >= tcp_data->SND_WND)
+            break;
+
+        len = buffered_end - tcp_data->SND_NXT;
+        if (len < tcp_data->SMSS && unacked > 0 && !entry->nodelay && !tcp_data->closing)
+            break;
+        if (len > tcp_data->SMSS)
+            len = tcp_data->SMSS;
+        if (len > tcp_data->cwnd - in_flight)
+            len = tcp_data->cwnd - in_flight;
+        if (len > tcp_data->SND_WND - unacked)
+            len = tcp_data->SND_WND - unacked;
+
+        if (chitcpd_tcp_transmit(si, entry, len, FALSE, FALSE) != CHITCP_OK)
+            return;
+        in_flight += len;
     }
-  else if (event == APPLICATION_CLOSE)
+
+    if (tcp_data->SND_NXT == buffered_end && tcp_data->closing)
     {
-      tcp_data_t *data = &entry->socket_state.active.tcp_data;
-      printf("Application close in established\n");
-      //sem_wait(&s);
-      if (circular_buffer_count(&data->send) == 0) {
-        printf("circular buffer empty\n");
-        send_fin(si, entry);
-        chitcpd_update_tcp_state(si, entry, FIN_WAIT_1);
+        if (chitcpd_tcp_transmit(si, entry, 0, FALSE, TRUE) != CHITCP_OK)
+            return;
+        tcp_data->fin_sent = TRUE;
 
-      }
-      else {
-        fin_state = 1;
-      }
-      return CHITCP_OK;
-      /*
-      circular_buffer_close(&data->recv);
-      circular_buffer_close(&data->send);
-      //*/
+        if (entry->tcp_state == ESTABLISHED)
+            chitcpd_update_tcp_state(si, entry, FIN_WAIT_1);
+        else if (entry->tcp_state == CLOSE_WAIT)
+            chitcpd_update_tcp_state(si, entry, LAST_ACK);
+    }
+    else if (SEQ_LT(tcp_data->SND_NXT, buffered_end) &&
+             list_empty(&tcp_data->retransmission_queue) && !chitcpd_timer_pending(&tcp_data->persist_timer))
+    {
+        /* The peer has closed its window: start the persist timer,
+         * so we will probe it when it expires */
+        chitcpd_tcp_persist_arm(tcp_data);
     }
-  else
-    chilog(WARNING, "In ESTABLISHED state, received unexpected event (%i).", event);
+}
+
+static void chitcpd_tcp_retransmit(serverinfo_t *si, chisocketentry_t *entry, tcp_segment_t *segment)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    chitcpd_tcp_send_segment(si, entry, segment->seq, segment->len, segment->syn, segment->fin);
+    segment->transmissions++;
+    segment->retransmitted = TRUE;
+    clock_gettime(CLOCK_MONOTONIC, &segment->sent);
 
-  return CHITCP_OK;
+    tcp_data->RTX_NXT = TCP_SEGMENT_END(segment);
 }
 
+/*
+ * After a retransmission timeout, the peer has most likely discarded
+ * the segments that followed the lost one, so each ACK that moves
+ * SND.UNA forward lets us resend (up to the send window) the segments
+ * that were in flight when the timer expired. This avoids having to
+ * wait for a full RTO to recover each of them. Segments the peer has
+ * SACKed are skipped.
+ */
+static void chitcpd_tcp_retransmit_lost(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_segment_t *segment;
+
+    if (SEQ_LT(tcp_data->RTX_NXT, tcp_data->SND_UNA))
+        tcp_data->RTX_NXT = tcp_data->SND_UNA;
 
-int chitcpd_tcp_state_handle_FIN_WAIT_1(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+    for (unsigned int i = 0; i < list_size(&tcp_data->retransmission_queue); i++)
+    {
+        segment = list_get_at(&tcp_data->retransmission_queue, i);
+
+        if (SEQ_GEQ(segment->seq, tcp_data->RECOVER))
+            break;
+        if (SEQ_LT(segment->seq, tcp_data->RTX_NXT) || segment->sacked)
+            continue;
+        if (TCP_SEGMENT_END(segment) - tcp_data->SND_UNA > chitcpd_tcp_usable_window(tcp_data))
+            break;
+
+        chitcpd_tcp_retransmit(si, entry, segment);
+    }
+}
+
+/*
+ * Loss recovery with SACK (RFC 6675, section 5). While the pipe leaves
+ * room in the congestion window, resends the segments the scoreboard
+ * deems lost, lowest sequence number first, each of them at most once
+ * per recovery. All the holes in a window can thus be filled in the
+ * same round trip. New data is sent afterwards by chitcpd_tcp_output.
+ */
+static void chitcpd_tcp_sack_recovery(serverinfo_t *si, chisocketentry_t *entry)
 {
-  if (event == PACKET_ARRIVAL)
-    {
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    data->SND_WND = SEG_WND(arrived); 
-    if(ar_header->fin){
-      printf("aaaaaaaaa fin\n");
-          //data->RCV_NXT++; 
-          tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-          tcphdr_t *header;
-          chitcpd_tcp_packet_create(entry, new, NULL, 0);
-          header = TCP_PACKET_HEADER(new);
-          header->seq = chitcp_htonl(data->SND_NXT);
-          header->ack_seq = chitcp_htonl(data->RCV_NXT);
-          header->ack = (1);
-          chilog_tcp(CRITICAL, new, LOG_OUTBOUND);                
-          chitcpd_send_tcp_packet(si, entry, new);
-          chitcp_tcp_packet_free(new);
-          chitcp_tcp_packet_free(arrived);
-            chitcpd_update_tcp_state(si,entry,CLOSING);
-            return CHITCP_OK;
-          }
-    if (((SEG_SEQ(arrived)==data->RCV_NXT)) || ((data->RCV_NXT<=SEG_SEQ(arrived)) && (SEG_SEQ(arrived)<(data->RCV_NXT+data->RCV_WND)))){
-      printf("aaaaaaaaa 2\n");
-      if (!ar_header->ack){
-        chilog(ERROR,"drop segment and return");
-        return CHITCP_OK;
-      }
-      if ((data->SND_UNA <= SEG_ACK(arrived)) && (SEG_ACK(arrived)<=data->SND_NXT)){
-        data->SND_UNA=SEG_ACK(arrived);
-        if (SEG_ACK(arrived)<data->SND_UNA){
-          chilog(ERROR,"Ignore duplicate packet");
-          chitcp_tcp_packet_free(arrived);
-          return CHITCP_OK;
-        }
-        if(SEG_ACK(arrived) > data->SND_NXT){
-         chilog(ERROR,"acked something not yet sent");
-          return CHITCP_OK ;
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_segment_t *segment;
+    uint32_t pipe = chitcpd_sack_pipe(tcp_data);
+
+    for (unsigned int i = 0; i < list_size(&tcp_data->retransmission_queue); i++)
+    {
+        segment = list_get_at(&tcp_data->retransmission_queue, i);
+
+        if (segment->sacked || !segment->lost || segment->retransmitted)
+            continue;
+        if (pipe + TCP_SEGMENT_END(segment) - segment->seq > tcp_data->cwnd)
+            break;
+
+        chitcpd_tcp_retransmit(si, entry, segment);
+        pipe += TCP_SEGMENT_END(segment) - segment->seq;
+    }
+}
+
+/*
+ * Fast retransmit and fast recovery, called for every ACK once the SACK
+ * scoreboard (if any) has been updated. Fast recovery is entered when
+ * the oldest segment in flight is deemed lost: after TCP_DUPTHRESH
+ * duplicate ACKs (RFC 5681, section 3.2) or, with SACK, as soon as
+ * enough of what follows it has been SACKed (RFC 6675, section 5). The
+ * congestion window is reduced once for the whole window of data that
+ * was in flight (up to RECOVER).
+ *
+ * It is not entered while recovering from a retransmission timeout,
+ * when the go-back-N retransmissions are bound to produce duplicate
+ * ACKs (RFC 6582, section 3.2).
+ */
+static void chitcpd_tcp_fast_recovery(serverinfo_t *si, chisocketentry_t *entry, bool_t partial_ack)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_segment_t *segment;
+
+    if (list_empty(&tcp_data->retransmission_queue) || tcp_data->rto_recovery)
+        return;
+
+    segment = list_get_at(&tcp_data->retransmission_queue, 0);
+
+    if (!tcp_data->fast_recovery)
+    {
+        if (tcp_data->dupacks < TCP_DUPTHRESH && !segment->lost)
+            return;
+
+        chilog(DEBUG, "Segment %u is lost (%u duplicate ACKs): entering fast recovery",
+               segment->seq, tcp_data->dupacks);
+
+        tcp_data->cc->on_loss(tcp_data);
+        tcp_data->fast_recovery = TRUE;
+        tcp_data->RECOVER = tcp_data->SND_NXT;
+        for (unsigned int i = 0; i < list_size(&tcp_data->retransmission_queue); i++)
+            ((tcp_segment_t *) list_get_at(&tcp_data->retransmission_queue, i))->retransmitted = FALSE;
+        segment->lost = TRUE;
+
+        if (!tcp_data->sack_permitted)
+        {
+            chitcpd_tcp_retransmit(si, entry, segment);
+            return;
         }
-        printf("aaaaaaaaa 1\n");
-          tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-          tcphdr_t *header;
-          chitcpd_tcp_packet_create(entry, new, NULL, 0);
-          header = TCP_PACKET_HEADER(new);
-          header->seq = chitcp_htonl(data->SND_NXT);
-          header->ack_seq = chitcp_htonl(data->RCV_NXT);
-          header->ack = (1);
-          chilog_tcp(CRITICAL, new, LOG_OUTBOUND);                
-          chitcpd_send_tcp_packet(si, entry, new);
-           chitcp_tcp_packet_free(new);
-          chitcp_tcp_packet_free(arrived);
-          chitcpd_update_tcp_state(si, entry,FIN_WAIT_2);
-          return CHITCP_OK;
+    }
+    else if (!tcp_data->sack_permitted)
+    {
+        /* NewReno: an ACK that doesn't cover RECOVER means the segment
+         * after the one we resent was lost too (RFC 6582, section 3.2) */
+        if (partial_ack)
+            chitcpd_tcp_retransmit(si, entry, segment);
+        return;
+    }
+
+    chitcpd_tcp_sack_recovery(si, entry);
+}
+
+/*
+ * Handles the expiration of the persist timer. If there is nothing in
+ * flight and the peer's window is still closed, we send it one byte of
+ * new data, so that its ACK tells us when the window opens, even if
+ * the window update it sent was lost (RFC 1122, section 4.2.2.17).
+ *
+ * The probe does not go into the retransmission queue, and SND.NXT
+ * stays where it is, unless the peer accepts the byte (see
+ * chitcpd_tcp_process_ack). Otherwise, it is simply sent again with
+ * the next probe, or as new data once the window opens.
+ */
+static void chitcpd_tcp_persist(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    uint32_t buffered_end;
+
+    buffered_end = circular_buffer_first(&tcp_data->send) + circular_buffer_count(&tcp_data->send);
+    if (tcp_data->SND_WND != 0 || !SEQ_LT(tcp_data->SND_NXT, buffered_end) ||
+        !list_empty(&tcp_data->retransmission_queue))
+    {
+        chitcpd_tcp_persist_stop(tcp_data);
+        return;
+    }
+
+    chilog(DEBUG, "Persist timeout: probing zero window (probe #%u)", tcp_data->persist_backoff + 1);
+
+    chitcpd_tcp_send_segment(si, entry, tcp_data->SND_NXT, 1, FALSE, FALSE);
+    if (((uint64_t) tcp_data->RTO << tcp_data->persist_backoff) < TCP_RTO_MAX)
+        tcp_data->persist_backoff++;
+    chitcpd_tcp_persist_arm(tcp_data);
+}
+
+/*
+ * Handles the expiration of the delayed ACK timer, by sending the ACK;
+ * of the persist timer (see chitcpd_tcp_persist); and of the
+ * retransmission timer: retransmits the oldest unacknowledged segment,
+ * and backs off the RTO (RFC 6298, section 5).
+ */
+static void chitcpd_tcp_handle_timeout(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_segment_t *segment;
+
+    if (chitcpd_timer_expired(&tcp_data->delack_timer) && tcp_data->delack_segments > 0)
+        chitcpd_tcp_send_ack(si, entry);
+
+    if (chitcpd_timer_expired(&tcp_data->persist_timer))
+        chitcpd_tcp_persist(si, entry);
+
+    /* The timer may have been stopped or restarted since it fired */
+    if (!chitcpd_timer_expired(&tcp_data->rto_timer) || list_empty(&tcp_data->retransmission_queue))
+        return;
+
+    tcp_data->dupacks = 0;
+
+    tcp_data->RTO *= 2;
+    if (tcp_data->RTO > TCP_RTO_MAX)
+        tcp_data->RTO = TCP_RTO_MAX;
+
+    segment = list_get_at(&tcp_data->retransmission_queue, 0);
+
+    /* Only the first timeout for a segment is a new congestion
+     * signal; repeated ones keep ssthresh (RFC 5681, section 3.1) */
+    if (segment->transmissions == 1)
+        tcp_data->cc->on_rto(tcp_data);
+
+    chilog(DEBUG, "Retransmission timeout: resending segment %u (%u bytes, transmission #%i, RTO=%ums)",
+           segment->seq, segment->len, segment->transmissions + 1, tcp_data->RTO / 1000);
+
+    chitcpd_tcp_retransmit(si, entry, segment);
+    chitcpd_tcp_timer_arm(tcp_data, tcp_data->RTO);
+
+    tcp_data->rto_recovery = TRUE;
+    tcp_data->fast_recovery = FALSE;
+    tcp_data->RECOVER = tcp_data->SND_NXT;
+}
+
+
+/*
+ *  Processing incoming segments
+ */
+
+static tcp_packet_t *chitcpd_tcp_fetch_packet(tcp_data_t *tcp_data)
+{
+    tcp_packet_t *packet;
+
+    pthread_mutex_lock(&tcp_data->lock_pending_packets);
+    packet = list_fetch(&tcp_data->pending_packets);
+    pthread_mutex_unlock(&tcp_data->lock_pending_packets);
+
+    return packet;
+}
+
+/*
+ * Segment acceptability test (RFC 793, page 69)
+ */
+static bool_t chitcpd_tcp_acceptable(tcp_data_t *tcp_data, uint32_t seq, uint32_t seg_len, uint32_t wnd)
+{
+    uint32_t rcv_nxt = tcp_data->RCV_NXT;
+
+    if (seg_len == 0)
+    {
+        if (wnd == 0)
+            return seq == rcv_nxt;
+        return SEQ_LEQ(rcv_nxt, seq) && SEQ_LT(seq, rcv_nxt + wnd);
+    }
+
+    if (wnd == 0)
+        return FALSE;
+
+    return (SEQ_LEQ(rcv_nxt, seq) && SEQ_LT(seq, rcv_nxt + wnd)) ||
+           (SEQ_LEQ(rcv_nxt, seq + seg_len - 1) && SEQ_LT(seq + seg_len - 1, rcv_nxt + wnd));
+}
+
+/*
+ * Removes the segments acknowledged by "ack" from the retransmission
+ * queue, trimming the first one if it is only partially acknowledged.
+ *
+ * Following Karn's rule, the round-trip time is only measured when
+ * none of the acknowledged segments have been retransmitted (otherwise
+ * we can't know which transmission is being acknowledged).
+ */
+static void chitcpd_tcp_ack_segments(tcp_data_t *tcp_data, uint32_t ack)
+{
+    tcp_segment_t *segment;
+    struct timespec sent, now;
+    bool_t sample = TRUE, acked_any = FALSE;
+    uint32_t acked;
+
+    while (!list_empty(&tcp_data->retransmission_queue))
+    {
+        segment = list_get_at(&tcp_data->retransmission_queue, 0);
+
+        if (SEQ_LEQ(TCP_SEGMENT_END(segment), ack))
+        {
+            if (segment->transmissions > 1)
+                sample = FALSE;
+            sent = segment->sent;
+            acked_any = TRUE;
+
+            list_delete_at(&tcp_data->retransmission_queue, 0);
+            chitcpd_tcp_segment_free(tcp_data, segment);
         }
-       
+        else
+        {
+            if (SEQ_GT(ack, segment->seq))
+            {
+                acked = ack - segment->seq;
+                if (segment->syn)
+                {
+                    segment->syn = FALSE;
+                    acked--;
+                }
+                segment->seq = ack;
+                segment->len -= acked;
+            }
+            break;
         }
-        
-        
-    else {
-     chilog(ERROR,"segment not acceptable");
-      return CHITCP_OK ;
-     }
-   }
-  else
-    chilog(WARNING, "In FIN_WAIT_1 state, received unexpected event (%i).", event);
+    }
 
-  return CHITCP_OK;
+    if (acked_any && sample)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        chitcpd_tcp_update_rto(tcp_data, chitcpd_tcp_usecs_between(&sent, &now));
+    }
 }
 
+/*
+ * An ACK is a duplicate if it acknowledges nothing new while there is
+ * data in flight, and carries no data, SYN, FIN, or window update
+ * (RFC 5681, section 2)
+ */
+static bool_t chitcpd_tcp_is_dupack(tcp_data_t *tcp_data, tcp_packet_t *packet)
+{
+    tcphdr_t *header = TCP_PACKET_HEADER(packet);
 
-int chitcpd_tcp_state_handle_FIN_WAIT_2(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+    return SEG_ACK(packet) == tcp_data->SND_UNA &&
+           !list_empty(&tcp_data->retransmission_queue) &&
+           TCP_PAYLOAD_LEN(packet) == 0 && !header->syn && !header->fin &&
+           chitcpd_tcp_seg_wnd(tcp_data, packet) == tcp_data->SND_WND;
+}
+
+/*
+ * Processes the ACK field of an incoming segment in a synchronized
+ * state (RFC 793, page 72): releases acknowledged data, updates the
+ * send window, and detects lost segments (see chitcpd_tcp_fast_recovery).
+ *
+ * Returns FALSE if the segment acknowledges something we have not sent
+ * yet, in which case it must be dropped.
+ */
+static bool_t chitcpd_tcp_process_ack(serverinfo_t *si, chisocketentry_t *entry, tcp_packet_t *packet)
 {
-  if (event == PACKET_ARRIVAL)
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    uint32_t seq = SEG_SEQ(packet);
+    uint32_t ack = SEG_ACK(packet);
+    uint32_t first, acked;
+    tcp_options_t options;
+    bool_t partial_ack = FALSE;
+
+    /* The peer accepted our zero window probe (see chitcpd_tcp_persist),
+     * so the byte in it now counts as sent */
+    if (tcp_data->persist_backoff > 0 && ack == tcp_data->SND_NXT + 1)
+        tcp_data->SND_NXT = ack;
+
+    if (SEQ_GT(ack, tcp_data->SND_NXT))
     {
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    data->SND_WND=SEG_WND(arrived);
-    if (((SEG_SEQ(arrived)==data->RCV_NXT)) || ((data->RCV_NXT<=SEG_SEQ(arrived)) && (SEG_SEQ(arrived)<(data->RCV_NXT+data->RCV_WND)))){
-      if (!ar_header->ack){
-        chilog(ERROR,"drop segment and return");
-        return CHITCP_OK;
-      }
-      if ((data->SND_UNA < SEG_ACK(arrived)) && (SEG_ACK(arrived)<=data->SND_NXT)){
-        data->SND_UNA=SEG_ACK(arrived);
-        if (SEG_ACK(arrived)<data->SND_UNA){
-          chilog(ERROR,"Ignore duplicate packet");
-          chitcp_tcp_packet_free(arrived);
-          return CHITCP_OK ;
-        }
-        chitcp_tcp_packet_free(arrived);
-        chitcpd_update_tcp_state(si, entry,CLOSED);
-        //chitcpd_free_socket_entry(si, entry); 
-        return CHITCP_OK;
-      }
-       if(SEG_ACK(arrived) > data->SND_NXT){
-          tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-          tcphdr_t *header;
-          header = TCP_PACKET_HEADER(new);
-          header->seq = data->SND_NXT;
-          header->ack_seq = data->RCV_NXT;
-          header->ack = (1);
-          chitcpd_send_tcp_packet(si, entry, new);
-          chilog_tcp(CRITICAL, new, LOG_OUTBOUND);
-          chitcp_tcp_packet_free(arrived);
-          chitcp_tcp_packet_free(new);
-          return CHITCP_OK ;
+        chilog(WARNING, "Received ACK for data that has not been sent yet (SEG.ACK=%u, SND.NXT=%u)",
+               ack, tcp_data->SND_NXT);
+        chitcpd_tcp_send_ack(si, entry);
+        return FALSE;
+    }
+
+    if (SEQ_GT(ack, tcp_data->SND_UNA))
+    {
+        chitcpd_tcp_ack_segments(tcp_data, ack);
+
+        tcp_data->dupacks = 0;
+
+        /* The window is not grown during fast recovery, and is left
+         * at the ssthresh set on entering it (RFC 6675, section 5,
+         * and RFC 6582, section 3.2) */
+        if (tcp_data->fast_recovery && SEQ_GEQ(ack, tcp_data->RECOVER))
+            tcp_data->fast_recovery = FALSE;
+        else if (tcp_data->fast_recovery)
+            partial_ack = TRUE;
+        else if (entry->tcp_state != SYN_SENT && entry->tcp_state != SYN_RCVD)
+            tcp_data->cc->on_ack(tcp_data, ack - tcp_data->SND_UNA);
+
+        /* The peer is making progress, so drop any backoff. Karn's rule
+         * won't let us take RTT samples while we are resending lost
+         * data, so waiting for a fresh sample (RFC 6298, section 5.7)
+         * would keep the RTO backed off through every later loss. */
+        chitcpd_tcp_set_rto(tcp_data);
+
+        /* Acknowledged data (but not our SYN or FIN) can now be
+         * removed from the send buffer */
+        first = circular_buffer_first(&tcp_data->send);
+        if (SEQ_GT(ack, first))
+        {
+            acked = ack - first;
+            if (acked > circular_buffer_count(&tcp_data->send))
+                acked = circular_buffer_count(&tcp_data->send);
+            circular_buffer_commit(&tcp_data->send, acked);
         }
-        else {
-          data->SND_WND = SEG_WND(arrived);
-          tcp_packet_t *new = (tcp_packet_t *)malloc(sizeof(tcp_packet_t));
-          tcphdr_t *header;
-          chitcpd_tcp_packet_create(entry, new, NULL, 0);
-          header = TCP_PACKET_HEADER(new);
-          header->seq = chitcp_htonl(data->SND_NXT);
-          header->ack_seq = chitcp_htonl(data->RCV_NXT);
-          header->ack = (1);
-          circular_buffer_write(&data->recv, TCP_PAYLOAD_START(arrived), TCP_PAYLOAD_LEN(arrived),FALSE);
-          data->RCV_NXT += TCP_PAYLOAD_LEN(arrived);
-          data->RCV_WND = circular_buffer_available(&data->recv);
-          chilog_tcp(CRITICAL, new, LOG_OUTBOUND);                
-          chitcpd_send_tcp_packet(si, entry, new);
-          chitcp_tcp_packet_free(arrived);
-          chitcp_tcp_packet_free(new);
+
+        tcp_data->SND_UNA = ack;
+
+        if (tcp_data->rto_recovery)
+        {
+            if (SEQ_LT(ack, tcp_data->RECOVER))
+                chitcpd_tcp_retransmit_lost(si, entry);
+            else
+                tcp_data->rto_recovery = FALSE;
         }
-        
-      }
-    else{
-      chilog(ERROR,"segment not acceptable");
+
+        /* Restart the timer for whatever is still in flight
+         * (RFC 6298, sections 5.2 and 5.3) */
+        if (list_empty(&tcp_data->retransmission_queue))
+            chitcpd_tcp_timer_disarm(tcp_data);
+        else
+            chitcpd_tcp_timer_arm(tcp_data, tcp_data->RTO);
+    }
+    else if (chitcpd_tcp_is_dupack(tcp_data, packet))
+        tcp_data->dupacks++;
+
+    /* Duplicate ACKs carry SACK information too */
+    if (tcp_data->sack_permitted && chitcp_tcp_options_parse(packet, &options) == CHITCP_OK &&
+        options.nsack > 0)
+        chitcpd_sack_update(tcp_data, options.sack, options.nsack);
+
+    chitcpd_tcp_fast_recovery(si, entry, partial_ack);
+
+    /* Only take the window from segments that are not older than the
+     * one we last took it from */
+    if (SEQ_LEQ(tcp_data->SND_UNA, ack) &&
+        (SEQ_LT(tcp_data->SND_WL1, seq) ||
+         (tcp_data->SND_WL1 == seq && SEQ_LEQ(tcp_data->SND_WL2, ack))))
+    {
+        tcp_data->SND_WND = chitcpd_tcp_seg_wnd(tcp_data, packet);
+        tcp_data->SND_WL1 = seq;
+        tcp_data->SND_WL2 = ack;
     }
-  }
-    
-  else
-    chilog(WARNING, "In FIN_WAIT_2 state, received unexpected event (%i).", event);
 
-  return CHITCP_OK;
+    if (tcp_data->SND_WND > 0)
+        chitcpd_tcp_persist_stop(tcp_data);
+
+    return TRUE;
 }
 
+/*
+ * Accepts the part of a segment's payload that falls within the receive
+ * window. In-sequence data goes straight into the receive buffer, along
+ * with any queued out-of-order data that it makes contiguous; data
+ * beyond RCV.NXT is held in the reassembly queue until the gap in front
+ * of it is filled. Data we already have is skipped.
+ */
+static void chitcpd_tcp_receive_data(tcp_data_t *tcp_data, uint32_t seq, uint8_t *payload, uint32_t len)
+{
+    uint32_t skip, window_end;
 
-int chitcpd_tcp_state_handle_CLOSE_WAIT(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+    if (SEQ_LT(seq, tcp_data->RCV_NXT))
+    {
+        skip = tcp_data->RCV_NXT - seq;
+        if (skip >= len)
+            return;
+        seq += skip;
+        payload += skip;
+        len -= skip;
+    }
+
+    window_end = tcp_data->RCV_NXT + chitcpd_tcp_rcv_window(tcp_data);
+    if (SEQ_GEQ(seq, window_end))
+        return;
+    if (SEQ_GT(seq + len, window_end))
+        len = window_end - seq;
+
+    if (seq != tcp_data->RCV_NXT)
+    {
+        chilog(DEBUG, "Queueing out-of-order segment (SEG.SEQ=%u, RCV.NXT=%u)", seq, tcp_data->RCV_NXT);
+        chitcpd_reassembly_insert(&tcp_data->reassembly, seq, payload, len);
+        return;
+    }
+
+    circular_buffer_write(&tcp_data->recv, payload, len, BUFFER_NONBLOCKING);
+    tcp_data->RCV_NXT += len;
+
+    chitcpd_reassembly_release(&tcp_data->reassembly, &tcp_data->RCV_NXT, &tcp_data->recv);
+    chitcpd_tcp_rcvbuf_adjust(tcp_data);
+}
+
+/*
+ * Handles an incoming segment in any of the synchronized states
+ * (and in SYN_RCVD), following RFC 793, pages 69-76.
+ */
+static int chitcpd_tcp_handle_segment(serverinfo_t *si, chisocketentry_t *entry)
 {
-  if (event == APPLICATION_CLOSE)
-    {
-      printf("in close_wait application close\n");
-      //sem_wait(&s);
-
-      tcp_data_t *data = &entry->socket_state.active.tcp_data;
-      if (circular_buffer_count(&data->send) == 0) {
-        send_fin(si, entry);
-        chitcpd_update_tcp_state(si, entry, LAST_ACK);
-      }
-      else {
-        closing_state = 1;
-      }
-      return CHITCP_OK ;
-    }
-  else if (event == PACKET_ARRIVAL)
-    {
-    printf("in close wait pcket arrival\n");
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    data->SND_WND=SEG_WND(arrived); 
-    /*
-    if(ar_header->fin){
-          //circular_buffer_close(&data->recv);
-          printf("I don' wanna nananananna!\n");
-          send_fin(si,entry);
-          chitcpd_update_tcp_state(si, entry, LAST_ACK);
-          return CHITCP_OK;
-    } */
-    if (((SEG_SEQ(arrived)==data->RCV_NXT)) || ((data->RCV_NXT<=SEG_SEQ(arrived)) && (SEG_SEQ(arrived)<(data->RCV_NXT+data->RCV_WND)))){
-      if (!ar_header->ack) {
-        chitcp_tcp_packet_free(arrived);
-        chilog(ERROR,"drop segment and return");
-         return CHITCP_OK;
-      }
-      if ((data->SND_UNA<=SEG_ACK(arrived))&&(SEG_ACK(arrived)<=data->SND_NXT)){
-        data->SND_UNA=SEG_ACK(arrived);
-        if (SEG_ACK(arrived)<data->SND_UNA){
-          chilog(ERROR,"Ignore duplicate packet");
-          chitcp_tcp_packet_free(arrived);
-          return CHITCP_OK;
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_packet_t *packet;
+    tcphdr_t *header;
+    uint32_t seq, payload_len;
+    bool_t acceptable, fin_acked, need_ack = FALSE, delay_ack = FALSE;
+
+    packet = chitcpd_tcp_fetch_packet(tcp_data);
+    if (packet == NULL)
+        return CHITCP_OK;
+
+    header = TCP_PACKET_HEADER(packet);
+    seq = SEG_SEQ(packet);
+    payload_len = TCP_PAYLOAD_LEN(packet);
+
+    /* If the peer retransmits its SYN, our SYN/ACK was probably lost */
+    if (entry->tcp_state == SYN_RCVD && header->syn && !header->ack && seq == tcp_data->IRS)
+    {
+        chitcpd_tcp_send_segment(si, entry, tcp_data->ISS, 0, TRUE, FALSE);
+        goto done;
+    }
+
+    acceptable = chitcpd_tcp_acceptable(tcp_data, seq, SEG_LEN(packet),
+                                        chitcpd_tcp_rcv_window(tcp_data));
+
+    /* An unacceptable segment is answered with an ACK (which lets the
+     * peer know what we're actually expecting). With a zero window we
+     * still have to process the ACK field of in-sequence segments. */
+    if (!acceptable)
+    {
+        chitcpd_tcp_send_ack(si, entry);
+
+        /* A retransmitted FIN means our ACK was lost. The peer gets
+         * another 2*MSL to receive the new one (RFC 793, page 73). */
+        if (entry->tcp_state == TIME_WAIT && header->fin)
+            chitcpd_timer_arm(&tcp_data->time_wait_timer, 2 * si->msl);
+
+        if (seq != tcp_data->RCV_NXT || chitcpd_tcp_rcv_window(tcp_data) != 0)
+            goto done;
+    }
+
+    if (!header->ack)
+        goto done;
+
+    if (entry->tcp_state == SYN_RCVD)
+    {
+        if (SEQ_LEQ(SEG_ACK(packet), tcp_data->SND_UNA) || SEQ_GT(SEG_ACK(packet), tcp_data->SND_NXT))
+        {
+            chilog(WARNING, "Received unacceptable ACK in SYN_RCVD (SEG.ACK=%u)", SEG_ACK(packet));
+            goto done;
         }
-        if(SEG_ACK(arrived) > data->SND_NXT){
-          chilog(ERROR,"acked something not yet sent");
-          return CHITCP_OK;
+        chitcpd_tcp_process_ack(si, entry, packet);
+        chitcpd_update_tcp_state(si, entry, ESTABLISHED);
+    }
+    else if (!chitcpd_tcp_process_ack(si, entry, packet))
+        goto done;
+
+    fin_acked = tcp_data->fin_sent && tcp_data->SND_UNA == tcp_data->SND_NXT;
+
+    if (entry->tcp_state == FIN_WAIT_1 && fin_acked)
+        chitcpd_update_tcp_state(si, entry, FIN_WAIT_2);
+    else if (entry->tcp_state == CLOSING && fin_acked)
+        chitcpd_tcp_time_wait(si, entry);
+    else if (entry->tcp_state == LAST_ACK && fin_acked)
+    {
+        chitcpd_update_tcp_state(si, entry, CLOSED);
+        goto done;
+    }
+
+    /* Segment text and FIN are only processed while we can still
+     * receive data */
+    if (acceptable && (entry->tcp_state == ESTABLISHED ||
+                       entry->tcp_state == FIN_WAIT_1 ||
+                       entry->tcp_state == FIN_WAIT_2))
+    {
+        if (payload_len > 0)
+        {
+            /* Only the ACK for in-sequence data that leaves no gap
+             * behind can be delayed. Out-of-order data and duplicates
+             * (which the peer needs duplicate ACKs for), and data that
+             * fills a gap, are acknowledged right away (RFC 5681,
+             * section 4.2). */
+            if (seq == tcp_data->RCV_NXT && tcp_data->reassembly.bytes == 0)
+                delay_ack = TRUE;
+            else
+                need_ack = TRUE;
+
+            chitcpd_tcp_receive_data(tcp_data, seq, TCP_PAYLOAD_START(packet), payload_len);
+
+            if (tcp_data->reassembly.bytes > 0)
+                need_ack = TRUE;
         }
-        else {
-          chitcp_tcp_packet_free(arrived);
-          return CHITCP_OK;
+
+        /* The FIN may arrive ahead of some of the data in front of it,
+         * so remember where it is until RCV.NXT gets there */
+        if (header->fin && SEQ_GEQ(seq + payload_len, tcp_data->RCV_NXT))
+        {
+            tcp_data->reassembly.fin = TRUE;
+            tcp_data->reassembly.fin_seq = seq + payload_len;
+            need_ack = TRUE;
+        }
+
+        if (tcp_data->reassembly.fin && tcp_data->reassembly.fin_seq == tcp_data->RCV_NXT)
+        {
+            tcp_data->reassembly.fin = FALSE;
+            tcp_data->RCV_NXT++;
+            need_ack = TRUE;
+
+            if (entry->tcp_state == ESTABLISHED)
+                chitcpd_update_tcp_state(si, entry, CLOSE_WAIT);
+            else if (entry->tcp_state == FIN_WAIT_1)
+                chitcpd_update_tcp_state(si, entry, CLOSING);
+            else
+                chitcpd_tcp_time_wait(si, entry);
+
+            /* Nothing else will be written to the receive buffer;
+             * the application can still read what is left in it */
+            circular_buffer_close(&tcp_data->recv);
         }
-      }
     }
-    else {
-     chilog(ERROR,"segment not acceptable");
+
+    if (need_ack)
+        chitcpd_tcp_send_ack(si, entry);
+    else if (delay_ack)
+        tcp_data->delack_segments++;
+
+    /* The ACK may have opened up the window. Any data we send now also
+     * acknowledges the data we just received. */
+    if (entry->tcp_state == ESTABLISHED || entry->tcp_state == CLOSE_WAIT)
+        chitcpd_tcp_output(si, entry);
+
+    chitcpd_tcp_delay_ack(si, entry);
+
+done:
+    chitcpd_packet_free(packet);
+
+    return CHITCP_OK;
+}
+
+/*
+ * Called when the application has read data from the receive buffer.
+ * If the window we last advertised was too small for a full segment
+ * (or, with a small buffer, half of it: RFC 1122, section 4.2.3.3),
+ * or the window has at least doubled since then, let the peer know
+ * (otherwise, it could be stuck waiting for its persist timer, or for
+ * our next delayed ACK). Smaller increases are not worth a segment of
+ * their own, and are left for the next ACK we send anyway.
+ */
+static void chitcpd_tcp_window_update(serverinfo_t *si, chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    uint32_t available = chitcpd_tcp_rcv_window(tcp_data);
+    uint32_t segment = tcp_data->RMSS < tcp_data->rcvbuf / 2 ? tcp_data->RMSS : tcp_data->rcvbuf / 2;
+
+    if (available >= segment && (tcp_data->RCV_WND < segment || available >= 2 * tcp_data->RCV_WND))
+        chitcpd_tcp_send_ack(si, entry);
+}
+
+
+/*
+ *  State handlers
+ */
+
+int chitcpd_tcp_state_handle_CLOSED(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    if (event == APPLICATION_CONNECT)
+    {
+        tcp_data->ISS = rand();
+        tcp_data->SND_UNA = tcp_data->ISS;
+        tcp_data->SND_NXT = tcp_data->ISS;
+        circular_buffer_set_seq_initial(&tcp_data->send, tcp_data->ISS + 1);
+
+        if (chitcpd_tcp_transmit(si, entry, 0, TRUE, FALSE) != CHITCP_OK)
+            return CHITCP_ENOMEM;
+        chitcpd_update_tcp_state(si, entry, SYN_SENT);
     }
-  }
-  else
-    chilog(WARNING, "In CLOSE_WAIT state, received unexpected event (%i).", event);
+    else if (event == CLEANUP)
+    {
+        /* The TCP thread frees the socket entry, but its timers
+         * have to be stopped first */
+        chitcpd_timer_cancel(&tcp_data->rto_timer);
+        chitcpd_timer_cancel(&tcp_data->persist_timer);
+        chitcpd_timer_cancel(&tcp_data->delack_timer);
+        chitcpd_timer_cancel(&tcp_data->time_wait_timer);
+    }
+    else
+        chilog(WARNING, "In CLOSED state, received unexpected event.");
 
+    return CHITCP_OK;
+}
+
+int chitcpd_tcp_state_handle_LISTEN(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_packet_t *packet;
+    tcp_options_t options;
+
+    if (event == PACKET_ARRIVAL)
+    {
+        packet = chitcpd_tcp_fetch_packet(tcp_data);
+        if (packet == NULL)
+            return CHITCP_OK;
+
+        if (TCP_PACKET_HEADER(packet)->ack || !TCP_PACKET_HEADER(packet)->syn)
+        {
+            chilog(WARNING, "In LISTEN state, received a segment that is not a SYN.");
+            chitcpd_packet_free(packet);
+            return CHITCP_OK;
+        }
+
+        tcp_data->IRS = SEG_SEQ(packet);
+        tcp_data->RCV_NXT = tcp_data->IRS + 1;
+        circular_buffer_set_seq_initial(&tcp_data->recv, tcp_data->RCV_NXT);
+
+        tcp_data->SND_WND = chitcpd_tcp_seg_wnd(tcp_data, packet);
+        tcp_data->SND_WL1 = tcp_data->IRS;
+        tcp_data->SND_WL2 = 0;
+
+        chitcp_tcp_options_parse(packet, &options);
+        chitcpd_tcp_negotiate_mss(tcp_data, &options);
+        chitcpd_tcp_negotiate_wscale(tcp_data, &options);
+        tcp_data->sack_permitted = options.sack_permitted && !si->sack_disabled;
+
+        tcp_data->ISS = rand();
+        tcp_data->SND_UNA = tcp_data->ISS;
+        tcp_data->SND_NXT = tcp_data->ISS;
+        circular_buffer_set_seq_initial(&tcp_data->send, tcp_data->ISS + 1);
+
+        chitcpd_packet_free(packet);
+
+        chitcpd_update_tcp_state(si, entry, SYN_RCVD);
+        if (chitcpd_tcp_transmit(si, entry, 0, TRUE, FALSE) != CHITCP_OK)
+            return CHITCP_ENOMEM;
+    }
+    else
+        chilog(WARNING, "In LISTEN state, received unexpected event.");
 
-  return CHITCP_OK;
+    return CHITCP_OK;
 }
 
+int chitcpd_tcp_state_handle_SYN_RCVD(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In SYN_RCVD state, received unexpected event.");
 
-int chitcpd_tcp_state_handle_CLOSING(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+    return CHITCP_OK;
+}
+
+int chitcpd_tcp_state_handle_SYN_SENT(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
 {
-  if (event == PACKET_ARRIVAL)
-    {
-      tcp_data_t *data = &entry->socket_state.active.tcp_data;
-      tcp_packet_t *arrived = handle_packet_arrival(entry);
-      tcphdr_t *ar_header;
-      ar_header = TCP_PACKET_HEADER(arrived);
-      data->SND_WND=SEG_WND(arrived);
-      if (((SEG_SEQ(arrived)==data->RCV_NXT)) || ((data->RCV_NXT<=SEG_SEQ(arrived)) && (SEG_SEQ(arrived)<(data->RCV_NXT+data->RCV_WND)))){
-      if (!ar_header->ack){
-        chitcp_tcp_packet_free(arrived);
-        chilog(ERROR,"drop segment and return");
-        return CHITCP_OK;
-      }
-      if ((data->SND_UNA<=SEG_ACK(arrived))&&(SEG_ACK(arrived)<=data->SND_NXT)){
-        data->SND_UNA=SEG_ACK(arrived);
-        if (SEG_ACK(arrived)<data->SND_UNA){
-          chilog(ERROR,"Ignore duplicate packet");
-          chitcp_tcp_packet_free(arrived);
-          return CHITCP_OK ;
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    tcp_packet_t *packet;
+    tcp_options_t options;
+    tcphdr_t *header;
+
+    if (event == PACKET_ARRIVAL)
+    {
+        packet = chitcpd_tcp_fetch_packet(tcp_data);
+        if (packet == NULL)
+            return CHITCP_OK;
+        header = TCP_PACKET_HEADER(packet);
+
+        if (header->ack && (SEQ_LEQ(SEG_ACK(packet), tcp_data->ISS) ||
+                            SEQ_GT(SEG_ACK(packet), tcp_data->SND_NXT)))
+        {
+            chilog(WARNING, "In SYN_SENT state, received unacceptable ACK (SEG.ACK=%u)", SEG_ACK(packet));
+            chitcpd_packet_free(packet);
+            return CHITCP_OK;
+        }
+
+        if (!header->syn)
+        {
+            chitcpd_packet_free(packet);
+            return CHITCP_OK;
+        }
+
+        tcp_data->IRS = SEG_SEQ(packet);
+        tcp_data->RCV_NXT = tcp_data->IRS + 1;
+        circular_buffer_set_seq_initial(&tcp_data->recv, tcp_data->RCV_NXT);
+
+        /* We offered window scaling and SACK in our SYN; it's up to the peer */
+        chitcp_tcp_options_parse(packet, &options);
+        chitcpd_tcp_negotiate_mss(tcp_data, &options);
+        chitcpd_tcp_negotiate_wscale(tcp_data, &options);
+        tcp_data->sack_permitted = options.sack_permitted && !si->sack_disabled;
+
+        if (header->ack)
+            chitcpd_tcp_process_ack(si, entry, packet);
+
+        tcp_data->SND_WND = chitcpd_tcp_seg_wnd(tcp_data, packet);
+        tcp_data->SND_WL1 = SEG_SEQ(packet);
+        tcp_data->SND_WL2 = SEG_ACK(packet);
+
+        if (SEQ_GT(tcp_data->SND_UNA, tcp_data->ISS))
+        {
+            chitcpd_update_tcp_state(si, entry, ESTABLISHED);
+            chitcpd_tcp_send_ack(si, entry);
+
+            /* The application may have written data before the
+             * connection was established */
+            chitcpd_tcp_output(si, entry);
         }
-        chitcpd_update_tcp_state(si, entry,TIME_WAIT);
-        //Transition to CLOSE_WAIT because TIME_WAIT is not supported, need to double check this
+        else
+        {
+            /* Simultaneous open: our SYN is still in the retransmission
+             * queue; resend it, now acknowledging the peer's SYN */
+            chitcpd_update_tcp_state(si, entry, SYN_RCVD);
+            chitcpd_tcp_send_segment(si, entry, tcp_data->ISS, 0, TRUE, FALSE);
         }
-        chitcp_tcp_packet_free(arrived);
-        return CHITCP_OK ;
-  
-      }
-    else {
-      chilog(ERROR,"segment not acceptabe");
-     }
-   }
-  
-  else
-    chilog(WARNING, "In CLOSING state, received unexpected event (%i).", event);
 
-  return CHITCP_OK;
+        chitcpd_packet_free(packet);
+    }
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In SYN_SENT state, received unexpected event.");
+
+    return CHITCP_OK;
 }
 
+int chitcpd_tcp_state_handle_ESTABLISHED(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    if (event == APPLICATION_SEND)
+        chitcpd_tcp_output(si, entry);
+    else if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == APPLICATION_RECEIVE)
+        chitcpd_tcp_window_update(si, entry);
+    else if (event == APPLICATION_CLOSE)
+    {
+        /* The FIN is sent once everything in the send buffer has been sent */
+        tcp_data->closing = TRUE;
+        chitcpd_tcp_output(si, entry);
+    }
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In ESTABLISHED state, received unexpected event (%i).", event);
 
-int chitcpd_tcp_state_handle_TIME_WAIT(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+    return CHITCP_OK;
+}
+
+int chitcpd_tcp_state_handle_FIN_WAIT_1(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
 {
-  chitcpd_update_tcp_state(si, entry,CLOSED);
-  chilog(WARNING, "Running handler for TIME_WAIT. This should not happen.");
+    if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == APPLICATION_RECEIVE)
+        chitcpd_tcp_window_update(si, entry);
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In FIN_WAIT_1 state, received unexpected event (%i).", event);
 
-  return CHITCP_OK;
+    return CHITCP_OK;
 }
 
+int chitcpd_tcp_state_handle_FIN_WAIT_2(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == APPLICATION_RECEIVE)
+        chitcpd_tcp_window_update(si, entry);
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In FIN_WAIT_2 state, received unexpected event (%i).", event);
 
-int chitcpd_tcp_state_handle_LAST_ACK(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+    return CHITCP_OK;
+}
+
+int chitcpd_tcp_state_handle_CLOSE_WAIT(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
 {
-  if (event == PACKET_ARRIVAL)
-    {
-    tcp_data_t *data = &entry->socket_state.active.tcp_data;
-    tcp_packet_t *arrived = handle_packet_arrival(entry);
-    tcphdr_t *ar_header;
-    ar_header = TCP_PACKET_HEADER(arrived);
-    data->SND_WND=SEG_WND(arrived);
-    printf("soooo meal~\n");
-    if (((SEG_SEQ(arrived)==data->RCV_NXT)) || ((data->RCV_NXT<=SEG_SEQ(arrived)) && (SEG_SEQ(arrived)<(data->RCV_NXT+data->RCV_WND)))){
-      if(!ar_header->ack){
-        chitcp_tcp_packet_free(arrived);
-        chilog(ERROR,"drop segment and return");
-        return CHITCP_OK;
-      }
-      printf("soooo meaningfull~\n");
-      if((data->SND_UNA<=SEG_ACK(arrived))&&(SEG_ACK(arrived)<=data->SND_NXT)){
-        printf("soooo ful of meanings~\n");
-        chitcpd_update_tcp_state(si, entry,CLOSED);
-        chitcp_tcp_packet_free(arrived);
-        //chitcpd_free_socket_entry(si, entry); 
-        return CHITCP_OK;
-      }
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    if (event == APPLICATION_CLOSE)
+    {
+        tcp_data->closing = TRUE;
+        chitcpd_tcp_output(si, entry);
     }
-    else{
-      chilog(ERROR,"segment not acceptable");
+    else if (event == APPLICATION_SEND)
+        chitcpd_tcp_output(si, entry);
+    else if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In CLOSE_WAIT state, received unexpected event (%i).", event);
+
+    return CHITCP_OK;
+}
+
+int chitcpd_tcp_state_handle_CLOSING(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In CLOSING state, received unexpected event (%i).", event);
+
+    return CHITCP_OK;
+}
+
+int chitcpd_tcp_state_handle_TIME_WAIT(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+
+    /* Until the TIME_WAIT timer fires, we only acknowledge
+     * retransmissions of the peer's FIN */
+    if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == TIMEOUT)
+    {
+        if (chitcpd_timer_expired(&tcp_data->time_wait_timer))
+            chitcpd_update_tcp_state(si, entry, CLOSED);
     }
-  }
-  else
-    chilog(WARNING, "In LAST_ACK state, received unexpected event (%i).", event);
+    else
+        chilog(WARNING, "In TIME_WAIT state, received unexpected event (%i).", event);
 
-  return CHITCP_OK;
+    return CHITCP_OK;
 }
 
-/*                                                           */
-/*     Any additional functions you need should go here      */
-/*                                                           */
+int chitcpd_tcp_state_handle_LAST_ACK(serverinfo_t *si, chisocketentry_t *entry, tcp_event_type_t event)
+{
+    if (event == PACKET_ARRIVAL)
+        chitcpd_tcp_handle_segment(si, entry);
+    else if (event == TIMEOUT)
+        chitcpd_tcp_handle_timeout(si, entry);
+    else
+        chilog(WARNING, "In LAST_ACK state, received unexpected event (%i).", event);
 
+    return CHITCP_OK;
+}
@@ -39,13 +39,64 @@
  *
  */
 
+#include <time.h>
 #include "chitcp/buffer.h"
+#include "congestion.h"
+#include "reassembly.h"
+#include "timer.h"
 
 #ifndef TCP_H_
 #define TCP_H_
 
-#define TCP_BUFFER_SIZE (4096)
+/* Maximum segment size, in bytes of payload. TCP_MSS is the MSS assumed
+ * for a peer that doesn't send the MSS option (RFC 1122, section
+ * 4.2.2.6). The MSS we advertise is derived from the real connection
+ * chiTCP runs on (see chitcpd_connection_mss), up to TCP_MSS_MAX. */
 #define TCP_MSS (536)
+#define TCP_MSS_MAX (8192)
+
+/* Buffer sizes, in bytes. The send buffer is TCP_SNDBUF_DEFAULT bytes
+ * long unless set with SO_SNDBUF. The receive buffer (and the window we
+ * advertise) starts at TCP_RCVBUF_INITIAL bytes and only grows, up to
+ * TCP_BUFFER_MAX, as far as the bandwidth-delay product of the
+ * connection requires (see chitcpd_tcp_rcvbuf_adjust in tcp.c), unless
+ * a fixed size is set with SO_RCVBUF. Both options are clamped to
+ * [TCP_BUFFER_MIN, TCP_BUFFER_MAX]. */
+#define TCP_BUFFER_MIN (4096)
+#define TCP_SNDBUF_DEFAULT (256 * 1024)
+#define TCP_RCVBUF_INITIAL (64 * 1024)
+#define TCP_BUFFER_MAX (4 * 1024 * 1024)
+
+/* Retransmission timeout bounds, in microseconds. RFC 6298 recommends
+ * a 1 second minimum, but chiTCP mostly runs over loopback or a LAN,
+ * so we use the same 200ms minimum as Linux. */
+#define TCP_RTO_INITIAL (1000000)
+#define TCP_RTO_MIN (200000)
+#define TCP_RTO_MAX (60000000)
+
+/* Number of segments that must arrive after a missing one before the
+ * sender considers it lost (RFC 5681 and RFC 6675's DupThresh) */
+#define TCP_DUPTHRESH (3)
+
+/* Delayed ACKs (RFC 1122, section 4.2.3.2, and RFC 5681, section 4.2):
+ * in-sequence data is acknowledged after at most TCP_DELACK_SEGMENTS
+ * segments or TCP_DELACK_TIMEOUT microseconds, whichever comes first
+ * (unless the ACK can ride on a segment we send before that). Linux
+ * also uses a 40ms minimum delay. */
+#define TCP_DELACK_SEGMENTS (2)
+#define TCP_DELACK_TIMEOUT (40000)
+
+/* Maximum segment lifetime, in microseconds. A connection stays in
+ * TIME_WAIT for twice this long (RFC 793 suggests a two-minute MSL;
+ * like Linux, we stay in TIME_WAIT for a minute). The daemon's MSL
+ * can be changed in serverinfo_t. */
+#define TCP_MSL (30000000)
+
+/* Sequence number comparisons (modulo 2^32) */
+#define SEQ_LT(a, b)  ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t) ((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t) ((a) - (b)) >= 0)
 
 /* TCP events. Roughly correspond to the ones specified in
  * http://tools.ietf.org/html/rfc793#section-3.9 */
@@ -87,7 +138,7 @@ typedef enum
 
     End quote.    */
 
-/* SND.UP, SND.WL1, SND.WL2, and RCV.UP are unused */
+/* SND.UP and RCV.UP are unused */
 
 static char *tcp_event_type_names[] =
 {
@@ -105,6 +156,28 @@ static inline char *tcp_event_str (tcp_event_type_t evt)
     return tcp_event_type_names[evt-1];
 }
 
+/* A segment that has been sent but not yet acknowledged. We only keep
+ * track of the sequence space it occupies: its payload stays in the
+ * send buffer until it is acknowledged, and is read from there again
+ * if the segment has to be retransmitted. */
+typedef struct tcp_segment
+{
+    uint32_t seq;               /* First sequence number */
+    uint32_t len;               /* Payload length (excluding SYN/FIN) */
+    bool_t syn;
+    bool_t fin;
+    struct timespec sent;       /* Time of the last transmission */
+    int transmissions;          /* Number of times it has been sent */
+
+    /* SACK scoreboard (see sack.h) */
+    bool_t sacked;              /* The peer has selectively acknowledged it */
+    bool_t lost;                /* Enough data after it has been SACKed */
+    bool_t retransmitted;       /* Resent during the current fast recovery */
+    struct tcp_segment *next_spare; /* See spare_segments in tcp_data_t */
+} tcp_segment_t;
+
+#define TCP_SEGMENT_END(seg) ((seg)->seq + (seg)->len + (seg)->syn + (seg)->fin)
+
 /* TCP data. Roughly corresponds to the variables and buffers
  * one would expect in a Transmission Control Block (as
  * specified in RFC 793). */
@@ -126,18 +199,109 @@ typedef struct tcp_data
     uint32_t SND_UNA;  /* First byte sent but not acknowledged */
     uint32_t SND_NXT;  /* Next sendable byte */
     uint32_t SND_WND;  /* Send Window */
+    uint32_t SND_WL1;  /* Segment sequence number used for last window update */
+    uint32_t SND_WL2;  /* Segment acknowledgment number used for last window update */
 
     /* Receive sequence variables */
     uint32_t IRS;      /* Initial receive sequence number */
     uint32_t RCV_NXT;  /* Next byte expected */
     uint32_t RCV_WND;  /* Receive Window */
 
+    /* Segment sizes (RFC 5681's SMSS and RMSS): the largest segment we
+     * send, which the peer's MSS option may limit, and the largest we
+     * are willing to receive, which we advertise in our SYN */
+    uint32_t SMSS;
+    uint32_t RMSS;
+
+    /* Window scaling (RFC 7323). Only used if both ends sent the window
+     * scale option in their SYN; otherwise, both shift counts are zero. */
+    bool_t wscale_ok;
+    uint8_t snd_wscale;     /* Applied to the windows the peer advertises */
+    uint8_t rcv_wscale;     /* Applied to the windows we advertise */
+
+    /* Receive buffer autotuning. We never advertise a window that would
+     * have more than rcvbuf bytes waiting in the receive buffer. Unless
+     * set with SO_RCVBUF (rcvbuf_locked), rcvbuf grows with the amount
+     * of data received in a round-trip time, which the receiver
+     * estimates as the time it takes for RCV.NXT to move a window
+     * ahead (rcv_rtt_seq, rcv_rtt_time), in microseconds. */
+    uint32_t rcvbuf;
+    bool_t rcvbuf_locked;
+    uint32_t rcv_rtt;
+    bool_t rcv_rtt_measuring;
+    uint32_t rcv_rtt_seq;
+    struct timespec rcv_rtt_time;
+    uint32_t rcv_space_seq;         /* RCV.NXT when the current RTT started */
+    struct timespec rcv_space_time;
+
     /* Buffers */
     circular_buffer_t send;
     circular_buffer_t recv;
 
+    /* Out-of-order data received within the window */
+    tcp_reassembly_t reassembly;
+
     /* Has a CLOSE been requested on this socket? */
     bool_t closing;
+
+    /* Has our FIN been sent? */
+    bool_t fin_sent;
+
+    /* Retransmission queue (tcp_segment_t), in sequence number order */
+    list_t retransmission_queue;
+
+    /* Segments that have left the retransmission queue, kept for reuse */
+    tcp_segment_t *spare_segments;
+
+    /* Round-trip time estimation (RFC 6298). In microseconds. */
+    uint32_t SRTT;
+    uint32_t RTTVAR;
+    uint32_t RTO;
+    bool_t rtt_measured;
+
+    /* Timers (see timer.h). When any of them fires, the TCP thread
+     * raises a TIMEOUT event. */
+    chitcpd_timer_t rto_timer;
+    chitcpd_timer_t persist_timer;
+    chitcpd_timer_t delack_timer;
+    chitcpd_timer_t time_wait_timer;
+
+    /* Zero window probes sent since the peer last opened its window.
+     * The persist timer is backed off separately from the RTO. */
+    uint32_t persist_backoff;
+
+    /* Number of data segments received since we last sent an ACK */
+    uint32_t delack_segments;
+
+    /* Recovery after a retransmission timeout: everything sent before
+     * the timeout (up to RECOVER) is resent as ACKs come in, starting
+     * at RTX_NXT. */
+    bool_t rto_recovery;
+    uint32_t RECOVER;
+    uint32_t RTX_NXT;
+
+    /* Selective acknowledgements (RFC 2018). Only used if both ends
+     * sent the SACK-permitted option in their SYN. */
+    bool_t sack_permitted;
+
+    /* Duplicate ACKs received in a row (RFC 5681, section 2) */
+    uint32_t dupacks;
+
+    /* Fast recovery: entered when the oldest unacknowledged segment is
+     * deemed lost (after TCP_DUPTHRESH duplicate ACKs or, with SACK,
+     * when enough data after it has been SACKed), and left once
+     * everything sent before that (up to RECOVER) is acknowledged.
+     * Uses the SACK scoreboard (RFC 6675) if SACK is enabled, and
+     * NewReno (RFC 6582) otherwise. */
+    bool_t fast_recovery;
+
+    /* Congestion control (see congestion.h). The sender never has
+     * more than min(cwnd, SND.WND) bytes in flight. */
+    const tcp_congestion_ops_t *cc;
+    uint32_t cwnd;          /* Congestion window */
+    uint32_t ssthresh;      /* Slow start threshold */
+    uint32_t bytes_acked;   /* Acknowledged bytes not yet reflected in cwnd */
+    tcp_cubic_t cubic;
 } tcp_data_t;
 
 #endif /* TCP_H_ */
@@ -118,8 +118,19 @@ void chilog_tcp_data(loglevel_t level, tcp_data_t *tcp_data, tcp_state_t state)
     chilog(level, "        SND.NXT:  %10i       RCV.NXT:  %10i ", tcp_data->SND_NXT, tcp_data->RCV_NXT);
     chilog(level, "        SND.WND:  %10i       RCV.WND:  %10i ", tcp_data->SND_WND, tcp_data->RCV_WND);
     chilog(level, "    Send Buffer: %4i / %4i   Recv Buffer: %4i / %4i", snd_buf_size, snd_buf_capacity, rcv_buf_size, rcv_buf_capacity);
+    chilog(level, "    SMSS: %5u  RMSS: %5u", tcp_data->SMSS, tcp_data->RMSS);
+    chilog(level, "    Window scale: %s (send %i, recv %i)    Autotuned RCVBUF: %u%s",
+           tcp_data->wscale_ok?"YES":"NO", tcp_data->snd_wscale, tcp_data->rcv_wscale,
+           tcp_data->rcvbuf, tcp_data->rcvbuf_locked?" (locked)":"");
     chilog(level, "");
     chilog(level, "       Pending packets: %4i    Closing? %s", list_size(&tcp_data->pending_packets), tcp_data->closing?"YES":"NO");
+    chilog(level, "    Out-of-order data: %5i bytes in %i blocks", tcp_data->reassembly.bytes, list_size(&tcp_data->reassembly.blocks));
+    chilog(level, "    Unacked segments: %4i    RTO: %6ims  SRTT: %6ims", list_size(&tcp_data->retransmission_queue),
+           tcp_data->RTO / 1000, tcp_data->SRTT / 1000);
+    chilog(level, "    CWND: %10u  SSTHRESH: %10u  (%s)", tcp_data->cwnd, tcp_data->ssthresh,
+           tcp_data->cc ? tcp_data->cc->name : "none");
+    chilog(level, "    SACK? %s    Fast recovery? %s", tcp_data->sack_permitted?"YES":"NO",
+           tcp_data->fast_recovery?"YES":"NO");
     chilog(level, "   ······················································");
     funlockfile(stdout);
 }
@@ -169,6 +180,31 @@ void chitcpd_dispatch_tcp(serverinfo_t *si, chisocketentry_t *entry, tcp_event_t
 }
 
 
+/*
+ * chitcpd_tcp_timer_callback - Raises a TIMEOUT event when one of
+ *                              a socket's timers fires
+ *
+ * Runs in the timer thread (see timer.h). The TCP thread checks which
+ * timers have actually expired when it handles the event.
+ *
+ * timer: Timer that has fired
+ *
+ * args: The socket's state (active_chisocket_state_t)
+ *
+ * Returns: Nothing.
+ *
+ */
+static void chitcpd_tcp_timer_callback(chitcpd_timer_t *timer, void *args)
+{
+    active_chisocket_state_t *socket_state = (active_chisocket_state_t *) args;
+
+    pthread_mutex_lock(&socket_state->lock_event);
+    socket_state->flags.timeout = 1;
+    pthread_cond_signal(&socket_state->cv_event);
+    pthread_mutex_unlock(&socket_state->lock_event);
+}
+
+
 /* Advance declaration of TCP thread function */
 void* chitcpd_tcp_thread_func(void *args);
 
@@ -179,6 +215,36 @@ typedef struct tcp_thread_args
 } tcp_thread_args_t;
 
 
+/* See tcp_thread.h */
+int chitcpd_tcp_init_buffers(chisocketentry_t *entry)
+{
+    tcp_data_t *tcp_data = &entry->socket_state.active.tcp_data;
+    int rc;
+
+    /* Each buffer has exactly one writer and one reader (the TCP thread
+     * and the socket's handler thread), so they can use the lock-free
+     * variant. Unless the application set its size, the receive buffer
+     * starts out as large as the initial receive window, and grows with
+     * it (see chitcpd_tcp_rcvbuf_adjust) */
+    rc = circular_buffer_init(&tcp_data->send, entry->sndbuf ? entry->sndbuf : TCP_SNDBUF_DEFAULT, BUFFER_SPSC);
+    if (rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not allocate send buffer");
+        return rc;
+    }
+
+    rc = circular_buffer_init(&tcp_data->recv, entry->rcvbuf ? entry->rcvbuf : TCP_RCVBUF_INITIAL, BUFFER_SPSC);
+    if (rc != CHITCP_OK)
+    {
+        chilog(ERROR, "Could not allocate receive buffer");
+        circular_buffer_free(&tcp_data->send);
+        return rc;
+    }
+
+    return CHITCP_OK;
+}
+
+
 /*
  * chitcpd_tcp_start_thread - Starts a TCP thread
  *
@@ -232,9 +298,48 @@ void* chitcpd_tcp_thread_func(void *args)
     /* Detach thread */
     pthread_detach(pthread_self());
 
-    /* Initialize buffers */
-    circular_buffer_init(&tcp_data->send, TCP_BUFFER_SIZE);
-    circular_buffer_init(&tcp_data->recv, TCP_BUFFER_SIZE);
+    chitcpd_reassembly_init(&tcp_data->reassembly);
+
+    /* Initialize the receive window. Unless the application set its
+     * size (SO_RCVBUF), it starts at TCP_RCVBUF_INITIAL and is
+     * autotuned from there (growing the receive buffer as it goes),
+     * so the window scale we offer has to cover TCP_BUFFER_MAX. */
+    tcp_data->rcvbuf_locked = entry->rcvbuf != 0;
+    tcp_data->rcvbuf = entry->rcvbuf ? entry->rcvbuf : TCP_RCVBUF_INITIAL;
+    tcp_data->rcv_rtt = 0;
+    tcp_data->rcv_rtt_measuring = FALSE;
+    tcp_data->wscale_ok = FALSE;
+    tcp_data->snd_wscale = 0;
+    tcp_data->rcv_wscale = 0;
+    uint32_t rcvbuf_max = tcp_data->rcvbuf_locked ? circular_buffer_capacity(&tcp_data->recv) : TCP_BUFFER_MAX;
+    while (tcp_data->rcv_wscale < TCP_WSCALE_MAX && (rcvbuf_max >> tcp_data->rcv_wscale) > UINT16_MAX)
+        tcp_data->rcv_wscale++;
+
+    /* Initialize retransmission state */
+    list_init(&tcp_data->retransmission_queue);
+    tcp_data->spare_segments = NULL;
+    tcp_data->RTO = TCP_RTO_INITIAL;
+    tcp_data->rtt_measured = FALSE;
+    chitcpd_timer_init(&si->timers, &tcp_data->rto_timer, chitcpd_tcp_timer_callback, socket_state);
+    chitcpd_timer_init(&si->timers, &tcp_data->persist_timer, chitcpd_tcp_timer_callback, socket_state);
+    chitcpd_timer_init(&si->timers, &tcp_data->delack_timer, chitcpd_tcp_timer_callback, socket_state);
+    chitcpd_timer_init(&si->timers, &tcp_data->time_wait_timer, chitcpd_tcp_timer_callback, socket_state);
+    tcp_data->persist_backoff = 0;
+    tcp_data->delack_segments = 0;
+    tcp_data->sack_permitted = FALSE;
+    tcp_data->dupacks = 0;
+    tcp_data->fast_recovery = FALSE;
+
+    /* Until the peer's SYN tells us otherwise, we assume the default MSS.
+     * The MSS we advertise can be lowered with TCP_MAXSEG. */
+    tcp_data->RMSS = chitcpd_connection_mss(socket_state->realtcpconn);
+    if (entry->maxseg != 0 && entry->maxseg < tcp_data->RMSS)
+        tcp_data->RMSS = entry->maxseg;
+    tcp_data->SMSS = TCP_MSS;
+
+    /* Initialize congestion control with the algorithm selected for
+     * this socket (TCP_CONGESTION) or, if none, the daemon's default */
+    chitcpd_congestion_init(tcp_data, entry->congestion_control ? entry->congestion_control : si->congestion_control);
 
     chilog(DEBUG, "TCP thread running");
 
@@ -255,6 +360,10 @@ void* chitcpd_tcp_thread_func(void *args)
      *
      * - net_recv: A packet has arrived over the network
      *
+     * - timeout: One of the socket's timers (retransmission, persist,
+     *            delayed ACK, or TIME_WAIT) has expired. This flag is
+     *            raised by the daemon's timer thread (see timer.h).
+     *
      * - cleanup: The thread must release its resources and exit
      *
      * Once an event is received, we clear the corresponding bit in the flags,
@@ -324,6 +433,14 @@ void* chitcpd_tcp_thread_func(void *args)
                 pthread_mutex_unlock(&socket_state->lock_event);
             }
         }
+        else if(socket_state->flags.timeout)
+        {
+            chilog(TRACE, "Event received: timeout");
+            socket_state->flags.timeout = 0;
+            pthread_mutex_unlock(&socket_state->lock_event);
+
+            chitcpd_dispatch_tcp(si, entry, TIMEOUT);
+        }
         else if(socket_state->flags.cleanup)
         {
             chilog(DEBUG, "Event received: cleanup");
@@ -331,7 +448,13 @@ void* chitcpd_tcp_thread_func(void *args)
             /* Cleanup can only happen in the CLOSED state */
             assert(entry->tcp_state == CLOSED);
 
+            /* The timers are cancelled while handling the event. A timer
+             * firing in the meantime needs this lock to raise its event,
+             * so we can't hold onto it. */
+            pthread_mutex_unlock(&socket_state->lock_event);
             chitcpd_dispatch_tcp(si, entry, CLEANUP);
+            pthread_mutex_lock(&socket_state->lock_event);
+
             chitcpd_free_socket_entry(si, entry);
 
             done = TRUE;
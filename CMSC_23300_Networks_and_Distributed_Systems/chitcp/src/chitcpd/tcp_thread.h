@@ -42,6 +42,18 @@
 
 #include "tcp.h"
 
+/*
+ * chitcpd_tcp_init_buffers - Allocates an active socket's send and receive buffers
+ *
+ * Must be called before the socket's TCP thread is started.
+ *
+ * entry: Pointer to the socket entry
+ *
+ * Returns: CHITCP_OK, or CHITCP_ENOMEM if a buffer can't be allocated
+ *          (in which case neither buffer is allocated)
+ */
+int chitcpd_tcp_init_buffers(chisocketentry_t *entry);
+
 int chitcpd_tcp_start_thread(serverinfo_t *si, chisocketentry_t *entry);
 
 #endif /* TCP_THREAD_H_ */
@@ -0,0 +1,309 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Timers (see timer.h)
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "timer.h"
+
+#define SLOT(tick) ((tick) & (TIMER_WHEEL_SLOTS - 1))
+
+/* Microseconds since tick 0 */
+static uint64_t chitcpd_timer_wheel_elapsed(chitcpd_timer_wheel_t *wheel)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) (now.tv_sec - wheel->start.tv_sec) * 1000000 +
+           (now.tv_nsec - wheel->start.tv_nsec) / 1000;
+}
+
+/* Start of tick "tick", as an absolute CLOCK_MONOTONIC time */
+static void chitcpd_timer_wheel_deadline(chitcpd_timer_wheel_t *wheel, uint64_t tick, struct timespec *deadline)
+{
+    uint64_t usecs = tick * TIMER_WHEEL_TICK;
+
+    deadline->tv_sec = wheel->start.tv_sec + usecs / 1000000;
+    deadline->tv_nsec = wheel->start.tv_nsec + (usecs % 1000000) * 1000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* The following functions must be called with the wheel locked */
+
+static void chitcpd_timer_link(chitcpd_timer_wheel_t *wheel, chitcpd_timer_t *timer)
+{
+    chitcpd_timer_t **head = &wheel->slots[SLOT(timer->expires)];
+
+    timer->prev = NULL;
+    timer->next = *head;
+    if (*head)
+        (*head)->prev = timer;
+    *head = timer;
+
+    timer->pending = TRUE;
+    wheel->npending++;
+}
+
+static void chitcpd_timer_unlink(chitcpd_timer_wheel_t *wheel, chitcpd_timer_t *timer)
+{
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else
+        wheel->slots[SLOT(timer->expires)] = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->prev = timer->next = NULL;
+    timer->pending = FALSE;
+    wheel->npending--;
+}
+
+/* Fires every pending timer that expires at or before tick "target"
+ * (visiting each slot at most once, even if the thread has been
+ * asleep for more than a turn of the wheel) */
+static void chitcpd_timer_wheel_advance(chitcpd_timer_wheel_t *wheel, uint64_t target)
+{
+    uint64_t nticks = target - wheel->now;
+    chitcpd_timer_t *timer, *next;
+
+    if (nticks > TIMER_WHEEL_SLOTS)
+        nticks = TIMER_WHEEL_SLOTS;
+
+    for (uint64_t i = 1; i <= nticks; i++)
+    {
+        for (timer = wheel->slots[SLOT(wheel->now + i)]; timer != NULL; timer = next)
+        {
+            next = timer->next;
+            if (timer->expires > target)
+                continue;
+
+            chitcpd_timer_unlink(wheel, timer);
+            timer->expired = TRUE;
+            timer->callback(timer, timer->args);
+        }
+    }
+
+    wheel->now = target;
+}
+
+/* The first tick after wheel->now with a timer in its slot. That timer
+ * may only be due on a later turn of the wheel, in which case the timer
+ * thread will just wake up, find nothing to do, and look again. */
+static uint64_t chitcpd_timer_wheel_next(chitcpd_timer_wheel_t *wheel)
+{
+    if (wheel->npending == 0)
+        return UINT64_MAX;
+
+    for (uint64_t tick = wheel->now + 1; tick <= wheel->now + TIMER_WHEEL_SLOTS; tick++)
+        if (wheel->slots[SLOT(tick)] != NULL)
+            return tick;
+
+    return wheel->now + TIMER_WHEEL_SLOTS;
+}
+
+static void* chitcpd_timer_wheel_thread_func(void *args)
+{
+    chitcpd_timer_wheel_t *wheel = (chitcpd_timer_wheel_t *) args;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (wheel->running)
+    {
+        chitcpd_timer_wheel_advance(wheel, chitcpd_timer_wheel_elapsed(wheel) / TIMER_WHEEL_TICK);
+
+        wheel->wakeup = chitcpd_timer_wheel_next(wheel);
+        if (wheel->wakeup == UINT64_MAX)
+            pthread_cond_wait(&wheel->cv, &wheel->lock);
+        else
+        {
+            chitcpd_timer_wheel_deadline(wheel, wheel->wakeup, &deadline);
+            pthread_cond_timedwait(&wheel->cv, &wheel->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&wheel->lock);
+
+    return NULL;
+}
+
+
+/* See timer.h */
+void chitcpd_timer_wheel_init(chitcpd_timer_wheel_t *wheel)
+{
+    pthread_condattr_t attr;
+
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+    wheel->now = 0;
+    wheel->wakeup = UINT64_MAX;
+    wheel->npending = 0;
+    wheel->running = FALSE;
+
+    /* Deadlines are on the monotonic clock, so they are not affected
+     * by changes to the system time */
+    pthread_mutex_init(&wheel->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wheel->cv, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* See timer.h */
+int chitcpd_timer_wheel_start(chitcpd_timer_wheel_t *wheel)
+{
+    wheel->running = TRUE;
+
+    if (pthread_create(&wheel->thread, NULL, chitcpd_timer_wheel_thread_func, wheel) != 0)
+    {
+        perror("Could not create timer thread");
+        wheel->running = FALSE;
+        return CHITCP_ETHREAD;
+    }
+
+    pthread_setname_np(wheel->thread, "timer");
+
+    return CHITCP_OK;
+}
+
+/* See timer.h */
+void chitcpd_timer_wheel_stop(chitcpd_timer_wheel_t *wheel)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (!wheel->running)
+    {
+        pthread_mutex_unlock(&wheel->lock);
+        return;
+    }
+    wheel->running = FALSE;
+    pthread_cond_signal(&wheel->cv);
+    pthread_mutex_unlock(&wheel->lock);
+
+    pthread_join(wheel->thread, NULL);
+}
+
+/* See timer.h */
+void chitcpd_timer_wheel_free(chitcpd_timer_wheel_t *wheel)
+{
+    pthread_mutex_destroy(&wheel->lock);
+    pthread_cond_destroy(&wheel->cv);
+}
+
+/* See timer.h */
+void chitcpd_timer_init(chitcpd_timer_wheel_t *wheel, chitcpd_timer_t *timer,
+                        chitcpd_timer_callback_t callback, void *args)
+{
+    timer->wheel = wheel;
+    timer->callback = callback;
+    timer->args = args;
+    timer->prev = timer->next = NULL;
+    timer->expires = 0;
+    timer->pending = FALSE;
+    timer->expired = FALSE;
+}
+
+/* See timer.h */
+void chitcpd_timer_arm(chitcpd_timer_t *timer, uint32_t usecs)
+{
+    chitcpd_timer_wheel_t *wheel = timer->wheel;
+    uint64_t expires;
+
+    pthread_mutex_lock(&wheel->lock);
+
+    if (timer->pending)
+        chitcpd_timer_unlink(wheel, timer);
+    timer->expired = FALSE;
+
+    /* Round up, and never into a tick the timer thread is done with */
+    expires = (chitcpd_timer_wheel_elapsed(wheel) + usecs + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK;
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    timer->expires = expires;
+
+    chitcpd_timer_link(wheel, timer);
+
+    /* Only wake up the timer thread if it would oversleep */
+    if (expires < wheel->wakeup)
+    {
+        wheel->wakeup = expires;
+        pthread_cond_signal(&wheel->cv);
+    }
+
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/* See timer.h */
+void chitcpd_timer_cancel(chitcpd_timer_t *timer)
+{
+    chitcpd_timer_wheel_t *wheel = timer->wheel;
+
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->pending)
+        chitcpd_timer_unlink(wheel, timer);
+    timer->expired = FALSE;
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/* See timer.h */
+bool_t chitcpd_timer_pending(chitcpd_timer_t *timer)
+{
+    bool_t pending;
+
+    pthread_mutex_lock(&timer->wheel->lock);
+    pending = timer->pending;
+    pthread_mutex_unlock(&timer->wheel->lock);
+
+    return pending;
+}
+
+/* See timer.h */
+bool_t chitcpd_timer_expired(chitcpd_timer_t *timer)
+{
+    bool_t expired;
+
+    pthread_mutex_lock(&timer->wheel->lock);
+    expired = timer->expired;
+    timer->expired = FALSE;
+    pthread_mutex_unlock(&timer->wheel->lock);
+
+    return expired;
+}
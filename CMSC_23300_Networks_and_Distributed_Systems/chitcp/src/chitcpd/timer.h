@@ -0,0 +1,242 @@
+/*
+ *  chiTCP - A simple, testable TCP stack
+ *
+ *  Timers.
+ *
+ *  All the timers in the daemon (retransmission, persist, delayed ACK,
+ *  TIME_WAIT) are kept in a single hashed timing wheel (Varghese and
+ *  Lauck's "scheme 6"), serviced by one thread. The wheel is an array
+ *  of TIMER_WHEEL_SLOTS slots, each covering one tick (TIMER_WHEEL_TICK
+ *  microseconds); a timer that expires at tick T is kept in a doubly
+ *  linked list in slot T % TIMER_WHEEL_SLOTS, so arming and cancelling
+ *  a timer take constant time no matter how many timers are armed.
+ *  Every tick, the timer thread looks at the timers in one slot, and
+ *  fires the ones that are due (timers further in the future than the
+ *  wheel's span share the slot until their turn comes).
+ *
+ *  Timers are rounded up to the next tick, so they never fire early,
+ *  and fire at most one tick (plus scheduling delays) late.
+ *
+ *  When a timer fires, its callback runs in the timer thread. Since
+ *  it runs with the wheel locked, it must be short, and it must not
+ *  arm or cancel timers. The usual thing to do is to wake up whatever
+ *  thread owns the timer (e.g., the TCP thread, see tcp_thread.c),
+ *  which can then check which of its timers have expired with
+ *  chitcpd_timer_expired.
+ *
+ */
+
+/*
+ *  Copyright (c) 2013-2014, The University of Chicago
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *
+ *  - Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ *  - Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ *  - Neither the name of The University of Chicago nor the names of its
+ *    contributors may be used to endorse or promote products derived from this
+ *    software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include "chitcp/types.h"
+
+/* Number of slots in the wheel (a power of two) and length of a tick,
+ * in microseconds. The wheel spans a little over a second, which covers
+ * delayed ACKs and most retransmission timeouts in a single turn. */
+#define TIMER_WHEEL_SLOTS (1024)
+#define TIMER_WHEEL_TICK (1000)
+
+typedef struct chitcpd_timer chitcpd_timer_t;
+typedef struct chitcpd_timer_wheel chitcpd_timer_wheel_t;
+
+/* Called by the timer thread when a timer fires (see above) */
+typedef void (*chitcpd_timer_callback_t)(chitcpd_timer_t *timer, void *args);
+
+struct chitcpd_timer
+{
+    chitcpd_timer_wheel_t *wheel;
+    chitcpd_timer_callback_t callback;
+    void *args;
+
+    /* Slot list */
+    chitcpd_timer_t *prev;
+    chitcpd_timer_t *next;
+
+    uint64_t expires;   /* In ticks since the wheel was initialized */
+    bool_t pending;     /* Armed, and has not fired yet */
+    bool_t expired;     /* Has fired since it was last armed or cancelled */
+};
+
+struct chitcpd_timer_wheel
+{
+    chitcpd_timer_t *slots[TIMER_WHEEL_SLOTS];
+
+    /* Start of tick 0 (CLOCK_MONOTONIC) */
+    struct timespec start;
+
+    /* Last tick processed by the timer thread, and tick at which it
+     * will wake up next (UINT64_MAX if no timer is pending) */
+    uint64_t now;
+    uint64_t wakeup;
+
+    uint32_t npending;
+
+    bool_t running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+};
+
+
+/*
+ * chitcpd_timer_wheel_init - Initialize an empty timer wheel
+ *
+ * wheel: Timer wheel
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_timer_wheel_init(chitcpd_timer_wheel_t *wheel);
+
+
+/*
+ * chitcpd_timer_wheel_start - Start the timer thread
+ *
+ * wheel: Timer wheel
+ *
+ * Returns:
+ *  - CHITCP_OK: The thread has started correctly
+ *  - CHITCP_ETHREAD: Could not create the thread
+ *
+ */
+int chitcpd_timer_wheel_start(chitcpd_timer_wheel_t *wheel);
+
+
+/*
+ * chitcpd_timer_wheel_stop - Stop the timer thread
+ *
+ * Waits for the timer thread to exit. Pending timers stay in the wheel,
+ * but will not fire.
+ *
+ * wheel: Timer wheel
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_timer_wheel_stop(chitcpd_timer_wheel_t *wheel);
+
+
+/*
+ * chitcpd_timer_wheel_free - Release the resources used by a timer wheel
+ *
+ * The timer thread must not be running.
+ *
+ * wheel: Timer wheel
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_timer_wheel_free(chitcpd_timer_wheel_t *wheel);
+
+
+/*
+ * chitcpd_timer_init - Initialize a timer
+ *
+ * wheel: Timer wheel the timer will be armed in
+ *
+ * timer: Timer
+ *
+ * callback: Function to call when the timer fires
+ *
+ * args: Argument to pass to the callback
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_timer_init(chitcpd_timer_wheel_t *wheel, chitcpd_timer_t *timer,
+                        chitcpd_timer_callback_t callback, void *args);
+
+
+/*
+ * chitcpd_timer_arm - Arm (or re-arm) a timer
+ *
+ * If the timer is already pending, its expiration time is replaced.
+ * Either way, its "expired" flag is cleared.
+ *
+ * timer: Timer
+ *
+ * usecs: Microseconds from now until the timer fires
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_timer_arm(chitcpd_timer_t *timer, uint32_t usecs);
+
+
+/*
+ * chitcpd_timer_cancel - Cancel a timer
+ *
+ * Once this function returns, the timer's callback will not run (until
+ * the timer is armed again), and its "expired" flag is cleared.
+ *
+ * timer: Timer
+ *
+ * Returns: Nothing
+ *
+ */
+void chitcpd_timer_cancel(chitcpd_timer_t *timer);
+
+
+/*
+ * chitcpd_timer_pending - Is a timer armed and yet to fire?
+ *
+ * timer: Timer
+ *
+ * Returns: TRUE if the timer is pending, FALSE otherwise
+ *
+ */
+bool_t chitcpd_timer_pending(chitcpd_timer_t *timer);
+
+
+/*
+ * chitcpd_timer_expired - Has a timer fired?
+ *
+ * Checks (and clears) the timer's "expired" flag, which is set when the
+ * timer fires, and cleared if it is armed again or cancelled before the
+ * owner gets around to checking it.
+ *
+ * timer: Timer
+ *
+ * Returns: TRUE if the timer has fired since it was last armed,
+ *          cancelled, or checked; FALSE otherwise
+ *
+ */
+bool_t chitcpd_timer_expired(chitcpd_timer_t *timer);
+
+#endif /* TIMER_H_ */
@@ -45,10 +45,365 @@
 
 #include "chitcp/buffer.h"
 
-int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
+/*
+ * Copies "len" bytes out of the ring starting at its read position,
+ * handling wraparound. Does not modify the buffer. "dst" may be NULL.
+ */
+static void circular_buffer_copy_out(circular_buffer_t *buf, uint8_t *dst, uint32_t len)
+{
+    uint32_t first = buf->maxsize - buf->start;
+
+    if (!dst)
+        return;
+
+    if (len > first) {
+        memcpy(dst, buf->data + buf->start, first);
+        memcpy(dst + first, buf->data, len - first);
+    }
+    else
+        memcpy(dst, buf->data + buf->start, len);
+}
+
+/*
+ * Copies "len" bytes into the ring at its write position, handling
+ * wraparound, and accounts for them. Caller must hold the lock and
+ * must have checked there is enough free space.
+ */
+static void circular_buffer_copy_in(circular_buffer_t *buf, uint8_t *data, uint32_t len)
+{
+    uint32_t first = buf->maxsize - buf->end;
+
+    if (len >= first) {
+        memcpy(buf->data + buf->end, data, first);
+        memcpy(buf->data, data + first, len - first);
+        buf->end = len - first;
+    }
+    else {
+        memcpy(buf->data + buf->end, data, len);
+        buf->end += len;
+    }
+    buf->seq_end += len;
+    buf->n_bytes += len;
+}
+
+/*
+ * Waits (with the lock held) until the buffer has data in it or is
+ * closed. Returns the number of bytes available (0 if the buffer was
+ * closed and there is nothing left in it), or CHITCP_EWOULDBLOCK in
+ * non-blocking mode.
+ */
+static int circular_buffer_wait_data(circular_buffer_t *buf, bool_t blocking)
+{
+    if (buf->n_bytes > 0 || buf->closing)
+        return buf->n_bytes;
+
+    if (blocking == BUFFER_NONBLOCKING)
+        return CHITCP_EWOULDBLOCK;
+
+    buf->rw_pending++;
+    while (buf->n_bytes == 0 && !buf->closing)
+        pthread_cond_wait(&buf->cv_not_empty, &buf->lock);
+    buf->rw_pending--;
+
+    if (buf->closing && buf->rw_pending == 0)
+        pthread_cond_broadcast(&buf->cv_idle);
+
+    return buf->n_bytes;
+}
+
+/*
+ * BUFFER_SPSC implementation
+ *
+ * head and tail are free-running counters (they wrap around at 2^32,
+ * which is fine since the capacity is a power of two no larger than
+ * 2^31), so the number of bytes in the buffer is always head - tail
+ * and byte number i lives at data[i & mask].
+ *
+ * Publishing an index uses a release store, and reading the other
+ * side's index an acquire load, so the bytes copied in by the producer
+ * are visible to the consumer once it sees the new head (and likewise
+ * for the space freed by the consumer). A side that has to block sets
+ * its *_waiting flag and re-checks the index under the lock; the other
+ * side publishes its index, issues a full fence and then checks the
+ * flag, so at least one of them is guaranteed to notice the other.
+ *
+ * The reader goes through its own view of the ring (rdata, rmask,
+ * rmaxsize), which only changes when it picks up a ring the writer
+ * retired in spsc_grow. The writer stores the new ring before it
+ * publishes any byte written to it, so a reader that sees such a byte
+ * in head also sees "retired" set, and switches before copying.
+ */
+
+#define LOAD_ACQ(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RLX(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define STORE_RLX(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define FULL_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static uint32_t spsc_used(circular_buffer_t *buf)
+{
+    return LOAD_ACQ(&buf->head) - LOAD_ACQ(&buf->tail);
+}
+
+/* Wake up the other side, if it said it was going to sleep. Must be
+ * called after publishing our index. */
+static void spsc_wake(circular_buffer_t *buf, uint32_t *waiting, pthread_cond_t *cv)
+{
+    FULL_FENCE();
+    if (LOAD_RLX(waiting)) {
+        pthread_mutex_lock(&buf->lock);
+        pthread_cond_broadcast(cv);
+        pthread_mutex_unlock(&buf->lock);
+    }
+}
+
+/*
+ * Sleeps until "ready" is true or the buffer is closed. Returns
+ * FALSE if the buffer was closed.
+ */
+static bool_t spsc_sleep(circular_buffer_t *buf, uint32_t *waiting, pthread_cond_t *cv,
+                         bool_t (*ready)(circular_buffer_t *buf))
+{
+    bool_t closed;
+
+    pthread_mutex_lock(&buf->lock);
+    buf->rw_pending++;
+    STORE_RLX(waiting, 1);
+    FULL_FENCE();
+    while (!ready(buf) && !buf->closing)
+        pthread_cond_wait(cv, &buf->lock);
+    STORE_RLX(waiting, 0);
+    buf->rw_pending--;
+
+    closed = buf->closing;
+    if (closed && buf->rw_pending == 0)
+        pthread_cond_broadcast(&buf->cv_idle);
+    pthread_mutex_unlock(&buf->lock);
+
+    return !closed;
+}
+
+/*
+ * Called by the reader before it touches the ring: if the writer has
+ * grown the buffer, start using the new ring and free the old one.
+ * Peeks from other threads copy out with the lock held, so the switch
+ * happens under the lock too.
+ */
+static void spsc_reader_switch(circular_buffer_t *buf)
+{
+    uint8_t *old = LOAD_ACQ(&buf->retired);
+
+    if (old == NULL)
+        return;
+
+    pthread_mutex_lock(&buf->lock);
+    buf->rdata = buf->data;
+    buf->rmask = buf->mask;
+    buf->rmaxsize = buf->maxsize;
+    STORE_REL(&buf->retired, NULL);
+    pthread_mutex_unlock(&buf->lock);
+
+    free(old);
+}
+
+static bool_t spsc_has_data(circular_buffer_t *buf)
+{
+    return LOAD_ACQ(&buf->head) != LOAD_RLX(&buf->tail);
+}
+
+static bool_t spsc_has_space(circular_buffer_t *buf)
+{
+    return LOAD_RLX(&buf->head) - LOAD_ACQ(&buf->tail) < buf->maxsize;
+}
+
+static int spsc_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
+{
+    uint32_t head = LOAD_RLX(&buf->head);
+    uint32_t written = 0;
+
+    if (LOAD_RLX(&buf->closing))
+        return 0;
+
+    /* Refresh our view of tail only when the cached one says we
+     * don't have room, so we touch the consumer's cache line as
+     * rarely as possible */
+    if (buf->maxsize - (head - buf->tail_cache) < len)
+        buf->tail_cache = LOAD_ACQ(&buf->tail);
+
+    if (blocking == BUFFER_NONBLOCKING && buf->maxsize - (head - buf->tail_cache) < len)
+        return CHITCP_EWOULDBLOCK;
+
+    while (written < len) {
+        uint32_t space = buf->maxsize - (head - buf->tail_cache);
+
+        if (space == 0) {
+            buf->tail_cache = LOAD_ACQ(&buf->tail);
+            if (buf->maxsize - (head - buf->tail_cache) == 0 &&
+                !spsc_sleep(buf, &buf->writer_waiting, &buf->cv_not_full, spsc_has_space))
+                break;
+            buf->tail_cache = LOAD_ACQ(&buf->tail);
+            continue;
+        }
+
+        uint32_t n = len - written < space ? len - written : space;
+        uint32_t idx = head & buf->mask;
+        uint32_t first = buf->maxsize - idx;
+
+        if (n > first) {
+            memcpy(buf->data + idx, data + written, first);
+            memcpy(buf->data, data + written + first, n - first);
+        }
+        else
+            memcpy(buf->data + idx, data + written, n);
+
+        head += n;
+        written += n;
+        STORE_REL(&buf->head, head);
+        spsc_wake(buf, &buf->reader_waiting, &buf->cv_not_empty);
+    }
+
+    return written;
+}
+
+/*
+ * Moves the unread bytes to a new ring of "size" bytes. The old ring
+ * is left for the reader to free (see spsc_reader_switch), since it may
+ * be copying out of it right now.
+ */
+static int spsc_grow(circular_buffer_t *buf, uint32_t size)
 {
-    //printf("Entering init...");
+    uint32_t head = LOAD_RLX(&buf->head);
+    uint32_t tail, i, n;
+    uint8_t *data, *old;
+
+    if (LOAD_ACQ(&buf->retired) != NULL)
+        return CHITCP_EWOULDBLOCK;
+
+    data = (uint8_t*)malloc(sizeof(uint8_t) * size);
+    if (data == NULL)
+        return CHITCP_ENOMEM;
+
+    /* Byte number i moves from old[i & mask] to data[i & (size - 1)].
+     * The reader can only consume bytes while we copy, so anything
+     * it reads in the meantime simply gets copied for nothing. */
+    tail = LOAD_ACQ(&buf->tail);
+    for (i = tail; i != head; i += n) {
+        uint32_t from = i & buf->mask, to = i & (size - 1);
+
+        n = head - i;
+        if (n > buf->maxsize - from)
+            n = buf->maxsize - from;
+        if (n > size - to)
+            n = size - to;
+        memcpy(data + to, buf->data + from, n);
+    }
+
+    old = buf->data;
+    buf->data = data;
+    buf->mask = size - 1;
+    buf->maxsize = size;
+    STORE_REL(&buf->retired, old);
+
+    return CHITCP_OK;
+}
+
+static int spsc_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking, bool_t consume)
+{
+    uint32_t tail = LOAD_RLX(&buf->tail);
+    uint32_t avail, n, idx, first;
+
+    if (buf->head_cache - tail < len)
+        buf->head_cache = LOAD_ACQ(&buf->head);
+
+    /* Once the buffer is closed, whatever is left in it can
+     * still be read */
+    while (buf->head_cache == tail) {
+        if (LOAD_RLX(&buf->closing))
+            return 0;
+        if (blocking == BUFFER_NONBLOCKING)
+            return CHITCP_EWOULDBLOCK;
+        spsc_sleep(buf, &buf->reader_waiting, &buf->cv_not_empty, spsc_has_data);
+        buf->head_cache = LOAD_ACQ(&buf->head);
+    }
+
+    avail = buf->head_cache - tail;
+    n = len < avail ? len : avail;
+
+    if (!consume) {
+        /* A peek may come from a thread other than the reader, so it
+         * can't switch rings; it copies from the newest one instead,
+         * which holds every byte in the buffer */
+        uint8_t *data;
+        uint32_t mask, maxsize;
+
+        pthread_mutex_lock(&buf->lock);
+        if (LOAD_ACQ(&buf->retired) != NULL) {
+            data = buf->data;
+            mask = buf->mask;
+            maxsize = buf->maxsize;
+        }
+        else {
+            data = buf->rdata;
+            mask = buf->rmask;
+            maxsize = buf->rmaxsize;
+        }
+        idx = tail & mask;
+        first = maxsize - idx;
+        if (dst) {
+            if (n > first) {
+                memcpy(dst, data + idx, first);
+                memcpy(dst + first, data, n - first);
+            }
+            else
+                memcpy(dst, data + idx, n);
+        }
+        pthread_mutex_unlock(&buf->lock);
+
+        return n;
+    }
+
+    if (LOAD_RLX(&buf->retired) != NULL)
+        spsc_reader_switch(buf);
+
+    idx = tail & buf->rmask;
+    first = buf->rmaxsize - idx;
+
+    if (dst) {
+        if (n > first) {
+            memcpy(dst, buf->rdata + idx, first);
+            memcpy(dst + first, buf->rdata, n - first);
+        }
+        else
+            memcpy(dst, buf->rdata + idx, n);
+    }
+
+    if (n > 0) {
+        STORE_REL(&buf->tail, tail + n);
+        spsc_wake(buf, &buf->writer_waiting, &buf->cv_not_full);
+    }
+
+    return n;
+}
+
+int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize, int type)
+{
+    if (type != BUFFER_LOCKED && type != BUFFER_SPSC)
+        return CHITCP_EINVAL;
+
+    if (type == BUFFER_SPSC) {
+        uint32_t size = 1;
+
+        if (maxsize == 0 || maxsize > (1u << 31))
+            return CHITCP_EINVAL;
+        while (size < maxsize)
+            size <<= 1;
+        maxsize = size;
+    }
+
     buf->data = (uint8_t*)malloc(sizeof(uint8_t) * maxsize);
+    if (buf->data == NULL)
+        return CHITCP_ENOMEM;
+
     buf->start = 0;
     buf->end = 0;
 
@@ -62,19 +417,81 @@ int circular_buffer_init(circular_buffer_t *buf, uint32_t maxsize)
     buf->n_bytes = 0;
     buf->maxsize = maxsize;
 
+    buf->type = type;
+    buf->mask = maxsize - 1;
+    buf->head = buf->tail = 0;
+    buf->head_cache = buf->tail_cache = 0;
+    buf->reader_waiting = buf->writer_waiting = 0;
+    buf->retired = NULL;
+    buf->rdata = buf->data;
+    buf->rmask = buf->mask;
+    buf->rmaxsize = buf->maxsize;
 
     pthread_mutex_init(&buf->lock, NULL);
-    //pthread_mutex_setpshared(PTHREAD_PROCESS_SHARED);
-    //printf("Leaving init\n");
-    //circular_buffer_dump(buf);
+    pthread_cond_init(&buf->cv_not_empty, NULL);
+    pthread_cond_init(&buf->cv_not_full, NULL);
+    pthread_cond_init(&buf->cv_idle, NULL);
+
+    return CHITCP_OK;
+}
+
+int circular_buffer_grow(circular_buffer_t *buf, uint32_t maxsize)
+{
+    uint8_t *data;
+
+    if (buf->type == BUFFER_SPSC) {
+        uint32_t size = 1;
+
+        if (maxsize > (1u << 31))
+            return CHITCP_EINVAL;
+        while (size < maxsize)
+            size <<= 1;
+        if (size <= buf->maxsize)
+            return CHITCP_OK;
+
+        return spsc_grow(buf, size);
+    }
+
+    pthread_mutex_lock(&buf->lock);
+
+    if (maxsize <= buf->maxsize) {
+        pthread_mutex_unlock(&buf->lock);
+        return CHITCP_OK;
+    }
+
+    data = (uint8_t*)malloc(sizeof(uint8_t) * maxsize);
+    if (data == NULL) {
+        pthread_mutex_unlock(&buf->lock);
+        return CHITCP_ENOMEM;
+    }
+
+    circular_buffer_copy_out(buf, data, buf->n_bytes);
+    free(buf->data);
+    buf->data = data;
+    buf->start = 0;
+    buf->end = buf->n_bytes;
+    buf->maxsize = maxsize;
+    pthread_cond_broadcast(&buf->cv_not_full);
+
+    pthread_mutex_unlock(&buf->lock);
+
     return CHITCP_OK;
 }
 
 int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial)
 {
+    if (buf->type == BUFFER_SPSC) {
+        /* Sequence numbers are derived from the read/write counters,
+         * so store the sequence number of byte zero instead */
+        buf->seq_initial = seq_initial - LOAD_RLX(&buf->tail);
+        return CHITCP_OK;
+    }
+
+    pthread_mutex_lock(&buf->lock);
     buf->seq_initial = seq_initial;
     buf->seq_start = seq_initial;
-    buf->seq_end = seq_initial + buf->end;
+    buf->seq_end = seq_initial + buf->n_bytes;
+    pthread_mutex_unlock(&buf->lock);
 
     return CHITCP_OK;
 }
@@ -82,193 +499,192 @@ int circular_buffer_set_seq_initial(circular_buffer_t *buf, uint32_t seq_initial
 
 int circular_buffer_write(circular_buffer_t *buf, uint8_t *data, uint32_t len, bool_t blocking)
 {
-    int bs_towrite, bs_remaining, bs_over;
-    bs_towrite = 0;
-    bs_remaining = len;
+    uint32_t bs_towrite, bs_remaining;
+
+    if (buf == NULL)
+        return 0;
+
+    if (buf->type == BUFFER_SPSC)
+        return spsc_write(buf, data, len, blocking);
 
     pthread_mutex_lock(&buf->lock);
-    //printf("Entering write, len = %i\n", len);
-    //circular_buffer_dump(buf);
 
-    if (buf == NULL || buf->closing == 1) {
+    if (buf->closing) {
         pthread_mutex_unlock(&buf->lock);
         return 0;
     }
 
     if (blocking == BUFFER_NONBLOCKING) {
-        if ((buf->maxsize - buf->n_bytes) < bs_remaining) {
-            //printf("W: chitcp ewouldblock\n");
+        if ((buf->maxsize - buf->n_bytes) < len) {
             pthread_mutex_unlock(&buf->lock);
             return CHITCP_EWOULDBLOCK;
         }
-        bs_towrite = bs_remaining;
-        bs_over = (buf->end + bs_towrite) - buf->maxsize;
-        if (bs_over >= 0) {
-            memcpy(buf->data + buf->end, data, bs_towrite - bs_over);
-            memcpy(buf->data, data + (bs_towrite - bs_over), bs_over);
-            buf->end = bs_over;
-        }
-        else { 
-            memcpy(buf->data + buf->end, data, bs_towrite);
-            buf->end += bs_towrite;
-        }
-        buf->seq_end += bs_towrite;
-        buf->n_bytes += bs_towrite;
+        circular_buffer_copy_in(buf, data, len);
+        if (len > 0)
+            pthread_cond_broadcast(&buf->cv_not_empty);
+        pthread_mutex_unlock(&buf->lock);
+        return len;
     }
 
-    else {
-        buf->rw_pending++;
-        while (bs_remaining != 0) {
-            if (buf == NULL || buf->closing == 1) {
-                buf->rw_pending--;
-                pthread_mutex_unlock(&buf->lock);
-                return len - bs_remaining;
-            }
-            else if ((buf->maxsize - buf->n_bytes) == 0) {
-                pthread_mutex_unlock(&buf->lock);
-                pthread_yield();
-                pthread_mutex_lock(&buf->lock);
-            }
-            else {
-                if ((buf->maxsize - buf->n_bytes) < bs_remaining) {
-                    bs_towrite = buf->maxsize - buf->n_bytes;
-                    bs_remaining -= bs_towrite;
-                }
-                else {
-                    bs_towrite = bs_remaining;
-                    bs_remaining = 0;
-                }
-                bs_over = (buf->end + bs_towrite) - buf->maxsize;
-                if (bs_over >= 0) {
-                    memcpy(buf->data + buf->end, data, bs_towrite - bs_over);
-                    memcpy(buf->data, data + (bs_towrite - bs_over), bs_over);
-                    buf->end = bs_over;
-                }
-                else { 
-                    memcpy(buf->data + buf->end, data, bs_towrite);
-                    buf->end += bs_towrite;
-                }
-                buf->seq_end += bs_towrite;
-                buf->n_bytes += bs_towrite;
-            }
-        }
-        buf->rw_pending--;
+    /* Blocking mode: write as much as fits, then sleep until the
+     * reader frees up space (or the buffer is closed) */
+    bs_remaining = len;
+    buf->rw_pending++;
+    while (bs_remaining != 0) {
+        while (buf->n_bytes == buf->maxsize && !buf->closing)
+            pthread_cond_wait(&buf->cv_not_full, &buf->lock);
+
+        if (buf->closing)
+            break;
+
+        bs_towrite = buf->maxsize - buf->n_bytes;
+        if (bs_towrite > bs_remaining)
+            bs_towrite = bs_remaining;
+
+        circular_buffer_copy_in(buf, data + (len - bs_remaining), bs_towrite);
+        bs_remaining -= bs_towrite;
+        pthread_cond_broadcast(&buf->cv_not_empty);
     }
-    //printf("Leaving write\n");
-    //circular_buffer_dump(buf);
+    buf->rw_pending--;
+
+    if (buf->closing && buf->rw_pending == 0)
+        pthread_cond_broadcast(&buf->cv_idle);
+
     pthread_mutex_unlock(&buf->lock);
-    return len;
+    return len - bs_remaining;
 }
 
 int circular_buffer_read(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking)
 {
-    int bs_toread, bs_over;
+    int rc;
+    uint32_t bs_toread;
 
-    pthread_mutex_lock(&buf->lock);
-    //printf("Entering read, len = %i\n", len);
-    //circular_buffer_dump(buf);
-    if (buf == NULL || buf->closing == 1) {
+    if (buf == NULL)
         return 0;
-    }
 
-    buf->rw_pending++;
-    while (buf->n_bytes == 0) {
-        if (blocking == BUFFER_NONBLOCKING) {
-            buf->rw_pending--;
-            pthread_mutex_unlock(&buf->lock);
-            //printf("R: chitcp ewouldblock\n");
-            return CHITCP_EWOULDBLOCK;    
-        }
-        else if (buf == NULL || buf->closing == 1) {
-            buf->rw_pending--;
-            pthread_mutex_unlock(&buf->lock);
-            return 0;
-        }
-        else {
-            pthread_mutex_unlock(&buf->lock);
-            pthread_yield();
-            pthread_mutex_lock(&buf->lock);
-        }
-    }
-    buf->rw_pending--;
-    if (len < buf->n_bytes) 
-        bs_toread = len;
-    else 
-        bs_toread = buf->n_bytes;
-
-    bs_over = (buf->start + bs_toread) - buf->maxsize;
-    if (bs_over >= 0) {
-        if(dst) memcpy(dst, buf->data + buf->start, bs_toread - bs_over);
-        if(dst) memcpy(dst + (bs_toread - bs_over), buf->data, bs_over);
-        buf->start = bs_over;
-    }
-    else {
-        if(dst) memcpy(dst, buf->data + buf->start, bs_toread);
-        buf->start += bs_toread;
+    if (buf->type == BUFFER_SPSC)
+        return spsc_read(buf, dst, len, blocking, TRUE);
+
+    pthread_mutex_lock(&buf->lock);
+
+    rc = circular_buffer_wait_data(buf, blocking);
+    if (rc <= 0) {
+        pthread_mutex_unlock(&buf->lock);
+        return rc;
     }
+
+    bs_toread = len < buf->n_bytes ? len : buf->n_bytes;
+
+    circular_buffer_copy_out(buf, dst, bs_toread);
+    buf->start = (buf->start + bs_toread) % buf->maxsize;
     buf->seq_start += bs_toread;
     buf->n_bytes -= bs_toread;
-    //printf("Leaving read\n");
-    //circular_buffer_dump(buf);
+
+    if (bs_toread > 0)
+        pthread_cond_broadcast(&buf->cv_not_full);
+
     pthread_mutex_unlock(&buf->lock);
     return bs_toread;
 }
 
 int circular_buffer_peek(circular_buffer_t *buf, uint8_t *dst, uint32_t len, bool_t blocking)
 {
-    int bs_toread, bs_over;
+    int rc;
+    uint32_t bs_toread;
 
-    pthread_mutex_lock(&buf->lock);
-    //printf("Entering peek, len = %i\n", len);
-    if (buf == NULL || buf->closing == 1) {
+    if (buf == NULL)
         return 0;
+
+    if (buf->type == BUFFER_SPSC)
+        return spsc_read(buf, dst, len, blocking, FALSE);
+
+    pthread_mutex_lock(&buf->lock);
+
+    rc = circular_buffer_wait_data(buf, blocking);
+    if (rc <= 0) {
+        pthread_mutex_unlock(&buf->lock);
+        return rc;
     }
-    
-    buf->rw_pending++;
-    while (buf->n_bytes == 0) {
-        if (blocking == BUFFER_NONBLOCKING) {
-            buf->rw_pending--;
-            pthread_mutex_unlock(&buf->lock);
-            //printf("P: chitcp ewouldblock\n");
-            return CHITCP_EWOULDBLOCK;    
-        }
-        else if (buf == NULL || buf->closing == 1) {
-            buf->rw_pending--;
-            pthread_mutex_unlock(&buf->lock);
-            return 0;
-        }
-        else {
-            pthread_mutex_unlock(&buf->lock);
-            pthread_yield();
-            pthread_mutex_lock(&buf->lock);
-        }
-    }
-    buf->rw_pending--;
-    if (len < buf->n_bytes) 
-        bs_toread = len;
-    else 
-        bs_toread = buf->n_bytes;
-
-    bs_over = (buf->start + bs_toread) - buf->maxsize;
-    if (bs_over >= 0) {
-        if(dst) memcpy(dst, buf->data + buf->start, bs_toread - bs_over);
-        if(dst) memcpy(dst + (bs_toread - bs_over), buf->data, bs_over);
+
+    bs_toread = len < buf->n_bytes ? len : buf->n_bytes;
+    circular_buffer_copy_out(buf, dst, bs_toread);
+
+    pthread_mutex_unlock(&buf->lock);
+    return bs_toread;
+}
+
+int circular_buffer_peek_iov(circular_buffer_t *buf, uint32_t offset, uint32_t len, struct iovec iov[2])
+{
+    uint32_t count, idx, first;
+
+    uint8_t *data;
+    uint32_t maxsize;
+
+    if (buf->type == BUFFER_SPSC) {
+        uint32_t tail = LOAD_RLX(&buf->tail);
+
+        count = LOAD_ACQ(&buf->head) - tail;
+        if (LOAD_RLX(&buf->retired) != NULL)
+            spsc_reader_switch(buf);
+        idx = tail & buf->rmask;
+        data = buf->rdata;
+        maxsize = buf->rmaxsize;
     }
     else {
-        if(dst) memcpy(dst, buf->data + buf->start, bs_toread);
+        pthread_mutex_lock(&buf->lock);
+        count = buf->n_bytes;
+        idx = buf->start;
+        data = buf->data;
+        maxsize = buf->maxsize;
+        pthread_mutex_unlock(&buf->lock);
     }
-    //printf("Leaving peek\n");
-    pthread_mutex_unlock(&buf->lock);
-    return bs_toread;
+
+    if (offset >= count || len == 0)
+        return 0;
+
+    if (len > count - offset)
+        len = count - offset;
+
+    idx = (idx + offset) % maxsize;
+    first = maxsize - idx;
+
+    iov[0].iov_base = data + idx;
+    if (len <= first) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+int circular_buffer_commit(circular_buffer_t *buf, uint32_t len)
+{
+    int rc;
+
+    if (len == 0)
+        return 0;
+
+    rc = circular_buffer_read(buf, NULL, len, BUFFER_NONBLOCKING);
+
+    return rc == CHITCP_EWOULDBLOCK ? 0 : rc;
 }
 
 int circular_buffer_first(circular_buffer_t *buf)
 {
+    if (buf->type == BUFFER_SPSC)
+        return buf->seq_initial + LOAD_ACQ(&buf->tail);
+
     return buf->seq_start;
 }
 
 int circular_buffer_next(circular_buffer_t *buf)
 {
+    if (buf->type == BUFFER_SPSC)
+        return buf->seq_initial + LOAD_ACQ(&buf->head);
+
     return buf->seq_end;
 }
 
@@ -279,27 +695,37 @@ int circular_buffer_capacity(circular_buffer_t *buf)
 
 int circular_buffer_count(circular_buffer_t *buf)
 {
+    if (buf->type == BUFFER_SPSC)
+        return spsc_used(buf);
+
     return buf->n_bytes;
 }
 
 int circular_buffer_available(circular_buffer_t *buf)
 {
-    return buf->maxsize - buf->n_bytes;
+    return buf->maxsize - circular_buffer_count(buf);
 }
 
 int circular_buffer_dump(circular_buffer_t *buf)
 {
+    uint32_t start = buf->start, end = buf->end;
+
+    if (buf->type == BUFFER_SPSC) {
+        start = LOAD_ACQ(&buf->tail) & buf->mask;
+        end = LOAD_ACQ(&buf->head) & buf->mask;
+    }
+
     printf("# # # # # # # # # # # # # # # # #\n");
 
-    printf("maxsize: %i, n_bytes: %i\n", buf->maxsize, buf->n_bytes);
-    printf("start: %i, end: %i\n", buf->start, buf->end);
+    printf("maxsize: %i, n_bytes: %i\n", buf->maxsize, circular_buffer_count(buf));
+    printf("start: %i, end: %i\n", start, end);
 
     for(int i=0; i<buf->maxsize; i++)
     {
         printf("data[%i] = %i", i, buf->data[i]);
-        if(i==buf->start)
+        if(i==start)
             printf("  <<< START");
-        if(i==buf->end)
+        if(i==end)
             printf("  <<< END");
         printf("\n");
     }
@@ -310,30 +736,36 @@ int circular_buffer_dump(circular_buffer_t *buf)
 
 int circular_buffer_close(circular_buffer_t *buf)
 {
-    //printf("Entering close\n");
-
     pthread_mutex_lock(&buf->lock);
-    buf->closing = 1;
-    pthread_mutex_unlock(&buf->lock);
+    STORE_RLX(&buf->closing, 1);
 
-    while (buf->rw_pending > 0) {
-        pthread_yield();
-    }
-    circular_buffer_free(buf);
+    /* Wake up every blocked reader and writer, and wait until all of
+     * them have left the buffer. The memory itself is released by
+     * circular_buffer_free, which the socket teardown calls. */
+    pthread_cond_broadcast(&buf->cv_not_empty);
+    pthread_cond_broadcast(&buf->cv_not_full);
+    while (buf->rw_pending > 0)
+        pthread_cond_wait(&buf->cv_idle, &buf->lock);
+
+    pthread_mutex_unlock(&buf->lock);
 
-    //printf("Leaving close\n");
     return CHITCP_OK;
 }
 
 int circular_buffer_free(circular_buffer_t *buf)
 {
- 
     pthread_mutex_lock(&buf->lock);
     free(buf->data);
+    buf->data = NULL;
+    if (buf->type == BUFFER_SPSC) {
+        free(buf->retired);
+        buf->retired = NULL;
+    }
     pthread_mutex_unlock(&buf->lock);
     pthread_mutex_destroy(&buf->lock);
-    //free(buf); // DOES NOT like this -- double free or corruption error?
+    pthread_cond_destroy(&buf->cv_not_empty);
+    pthread_cond_destroy(&buf->cv_not_full);
+    pthread_cond_destroy(&buf->cv_idle);
 
     return CHITCP_OK;
 }
-
@@ -177,6 +177,9 @@ void chilog_hex (loglevel_t level, void *data, int len)
     char line[74];
     uint8_t *pc = data;
 
+    if(level > loglevel)
+        return;
+
     line[0] = '\0';
     // Process every byte in the data.
     for (i = 0; i < len; i++)
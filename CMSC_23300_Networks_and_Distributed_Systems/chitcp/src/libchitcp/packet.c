@@ -74,23 +74,185 @@ uint32_t chitcp_htonl(uint32_t hostlong)
 
 
 int chitcp_tcp_packet_create(tcp_packet_t *packet, const uint8_t* payload, uint16_t payload_len)
+{
+    return chitcp_tcp_packet_create_options(packet, NULL, payload, payload_len);
+}
+
+
+/*
+ * Writes the options in "options" to "buf" (which must have room for
+ * TCP_OPTIONS_MAX_SIZE bytes). Options are aligned on four-byte
+ * boundaries with NOPs, as most TCP implementations do.
+ *
+ * Returns the number of bytes written, which is always a multiple of four.
+ */
+static int chitcp_tcp_options_write(uint8_t *buf, const tcp_options_t *options)
+{
+    uint8_t *opt = buf;
+    int nsack = options->nsack;
+
+    if (options->mss_ok)
+    {
+        uint16_t mss = htons(options->mss);
+
+        *opt++ = TCP_OPTION_MSS;
+        *opt++ = 4;
+        memcpy(opt, &mss, sizeof(mss));
+        opt += sizeof(mss);
+    }
+
+    if (options->wscale_ok)
+    {
+        *opt++ = TCP_OPTION_NOP;
+        *opt++ = TCP_OPTION_WSCALE;
+        *opt++ = 3;
+        *opt++ = options->wscale;
+    }
+
+    if (options->sack_permitted)
+    {
+        *opt++ = TCP_OPTION_NOP;
+        *opt++ = TCP_OPTION_NOP;
+        *opt++ = TCP_OPTION_SACK_PERMITTED;
+        *opt++ = 2;
+    }
+
+    if (nsack > 0)
+    {
+        /* Only as many blocks as fit in the space that is left */
+        if (nsack > (TCP_OPTIONS_MAX_SIZE - (opt - buf) - 4) / 8)
+            nsack = (TCP_OPTIONS_MAX_SIZE - (opt - buf) - 4) / 8;
+
+        *opt++ = TCP_OPTION_NOP;
+        *opt++ = TCP_OPTION_NOP;
+        *opt++ = TCP_OPTION_SACK;
+        *opt++ = 2 + nsack * 8;
+        for (int i = 0; i < nsack; i++)
+        {
+            uint32_t edges[2] = { htonl(options->sack[i].left), htonl(options->sack[i].right) };
+            memcpy(opt, edges, sizeof(edges));
+            opt += sizeof(edges);
+        }
+    }
+
+    return opt - buf;
+}
+
+
+int chitcp_tcp_packet_create_options(tcp_packet_t *packet, const tcp_options_t *options,
+                                     const uint8_t* payload, uint16_t payload_len)
+{
+    packet->raw = malloc(TCP_HEADER_MAX_SIZE + payload_len);
+
+    return chitcp_tcp_packet_fill_options(packet, options, payload, payload_len);
+}
+
+
+int chitcp_tcp_packet_fill_options(tcp_packet_t *packet, const tcp_options_t *options,
+                                   const uint8_t* payload, uint16_t payload_len)
 {
     tcphdr_t *header;
+    int options_len = 0;
+
+    memset(packet->raw, 0, TCP_HEADER_NOOPTIONS_SIZE);
 
-    packet->length = TCP_HEADER_NOOPTIONS_SIZE + payload_len;
-    packet->raw = calloc(packet->length, 1);
+    /* Options are written right after the fixed part of the header */
+    if (options)
+        options_len = chitcp_tcp_options_write(packet->raw + TCP_HEADER_NOOPTIONS_SIZE, options);
+
+    packet->length = TCP_HEADER_NOOPTIONS_SIZE + options_len + payload_len;
     header = (tcphdr_t*) packet->raw;
 
-    // No TCP options
-    header->doff = TCP_HEADER_NOOPTIONS_SIZE / sizeof(uint32_t);
+    header->doff = (TCP_HEADER_NOOPTIONS_SIZE + options_len) / sizeof(uint32_t);
 
     if (payload_len)
-        memcpy(packet->raw + TCP_HEADER_NOOPTIONS_SIZE, payload, payload_len);
+        memcpy(packet->raw + TCP_HEADER_NOOPTIONS_SIZE + options_len, payload, payload_len);
 
     return packet->length;
 }
 
 
+int chitcp_tcp_options_parse(const tcp_packet_t *packet, tcp_options_t *options)
+{
+    const uint8_t *opt, *end;
+    uint8_t kind, len;
+
+    memset(options, 0, sizeof(tcp_options_t));
+
+    if (packet->length < TCP_HEADER_NOOPTIONS_SIZE ||
+        TCP_HEADER_SIZE(packet) < TCP_HEADER_NOOPTIONS_SIZE ||
+        TCP_HEADER_SIZE(packet) > packet->length)
+        return CHITCP_EINVAL;
+
+    opt = packet->raw + TCP_HEADER_NOOPTIONS_SIZE;
+    end = packet->raw + TCP_HEADER_SIZE(packet);
+
+    while (opt < end)
+    {
+        kind = opt[0];
+
+        if (kind == TCP_OPTION_EOL)
+            break;
+        if (kind == TCP_OPTION_NOP)
+        {
+            opt++;
+            continue;
+        }
+
+        /* Every other option has a length field, which includes the
+         * kind and length bytes */
+        if (end - opt < 2 || opt[1] < 2 || opt[1] > end - opt)
+            return CHITCP_EINVAL;
+        len = opt[1];
+
+        switch (kind)
+        {
+        case TCP_OPTION_MSS:
+            if (len != 4)
+                return CHITCP_EINVAL;
+            options->mss_ok = TRUE;
+            memcpy(&options->mss, opt + 2, sizeof(options->mss));
+            options->mss = ntohs(options->mss);
+            break;
+
+        case TCP_OPTION_WSCALE:
+            if (len != 3)
+                return CHITCP_EINVAL;
+            options->wscale_ok = TRUE;
+            options->wscale = opt[2];
+            break;
+
+        case TCP_OPTION_SACK_PERMITTED:
+            if (len != 2)
+                return CHITCP_EINVAL;
+            options->sack_permitted = TRUE;
+            break;
+
+        case TCP_OPTION_SACK:
+            if ((len - 2) % 8 != 0 || (len - 2) / 8 > TCP_SACK_MAX_BLOCKS)
+                return CHITCP_EINVAL;
+            options->nsack = (len - 2) / 8;
+            for (int i = 0; i < options->nsack; i++)
+            {
+                uint32_t edges[2];
+                memcpy(edges, opt + 2 + i * 8, sizeof(edges));
+                options->sack[i].left = ntohl(edges[0]);
+                options->sack[i].right = ntohl(edges[1]);
+            }
+            break;
+
+        default:
+            /* Not supported; skip it */
+            break;
+        }
+
+        opt += len;
+    }
+
+    return CHITCP_OK;
+}
+
+
 void chitcp_tcp_packet_free(tcp_packet_t *packet)
 {
     free((void *) packet->raw);
@@ -395,3 +395,56 @@ ssize_t chisocket_recv(int sockfd, void *buf, size_t len, int flags)
     return ret;
 }
 
+
+int chisocket_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen)
+{
+    ChitcpdMsg req = CHITCPD_MSG__INIT;
+    ChitcpdSetsockoptArgs sa = CHITCPD_SETSOCKOPT_ARGS__INIT;
+    ChitcpdMsg *resp_p;
+    int daemon_socket;
+    int rc, ret, error_code;
+    uint8_t *newval;
+
+    daemon_socket = chitcpd_get_socket();
+    if (daemon_socket < 0)
+        CHITCPD_FAIL("Error when connecting to chiTCP daemon.");
+
+    /* Copy the value for const-correctness (see chisocket_send) */
+    newval = malloc(optlen);
+    if (optlen > 0 && !newval)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memcpy(newval, optval, optlen);
+
+    /* Create request */
+    req.code = CHITCPD_MSG_CODE__SETSOCKOPT;
+    req.setsockopt_args = &sa;
+
+    sa.sockfd = sockfd;
+    sa.level = level;
+    sa.optname = optname;
+    sa.optval.data = newval;
+    sa.optval.len = optlen;
+
+    rc = chitcpd_send_command(daemon_socket, &req, &resp_p);
+
+    free(newval);
+
+    if(rc != CHITCP_OK)
+        CHITCPD_FAIL("Error when communicating with chiTCP daemon.");
+
+    /* Unpack response */
+    assert(resp_p->resp != NULL);
+    ret = resp_p->resp->ret;
+    error_code = resp_p->resp->error_code;
+
+    chitcpd_msg__free_unpacked(resp_p, NULL);
+
+    ret = (error_code? -1 : ret);
+    if(error_code) errno = error_code;
+
+    return ret;
+}
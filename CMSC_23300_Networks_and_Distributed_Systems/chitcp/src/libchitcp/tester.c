@@ -34,6 +34,8 @@ int chitcp_tester_init(chitcp_tester_t* tester)
     tester->server->state = STATE_UNINITIALIZED;
     tester->server->func = NULL;
     tester->server->debug_handler_func = NULL;
+    tester->server->sndbuf = 0;
+    tester->server->rcvbuf = 0;
 
     RET_ON_ERROR(pthread_mutex_init(&tester->client->lock_event, NULL),
             CHITCP_ESYNC);
@@ -51,6 +53,8 @@ int chitcp_tester_init(chitcp_tester_t* tester)
     tester->client->state = STATE_UNINITIALIZED;
     tester->client->func = NULL;
     tester->client->debug_handler_func = NULL;
+    tester->client->sndbuf = 0;
+    tester->client->rcvbuf = 0;
 
     return CHITCP_OK;
 }
@@ -140,6 +144,22 @@ int chitcp_tester_client_set_debug(chitcp_tester_t* tester, debug_event_handler
     return CHITCP_OK;
 }
 
+int chitcp_tester_server_set_buffers(chitcp_tester_t* tester, int sndbuf, int rcvbuf)
+{
+    tester->server->sndbuf = sndbuf;
+    tester->server->rcvbuf = rcvbuf;
+
+    return CHITCP_OK;
+}
+
+int chitcp_tester_client_set_buffers(chitcp_tester_t* tester, int sndbuf, int rcvbuf)
+{
+    tester->client->sndbuf = sndbuf;
+    tester->client->rcvbuf = rcvbuf;
+
+    return CHITCP_OK;
+}
+
 int chitcp_tester_client_run_set(chitcp_tester_t* tester, chitcp_tester_runnable func, void *args)
 {
     tester->client->func = func;
@@ -26,6 +26,22 @@ void chitcp_tester_peer_init(chitcp_tester_t *tester, chitcp_tester_peer_t *peer
         exit(-1);
     }
 
+    /* The buffers are allocated when the connection is established,
+     * so their sizes have to be set before that */
+    if(peer->sndbuf && chisocket_setsockopt(peer->sockfd, SOL_SOCKET, SO_SNDBUF, &peer->sndbuf, sizeof(int)) == -1)
+    {
+        perror("Could not set SO_SNDBUF");
+        chisocket_close(peer->sockfd);
+        exit(-1);
+    }
+
+    if(peer->rcvbuf && chisocket_setsockopt(peer->sockfd, SOL_SOCKET, SO_RCVBUF, &peer->rcvbuf, sizeof(int)) == -1)
+    {
+        perror("Could not set SO_RCVBUF");
+        chisocket_close(peer->sockfd);
+        exit(-1);
+    }
+
     if(peer->debug_handler_func)
     {
         /* Register the debug event handler */
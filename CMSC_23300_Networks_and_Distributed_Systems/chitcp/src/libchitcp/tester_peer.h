@@ -54,6 +54,10 @@ typedef struct chitcp_tester_peer
 
     debug_event_handler debug_handler_func;
     int debug_event_flags;
+
+    /* SO_SNDBUF and SO_RCVBUF (0 to use the defaults) */
+    int sndbuf;
+    int rcvbuf;
 } chitcp_tester_peer_t;
 
 typedef struct test_peer_thread_args
@@ -3,6 +3,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <check.h>
 
 uint8_t numbers[16] = {10,20,30,40,50,60,70,80,90,100,110,120,130,140,150,160};
@@ -37,7 +39,7 @@ START_TEST (test_buffer_writeread_exact)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
@@ -60,7 +62,7 @@ START_TEST (test_buffer_writepeek_exact)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
@@ -83,7 +85,7 @@ START_TEST (test_buffer_writeread_more)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
@@ -106,7 +108,7 @@ START_TEST (test_buffer_writepeek_more)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
@@ -130,7 +132,7 @@ START_TEST (test_buffer_multi_write)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
@@ -153,7 +155,7 @@ START_TEST (test_buffer_wrap_1)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 3, BUFFER_NONBLOCKING);
@@ -180,7 +182,7 @@ START_TEST (test_buffer_wrap_2)
     circular_buffer_t buf;
     uint8_t tmp[26];
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
 
     rc = circular_buffer_write(&buf, numbers, 4, BUFFER_NONBLOCKING);
@@ -201,13 +203,70 @@ START_TEST (test_buffer_wrap_2)
 }
 END_TEST
 
+static void check_peek_iov(int type)
+{
+    int rc;
+    circular_buffer_t buf;
+    struct iovec iov[2];
+    uint8_t tmp[26];
+
+    circular_buffer_init(&buf, 8, type);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    ck_assert_int_eq(circular_buffer_peek_iov(&buf, 0, 8, iov), 0);
+
+    /* Move the start of the data to position 6, so the next
+     * six bytes wrap around */
+    circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+    circular_buffer_commit(&buf, 6);
+    circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+
+    rc = circular_buffer_peek_iov(&buf, 0, 8, iov);
+    ck_assert_int_eq(rc, 2);
+    ck_assert_int_eq(iov[0].iov_len, 2);
+    ck_assert_int_eq(iov[1].iov_len, 4);
+    memcpy(tmp, iov[0].iov_base, 2);
+    memcpy(tmp + 2, iov[1].iov_base, 4);
+    ck_assert_int_eq(memcmp(numbers, tmp, 6), 0);
+
+    rc = circular_buffer_peek_iov(&buf, 3, 2, iov);
+    ck_assert_int_eq(rc, 1);
+    ck_assert_int_eq(iov[0].iov_len, 2);
+    ck_assert_int_eq(memcmp(numbers + 3, iov[0].iov_base, 2), 0);
+
+    ck_assert_int_eq(circular_buffer_peek_iov(&buf, 6, 8, iov), 0);
+
+    rc = circular_buffer_commit(&buf, 4);
+    ck_assert_int_eq(rc, 4);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1010);
+    ck_assert_int_eq(circular_buffer_count(&buf), 2);
+
+    rc = circular_buffer_commit(&buf, 100);
+    ck_assert_int_eq(rc, 2);
+    ck_assert_int_eq(circular_buffer_commit(&buf, 1), 0);
+
+    circular_buffer_free(&buf);
+}
+
+START_TEST (test_buffer_peek_iov)
+{
+    check_peek_iov(BUFFER_LOCKED);
+}
+END_TEST
+
+START_TEST (test_buffer_peek_iov_spsc)
+{
+    check_peek_iov(BUFFER_SPSC);
+}
+END_TEST
+
 START_TEST (test_buffer_concurrency_2threads)
 {
     circular_buffer_t buf;
 
     pthread_t consumer_thread, producer_thread;
 
-    circular_buffer_init(&buf, 8);
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
     circular_buffer_set_seq_initial(&buf, 1000);
     pthread_create(&consumer_thread, NULL, consumer_func1, &buf);
     pthread_create(&producer_thread, NULL, producer_func1, &buf);
@@ -217,6 +276,426 @@ START_TEST (test_buffer_concurrency_2threads)
 }
 END_TEST
 
+START_TEST (test_buffer_spsc_capacity)
+{
+    circular_buffer_t buf;
+
+    ck_assert_int_eq(circular_buffer_init(&buf, 6, BUFFER_SPSC), CHITCP_OK);
+    ck_assert_int_eq(circular_buffer_capacity(&buf), 8);
+    ck_assert_int_eq(circular_buffer_available(&buf), 8);
+    circular_buffer_free(&buf);
+
+    ck_assert_int_eq(circular_buffer_init(&buf, 8, 42), CHITCP_EINVAL);
+}
+END_TEST
+
+START_TEST (test_buffer_spsc_wrap)
+{
+    int rc;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init(&buf, 8, BUFFER_SPSC);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    rc = circular_buffer_write(&buf, numbers, 4, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 4);
+
+    rc = circular_buffer_read(&buf, tmp, 2, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 2);
+    ck_assert_int_eq(memcmp(numbers, tmp, 2), 0);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1002);
+
+    rc = circular_buffer_write(&buf, numbers+4, 6, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 6);
+    ck_assert_int_eq(circular_buffer_next(&buf), 1010);
+
+    rc = circular_buffer_write(&buf, numbers, 1, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, CHITCP_EWOULDBLOCK);
+
+    rc = circular_buffer_peek(&buf, tmp+2, 8, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 8);
+    ck_assert_int_eq(circular_buffer_count(&buf), 8);
+
+    rc = circular_buffer_read(&buf, tmp+2, 8, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 8);
+    ck_assert_int_eq(memcmp(numbers, tmp, 10), 0);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1010);
+
+    rc = circular_buffer_read(&buf, tmp, 1, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, CHITCP_EWOULDBLOCK);
+
+    circular_buffer_free(&buf);
+}
+END_TEST
+
+START_TEST (test_buffer_spsc_concurrency_2threads)
+{
+    circular_buffer_t buf;
+
+    pthread_t consumer_thread, producer_thread;
+
+    circular_buffer_init(&buf, 8, BUFFER_SPSC);
+    circular_buffer_set_seq_initial(&buf, 1000);
+    pthread_create(&consumer_thread, NULL, consumer_func1, &buf);
+    pthread_create(&producer_thread, NULL, producer_func1, &buf);
+    pthread_join(consumer_thread, NULL);
+    pthread_join(producer_thread, NULL);
+    circular_buffer_free(&buf);
+}
+END_TEST
+
+static void check_grow(int type, uint32_t grown)
+{
+    int rc;
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init(&buf, 8, type);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    /* Leave six bytes in the buffer, wrapping around its end */
+    circular_buffer_write(&buf, numbers, 4, BUFFER_NONBLOCKING);
+    circular_buffer_read(&buf, tmp, 4, BUFFER_NONBLOCKING);
+    circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+
+    ck_assert_int_eq(circular_buffer_grow(&buf, 4), CHITCP_OK);
+    ck_assert_int_eq(circular_buffer_capacity(&buf), 8);
+
+    ck_assert_int_eq(circular_buffer_grow(&buf, 20), CHITCP_OK);
+    ck_assert_int_eq(circular_buffer_capacity(&buf), grown);
+    ck_assert_int_eq(circular_buffer_count(&buf), 6);
+    ck_assert_int_eq(circular_buffer_available(&buf), grown - 6);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1004);
+    ck_assert_int_eq(circular_buffer_next(&buf), 1010);
+
+    rc = circular_buffer_write(&buf, numbers + 6, 10, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 10);
+
+    rc = circular_buffer_peek(&buf, tmp, 16, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 16);
+    ck_assert_int_eq(memcmp(numbers, tmp, 16), 0);
+
+    rc = circular_buffer_read(&buf, tmp, 16, BUFFER_NONBLOCKING);
+    ck_assert_int_eq(rc, 16);
+    ck_assert_int_eq(memcmp(numbers, tmp, 16), 0);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1020);
+
+    circular_buffer_free(&buf);
+}
+
+START_TEST (test_buffer_grow)
+{
+    check_grow(BUFFER_LOCKED, 20);
+}
+END_TEST
+
+START_TEST (test_buffer_grow_spsc)
+{
+    check_grow(BUFFER_SPSC, 32);
+}
+END_TEST
+
+START_TEST (test_buffer_spsc_grow_pending)
+{
+    circular_buffer_t buf;
+    uint8_t tmp[26];
+
+    circular_buffer_init(&buf, 8, BUFFER_SPSC);
+    circular_buffer_write(&buf, numbers, 6, BUFFER_NONBLOCKING);
+
+    /* The writer can't grow the buffer again until the reader has
+     * moved on to the ring from the last time */
+    ck_assert_int_eq(circular_buffer_grow(&buf, 16), CHITCP_OK);
+    ck_assert_int_eq(circular_buffer_grow(&buf, 32), CHITCP_EWOULDBLOCK);
+    ck_assert_int_eq(circular_buffer_capacity(&buf), 16);
+
+    ck_assert_int_eq(circular_buffer_read(&buf, tmp, 2, BUFFER_NONBLOCKING), 2);
+    ck_assert_int_eq(circular_buffer_grow(&buf, 32), CHITCP_OK);
+    ck_assert_int_eq(circular_buffer_capacity(&buf), 32);
+
+    ck_assert_int_eq(circular_buffer_read(&buf, tmp + 2, 8, BUFFER_NONBLOCKING), 4);
+    ck_assert_int_eq(memcmp(numbers, tmp, 6), 0);
+
+    ck_assert_int_eq(circular_buffer_grow(&buf, (1u << 31) + 1), CHITCP_EINVAL);
+
+    circular_buffer_free(&buf);
+}
+END_TEST
+
+/* Contention benchmarks: a producer and a consumer move a stream of
+ * bytes through a small buffer, and we report how much CPU time the
+ * process burned per megabyte moved. */
+
+#define BENCH_BUFSIZE (4096)
+#define BENCH_WRITE_CHUNK (536)
+#define BENCH_READ_CHUNK (1024)
+
+typedef struct bench_args
+{
+    circular_buffer_t *buf;
+    uint32_t total;
+    useconds_t consumer_delay;
+    int ok;
+} bench_args_t;
+
+static double bench_clock(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void* bench_producer(void* args)
+{
+    bench_args_t *ba = (bench_args_t *) args;
+    uint8_t chunk[BENCH_WRITE_CHUNK];
+    uint32_t sent = 0;
+    int rc;
+
+    while (sent < ba->total)
+    {
+        uint32_t n = ba->total - sent;
+        if (n > BENCH_WRITE_CHUNK)
+            n = BENCH_WRITE_CHUNK;
+
+        for (int i = 0; i < n; i++)
+            chunk[i] = (uint8_t) (sent + i);
+
+        rc = circular_buffer_write(ba->buf, chunk, n, BUFFER_BLOCKING);
+        if (rc != n)
+            return NULL;
+        sent += n;
+    }
+
+    return NULL;
+}
+
+void* bench_consumer(void* args)
+{
+    bench_args_t *ba = (bench_args_t *) args;
+    uint8_t chunk[BENCH_READ_CHUNK];
+    uint32_t received = 0;
+    int rc;
+
+    ba->ok = 1;
+    while (received < ba->total)
+    {
+        if (ba->consumer_delay)
+            usleep(ba->consumer_delay);
+
+        rc = circular_buffer_read(ba->buf, chunk, BENCH_READ_CHUNK, BUFFER_BLOCKING);
+        if (rc <= 0)
+        {
+            ba->ok = 0;
+            return NULL;
+        }
+
+        for (int i = 0; i < rc; i++)
+            if (chunk[i] != (uint8_t) (received + i))
+                ba->ok = 0;
+        received += rc;
+    }
+
+    return NULL;
+}
+
+static void run_bench(const char *name, int type, uint32_t total, useconds_t consumer_delay,
+                      double *cpu, double *wall)
+{
+    circular_buffer_t buf;
+    bench_args_t ba;
+    pthread_t consumer_thread, producer_thread;
+    double cpu0, wall0;
+
+    circular_buffer_init(&buf, BENCH_BUFSIZE, type);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    ba.buf = &buf;
+    ba.total = total;
+    ba.consumer_delay = consumer_delay;
+    ba.ok = 0;
+
+    cpu0 = bench_clock(CLOCK_PROCESS_CPUTIME_ID);
+    wall0 = bench_clock(CLOCK_MONOTONIC);
+    pthread_create(&consumer_thread, NULL, bench_consumer, &ba);
+    pthread_create(&producer_thread, NULL, bench_producer, &ba);
+    pthread_join(producer_thread, NULL);
+    pthread_join(consumer_thread, NULL);
+    *cpu = bench_clock(CLOCK_PROCESS_CPUTIME_ID) - cpu0;
+    *wall = bench_clock(CLOCK_MONOTONIC) - wall0;
+
+    ck_assert_int_eq(ba.ok, 1);
+    ck_assert_int_eq(circular_buffer_count(&buf), 0);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1000 + total);
+    circular_buffer_free(&buf);
+
+    printf("%s: %.2f MB in %.3fs wall, %.3fs CPU (%.3f ms CPU/MB)\n",
+           name, total / 1048576.0, *wall, *cpu, *cpu * 1000 / (total / 1048576.0));
+}
+
+START_TEST (test_buffer_bench_throughput)
+{
+    double cpu, wall;
+
+    run_bench("throughput", BUFFER_LOCKED, 64 * 1048576, 0, &cpu, &wall);
+}
+END_TEST
+
+START_TEST (test_buffer_bench_throughput_spsc)
+{
+    double cpu, wall;
+
+    run_bench("throughput (spsc)", BUFFER_SPSC, 64 * 1048576, 0, &cpu, &wall);
+}
+END_TEST
+
+START_TEST (test_buffer_bench_slow_consumer)
+{
+    double cpu, wall;
+
+    /* The consumer drains one chunk per millisecond, so the producer
+     * spends nearly all its time blocked on a full buffer. A blocked
+     * producer must sleep, not spin. */
+    run_bench("slow consumer", BUFFER_LOCKED, 256 * BENCH_READ_CHUNK, 1000, &cpu, &wall);
+    ck_assert(cpu < wall / 2);
+}
+END_TEST
+
+START_TEST (test_buffer_bench_slow_consumer_spsc)
+{
+    double cpu, wall;
+
+    run_bench("slow consumer (spsc)", BUFFER_SPSC, 256 * BENCH_READ_CHUNK, 1000, &cpu, &wall);
+    ck_assert(cpu < wall / 2);
+}
+END_TEST
+
+/* Like bench_producer, but grows the buffer (up to 64 times its initial
+ * size) after every chunk it writes, while the consumer keeps reading */
+void* grow_producer(void* args)
+{
+    bench_args_t *ba = (bench_args_t *) args;
+    uint8_t chunk[BENCH_WRITE_CHUNK];
+    uint32_t sent = 0;
+    int rc;
+
+    while (sent < ba->total)
+    {
+        uint32_t n = ba->total - sent;
+        if (n > BENCH_WRITE_CHUNK)
+            n = BENCH_WRITE_CHUNK;
+
+        for (int i = 0; i < n; i++)
+            chunk[i] = (uint8_t) (sent + i);
+
+        rc = circular_buffer_write(ba->buf, chunk, n, BUFFER_BLOCKING);
+        if (rc != n)
+            return NULL;
+        sent += n;
+
+        if (circular_buffer_capacity(ba->buf) < 64 * BENCH_BUFSIZE)
+            circular_buffer_grow(ba->buf, 2 * circular_buffer_capacity(ba->buf));
+    }
+
+    return NULL;
+}
+
+static void check_grow_concurrency(int type)
+{
+    circular_buffer_t buf;
+    bench_args_t ba;
+    pthread_t consumer_thread, producer_thread;
+
+    circular_buffer_init(&buf, BENCH_BUFSIZE, type);
+    circular_buffer_set_seq_initial(&buf, 1000);
+
+    ba.buf = &buf;
+    ba.total = 4 * 1048576;
+    ba.consumer_delay = 0;
+    ba.ok = 0;
+
+    pthread_create(&consumer_thread, NULL, bench_consumer, &ba);
+    pthread_create(&producer_thread, NULL, grow_producer, &ba);
+    pthread_join(producer_thread, NULL);
+    pthread_join(consumer_thread, NULL);
+
+    ck_assert_int_eq(ba.ok, 1);
+    ck_assert_int_eq(circular_buffer_first(&buf), 1000 + ba.total);
+    ck_assert_int_eq(circular_buffer_capacity(&buf), 64 * BENCH_BUFSIZE);
+    circular_buffer_free(&buf);
+}
+
+START_TEST (test_buffer_grow_concurrency)
+{
+    check_grow_concurrency(BUFFER_LOCKED);
+}
+END_TEST
+
+START_TEST (test_buffer_grow_concurrency_spsc)
+{
+    check_grow_concurrency(BUFFER_SPSC);
+}
+END_TEST
+
+START_TEST (test_buffer_close_wakes_reader)
+{
+    circular_buffer_t buf;
+    pthread_t consumer_thread;
+    bench_args_t ba;
+
+    circular_buffer_init(&buf, 8, BUFFER_LOCKED);
+    ba.buf = &buf;
+    ba.total = 8;
+    ba.consumer_delay = 0;
+    pthread_create(&consumer_thread, NULL, bench_consumer, &ba);
+    usleep(10000);
+    circular_buffer_close(&buf);
+    pthread_join(consumer_thread, NULL);
+    ck_assert_int_eq(ba.ok, 0);
+    circular_buffer_free(&buf);
+}
+END_TEST
+
+static void check_close_drains(int type)
+{
+    circular_buffer_t buf;
+    uint8_t data[6] = {1, 2, 3, 4, 5, 6}, out[6];
+    int nbytes;
+
+    circular_buffer_init(&buf, 8, type);
+    circular_buffer_set_seq_initial(&buf, 1000);
+    circular_buffer_write(&buf, data, 6, BUFFER_BLOCKING);
+    circular_buffer_read(&buf, out, 2, BUFFER_BLOCKING);
+    circular_buffer_set_seq_initial(&buf, 2000);
+    ck_assert_int_eq(circular_buffer_first(&buf), 2000);
+    ck_assert_int_eq(circular_buffer_next(&buf), 2004);
+
+    /* Data written before the buffer was closed can still be read */
+    circular_buffer_close(&buf);
+    ck_assert_int_eq(circular_buffer_write(&buf, data, 1, BUFFER_NONBLOCKING), 0);
+    nbytes = circular_buffer_read(&buf, out, 6, BUFFER_BLOCKING);
+    ck_assert_int_eq(nbytes, 4);
+    ck_assert(memcmp(out, data + 2, 4) == 0);
+    ck_assert_int_eq(circular_buffer_read(&buf, out, 6, BUFFER_BLOCKING), 0);
+    ck_assert_int_eq(circular_buffer_read(&buf, out, 6, BUFFER_NONBLOCKING), 0);
+
+    circular_buffer_free(&buf);
+}
+
+START_TEST (test_buffer_close_drains)
+{
+    check_close_drains(BUFFER_LOCKED);
+}
+END_TEST
+
+START_TEST (test_buffer_close_drains_spsc)
+{
+    check_close_drains(BUFFER_SPSC);
+}
+END_TEST
+
 Suite* make_buffer_suite (void)
 {
   Suite *s = suite_create ("Circular Buffer");
@@ -238,9 +717,39 @@ Suite* make_buffer_suite (void)
   tcase_add_test (tc_wraparound, test_buffer_wrap_2);
   suite_add_tcase (s, tc_wraparound);
 
+  TCase *tc_zerocopy = tcase_create ("Zero-copy access");
+  tcase_add_test (tc_zerocopy, test_buffer_peek_iov);
+  tcase_add_test (tc_zerocopy, test_buffer_peek_iov_spsc);
+  suite_add_tcase (s, tc_zerocopy);
+
+  TCase *tc_grow = tcase_create ("Growing");
+  tcase_add_test (tc_grow, test_buffer_grow);
+  tcase_add_test (tc_grow, test_buffer_grow_spsc);
+  tcase_add_test (tc_grow, test_buffer_spsc_grow_pending);
+  tcase_add_test (tc_grow, test_buffer_grow_concurrency);
+  tcase_add_test (tc_grow, test_buffer_grow_concurrency_spsc);
+  suite_add_tcase (s, tc_grow);
+
   TCase *tc_concurrency = tcase_create ("Concurrency");
   tcase_add_test (tc_concurrency, test_buffer_concurrency_2threads);
+  tcase_add_test (tc_concurrency, test_buffer_close_wakes_reader);
+  tcase_add_test (tc_concurrency, test_buffer_close_drains);
+  tcase_add_test (tc_concurrency, test_buffer_close_drains_spsc);
   suite_add_tcase (s, tc_concurrency);
 
+  TCase *tc_spsc = tcase_create ("Lock-free SPSC");
+  tcase_add_test (tc_spsc, test_buffer_spsc_capacity);
+  tcase_add_test (tc_spsc, test_buffer_spsc_wrap);
+  tcase_add_test (tc_spsc, test_buffer_spsc_concurrency_2threads);
+  suite_add_tcase (s, tc_spsc);
+
+  TCase *tc_bench = tcase_create ("Contention benchmark");
+  tcase_set_timeout (tc_bench, 60);
+  tcase_add_test (tc_bench, test_buffer_bench_throughput);
+  tcase_add_test (tc_bench, test_buffer_bench_slow_consumer);
+  tcase_add_test (tc_bench, test_buffer_bench_throughput_spsc);
+  tcase_add_test (tc_bench, test_buffer_bench_slow_consumer_spsc);
+  suite_add_tcase (s, tc_bench);
+
   return s;
 }
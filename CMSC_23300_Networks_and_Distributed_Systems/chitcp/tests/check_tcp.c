@@ -10,6 +10,21 @@
 
 Suite* make_connection_init_suite (void);
 Suite* make_data_transfer_suite (void);
+Suite* make_rto_suite (void);
+Suite* make_congestion_suite (void);
+Suite* make_reassembly_suite (void);
+Suite* make_sack_suite (void);
+Suite* make_fast_retransmit_suite (void);
+Suite* make_delayed_ack_suite (void);
+Suite* make_nagle_suite (void);
+Suite* make_window_suite (void);
+Suite* make_mss_suite (void);
+Suite* make_timer_suite (void);
+Suite* make_packet_pool_suite (void);
+Suite* make_transmit_suite (void);
+Suite* make_receive_suite (void);
+Suite* make_demux_suite (void);
+Suite* make_alloc_suite (void);
 
 
 int main (void)
@@ -19,6 +34,21 @@ int main (void)
 
     sr = srunner_create (make_connection_init_suite ());
     srunner_add_suite (sr, make_data_transfer_suite ());
+    srunner_add_suite (sr, make_rto_suite ());
+    srunner_add_suite (sr, make_congestion_suite ());
+    srunner_add_suite (sr, make_reassembly_suite ());
+    srunner_add_suite (sr, make_sack_suite ());
+    srunner_add_suite (sr, make_fast_retransmit_suite ());
+    srunner_add_suite (sr, make_delayed_ack_suite ());
+    srunner_add_suite (sr, make_nagle_suite ());
+    srunner_add_suite (sr, make_window_suite ());
+    srunner_add_suite (sr, make_mss_suite ());
+    srunner_add_suite (sr, make_timer_suite ());
+    srunner_add_suite (sr, make_packet_pool_suite ());
+    srunner_add_suite (sr, make_transmit_suite ());
+    srunner_add_suite (sr, make_receive_suite ());
+    srunner_add_suite (sr, make_demux_suite ());
+    srunner_add_suite (sr, make_alloc_suite ());
 
     srunner_run_all (sr, CK_NORMAL);
     number_failed = srunner_ntests_failed (sr);
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "connection.h"
+
+#define NDISTINCT (100)
+#define NSEGMENTS (4)
+
+/* The socket table grows as sockets are allocated, freed socket
+ * entries are handed out again, and running out of entries is
+ * reported as an error */
+START_TEST (test_alloc_sockets)
+{
+    serverinfo_t *si = calloc(1, sizeof(serverinfo_t));
+    chisocketentry_t *first;
+    int socket_index;
+
+    si->chisocket_table_max = NSEGMENTS * CHISOCKET_SEGMENT_SIZE;
+    ck_assert_int_eq(chitcpd_server_init(si), CHITCP_OK);
+    ck_assert_int_eq(si->chisocket_table_size, 0);
+
+    ck_assert_int_eq(chitcpd_allocate_socket(si, &socket_index), CHITCP_OK);
+    ck_assert_int_eq(si->chisocket_table_size, CHISOCKET_SEGMENT_SIZE);
+    first = SOCKET_ENTRY(si, socket_index);
+
+    for (int i = 1; i < si->chisocket_table_max; i++)
+    {
+        ck_assert_int_eq(chitcpd_allocate_socket(si, &socket_index), CHITCP_OK);
+        ck_assert(!SOCKET_ENTRY(si, socket_index)->available);
+        ck_assert_int_eq(SOCKET_NO(si, SOCKET_ENTRY(si, socket_index)), socket_index);
+    }
+    ck_assert_int_eq(si->chisocket_table_size, si->chisocket_table_max);
+    ck_assert_int_eq(chitcpd_allocate_socket(si, &socket_index), CHITCP_ESOCKET);
+
+    /* Growing the table does not move the entries already in it */
+    ck_assert(SOCKET_ENTRY(si, 0) == first);
+
+    chitcpd_free_socket_entry(si, SOCKET_ENTRY(si, 10));
+    chitcpd_free_socket_entry(si, SOCKET_ENTRY(si, 500));
+    ck_assert(SOCKET_ENTRY(si, 10)->available);
+    ck_assert_int_eq(SOCKET_NO(si, SOCKET_ENTRY(si, 10)), 10);
+
+    ck_assert_int_eq(chitcpd_allocate_socket(si, &socket_index), CHITCP_OK);
+    ck_assert(socket_index == 10 || socket_index == 500);
+    ck_assert_int_eq(chitcpd_allocate_socket(si, &socket_index), CHITCP_OK);
+    ck_assert(socket_index == 10 || socket_index == 500);
+    ck_assert_int_eq(chitcpd_allocate_socket(si, &socket_index), CHITCP_ESOCKET);
+
+    chitcpd_server_free(si);
+    free(si);
+}
+END_TEST
+
+/* The connection table also grows on demand, up to its maximum size */
+START_TEST (test_alloc_connections)
+{
+    serverinfo_t *si = calloc(1, sizeof(serverinfo_t));
+    struct sockaddr_in addr;
+    tcpconnentry_t *connection;
+
+    si->connection_table_max = NSEGMENTS * CONNECTION_SEGMENT_SIZE;
+    ck_assert_int_eq(chitcpd_server_init(si), CHITCP_OK);
+    ck_assert_int_eq(si->connection_table_size, 0);
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+
+    for (int i = 0; i < si->connection_table_max; i++)
+    {
+        addr.sin_addr.s_addr = htonl(0x0a000001 + i);
+        connection = chitcpd_add_connection(si, -1, -1, (struct sockaddr *) &addr);
+        ck_assert(connection != NULL);
+        ck_assert_int_eq(si->connection_table_size,
+                         (i / CONNECTION_SEGMENT_SIZE + 1) * CONNECTION_SEGMENT_SIZE);
+    }
+    addr.sin_addr.s_addr = htonl(0x0b000001);
+    ck_assert(chitcpd_add_connection(si, -1, -1, (struct sockaddr *) &addr) == NULL);
+
+    for (int i = 0; i < si->connection_table_max; i++)
+    {
+        addr.sin_addr.s_addr = htonl(0x0a000001 + i);
+        ck_assert(chitcpd_get_connection(si, (struct sockaddr *) &addr) == CONNECTION_ENTRY(si, i));
+    }
+
+    chitcpd_server_free(si);
+    free(si);
+}
+END_TEST
+
+/* Every ephemeral port can be used (once), and ports are not reused
+ * in order */
+START_TEST (test_alloc_ephemeral)
+{
+    serverinfo_t *si = calloc(1, sizeof(serverinfo_t));
+    chisocketentry_t entry, other;
+    int nports, port, ndistinct = 0;
+    bool_t *seen;
+
+    ck_assert_int_eq(chitcpd_server_init(si), CHITCP_OK);
+    nports = si->port_table_size - si->ephemeral_port_start;
+    seen = calloc(si->port_table_size, sizeof(bool_t));
+
+    /* Ports that are already taken are skipped */
+    ck_assert_int_eq(chitcpd_reserve_port(si, si->ephemeral_port_start + 1, &other), CHITCP_OK);
+    ck_assert_int_eq(chitcpd_reserve_port(si, si->ephemeral_port_start + 1, &entry), CHITCP_EINVAL);
+
+    for (int i = 0; i < nports - 1; i++)
+    {
+        port = chitcpd_find_ephemeral_port(si, &entry);
+        ck_assert_int_ge(port, si->ephemeral_port_start);
+        ck_assert_int_lt(port, si->port_table_size);
+        ck_assert_msg(!seen[port], "Port %i was assigned twice", port);
+        ck_assert(chitcpd_port_owner(si, port) == &entry);
+        seen[port] = TRUE;
+    }
+    ck_assert(!seen[si->ephemeral_port_start + 1]);
+    ck_assert_int_eq(chitcpd_find_ephemeral_port(si, &entry), -1);
+
+    /* The only free port is the one that was just released... */
+    chitcpd_release_port(si, si->ephemeral_port_start + 100, &other);
+    ck_assert_int_eq(chitcpd_find_ephemeral_port(si, &entry), -1);
+    chitcpd_release_port(si, si->ephemeral_port_start + 100, &entry);
+    ck_assert_int_eq(chitcpd_find_ephemeral_port(si, &entry), si->ephemeral_port_start + 100);
+
+    /* ...but, with plenty of free ports, it is unlikely to be picked again */
+    for (int i = 0; i < nports; i++)
+        chitcpd_release_port(si, si->ephemeral_port_start + i, &entry);
+    memset(seen, 0, si->port_table_size * sizeof(bool_t));
+
+    for (int i = 0; i < NDISTINCT; i++)
+    {
+        port = chitcpd_find_ephemeral_port(si, &entry);
+        if (!seen[port])
+            ndistinct++;
+        seen[port] = TRUE;
+        chitcpd_release_port(si, port, &entry);
+    }
+    ck_assert_msg(ndistinct > NDISTINCT / 2, "Only %i distinct ports in %i connections", ndistinct, NDISTINCT);
+
+    chitcpd_server_free(si);
+    free(seen);
+    free(si);
+}
+END_TEST
+
+Suite* make_alloc_suite (void)
+{
+  Suite *s = suite_create ("TCP: Socket and port allocation");
+
+  TCase *tc_alloc = tcase_create ("Allocation");
+  tcase_add_test (tc_alloc, test_alloc_sockets);
+  tcase_add_test (tc_alloc, test_alloc_connections);
+  tcase_add_test (tc_alloc, test_alloc_ephemeral);
+  suite_add_tcase (s, tc_alloc);
+
+  return s;
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "congestion.h"
+
+static const tcp_congestion_ops_t *algorithms[2] = {&tcp_congestion_newreno, &tcp_congestion_cubic};
+
+static tcp_data_t *congestion_setup(const tcp_congestion_ops_t *cc)
+{
+    tcp_data_t *tcp_data = calloc(1, sizeof(tcp_data_t));
+
+    tcp_data->SMSS = TCP_MSS;
+    chitcpd_congestion_init(tcp_data, cc);
+    tcp_data->SND_UNA = 1000;
+    tcp_data->SND_NXT = 1000;
+    tcp_data->SND_WND = UINT32_MAX;
+
+    return tcp_data;
+}
+
+/* Fills the congestion window, as a sender with unlimited data would */
+static void congestion_fill(tcp_data_t *tcp_data)
+{
+    tcp_data->SND_NXT = tcp_data->SND_UNA + tcp_data->cwnd;
+}
+
+/* Acknowledges "nsegments" full-sized segments, one ACK per segment,
+ * keeping the window full */
+static void congestion_ack(tcp_data_t *tcp_data, int nsegments)
+{
+    for (int i = 0; i < nsegments; i++)
+    {
+        tcp_data->cc->on_ack(tcp_data, TCP_MSS);
+        tcp_data->SND_UNA += TCP_MSS;
+        congestion_fill(tcp_data);
+    }
+}
+
+START_TEST (test_congestion_find)
+{
+    ck_assert(chitcpd_congestion_find("newreno") == &tcp_congestion_newreno);
+    ck_assert(chitcpd_congestion_find("cubic") == &tcp_congestion_cubic);
+    ck_assert(chitcpd_congestion_find("vegas") == NULL);
+}
+END_TEST
+
+START_TEST (test_congestion_default)
+{
+    tcp_data_t *tcp_data = congestion_setup(NULL);
+
+    ck_assert(tcp_data->cc == TCP_CONGESTION_DEFAULT);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_congestion_slow_start)
+{
+    tcp_data_t *tcp_data = congestion_setup(algorithms[_i]);
+    uint32_t cwnd = tcp_data->cwnd;
+
+    ck_assert_int_ge(cwnd, 2 * TCP_MSS);
+    ck_assert_int_le(cwnd, 4 * TCP_MSS);
+
+    /* Acknowledging a full window doubles it */
+    congestion_fill(tcp_data);
+    congestion_ack(tcp_data, cwnd / TCP_MSS);
+    ck_assert_int_eq(tcp_data->cwnd, cwnd + (cwnd / TCP_MSS) * TCP_MSS);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_congestion_app_limited)
+{
+    tcp_data_t *tcp_data = congestion_setup(algorithms[_i]);
+    uint32_t cwnd = tcp_data->cwnd;
+
+    /* Only one segment in flight: the window is not what limits
+     * the sender, so it must not grow */
+    for (int i = 0; i < 20; i++)
+    {
+        tcp_data->SND_NXT = tcp_data->SND_UNA + TCP_MSS;
+        tcp_data->cc->on_ack(tcp_data, TCP_MSS);
+        tcp_data->SND_UNA += TCP_MSS;
+    }
+
+    ck_assert_int_eq(tcp_data->cwnd, cwnd);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_congestion_rto)
+{
+    tcp_data_t *tcp_data = congestion_setup(algorithms[_i]);
+
+    tcp_data->cwnd = 20 * TCP_MSS;
+    congestion_fill(tcp_data);
+    tcp_data->cc->on_rto(tcp_data);
+
+    ck_assert_int_eq(tcp_data->cwnd, TCP_MSS);
+    ck_assert_int_ge(tcp_data->ssthresh, 2 * TCP_MSS);
+    ck_assert_int_lt(tcp_data->ssthresh, 20 * TCP_MSS);
+
+    /* Slow start up to ssthresh */
+    while (tcp_data->cwnd < tcp_data->ssthresh)
+        congestion_ack(tcp_data, 1);
+    ck_assert_int_le(tcp_data->cwnd, tcp_data->ssthresh + TCP_MSS);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_newreno_loss)
+{
+    tcp_data_t *tcp_data = congestion_setup(&tcp_congestion_newreno);
+
+    tcp_data->cwnd = 20 * TCP_MSS;
+    congestion_fill(tcp_data);
+    tcp_data->cc->on_loss(tcp_data);
+
+    ck_assert_int_eq(tcp_data->ssthresh, 10 * TCP_MSS);
+    ck_assert_int_eq(tcp_data->cwnd, 10 * TCP_MSS);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_newreno_congestion_avoidance)
+{
+    tcp_data_t *tcp_data = congestion_setup(&tcp_congestion_newreno);
+
+    tcp_data->cwnd = 10 * TCP_MSS;
+    tcp_data->ssthresh = 10 * TCP_MSS;
+    congestion_fill(tcp_data);
+
+    /* One segment per round trip */
+    congestion_ack(tcp_data, 9);
+    ck_assert_int_eq(tcp_data->cwnd, 10 * TCP_MSS);
+    congestion_ack(tcp_data, 1);
+    ck_assert_int_eq(tcp_data->cwnd, 11 * TCP_MSS);
+    congestion_ack(tcp_data, 11);
+    ck_assert_int_eq(tcp_data->cwnd, 12 * TCP_MSS);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_cubic_loss)
+{
+    tcp_data_t *tcp_data = congestion_setup(&tcp_congestion_cubic);
+
+    tcp_data->cwnd = 100 * TCP_MSS;
+    congestion_fill(tcp_data);
+    tcp_data->cc->on_loss(tcp_data);
+
+    ck_assert_int_eq(tcp_data->cwnd, 70 * TCP_MSS);
+    ck_assert_int_eq(tcp_data->ssthresh, 70 * TCP_MSS);
+    ck_assert(tcp_data->cubic.W_max == 100);
+
+    /* A second loss before getting back to W_max releases bandwidth
+     * to other flows (fast convergence) */
+    tcp_data->cc->on_loss(tcp_data);
+    ck_assert(tcp_data->cubic.W_max == 70 * (1 + 0.7) / 2);
+
+    free(tcp_data);
+}
+END_TEST
+
+START_TEST (test_cubic_growth)
+{
+    tcp_data_t *tcp_data = congestion_setup(&tcp_congestion_cubic);
+
+    tcp_data->cwnd = 100 * TCP_MSS;
+    congestion_fill(tcp_data);
+    tcp_data->cc->on_loss(tcp_data);
+    congestion_fill(tcp_data);
+
+    /* Right after the loss, the cubic function is flat: the window
+     * barely grows over a round trip */
+    congestion_ack(tcp_data, 70);
+    ck_assert_int_le(tcp_data->cwnd, 72 * TCP_MSS);
+    ck_assert(tcp_data->cubic.in_epoch);
+
+    /* Well past K, the window grows beyond W_max */
+    tcp_data->cubic.epoch_start.tv_sec -= 10;
+    congestion_ack(tcp_data, 70);
+    ck_assert_int_gt(tcp_data->cwnd, 100 * TCP_MSS);
+
+    free(tcp_data);
+}
+END_TEST
+
+Suite* make_congestion_suite (void)
+{
+  Suite *s = suite_create ("TCP: Congestion control");
+
+  TCase *tc_algorithms = tcase_create ("Algorithms");
+  tcase_add_test (tc_algorithms, test_congestion_find);
+  tcase_add_test (tc_algorithms, test_congestion_default);
+  tcase_add_loop_test (tc_algorithms, test_congestion_slow_start, 0, 2);
+  tcase_add_loop_test (tc_algorithms, test_congestion_app_limited, 0, 2);
+  tcase_add_loop_test (tc_algorithms, test_congestion_rto, 0, 2);
+  suite_add_tcase (s, tc_algorithms);
+
+  TCase *tc_newreno = tcase_create ("NewReno");
+  tcase_add_test (tc_newreno, test_newreno_loss);
+  tcase_add_test (tc_newreno, test_newreno_congestion_avoidance);
+  suite_add_tcase (s, tc_newreno);
+
+  TCase *tc_cubic = tcase_create ("CUBIC");
+  tcase_add_test (tc_cubic, test_cubic_loss);
+  tcase_add_test (tc_cubic, test_cubic_growth);
+  suite_add_tcase (s, tc_cubic);
+
+  return s;
+}
@@ -18,52 +18,6 @@
 
 static const int bufsizes[6] = {1, 10, 536, 537, 1072, 4096};
 
-uint8_t* generate_msg(int size)
-{
-    uint8_t *buf = malloc(size);
-
-    for(int i=0; i < size; i++)
-        buf[i] = i % 256;
-
-    return buf;
-}
-
-
-int client_send_recv(int sockfd, void *args)
-{
-    int rc;
-    int size = *((int *) args);
-
-    uint8_t *buf = generate_msg(size);
-
-    rc = chitcp_socket_send(sockfd, buf, size);
-    ck_assert_msg(rc == size,
-                  "Socket did not send all the bytes (expected %i, got %i)", size, rc);
-
-    free(buf);
-
-    return 0;
-}
-
-
-int server_send_recv(int sockfd, void *args)
-{
-    int rc;
-    int size = *((int *) args);
-    uint8_t buf[size];
-
-    rc = chitcp_socket_recv(sockfd, buf, size);
-    ck_assert_msg(rc == size,
-                  "Socket did not receive all the bytes (expected %i, got %i)", size, rc);
-
-    for (int i = 0; i < size; i++)
-        ck_assert_msg(buf[i] == (i % 256),
-                      "Unexpected value encountered: buf[%i] == %i (expected %i)",
-                      i, buf[i], (i % 256));
-
-    return 0;
-}
-
 int client_echo(int sockfd, void *args)
 {
     int rc;
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+#define DELACK_NBYTES (32 * TCP_MSS_MAX)
+
+static int data_segments, acks_sent;
+
+enum chitcpd_debug_response count_acks(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (event_flag == DBG_EVT_PENDING_CONNECTION)
+    {
+        return DBG_RESP_ACCEPT_MONITOR;
+    }
+
+    /* The server never sends data, so (before the client closes the
+     * connection) it only sends ACKs and receives data segments */
+    if (state_info->tcp_state == ESTABLISHED)
+    {
+        if (event_flag == DBG_EVT_INCOMING_PACKET)
+            data_segments++;
+        else if (event_flag == DBG_EVT_OUTGOING_PACKET)
+            acks_sent++;
+    }
+
+    return DBG_RESP_NONE;
+}
+
+/* A bulk transfer should not be acknowledged segment by segment (the
+ * only extra ACKs are the window updates sent as the server reads) */
+START_TEST (test_delayed_ack_bulk)
+{
+    int rc, nbytes = DELACK_NBYTES;
+
+    data_segments = 0;
+    acks_sent = 0;
+
+    rc = chitcp_tester_server_set_debug(tester, count_acks,
+            DBG_EVT_PENDING_CONNECTION | DBG_EVT_INCOMING_PACKET | DBG_EVT_OUTGOING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (server)");
+
+    chitcp_tester_client_run_set(tester, client_send_recv, &nbytes);
+    chitcp_tester_server_run_set(tester, server_send_recv, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    chilog(INFO, "Server sent %i ACKs for %i data segments", acks_sent, data_segments);
+
+    ck_assert_msg(data_segments >= DELACK_NBYTES / TCP_MSS_MAX,
+                  "Received only %i data segments", data_segments);
+    ck_assert_msg(acks_sent >= data_segments / TCP_DELACK_SEGMENTS,
+                  "Sent only %i ACKs for %i data segments", acks_sent, data_segments);
+    ck_assert_msg(acks_sent < data_segments,
+                  "Sent %i ACKs for %i data segments (ACKs are not being delayed)", acks_sent, data_segments);
+}
+END_TEST
+
+Suite* make_delayed_ack_suite (void)
+{
+  Suite *s = suite_create ("TCP: Delayed ACKs");
+
+  TCase *tc_bulk = tcase_create ("Bulk transfer");
+  tcase_add_checked_fixture (tc_bulk, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_bulk, test_delayed_ack_bulk);
+  suite_add_tcase (s, tc_bulk);
+
+  return s;
+}
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "chitcp/addr.h"
+
+/* Many more connected sockets than the hash table initially has buckets */
+#define NCONNECTED (20000)
+#define NACCEPTED (2000)
+#define LISTEN_PORT (80)
+
+static void set_addr(struct sockaddr_storage *ss, const char *ip, uint16_t port)
+{
+    struct sockaddr_in *addr = (struct sockaddr_in *) ss;
+
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+    addr->sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &addr->sin_addr);
+    addr->sin_port = htons(port);
+}
+
+static void remote_ip(char *buf, int i)
+{
+    sprintf(buf, "10.%i.%i.%i", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+}
+
+/* Sockets created by connect() (bound to the ANY address, see the
+ * CONNECT handler), sockets created by accept(), and the listening
+ * socket they were accepted from */
+START_TEST (test_demux_lookup)
+{
+    serverinfo_t *si = calloc(1, sizeof(serverinfo_t));
+    chisocketentry_t *connected = calloc(NCONNECTED, sizeof(chisocketentry_t));
+    chisocketentry_t *accepted = calloc(NACCEPTED, sizeof(chisocketentry_t));
+    chisocketentry_t listener;
+    struct sockaddr_storage local, remote;
+    char ip[INET_ADDRSTRLEN];
+
+    ck_assert_int_eq(chitcpd_server_init(si), CHITCP_OK);
+
+    memset(&listener, 0, sizeof(chisocketentry_t));
+    set_addr(&listener.local_addr, "0.0.0.0", LISTEN_PORT);
+    set_addr(&listener.remote_addr, "0.0.0.0", 0);
+    ck_assert_int_eq(chitcpd_reserve_port(si, LISTEN_PORT, &listener), CHITCP_OK);
+
+    for (int i = 0; i < NCONNECTED; i++)
+    {
+        remote_ip(ip, i);
+        set_addr(&connected[i].local_addr, "0.0.0.0", 1024 + i);
+        set_addr(&connected[i].remote_addr, ip, LISTEN_PORT);
+        ck_assert_int_eq(chitcpd_reserve_port(si, 1024 + i, &connected[i]), CHITCP_OK);
+        chitcpd_hash_socket(si, &connected[i]);
+    }
+
+    for (int i = 0; i < NACCEPTED; i++)
+    {
+        set_addr(&accepted[i].local_addr, "127.0.0.1", LISTEN_PORT);
+        set_addr(&accepted[i].remote_addr, "127.0.0.1", 40000 + i);
+        chitcpd_hash_socket(si, &accepted[i]);
+    }
+
+    ck_assert_int_eq(si->socket_hash_count, NCONNECTED + NACCEPTED);
+    ck_assert(si->socket_hash_size >= si->socket_hash_count);
+
+    /* Packets for connected sockets (sent to a specific local address) */
+    for (int i = 0; i < NCONNECTED; i++)
+    {
+        remote_ip(ip, i);
+        set_addr(&local, "192.168.1.1", 1024 + i);
+        set_addr(&remote, ip, LISTEN_PORT);
+        ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, FALSE) == &connected[i]);
+    }
+
+    /* Packets for accepted sockets, and for new connections */
+    for (int i = 0; i < NACCEPTED; i++)
+    {
+        set_addr(&local, "127.0.0.1", LISTEN_PORT);
+        set_addr(&remote, "127.0.0.1", 40000 + i);
+        ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, FALSE) == &accepted[i]);
+        ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, TRUE) == &accepted[i]);
+
+        set_addr(&remote, "127.0.0.1", 50000 + i);
+        ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, FALSE) == &listener);
+        ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, TRUE) == NULL);
+    }
+
+    /* Right port, wrong peer */
+    set_addr(&local, "127.0.0.1", 1024);
+    set_addr(&remote, "10.0.0.1", LISTEN_PORT);
+    ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, FALSE) == NULL);
+
+    /* Nothing bound to the port */
+    set_addr(&local, "127.0.0.1", 1023);
+    set_addr(&remote, "10.0.0.0", LISTEN_PORT);
+    ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, FALSE) == NULL);
+
+    /* Once removed from the table, accepted sockets' packets go to the
+     * listening socket */
+    for (int i = 0; i < NACCEPTED; i += 2)
+        chitcpd_unhash_socket(si, &accepted[i]);
+    chitcpd_unhash_socket(si, &accepted[0]);
+    ck_assert_int_eq(si->socket_hash_count, NCONNECTED + NACCEPTED / 2);
+
+    for (int i = 0; i < NACCEPTED; i++)
+    {
+        set_addr(&local, "127.0.0.1", LISTEN_PORT);
+        set_addr(&remote, "127.0.0.1", 40000 + i);
+        ck_assert(chitcpd_lookup_socket(si, (struct sockaddr *) &local, (struct sockaddr *) &remote, FALSE) ==
+                  (i % 2 == 0 ? &listener : &accepted[i]));
+    }
+
+    chitcpd_server_free(si);
+    free(connected);
+    free(accepted);
+    free(si);
+}
+END_TEST
+
+Suite* make_demux_suite (void)
+{
+  Suite *s = suite_create ("TCP: Demultiplexing");
+
+  TCase *tc_lookup = tcase_create ("Socket lookup");
+  tcase_add_test (tc_lookup, test_demux_lookup);
+  suite_add_tcase (s, tc_lookup);
+
+  return s;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+/* Enough full-sized segments for the ones sent after the withheld
+ * segment to produce TCP_DUPTHRESH duplicate ACKs */
+#define LOSS_NBYTES (16 * TCP_MSS_MAX)
+
+/* The data segment the server never gets to see */
+#define LOSS_WITHHELD_SEGMENT (2)
+
+static int data_segments;
+static struct timespec withheld_at, received_at;
+
+
+static double elapsed_ms(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+enum chitcpd_debug_response withhold_segment(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (event_flag == DBG_EVT_PENDING_CONNECTION)
+    {
+        return DBG_RESP_ACCEPT_MONITOR;
+    }
+
+    /* Once the connection is established, only the client sends data
+     * (and the server only sends ACKs), so every segment the server
+     * receives carries data */
+    if (event_flag == DBG_EVT_INCOMING_PACKET && state_info->tcp_state == ESTABLISHED)
+    {
+        data_segments++;
+        if (data_segments == LOSS_WITHHELD_SEGMENT)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &withheld_at);
+            return DBG_RESP_WITHHOLD;
+        }
+    }
+
+    return DBG_RESP_NONE;
+}
+
+int client_send(int sockfd, void *args)
+{
+    int rc;
+    uint8_t *buf = malloc(LOSS_NBYTES);
+
+    for(int i=0; i < LOSS_NBYTES; i++)
+        buf[i] = i % 256;
+
+    rc = chitcp_socket_send(sockfd, buf, LOSS_NBYTES);
+    ck_assert_msg(rc == LOSS_NBYTES,
+                  "Socket did not send all the bytes (expected %i, got %i)", LOSS_NBYTES, rc);
+
+    free(buf);
+
+    return 0;
+}
+
+int server_recv(int sockfd, void *args)
+{
+    int rc;
+    uint8_t *buf = malloc(LOSS_NBYTES);
+
+    rc = chitcp_socket_recv(sockfd, buf, LOSS_NBYTES);
+    clock_gettime(CLOCK_MONOTONIC, &received_at);
+    ck_assert_msg(rc == LOSS_NBYTES,
+                  "Socket did not receive all the bytes (expected %i, got %i)", LOSS_NBYTES, rc);
+
+    for (int i = 0; i < LOSS_NBYTES; i++)
+        ck_assert_msg(buf[i] == (i % 256),
+                      "Unexpected value encountered: buf[%i] == %i (expected %i)",
+                      i, buf[i], (i % 256));
+
+    free(buf);
+
+    return 0;
+}
+
+/* A single segment is lost (with SACK in the first iteration, and
+ * without it in the second). The sender has to resend it after three
+ * duplicate ACKs, instead of waiting for the retransmission timer,
+ * which never expires in less than TCP_RTO_MIN. */
+START_TEST (test_fast_retransmit)
+{
+    int rc;
+    double recovery_ms;
+
+    si->sack_disabled = _i;
+    data_segments = 0;
+
+    rc = chitcp_tester_server_set_debug(tester, withhold_segment,
+            DBG_EVT_PENDING_CONNECTION | DBG_EVT_INCOMING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (server)");
+
+    chitcp_tester_client_run_set(tester, client_send, NULL);
+    chitcp_tester_server_run_set(tester, server_recv, NULL);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    ck_assert_msg(data_segments >= LOSS_WITHHELD_SEGMENT, "No segment was withheld");
+
+    recovery_ms = elapsed_ms(&withheld_at, &received_at);
+    chilog(INFO, "Recovered from a lost segment (%s SACK) in %.3f ms", _i ? "without" : "with", recovery_ms);
+
+    ck_assert_msg(recovery_ms < TCP_RTO_MIN / 1000.0,
+                  "Took %.3f ms to recover from a single loss (a retransmission timeout?)", recovery_ms);
+}
+END_TEST
+
+Suite* make_fast_retransmit_suite (void)
+{
+  Suite *s = suite_create ("TCP: Fast retransmit");
+
+  TCase *tc_loss = tcase_create ("Single loss");
+  tcase_add_checked_fixture (tc_loss, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_loop_test (tc_loss, test_fast_retransmit, 0, 2);
+  suite_add_tcase (s, tc_loss);
+
+  return s;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "congestion.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/socket.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+/* Enough data for a few dozen TCP_MSS-sized segments */
+#define MSS_NBYTES (32 * TCP_MSS)
+
+static int data_segments;
+
+enum chitcpd_debug_response count_data_segments(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (event_flag == DBG_EVT_PENDING_CONNECTION)
+    {
+        return DBG_RESP_ACCEPT_MONITOR;
+    }
+
+    /* Only the client sends data */
+    if (event_flag == DBG_EVT_INCOMING_PACKET && state_info->tcp_state == ESTABLISHED)
+        data_segments++;
+
+    return DBG_RESP_NONE;
+}
+
+START_TEST (test_mss_option)
+{
+    tcp_packet_t packet;
+    tcp_options_t options, parsed;
+    uint8_t *opt;
+
+    memset(&options, 0, sizeof(tcp_options_t));
+    options.mss_ok = TRUE;
+    options.mss = 8152;
+    options.wscale_ok = TRUE;
+    options.wscale = 3;
+    chitcp_tcp_packet_create_options(&packet, &options, NULL, 0);
+
+    ck_assert_int_eq(TCP_HEADER_SIZE(&packet) % 4, 0);
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_OK);
+    ck_assert(parsed.mss_ok);
+    ck_assert_int_eq(parsed.mss, 8152);
+    ck_assert(parsed.wscale_ok);
+    ck_assert_int_eq(parsed.wscale, 3);
+    chitcp_tcp_packet_free(&packet);
+
+    /* The MSS is sent in network byte order, and the option is always
+     * four bytes long */
+    options.wscale_ok = FALSE;
+    chitcp_tcp_packet_create_options(&packet, &options, NULL, 0);
+    opt = packet.raw + TCP_HEADER_NOOPTIONS_SIZE;
+    ck_assert_int_eq(opt[0], TCP_OPTION_MSS);
+    ck_assert_int_eq(opt[1], 4);
+    ck_assert_int_eq((opt[2] << 8) | opt[3], 8152);
+    opt[1] = 3;
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_EINVAL);
+    chitcp_tcp_packet_free(&packet);
+
+    /* Segments without the option */
+    memset(&options, 0, sizeof(tcp_options_t));
+    chitcp_tcp_packet_create_options(&packet, &options, NULL, 0);
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_OK);
+    ck_assert(!parsed.mss_ok);
+    chitcp_tcp_packet_free(&packet);
+}
+END_TEST
+
+/* The initial window (RFC 3390) depends on the negotiated segment size */
+START_TEST (test_mss_initial_window)
+{
+    uint32_t mss[] = {TCP_MSS, 1460, TCP_MSS_MAX};
+    uint32_t expected[] = {4 * TCP_MSS, 4380, 2 * TCP_MSS_MAX};
+    tcp_data_t *tcp_data = calloc(1, sizeof(tcp_data_t));
+
+    for (int i = 0; i < 3; i++)
+    {
+        tcp_data->SMSS = mss[i];
+        chitcpd_congestion_init(tcp_data, &tcp_congestion_newreno);
+        ck_assert_int_eq(tcp_data->cwnd, expected[i]);
+    }
+
+    free(tcp_data);
+}
+END_TEST
+
+/* chitcpd's real connections run over loopback, which can carry much
+ * larger segments than the TCP_MSS default */
+START_TEST (test_mss_bulk)
+{
+    int rc, nbytes = MSS_NBYTES;
+
+    data_segments = 0;
+
+    rc = chitcp_tester_server_set_debug(tester, count_data_segments,
+            DBG_EVT_PENDING_CONNECTION | DBG_EVT_INCOMING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (server)");
+
+    chitcp_tester_client_run_set(tester, client_send_recv, &nbytes);
+    chitcp_tester_server_run_set(tester, server_send_recv, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    chilog(INFO, "%i bytes sent in %i segments", MSS_NBYTES, data_segments);
+
+    ck_assert_msg(data_segments > 0, "Received no data segments");
+    ck_assert_msg(data_segments < MSS_NBYTES / TCP_MSS,
+                  "Received %i data segments (segments are not larger than TCP_MSS)", data_segments);
+}
+END_TEST
+
+Suite* make_mss_suite (void)
+{
+  Suite *s = suite_create ("TCP: Maximum segment size");
+
+  TCase *tc_options = tcase_create ("Options");
+  tcase_add_test (tc_options, test_mss_option);
+  tcase_add_test (tc_options, test_mss_initial_window);
+  suite_add_tcase (s, tc_options);
+
+  TCase *tc_bulk = tcase_create ("Bulk transfer");
+  tcase_add_checked_fixture (tc_bulk, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_bulk, test_mss_bulk);
+  suite_add_tcase (s, tc_bulk);
+
+  return s;
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/socket.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+/* Number of one-byte writes made by the client */
+#define NAGLE_NWRITES (20)
+
+static int data_segments;
+
+enum chitcpd_debug_response count_segments(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (event_flag == DBG_EVT_PENDING_CONNECTION)
+    {
+        return DBG_RESP_ACCEPT_MONITOR;
+    }
+
+    /* Only the client sends data */
+    if (event_flag == DBG_EVT_INCOMING_PACKET && state_info->tcp_state == ESTABLISHED)
+        data_segments++;
+
+    return DBG_RESP_NONE;
+}
+
+int client_send_bytes(int sockfd, void *args)
+{
+    int rc;
+    int nodelay = *((int *) args);
+    uint8_t byte;
+
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(int));
+    ck_assert_msg(rc == 0, "Could not set TCP_NODELAY (errno=%i)", errno);
+
+    for (int i = 0; i < NAGLE_NWRITES; i++)
+    {
+        byte = i;
+        rc = chitcp_socket_send(sockfd, &byte, 1);
+        ck_assert_msg(rc == 1, "Socket did not send byte %i", i);
+    }
+
+    return 0;
+}
+
+int server_recv_bytes(int sockfd, void *args)
+{
+    int rc;
+    uint8_t buf[NAGLE_NWRITES];
+
+    rc = chitcp_socket_recv(sockfd, buf, NAGLE_NWRITES);
+    ck_assert_msg(rc == NAGLE_NWRITES,
+                  "Socket did not receive all the bytes (expected %i, got %i)", NAGLE_NWRITES, rc);
+
+    for (int i = 0; i < NAGLE_NWRITES; i++)
+        ck_assert_msg(buf[i] == i, "Unexpected value encountered: buf[%i] == %i", i, buf[i]);
+
+    return 0;
+}
+
+int client_setsockopt_errors(int sockfd, void *args)
+{
+    int rc, one = 1, mss = TCP_MSS;
+
+    rc = chisocket_setsockopt(sockfd, SOL_SOCKET, TCP_NODELAY, &one, sizeof(int));
+    ck_assert_msg(rc == -1 && errno == ENOPROTOOPT, "Unsupported level accepted");
+
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, -1, &one, sizeof(int));
+    ck_assert_msg(rc == -1 && errno == ENOPROTOOPT, "Unsupported option accepted");
+
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, 1);
+    ck_assert_msg(rc == -1 && errno == EINVAL, "Short TCP_NODELAY value accepted");
+
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, "bogus", strlen("bogus"));
+    ck_assert_msg(rc == -1 && errno == ENOENT, "Unknown congestion control algorithm accepted");
+
+    /* Too late: the connection is already using an algorithm */
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, TCP_CONGESTION, "cubic", strlen("cubic"));
+    ck_assert_msg(rc == -1 && errno == EISCONN, "Congestion control algorithm changed on a connected socket");
+
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, TCP_MAXSEG, &mss, 1);
+    ck_assert_msg(rc == -1 && errno == EINVAL, "Short TCP_MAXSEG value accepted");
+
+    /* Too late: the MSS was advertised in the SYN */
+    rc = chisocket_setsockopt(sockfd, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(int));
+    ck_assert_msg(rc == -1 && errno == EISCONN, "MSS changed on a connected socket");
+
+    rc = chisocket_setsockopt(sockfd + 1000, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int));
+    ck_assert_msg(rc == -1 && errno == EBADF, "Invalid socket accepted");
+
+    return 0;
+}
+
+/* Twenty one-byte writes in a row. With Nagle's algorithm, everything
+ * written while the first byte is unacknowledged goes out together. */
+START_TEST (test_nagle)
+{
+    int rc;
+    int nodelay = _i;
+
+    data_segments = 0;
+
+    rc = chitcp_tester_server_set_debug(tester, count_segments,
+            DBG_EVT_PENDING_CONNECTION | DBG_EVT_INCOMING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (server)");
+
+    chitcp_tester_client_run_set(tester, client_send_bytes, &nodelay);
+    chitcp_tester_server_run_set(tester, server_recv_bytes, NULL);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    chilog(INFO, "%i one-byte writes sent in %i segments (TCP_NODELAY=%i)", NAGLE_NWRITES, data_segments, nodelay);
+
+    ck_assert_msg(data_segments > 0 && data_segments <= NAGLE_NWRITES,
+                  "Received %i data segments", data_segments);
+    if (!nodelay)
+        ck_assert_msg(data_segments < NAGLE_NWRITES / 2,
+                      "Received %i data segments (small writes are not being coalesced)", data_segments);
+}
+END_TEST
+
+START_TEST (test_setsockopt_errors)
+{
+    chitcp_tester_client_run_set(tester, client_setsockopt_errors, NULL);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+}
+END_TEST
+
+Suite* make_nagle_suite (void)
+{
+  Suite *s = suite_create ("TCP: Nagle's algorithm");
+
+  TCase *tc_nagle = tcase_create ("Small writes");
+  tcase_add_checked_fixture (tc_nagle, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_loop_test (tc_nagle, test_nagle, 0, 2);
+  suite_add_tcase (s, tc_nagle);
+
+  TCase *tc_setsockopt = tcase_create ("Socket options");
+  tcase_add_checked_fixture (tc_setsockopt, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_setsockopt, test_setsockopt_errors);
+  suite_add_tcase (s, tc_setsockopt);
+
+  return s;
+}
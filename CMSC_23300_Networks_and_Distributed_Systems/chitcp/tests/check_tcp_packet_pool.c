@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <check.h>
+#include "packet_pool.h"
+
+#define NPACKETS (512)
+
+static tcp_packet_t *packets[NPACKETS];
+
+/* Freed buffers are reused right away, by the same thread */
+START_TEST (test_pool_reuse)
+{
+    tcp_packet_t *packet, *small, *large;
+    uint8_t *raw;
+
+    packet = chitcpd_packet_alloc(TCP_HEADER_NOOPTIONS_SIZE);
+    ck_assert_int_eq(packet->length, TCP_HEADER_NOOPTIONS_SIZE);
+    ck_assert(chitcpd_packet_headroom(packet) + PACKET_HEADROOM == packet->raw);
+    raw = packet->raw;
+    chitcpd_packet_free(packet);
+
+    small = chitcpd_packet_alloc(PACKET_POOL_SMALL);
+    ck_assert(small->raw == raw);
+
+    /* Large packets get a different kind of buffer */
+    large = chitcpd_packet_alloc(PACKET_POOL_SMALL + 1);
+    ck_assert(large->raw != raw);
+    memset(chitcpd_packet_headroom(large), 0xff, PACKET_HEADROOM + PACKET_POOL_SMALL + 1);
+    raw = large->raw;
+    chitcpd_packet_free(large);
+
+    large = chitcpd_packet_alloc(PACKET_POOL_LARGE);
+    ck_assert(large->raw == raw);
+
+    chitcpd_packet_free(small);
+    chitcpd_packet_free(large);
+}
+END_TEST
+
+/* Packets too large for the pool are allocated on their own */
+START_TEST (test_pool_oversized)
+{
+    tcp_packet_t *packet, *copy;
+
+    packet = chitcpd_packet_alloc(UINT16_MAX);
+    ck_assert_int_eq(packet->length, UINT16_MAX);
+    for (int i = 0; i < UINT16_MAX; i++)
+        packet->raw[i] = i % 256;
+    memset(chitcpd_packet_headroom(packet), 0, PACKET_HEADROOM);
+
+    copy = chitcpd_packet_copy(packet);
+    ck_assert_int_eq(copy->length, UINT16_MAX);
+    ck_assert(memcmp(copy->raw, packet->raw, UINT16_MAX) == 0);
+
+    chitcpd_packet_free(packet);
+    chitcpd_packet_free(copy);
+    chitcpd_packet_free(NULL);
+}
+END_TEST
+
+void *alloc_packets(void *args)
+{
+    for (int i = 0; i < NPACKETS; i++)
+    {
+        packets[i] = chitcpd_packet_alloc(PACKET_POOL_LARGE);
+        memset(packets[i]->raw, i % 256, PACKET_POOL_LARGE);
+    }
+
+    return NULL;
+}
+
+/* Buffers freed by one thread end up being used by other threads */
+START_TEST (test_pool_threads)
+{
+    pthread_t thread;
+    uint8_t *freed[NPACKETS];
+    int reused = 0;
+
+    pthread_create(&thread, NULL, alloc_packets, NULL);
+    pthread_join(thread, NULL);
+
+    for (int i = 0; i < NPACKETS; i++)
+    {
+        ck_assert_int_eq(packets[i]->raw[PACKET_POOL_LARGE - 1], i % 256);
+        freed[i] = packets[i]->raw;
+        chitcpd_packet_free(packets[i]);
+    }
+
+    /* All but the ones this thread keeps for itself are in the shared pool */
+    pthread_create(&thread, NULL, alloc_packets, NULL);
+    pthread_join(thread, NULL);
+
+    for (int i = 0; i < NPACKETS; i++)
+    {
+        for (int j = 0; j < NPACKETS; j++)
+            if (packets[i]->raw == freed[j])
+            {
+                reused++;
+                break;
+            }
+        chitcpd_packet_free(packets[i]);
+    }
+
+    ck_assert_msg(reused >= NPACKETS - PACKET_POOL_THREAD_MAX,
+                  "Only %i of %i buffers were reused", reused, NPACKETS);
+}
+END_TEST
+
+Suite* make_packet_pool_suite (void)
+{
+  Suite *s = suite_create ("TCP: Packet pool");
+
+  TCase *tc_pool = tcase_create ("Packet pool");
+  tcase_add_test (tc_pool, test_pool_reuse);
+  tcase_add_test (tc_pool, test_pool_oversized);
+  tcase_add_test (tc_pool, test_pool_threads);
+  suite_add_tcase (s, tc_pool);
+
+  return s;
+}
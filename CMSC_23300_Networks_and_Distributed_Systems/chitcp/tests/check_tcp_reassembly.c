@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "reassembly.h"
+
+#define REASSEMBLY_SEQ_INITIAL (1000)
+
+static uint8_t stream[1024];
+static tcp_reassembly_t rq;
+static circular_buffer_t recv_buf;
+static uint32_t rcv_nxt;
+
+static void reassembly_setup(void)
+{
+    for (int i = 0; i < sizeof(stream); i++)
+        stream[i] = i % 251;
+
+    chitcpd_reassembly_init(&rq);
+    circular_buffer_init(&recv_buf, sizeof(stream), BUFFER_LOCKED);
+    circular_buffer_set_seq_initial(&recv_buf, REASSEMBLY_SEQ_INITIAL);
+    rcv_nxt = REASSEMBLY_SEQ_INITIAL;
+}
+
+static void reassembly_teardown(void)
+{
+    chitcpd_reassembly_free(&rq);
+    circular_buffer_free(&recv_buf);
+}
+
+/* Queues bytes [offset, offset + len) of the stream */
+static void reassembly_insert(uint32_t offset, uint32_t len)
+{
+    chitcpd_reassembly_insert(&rq, REASSEMBLY_SEQ_INITIAL + offset, stream + offset, len);
+}
+
+/* Receives bytes [offset, offset + len) of the stream in sequence,
+ * as tcp.c does, and returns the number of bytes released from the
+ * reassembly queue */
+static int reassembly_receive(uint32_t offset, uint32_t len)
+{
+    ck_assert_int_eq(rcv_nxt, REASSEMBLY_SEQ_INITIAL + offset);
+    circular_buffer_write(&recv_buf, stream + offset, len, BUFFER_NONBLOCKING);
+    rcv_nxt += len;
+
+    return chitcpd_reassembly_release(&rq, &rcv_nxt, &recv_buf);
+}
+
+static void reassembly_check_blocks(int nblocks, uint32_t bytes)
+{
+    ck_assert_int_eq(list_size(&rq.blocks), nblocks);
+    ck_assert_int_eq(rq.bytes, bytes);
+}
+
+static void reassembly_check_received(uint32_t len)
+{
+    uint8_t buf[sizeof(stream)];
+
+    ck_assert_int_eq(rcv_nxt, REASSEMBLY_SEQ_INITIAL + len);
+    ck_assert_int_eq(circular_buffer_read(&recv_buf, buf, len, BUFFER_NONBLOCKING), len);
+    ck_assert(memcmp(buf, stream, len) == 0);
+}
+
+START_TEST (test_reassembly_fill_gap)
+{
+    reassembly_insert(100, 100);
+    reassembly_insert(300, 100);
+    reassembly_check_blocks(2, 200);
+
+    /* Filling the first gap releases the first block only */
+    ck_assert_int_eq(reassembly_receive(0, 100), 100);
+    reassembly_check_blocks(1, 100);
+
+    ck_assert_int_eq(reassembly_receive(200, 100), 100);
+    reassembly_check_blocks(0, 0);
+
+    reassembly_check_received(400);
+}
+END_TEST
+
+START_TEST (test_reassembly_coalesce)
+{
+    reassembly_insert(100, 50);
+    reassembly_insert(200, 50);
+    reassembly_insert(300, 50);
+    reassembly_check_blocks(3, 150);
+
+    /* Adjacent to the first block */
+    reassembly_insert(150, 20);
+    reassembly_check_blocks(3, 170);
+
+    /* Overlaps the first two blocks, and fills the gap between them */
+    reassembly_insert(160, 60);
+    reassembly_check_blocks(2, 200);
+
+    /* Covers everything */
+    reassembly_insert(50, 400);
+    reassembly_check_blocks(1, 400);
+
+    ck_assert_int_eq(reassembly_receive(0, 50), 400);
+    reassembly_check_received(450);
+}
+END_TEST
+
+START_TEST (test_reassembly_duplicate)
+{
+    reassembly_insert(100, 100);
+    reassembly_insert(100, 100);
+    reassembly_insert(120, 30);
+    reassembly_check_blocks(1, 100);
+
+    ck_assert_int_eq(reassembly_receive(0, 100), 100);
+    reassembly_check_received(200);
+}
+END_TEST
+
+START_TEST (test_reassembly_partial_release)
+{
+    reassembly_insert(100, 100);
+
+    /* The in-sequence data overlaps the start of the queued block */
+    ck_assert_int_eq(reassembly_receive(0, 150), 50);
+    reassembly_check_blocks(0, 0);
+    reassembly_check_received(200);
+}
+END_TEST
+
+START_TEST (test_reassembly_max_blocks)
+{
+    /* One-byte blocks with one-byte gaps between them */
+    for (int i = 0; i < TCP_REASSEMBLY_MAX_BLOCKS; i++)
+        reassembly_insert(2 * i + 2, 1);
+    reassembly_check_blocks(TCP_REASSEMBLY_MAX_BLOCKS, TCP_REASSEMBLY_MAX_BLOCKS);
+
+    /* No room for a block past the last one */
+    reassembly_insert(500, 10);
+    reassembly_check_blocks(TCP_REASSEMBLY_MAX_BLOCKS, TCP_REASSEMBLY_MAX_BLOCKS);
+
+    /* A block closer to RCV.NXT evicts the last one */
+    reassembly_insert(0, 1);
+    reassembly_check_blocks(TCP_REASSEMBLY_MAX_BLOCKS, TCP_REASSEMBLY_MAX_BLOCKS);
+
+    /* Data that merges with an existing block can always be queued */
+    reassembly_insert(3, 1);
+    reassembly_check_blocks(TCP_REASSEMBLY_MAX_BLOCKS - 1, TCP_REASSEMBLY_MAX_BLOCKS + 1);
+}
+END_TEST
+
+Suite* make_reassembly_suite (void)
+{
+  Suite *s = suite_create ("TCP: Reassembly queue");
+
+  TCase *tc_reassembly = tcase_create ("Out-of-order data");
+  tcase_add_checked_fixture (tc_reassembly, reassembly_setup, reassembly_teardown);
+  tcase_add_test (tc_reassembly, test_reassembly_fill_gap);
+  tcase_add_test (tc_reassembly, test_reassembly_coalesce);
+  tcase_add_test (tc_reassembly, test_reassembly_duplicate);
+  tcase_add_test (tc_reassembly, test_reassembly_partial_release);
+  tcase_add_test (tc_reassembly, test_reassembly_max_blocks);
+  suite_add_tcase (s, tc_reassembly);
+
+  return s;
+}
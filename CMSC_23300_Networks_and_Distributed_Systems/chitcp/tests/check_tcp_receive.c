@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "connection.h"
+#include "packet_pool.h"
+#include "chitcp/addr.h"
+
+#define NFRAMES (2000)
+#define MAX_PAYLOAD (3000)
+#define LISTEN_PORT (80)
+#define PEER_PORT (50000)
+
+/* How the frames are cut up when they are written to the connection */
+typedef enum
+{
+    WRITE_SPLIT,    /* Each frame over several writes */
+    WRITE_BATCHED,  /* Several frames per write */
+    WRITE_RANDOM    /* Writes of any size, regardless of frame boundaries */
+} write_pattern_t;
+
+typedef struct
+{
+    int fd;
+    uint8_t *stream;
+    size_t *frame_start;
+    write_pattern_t pattern;
+} writer_args_t;
+
+/* A real TCP connection over loopback (the connection thread needs the
+ * connection's addresses to find the socket each packet is for) */
+static void loopback_pair(int sv[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(struct sockaddr_in);
+    int listener;
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    ck_assert_int_eq(bind(listener, (struct sockaddr *) &addr, len), 0);
+    ck_assert_int_eq(listen(listener, 1), 0);
+    getsockname(listener, (struct sockaddr *) &addr, &len);
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    ck_assert_int_eq(connect(sv[0], (struct sockaddr *) &addr, len), 0);
+    sv[1] = accept(listener, NULL, NULL);
+    ck_assert_int_ne(sv[1], -1);
+
+    close(listener);
+}
+
+static uint8_t payload_byte(uint32_t seq, int i)
+{
+    return (seq * 7 + i) % 256;
+}
+
+static uint16_t payload_len(uint32_t seq)
+{
+    /* Every tenth segment is a bare header (an ACK) */
+    return seq % 10 == 0 ? 0 : (seq * 997) % MAX_PAYLOAD + 1;
+}
+
+/* Lays out NFRAMES chiTCP frames, back to back, as they would travel
+ * over a connection. The n-th frame carries a TCP segment with sequence
+ * number n, and starts at frame_start[n]. */
+static uint8_t *build_stream(size_t *frame_start)
+{
+    uint8_t *stream = malloc(NFRAMES * (sizeof(chitcphdr_t) + TCP_HEADER_NOOPTIONS_SIZE + MAX_PAYLOAD));
+    size_t len = 0;
+
+    for (uint32_t seq = 0; seq < NFRAMES; seq++)
+    {
+        chitcphdr_t *chitcp_header = (chitcphdr_t *) (stream + len);
+        tcphdr_t *header = (tcphdr_t *) (stream + len + sizeof(chitcphdr_t));
+        uint8_t *payload = (uint8_t *) header + TCP_HEADER_NOOPTIONS_SIZE;
+
+        frame_start[seq] = len;
+
+        memset(chitcp_header, 0, sizeof(chitcphdr_t));
+        chitcp_header->payload_len = chitcp_htons(TCP_HEADER_NOOPTIONS_SIZE + payload_len(seq));
+        chitcp_header->proto = CHITCP_PROTO_TCP;
+
+        memset(header, 0, TCP_HEADER_NOOPTIONS_SIZE);
+        header->source = chitcp_htons(PEER_PORT);
+        header->dest = chitcp_htons(LISTEN_PORT);
+        header->seq = chitcp_htonl(seq);
+        header->doff = TCP_HEADER_NOOPTIONS_SIZE / sizeof(uint32_t);
+
+        for (int i = 0; i < payload_len(seq); i++)
+            payload[i] = payload_byte(seq, i);
+
+        len += sizeof(chitcphdr_t) + TCP_HEADER_NOOPTIONS_SIZE + payload_len(seq);
+    }
+    frame_start[NFRAMES] = len;
+
+    return stream;
+}
+
+static void write_all(int fd, uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, data, len, 0);
+        ck_assert_int_gt(n, 0);
+        data += n;
+        len -= n;
+    }
+}
+
+/* Writes the stream, and closes the connection when done. Every so
+ * often, it waits a bit before the next write, so the connection
+ * thread has to work with whatever it got so far. */
+void *write_stream(void *args)
+{
+    writer_args_t *wa = (writer_args_t *) args;
+    size_t *frame_start = wa->frame_start;
+    size_t pos = 0, end = frame_start[NFRAMES], next;
+    uint32_t frame = 0;
+
+    while (pos < end)
+    {
+        switch (wa->pattern)
+        {
+        case WRITE_SPLIT:
+            /* Write some (or the rest) of the current frame */
+            next = pos + 1 + rand() % (frame_start[frame + 1] - pos);
+            if (next == frame_start[frame + 1])
+                frame++;
+            break;
+        case WRITE_BATCHED:
+            frame += 1 + rand() % 16;
+            if (frame > NFRAMES)
+                frame = NFRAMES;
+            next = frame_start[frame];
+            break;
+        default:
+            next = pos + 1 + rand() % (2 * MAX_PAYLOAD);
+            if (next > end)
+                next = end;
+            break;
+        }
+
+        write_all(wa->fd, wa->stream + pos, next - pos);
+        pos = next;
+
+        if (rand() % 8 == 0)
+            usleep(100);
+    }
+
+    shutdown(wa->fd, SHUT_WR);
+
+    return NULL;
+}
+
+/* Feeds the frames to the connection thread, and checks that every
+ * packet reaches the socket it is for exactly once, in order, and
+ * exactly as it was sent */
+static void check_receive(write_pattern_t pattern)
+{
+    serverinfo_t *si = calloc(1, sizeof(serverinfo_t));
+    size_t *frame_start = malloc((NFRAMES + 1) * sizeof(size_t));
+    uint8_t *stream = build_stream(frame_start);
+    chisocketentry_t listener;
+    passive_chisocket_state_t *socket_state = &listener.socket_state.passive;
+    tcpconnentry_t connection;
+    connection_thread_args_t cta;
+    writer_args_t wa;
+    pthread_t connection_thread, writer_thread;
+    pending_connection_t *pending_connection;
+    int sv[2];
+
+    ck_assert_int_eq(chitcpd_server_init(si), CHITCP_OK);
+
+    /* A passive socket keeps every packet it receives, as the initial
+     * packet of a pending connection */
+    memset(&listener, 0, sizeof(chisocketentry_t));
+    listener.actpas_type = SOCKET_PASSIVE;
+    ((struct sockaddr_in *) &listener.local_addr)->sin_family = AF_INET;
+    ((struct sockaddr_in *) &listener.local_addr)->sin_port = chitcp_htons(LISTEN_PORT);
+    ((struct sockaddr_in *) &listener.remote_addr)->sin_family = AF_INET;
+    list_init(&socket_state->pending_connections);
+    pthread_mutex_init(&socket_state->lock_pending_connections, NULL);
+    pthread_cond_init(&socket_state->cv_pending_connections, NULL);
+    ck_assert_int_eq(chitcpd_reserve_port(si, LISTEN_PORT, &listener), CHITCP_OK);
+
+    loopback_pair(sv);
+
+    memset(&connection, 0, sizeof(tcpconnentry_t));
+    connection.realsocket_recv = sv[1];
+    cta.si = si;
+    cta.connection = &connection;
+
+    wa.fd = sv[0];
+    wa.stream = stream;
+    wa.frame_start = frame_start;
+    wa.pattern = pattern;
+
+    pthread_create(&connection_thread, NULL, chitcpd_connection_thread_func, &cta);
+    pthread_create(&writer_thread, NULL, write_stream, &wa);
+    pthread_join(writer_thread, NULL);
+
+    /* The connection thread exits once the peer closes the connection */
+    pthread_join(connection_thread, NULL);
+
+    ck_assert_int_eq(list_size(&socket_state->pending_connections), NFRAMES);
+
+    for (uint32_t seq = 0; seq < NFRAMES; seq++)
+    {
+        size_t frame_len = frame_start[seq + 1] - frame_start[seq] - sizeof(chitcphdr_t);
+        tcp_packet_t *packet;
+
+        pending_connection = list_fetch(&socket_state->pending_connections);
+        packet = pending_connection->initial_packet;
+
+        ck_assert_int_eq(SEG_SEQ(packet), seq);
+        ck_assert_int_eq(packet->length, frame_len);
+        ck_assert_int_eq(TCP_PAYLOAD_LEN(packet), payload_len(seq));
+        ck_assert_msg(memcmp(packet->raw, stream + frame_start[seq] + sizeof(chitcphdr_t), frame_len) == 0,
+                      "Packet %i is corrupted", seq);
+
+        chitcpd_packet_free(packet);
+        free(pending_connection);
+    }
+
+    close(sv[0]);
+    chitcpd_release_port(si, LISTEN_PORT, &listener);
+    list_destroy(&socket_state->pending_connections);
+    pthread_mutex_destroy(&socket_state->lock_pending_connections);
+    pthread_cond_destroy(&socket_state->cv_pending_connections);
+    chitcpd_server_free(si);
+    free(si);
+    free(stream);
+    free(frame_start);
+}
+
+START_TEST (test_receive_split)
+{
+    check_receive(WRITE_SPLIT);
+}
+END_TEST
+
+START_TEST (test_receive_batched)
+{
+    check_receive(WRITE_BATCHED);
+}
+END_TEST
+
+START_TEST (test_receive_random)
+{
+    check_receive(WRITE_RANDOM);
+}
+END_TEST
+
+Suite* make_receive_suite (void)
+{
+  Suite *s = suite_create ("TCP: Connection receive");
+
+  TCase *tc_framing = tcase_create ("Framing");
+  tcase_add_test (tc_framing, test_receive_split);
+  tcase_add_test (tc_framing, test_receive_batched);
+  tcase_add_test (tc_framing, test_receive_random);
+  suite_add_tcase (s, tc_framing);
+
+  return s;
+}
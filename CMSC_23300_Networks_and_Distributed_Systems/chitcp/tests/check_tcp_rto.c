@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+/* Each message fits in a single segment, so nothing else is in flight
+ * (and there are no duplicate ACKs) when it is lost */
+#define RTO_NBYTES (100)
+
+/* Times the first message is dropped, and how long (in ms) the
+ * transmission that finally gets through is held up before the server
+ * sees it. The delay is shorter than the backed off RTO, so there is
+ * no other retransmission, but long enough that, if it were sampled,
+ * the RTO would end up well above TCP_RTO_MIN. */
+#define RTO_DROPS (3)
+#define RTO_KARN_DELAY_MS (600)
+
+/* Data segments the server receives: the transmissions of the first
+ * message, and then the two of the second one (the first of which is
+ * dropped) */
+#define RTO_SEGMENTS (RTO_DROPS + 3)
+
+/* How much later than expected a retransmission can arrive */
+#define RTO_SLACK_MS (50)
+
+static int data_segments;
+static struct timespec arrived_at[RTO_SEGMENTS];
+
+
+static double elapsed_ms(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+enum chitcpd_debug_response drop_segments(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (event_flag == DBG_EVT_PENDING_CONNECTION)
+    {
+        return DBG_RESP_ACCEPT_MONITOR;
+    }
+
+    /* Once the connection is established, only the client sends data
+     * (and the server only sends ACKs), so every segment the server
+     * receives carries data */
+    if (event_flag == DBG_EVT_INCOMING_PACKET && state_info->tcp_state == ESTABLISHED &&
+        data_segments < RTO_SEGMENTS)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &arrived_at[data_segments]);
+        data_segments++;
+
+        /* The first message */
+        if (data_segments <= RTO_DROPS)
+            return DBG_RESP_DROP;
+        if (data_segments == RTO_DROPS + 1)
+            usleep(RTO_KARN_DELAY_MS * 1000);
+
+        /* The second message */
+        if (data_segments == RTO_DROPS + 2)
+            return DBG_RESP_DROP;
+    }
+
+    return DBG_RESP_NONE;
+}
+
+/* Sends two messages, the second one only once the first one has been
+ * acknowledged */
+int client_send_twice(int sockfd, void *args)
+{
+    uint8_t *buf = malloc(2 * RTO_NBYTES);
+    debug_socket_state_t *state_info;
+    bool_t acked = FALSE;
+    int rc;
+
+    for(int i=0; i < 2 * RTO_NBYTES; i++)
+        buf[i] = i % 256;
+
+    rc = chitcp_socket_send(sockfd, buf, RTO_NBYTES);
+    ck_assert_msg(rc == RTO_NBYTES,
+                  "Socket did not send all the bytes (expected %i, got %i)", RTO_NBYTES, rc);
+
+    while (!acked)
+    {
+        state_info = chitcpd_get_socket_state(sockfd, FALSE);
+        ck_assert_msg(state_info != NULL, "Could not get the client's socket state");
+        acked = state_info->SND_UNA == state_info->SND_NXT;
+        free(state_info);
+
+        if (!acked)
+            usleep(1000);
+    }
+
+    rc = chitcp_socket_send(sockfd, buf + RTO_NBYTES, RTO_NBYTES);
+    ck_assert_msg(rc == RTO_NBYTES,
+                  "Socket did not send all the bytes (expected %i, got %i)", RTO_NBYTES, rc);
+
+    free(buf);
+
+    return 0;
+}
+
+int server_recv_twice(int sockfd, void *args)
+{
+    int rc;
+    uint8_t *buf = malloc(2 * RTO_NBYTES);
+
+    rc = chitcp_socket_recv(sockfd, buf, 2 * RTO_NBYTES);
+    ck_assert_msg(rc == 2 * RTO_NBYTES,
+                  "Socket did not receive all the bytes (expected %i, got %i)", 2 * RTO_NBYTES, rc);
+
+    for (int i = 0; i < 2 * RTO_NBYTES; i++)
+        ck_assert_msg(buf[i] == (i % 256),
+                      "Unexpected value encountered: buf[%i] == %i (expected %i)",
+                      i, buf[i], (i % 256));
+
+    free(buf);
+
+    return 0;
+}
+
+/* The first message is lost RTO_DROPS times. Over loopback, the RTT
+ * measured during the handshake puts the RTO at TCP_RTO_MIN, so the
+ * first retransmission should come TCP_RTO_MIN after the original,
+ * and the RTO should double with each one after that.
+ *
+ * The transmission that gets through is held up, and its ACK must not
+ * be taken as an RTT sample (Karn's rule). Since the ACK also drops
+ * the backoff, the second message (which is lost once) should be
+ * resent TCP_RTO_MIN after it was first sent. */
+START_TEST (test_rto_backoff)
+{
+    int rc;
+    double expected_ms, interval_ms;
+
+    data_segments = 0;
+
+    rc = chitcp_tester_server_set_debug(tester, drop_segments,
+            DBG_EVT_PENDING_CONNECTION | DBG_EVT_INCOMING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (server)");
+
+    chitcp_tester_client_run_set(tester, client_send_twice, NULL);
+    chitcp_tester_server_run_set(tester, server_recv_twice, NULL);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    ck_assert_msg(data_segments == RTO_SEGMENTS,
+                  "Expected %i data segments, got %i", RTO_SEGMENTS, data_segments);
+
+    expected_ms = TCP_RTO_MIN / 1000.0;
+    for (int i = 1; i <= RTO_DROPS; i++)
+    {
+        interval_ms = elapsed_ms(&arrived_at[i - 1], &arrived_at[i]);
+        chilog(INFO, "Transmission #%i of the first message came %.3f ms after the previous one", i + 1, interval_ms);
+
+        ck_assert_msg(interval_ms >= expected_ms && interval_ms < expected_ms + RTO_SLACK_MS,
+                      "Transmission #%i came %.3f ms after the previous one (expected %.0f ms)",
+                      i + 1, interval_ms, expected_ms);
+        expected_ms *= 2;
+    }
+
+    expected_ms = TCP_RTO_MIN / 1000.0;
+    interval_ms = elapsed_ms(&arrived_at[RTO_DROPS + 1], &arrived_at[RTO_DROPS + 2]);
+    chilog(INFO, "The second message was resent after %.3f ms", interval_ms);
+
+    ck_assert_msg(interval_ms >= expected_ms && interval_ms < expected_ms + RTO_SLACK_MS,
+                  "The second message was resent after %.3f ms (expected %.0f ms)",
+                  interval_ms, expected_ms);
+}
+END_TEST
+
+Suite* make_rto_suite (void)
+{
+  Suite *s = suite_create ("TCP: Retransmission timeout");
+
+  TCase *tc_backoff = tcase_create ("Backoff");
+  tcase_add_checked_fixture (tc_backoff, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_backoff, test_rto_backoff);
+  tcase_set_timeout (tc_backoff, 10);
+  suite_add_tcase (s, tc_backoff);
+
+  return s;
+}
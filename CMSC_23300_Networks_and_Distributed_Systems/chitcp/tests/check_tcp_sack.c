@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "sack.h"
+
+#define SACK_SEQ_INITIAL (1000)
+
+static tcp_data_t tcp_data;
+
+/* Puts "nsegments" full-sized segments in flight */
+static void sack_setup(int nsegments)
+{
+    tcp_segment_t *segment;
+
+    memset(&tcp_data, 0, sizeof(tcp_data_t));
+    list_init(&tcp_data.retransmission_queue);
+    tcp_data.SMSS = TCP_MSS;
+    tcp_data.SND_UNA = SACK_SEQ_INITIAL;
+    tcp_data.SND_NXT = SACK_SEQ_INITIAL;
+
+    for (int i = 0; i < nsegments; i++)
+    {
+        segment = calloc(1, sizeof(tcp_segment_t));
+        segment->seq = tcp_data.SND_NXT;
+        segment->len = TCP_MSS;
+        segment->transmissions = 1;
+        list_append(&tcp_data.retransmission_queue, segment);
+        tcp_data.SND_NXT += TCP_MSS;
+    }
+}
+
+static void sack_teardown(void)
+{
+    while (!list_empty(&tcp_data.retransmission_queue))
+        free(list_fetch(&tcp_data.retransmission_queue));
+    list_destroy(&tcp_data.retransmission_queue);
+}
+
+/* Returns segment number i */
+static tcp_segment_t *sack_segment(int i)
+{
+    return list_get_at(&tcp_data.retransmission_queue, i);
+}
+
+/* The peer SACKs segments [first, last] */
+static bool_t sack_ack(int first, int last)
+{
+    tcp_sack_block_t block;
+
+    block.left = SACK_SEQ_INITIAL + first * TCP_MSS;
+    block.right = SACK_SEQ_INITIAL + (last + 1) * TCP_MSS;
+
+    return chitcpd_sack_update(&tcp_data, &block, 1);
+}
+
+START_TEST (test_sack_options)
+{
+    tcp_packet_t packet;
+    tcp_options_t options, parsed;
+    uint8_t payload[] = "chiTCP";
+
+    memset(&options, 0, sizeof(tcp_options_t));
+    options.sack_permitted = TRUE;
+    chitcp_tcp_packet_create_options(&packet, &options, payload, sizeof(payload));
+
+    ck_assert_int_eq(TCP_HEADER_SIZE(&packet) % 4, 0);
+    ck_assert_int_gt(TCP_HEADER_SIZE(&packet), TCP_HEADER_NOOPTIONS_SIZE);
+    ck_assert_int_eq(TCP_PAYLOAD_LEN(&packet), sizeof(payload));
+    ck_assert(memcmp(TCP_PAYLOAD_START(&packet), payload, sizeof(payload)) == 0);
+
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_OK);
+    ck_assert(parsed.sack_permitted);
+    ck_assert_int_eq(parsed.nsack, 0);
+    chitcp_tcp_packet_free(&packet);
+
+    /* As many blocks as fit */
+    memset(&options, 0, sizeof(tcp_options_t));
+    options.nsack = TCP_SACK_MAX_BLOCKS;
+    for (int i = 0; i < TCP_SACK_MAX_BLOCKS; i++)
+    {
+        options.sack[i].left = 0xfffff000 + i * 200;
+        options.sack[i].right = 0xfffff000 + i * 200 + 100;
+    }
+    chitcp_tcp_packet_create_options(&packet, &options, NULL, 0);
+
+    ck_assert_int_le(TCP_HEADER_SIZE(&packet), TCP_HEADER_MAX_SIZE);
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_OK);
+    ck_assert(!parsed.sack_permitted);
+    ck_assert_int_eq(parsed.nsack, TCP_SACK_MAX_BLOCKS);
+    ck_assert(memcmp(parsed.sack, options.sack, sizeof(options.sack)) == 0);
+    chitcp_tcp_packet_free(&packet);
+}
+END_TEST
+
+START_TEST (test_sack_options_malformed)
+{
+    tcp_packet_t packet;
+    tcp_options_t options;
+    uint8_t zeros[8] = { 0 };
+    uint8_t *opt;
+
+    chitcp_tcp_packet_create(&packet, zeros, sizeof(zeros));
+    opt = packet.raw + TCP_HEADER_NOOPTIONS_SIZE;
+    TCP_PACKET_HEADER(&packet)->doff = 7;
+
+    /* Unknown options are skipped */
+    opt[0] = 30;
+    opt[1] = 3;
+    opt[3] = TCP_OPTION_SACK_PERMITTED;
+    opt[4] = 2;
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &options), CHITCP_OK);
+    ck_assert(options.sack_permitted);
+
+    /* An option that runs past the header */
+    opt[4] = 8;
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &options), CHITCP_EINVAL);
+
+    /* A data offset that runs past the packet */
+    TCP_PACKET_HEADER(&packet)->doff = 8;
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &options), CHITCP_EINVAL);
+
+    chitcp_tcp_packet_free(&packet);
+}
+END_TEST
+
+START_TEST (test_sack_blocks)
+{
+    tcp_reassembly_t rq;
+    tcp_sack_block_t blocks[TCP_SACK_MAX_BLOCKS];
+    uint8_t data[100] = { 0 };
+
+    chitcpd_reassembly_init(&rq);
+    ck_assert_int_eq(chitcpd_sack_blocks(&rq, blocks, TCP_SACK_MAX_BLOCKS), 0);
+
+    for (int i = 0; i < 6; i++)
+        chitcpd_reassembly_insert(&rq, 1000 + i * 200, data, 100);
+
+    /* Extending the second block makes it the most recent one */
+    chitcpd_reassembly_insert(&rq, 1300, data, 50);
+
+    ck_assert_int_eq(chitcpd_sack_blocks(&rq, blocks, TCP_SACK_MAX_BLOCKS), TCP_SACK_MAX_BLOCKS);
+    ck_assert_int_eq(blocks[0].left, 1200);
+    ck_assert_int_eq(blocks[0].right, 1350);
+    ck_assert_int_eq(blocks[1].left, 2000);
+    ck_assert_int_eq(blocks[2].left, 1800);
+    ck_assert_int_eq(blocks[3].left, 1600);
+
+    chitcpd_reassembly_free(&rq);
+}
+END_TEST
+
+START_TEST (test_sack_scoreboard)
+{
+    sack_setup(10);
+
+    /* Segments 0, 2 and 3 are missing */
+    ck_assert(sack_ack(1, 1));
+    ck_assert(!sack_ack(1, 1));
+    ck_assert(sack_segment(1)->sacked);
+    ck_assert(!sack_segment(0)->lost);
+
+    /* Three segments after segment 0 have been SACKed, but only
+     * two after segments 2 and 3 */
+    ck_assert(sack_ack(4, 5));
+    ck_assert(sack_segment(0)->lost);
+    ck_assert(!sack_segment(2)->lost);
+    ck_assert(!sack_segment(3)->lost);
+    ck_assert(!sack_segment(3)->sacked);
+
+    ck_assert(sack_ack(4, 6));
+    ck_assert(sack_segment(2)->lost);
+    ck_assert(sack_segment(3)->lost);
+    ck_assert(!sack_segment(7)->lost);
+
+    sack_teardown();
+}
+END_TEST
+
+START_TEST (test_sack_invalid_blocks)
+{
+    tcp_sack_block_t block;
+
+    sack_setup(4);
+
+    /* Beyond SND.NXT */
+    block.left = SACK_SEQ_INITIAL + 3 * TCP_MSS;
+    block.right = SACK_SEQ_INITIAL + 5 * TCP_MSS;
+    ck_assert(!chitcpd_sack_update(&tcp_data, &block, 1));
+
+    /* Before SND.UNA (D-SACK) */
+    block.left = SACK_SEQ_INITIAL - TCP_MSS;
+    block.right = SACK_SEQ_INITIAL + TCP_MSS;
+    ck_assert(!chitcpd_sack_update(&tcp_data, &block, 1));
+
+    /* Only part of a segment */
+    block.left = SACK_SEQ_INITIAL + TCP_MSS;
+    block.right = SACK_SEQ_INITIAL + TCP_MSS + 10;
+    ck_assert(!chitcpd_sack_update(&tcp_data, &block, 1));
+
+    sack_teardown();
+}
+END_TEST
+
+START_TEST (test_sack_pipe)
+{
+    sack_setup(10);
+    ck_assert_int_eq(chitcpd_sack_pipe(&tcp_data), 10 * TCP_MSS);
+
+    /* Segments 0 and 1 are lost, 2-4 SACKed */
+    sack_ack(2, 4);
+    ck_assert_int_eq(chitcpd_sack_pipe(&tcp_data), 5 * TCP_MSS);
+
+    /* A retransmission is in flight again */
+    sack_segment(0)->retransmitted = TRUE;
+    ck_assert_int_eq(chitcpd_sack_pipe(&tcp_data), 6 * TCP_MSS);
+
+    sack_teardown();
+}
+END_TEST
+
+Suite* make_sack_suite (void)
+{
+  Suite *s = suite_create ("TCP: Selective acknowledgements");
+
+  TCase *tc_options = tcase_create ("Options");
+  tcase_add_test (tc_options, test_sack_options);
+  tcase_add_test (tc_options, test_sack_options_malformed);
+  suite_add_tcase (s, tc_options);
+
+  TCase *tc_receiver = tcase_create ("Receiver");
+  tcase_add_test (tc_receiver, test_sack_blocks);
+  suite_add_tcase (s, tc_receiver);
+
+  TCase *tc_sender = tcase_create ("Scoreboard");
+  tcase_add_test (tc_sender, test_sack_scoreboard);
+  tcase_add_test (tc_sender, test_sack_invalid_blocks);
+  tcase_add_test (tc_sender, test_sack_pipe);
+  suite_add_tcase (s, tc_sender);
+
+  return s;
+}
@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "timer.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/tester.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+#define NTIMERS (4096)
+#define MAX_DELAY (50000)
+
+/* Short enough for TIME_WAIT to expire during the test */
+#define TEST_MSL (20000)
+
+typedef struct
+{
+    struct timespec armed;
+    uint32_t usecs;
+    int fired;
+    bool_t early;
+} timer_record_t;
+
+static int nfired;
+
+static uint64_t usecs_since(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) (now.tv_sec - start->tv_sec) * 1000000 +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Runs in the timer thread, so it only records what happened */
+void record_firing(chitcpd_timer_t *timer, void *args)
+{
+    timer_record_t *record = (timer_record_t *) args;
+
+    record->fired++;
+    if (usecs_since(&record->armed) < record->usecs)
+        record->early = TRUE;
+
+    __sync_fetch_and_add(&nfired, 1);
+}
+
+/* Waits (for a bounded amount of time) until "n" timers have fired */
+static void wait_for_firings(int n, uint32_t max_usecs)
+{
+    for (uint32_t waited = 0; __sync_fetch_and_add(&nfired, 0) < n && waited < max_usecs; waited += 1000)
+        usleep(1000);
+}
+
+static void arm_recorded(chitcpd_timer_t *timer, timer_record_t *record, uint32_t usecs)
+{
+    record->usecs = usecs;
+    clock_gettime(CLOCK_MONOTONIC, &record->armed);
+    chitcpd_timer_arm(timer, usecs);
+}
+
+/* Thousands of timers, half of them cancelled: the others must all
+ * fire exactly once, and never before they are due */
+START_TEST (test_timer_wheel)
+{
+    chitcpd_timer_wheel_t wheel;
+    chitcpd_timer_t *timers = calloc(NTIMERS, sizeof(chitcpd_timer_t));
+    timer_record_t *records = calloc(NTIMERS, sizeof(timer_record_t));
+
+    nfired = 0;
+    chitcpd_timer_wheel_init(&wheel);
+    ck_assert_int_eq(chitcpd_timer_wheel_start(&wheel), CHITCP_OK);
+
+    for (int i = 0; i < NTIMERS; i++)
+    {
+        chitcpd_timer_init(&wheel, &timers[i], record_firing, &records[i]);
+        arm_recorded(&timers[i], &records[i], 1 + rand() % MAX_DELAY);
+    }
+
+    for (int i = 0; i < NTIMERS; i += 2)
+        chitcpd_timer_cancel(&timers[i]);
+
+    wait_for_firings(NTIMERS / 2, 10 * MAX_DELAY);
+
+    /* Give any cancelled timer the chance to (wrongly) fire */
+    usleep(2 * TIMER_WHEEL_TICK);
+
+    chitcpd_timer_wheel_stop(&wheel);
+
+    for (int i = 0; i < NTIMERS; i++)
+    {
+        if (i % 2 == 0)
+        {
+            ck_assert_msg(records[i].fired == 0, "Cancelled timer %i fired", i);
+            ck_assert(!chitcpd_timer_pending(&timers[i]));
+            ck_assert(!chitcpd_timer_expired(&timers[i]));
+        }
+        else
+        {
+            ck_assert_msg(records[i].fired == 1, "Timer %i fired %i times", i, records[i].fired);
+            ck_assert_msg(!records[i].early, "Timer %i fired early", i);
+            ck_assert(!chitcpd_timer_pending(&timers[i]));
+            ck_assert(chitcpd_timer_expired(&timers[i]));
+            ck_assert(!chitcpd_timer_expired(&timers[i]));
+        }
+    }
+
+    chitcpd_timer_wheel_free(&wheel);
+    free(timers);
+    free(records);
+}
+END_TEST
+
+/* Re-arming a timer replaces its expiration time, and arming or
+ * cancelling it clears its "expired" flag */
+START_TEST (test_timer_rearm)
+{
+    chitcpd_timer_wheel_t wheel;
+    chitcpd_timer_t timer;
+    timer_record_t record;
+
+    nfired = 0;
+    memset(&record, 0, sizeof(timer_record_t));
+    chitcpd_timer_wheel_init(&wheel);
+    ck_assert_int_eq(chitcpd_timer_wheel_start(&wheel), CHITCP_OK);
+    chitcpd_timer_init(&wheel, &timer, record_firing, &record);
+
+    /* Pushed back (beyond a turn of the wheel) before it fires */
+    arm_recorded(&timer, &record, 5000);
+    arm_recorded(&timer, &record, 1500000);
+    usleep(50000);
+    ck_assert_int_eq(record.fired, 0);
+    ck_assert(chitcpd_timer_pending(&timer));
+
+    /* Brought forward */
+    arm_recorded(&timer, &record, 5000);
+    wait_for_firings(1, 1000000);
+    ck_assert_int_eq(record.fired, 1);
+    ck_assert(!record.early);
+    ck_assert(!chitcpd_timer_pending(&timer));
+
+    /* Fired, but cancelled before anyone checked */
+    chitcpd_timer_cancel(&timer);
+    ck_assert(!chitcpd_timer_expired(&timer));
+
+    chitcpd_timer_wheel_stop(&wheel);
+    chitcpd_timer_wheel_free(&wheel);
+}
+END_TEST
+
+
+static struct timespec time_wait_entered;
+static uint64_t time_wait_usecs;
+static int client_closed;
+
+enum chitcpd_debug_response record_time_wait(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (event_flag == DBG_EVT_TCP_STATE_CHANGE)
+    {
+        if (state_info->tcp_state == TIME_WAIT)
+            clock_gettime(CLOCK_MONOTONIC, &time_wait_entered);
+        else if (state_info->tcp_state == CLOSED)
+        {
+            time_wait_usecs = usecs_since(&time_wait_entered);
+            __sync_fetch_and_add(&client_closed, 1);
+        }
+    }
+
+    return DBG_RESP_NONE;
+}
+
+/* The side that closes first stays in TIME_WAIT for 2*MSL, and is
+ * then closed (and its socket freed) */
+START_TEST (test_timer_time_wait)
+{
+    int rc;
+
+    client_closed = 0;
+    si->msl = TEST_MSL;
+
+    rc = chitcp_tester_client_set_debug(tester, record_time_wait, DBG_EVT_TCP_STATE_CHANGE);
+    ck_assert_msg(rc == 0, "Error setting debug handler (client)");
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_close();
+
+    for (int waited = 0; __sync_fetch_and_add(&client_closed, 0) == 0 && waited < 1000; waited++)
+        usleep(1000);
+
+    tester_done();
+
+    ck_assert_msg(client_closed, "Client did not leave TIME_WAIT");
+    ck_assert_msg(time_wait_usecs >= 2 * TEST_MSL,
+                  "Client left TIME_WAIT after %lu us (2*MSL is %i us)",
+                  (unsigned long) time_wait_usecs, 2 * TEST_MSL);
+}
+END_TEST
+
+Suite* make_timer_suite (void)
+{
+  Suite *s = suite_create ("TCP: Timers");
+
+  TCase *tc_wheel = tcase_create ("Timer wheel");
+  tcase_add_test (tc_wheel, test_timer_wheel);
+  tcase_add_test (tc_wheel, test_timer_rearm);
+  suite_add_tcase (s, tc_wheel);
+
+  TCase *tc_time_wait = tcase_create ("TIME_WAIT");
+  tcase_add_checked_fixture (tc_time_wait, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_time_wait, test_timer_time_wait);
+  suite_add_tcase (s, tc_time_wait);
+
+  return s;
+}
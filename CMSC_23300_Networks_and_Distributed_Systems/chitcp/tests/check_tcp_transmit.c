@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "connection.h"
+
+#define NSENDERS (8)
+#define NFRAMES (2000)
+#define MAX_PAYLOAD (3000)
+
+/* What each sender puts at the start of its frames */
+typedef struct
+{
+    uint16_t sender;
+    uint16_t seq;
+    uint16_t payload_len;
+} frame_header_t;
+
+typedef struct
+{
+    tcpconnentry_t *connection;
+    uint16_t sender;
+} sender_args_t;
+
+/* A real TCP connection over loopback (with a send buffer that is small
+ * enough for writes to be cut short now and then) */
+static void loopback_pair(int sv[2])
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(struct sockaddr_in);
+    int listener, sndbuf = 4096;
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listener = socket(AF_INET, SOCK_STREAM, 0);
+    ck_assert_int_eq(bind(listener, (struct sockaddr *) &addr, len), 0);
+    ck_assert_int_eq(listen(listener, 1), 0);
+    getsockname(listener, (struct sockaddr *) &addr, &len);
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int));
+    ck_assert_int_eq(connect(sv[0], (struct sockaddr *) &addr, len), 0);
+    sv[1] = accept(listener, NULL, NULL);
+    ck_assert_int_ne(sv[1], -1);
+
+    close(listener);
+}
+
+static uint8_t payload_byte(uint16_t sender, uint16_t seq, int i)
+{
+    return (sender * 31 + seq * 7 + i) % 256;
+}
+
+/* Sends NFRAMES frames, each split across three iovecs (like the
+ * chiTCP header, TCP header and payload in chitcpd_send_tcp_packet_iov) */
+void *send_frames(void *args)
+{
+    sender_args_t *sa = (sender_args_t *) args;
+    uint8_t *payload = malloc(MAX_PAYLOAD);
+    frame_header_t header;
+    struct iovec iov[3];
+    int rc;
+
+    for (uint16_t seq = 0; seq < NFRAMES; seq++)
+    {
+        header.sender = sa->sender;
+        header.seq = seq;
+        header.payload_len = 1 + rand() % MAX_PAYLOAD;
+        for (int i = 0; i < header.payload_len; i++)
+            payload[i] = payload_byte(header.sender, seq, i);
+
+        iov[0].iov_base = &header;
+        iov[0].iov_len = sizeof(frame_header_t);
+        iov[1].iov_base = payload;
+        iov[1].iov_len = header.payload_len / 2;
+        iov[2].iov_base = payload + header.payload_len / 2;
+        iov[2].iov_len = header.payload_len - header.payload_len / 2;
+
+        rc = chitcpd_connection_send(sa->connection, iov, 3);
+        ck_assert_int_eq(rc, sizeof(frame_header_t) + header.payload_len);
+    }
+
+    free(payload);
+
+    return NULL;
+}
+
+/* Several threads sending over the same connection at once: every
+ * frame must arrive whole, and each thread's frames must arrive in
+ * the order they were sent */
+START_TEST (test_transmit_interleaved)
+{
+    int sv[2];
+    tcpconnentry_t connection;
+    pthread_t threads[NSENDERS];
+    sender_args_t args[NSENDERS];
+    uint16_t expected_seq[NSENDERS];
+    uint8_t *payload = malloc(MAX_PAYLOAD);
+    frame_header_t header;
+
+    loopback_pair(sv);
+
+    memset(&connection, 0, sizeof(tcpconnentry_t));
+    connection.realsocket_send = sv[0];
+    pthread_mutex_init(&connection.lock_send, NULL);
+    pthread_cond_init(&connection.cv_send, NULL);
+
+    for (int i = 0; i < NSENDERS; i++)
+    {
+        args[i].connection = &connection;
+        args[i].sender = i;
+        expected_seq[i] = 0;
+        pthread_create(&threads[i], NULL, send_frames, &args[i]);
+    }
+
+    for (int n = 0; n < NSENDERS * NFRAMES; n++)
+    {
+        ck_assert_int_eq(recv(sv[1], &header, sizeof(frame_header_t), MSG_WAITALL), sizeof(frame_header_t));
+        ck_assert_int_lt(header.sender, NSENDERS);
+        ck_assert_int_eq(header.seq, expected_seq[header.sender]);
+        ck_assert_int_le(header.payload_len, MAX_PAYLOAD);
+        expected_seq[header.sender]++;
+
+        ck_assert_int_eq(recv(sv[1], payload, header.payload_len, MSG_WAITALL), header.payload_len);
+        for (int i = 0; i < header.payload_len; i++)
+            ck_assert_msg(payload[i] == payload_byte(header.sender, header.seq, i),
+                          "Frame %i from sender %i is corrupted at byte %i",
+                          header.seq, header.sender, i);
+    }
+
+    for (int i = 0; i < NSENDERS; i++)
+        pthread_join(threads[i], NULL);
+
+    ck_assert(connection.send_head == NULL);
+    ck_assert(!connection.sending);
+
+    close(sv[0]);
+    close(sv[1]);
+    pthread_mutex_destroy(&connection.lock_send);
+    pthread_cond_destroy(&connection.cv_send);
+    free(payload);
+}
+END_TEST
+
+/* Frames that can't be written are reported as errors */
+START_TEST (test_transmit_error)
+{
+    int sv[2];
+    tcpconnentry_t connection;
+    uint8_t byte = 0;
+    struct iovec iov;
+
+    loopback_pair(sv);
+    shutdown(sv[0], SHUT_WR);
+
+    memset(&connection, 0, sizeof(tcpconnentry_t));
+    connection.realsocket_send = sv[0];
+    pthread_mutex_init(&connection.lock_send, NULL);
+    pthread_cond_init(&connection.cv_send, NULL);
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    ck_assert_int_eq(chitcpd_connection_send(&connection, &iov, 1), -1);
+    ck_assert(connection.send_head == NULL);
+    ck_assert(!connection.sending);
+
+    close(sv[0]);
+    close(sv[1]);
+    pthread_mutex_destroy(&connection.lock_send);
+    pthread_cond_destroy(&connection.cv_send);
+}
+END_TEST
+
+Suite* make_transmit_suite (void)
+{
+  Suite *s = suite_create ("TCP: Transmit queue");
+
+  TCase *tc_queue = tcase_create ("Transmit queue");
+  tcase_add_test (tc_queue, test_transmit_interleaved);
+  tcase_add_test (tc_queue, test_transmit_error);
+  suite_add_tcase (s, tc_queue);
+
+  return s;
+}
@@ -0,0 +1,247 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+#include "serverinfo.h"
+#include "server.h"
+#include "chitcp/chitcpd.h"
+#include "chitcp/debug_api.h"
+#include "chitcp/socket.h"
+#include "chitcp/tester.h"
+#include "chitcp/utils.h"
+#include "chitcp/log.h"
+#include "fixtures.h"
+
+/* Enough data for the receive window to fill up more than once */
+#define WINDOW_NBYTES (2 * TCP_RCVBUF_INITIAL)
+
+/* A receive buffer whose window needs a scale factor of 3 */
+#define SCALING_RCVBUF (4 * TCP_RCVBUF_INITIAL)
+
+/* Small buffers, set before connecting */
+#define SMALL_SNDBUF (8192)
+#define SMALL_RCVBUF (16384)
+
+/* Enough data for autotuning to grow the receive buffer a few times */
+#define AUTOTUNE_NBYTES (16 * TCP_RCVBUF_INITIAL)
+
+static uint32_t max_snd_wnd, max_rcv_wnd;
+static int max_send_len;
+
+enum chitcpd_debug_response track_window(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (state_info->tcp_state == ESTABLISHED && state_info->SND_WND > max_snd_wnd)
+        max_snd_wnd = state_info->SND_WND;
+    if (state_info->tcp_state == ESTABLISHED && state_info->send_len > max_send_len)
+        max_send_len = state_info->send_len;
+
+    return DBG_RESP_NONE;
+}
+
+enum chitcpd_debug_response track_rcv_window(int sockfd, enum chitcpd_debug_event event_flag, debug_socket_state_t *state_info, debug_socket_state_t *saved_state_info, int new_sockfd)
+{
+    if (state_info->tcp_state == ESTABLISHED && state_info->RCV_WND > max_rcv_wnd)
+        max_rcv_wnd = state_info->RCV_WND;
+
+    return DBG_RESP_NONE;
+}
+
+int client_setsockopt_buffers(int sockfd, void *args)
+{
+    int rc, size = 1 << 20;
+
+    rc = chisocket_setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, 1);
+    ck_assert_msg(rc == -1 && errno == EINVAL, "Short SO_RCVBUF value accepted");
+
+    /* Too late: the buffers are already allocated */
+    rc = chisocket_setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(int));
+    ck_assert_msg(rc == -1 && errno == EISCONN, "Send buffer resized on a connected socket");
+
+    rc = chisocket_setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(int));
+    ck_assert_msg(rc == -1 && errno == EISCONN, "Receive buffer resized on a connected socket");
+
+    return 0;
+}
+
+START_TEST (test_wscale_options)
+{
+    tcp_packet_t packet;
+    tcp_options_t options, parsed;
+    uint8_t *opt;
+
+    memset(&options, 0, sizeof(tcp_options_t));
+    options.wscale_ok = TRUE;
+    options.wscale = 7;
+    options.sack_permitted = TRUE;
+    chitcp_tcp_packet_create_options(&packet, &options, NULL, 0);
+
+    ck_assert_int_eq(TCP_HEADER_SIZE(&packet) % 4, 0);
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_OK);
+    ck_assert(parsed.wscale_ok);
+    ck_assert_int_eq(parsed.wscale, 7);
+    ck_assert(parsed.sack_permitted);
+    chitcp_tcp_packet_free(&packet);
+
+    /* The option is always three bytes long */
+    options.sack_permitted = FALSE;
+    chitcp_tcp_packet_create_options(&packet, &options, NULL, 0);
+    opt = packet.raw + TCP_HEADER_NOOPTIONS_SIZE;
+    ck_assert_int_eq(opt[1], TCP_OPTION_WSCALE);
+    opt[2] = 2;
+    ck_assert_int_eq(chitcp_tcp_options_parse(&packet, &parsed), CHITCP_EINVAL);
+    chitcp_tcp_packet_free(&packet);
+}
+END_TEST
+
+/* The server's receive buffer is several times larger than what fits
+ * in the 16-bit window field. Even with all the data sent unread, its
+ * window never drops below SCALING_RCVBUF - WINDOW_NBYTES bytes, so the
+ * client sees a window that large only if both ends agreed to scale
+ * their windows. */
+START_TEST (test_window_scaling)
+{
+    int rc, nbytes = WINDOW_NBYTES;
+
+    max_snd_wnd = 0;
+
+    rc = chitcp_tester_server_set_buffers(tester, 0, SCALING_RCVBUF);
+    ck_assert_msg(rc == 0, "Error setting buffer sizes (server)");
+
+    rc = chitcp_tester_client_set_debug(tester, track_window,
+            DBG_EVT_INCOMING_PACKET | DBG_EVT_OUTGOING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (client)");
+
+    chitcp_tester_client_run_set(tester, client_send_recv, &nbytes);
+    chitcp_tester_server_run_set(tester, server_send_recv, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    chilog(INFO, "Largest send window: %u bytes", max_snd_wnd);
+
+    ck_assert_msg(max_snd_wnd >= SCALING_RCVBUF - WINDOW_NBYTES,
+                  "Largest send window was %u bytes (windows are not being scaled)", max_snd_wnd);
+    ck_assert_msg(max_snd_wnd <= SCALING_RCVBUF,
+                  "Largest send window was %u bytes (the receive buffer is %u bytes)",
+                  max_snd_wnd, SCALING_RCVBUF);
+}
+END_TEST
+
+/* With its default receive buffer, the server starts out advertising
+ * TCP_RCVBUF_INITIAL bytes, and autotuning should grow its window past
+ * that once a bulk transfer gets going */
+START_TEST (test_rcvbuf_autotuning)
+{
+    int rc, nbytes = AUTOTUNE_NBYTES;
+
+    max_rcv_wnd = 0;
+
+    rc = chitcp_tester_server_set_debug(tester, track_rcv_window, DBG_EVT_OUTGOING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (server)");
+
+    chitcp_tester_client_run_set(tester, client_send_recv, &nbytes);
+    chitcp_tester_server_run_set(tester, server_send_recv, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    chilog(INFO, "Largest receive window: %u bytes", max_rcv_wnd);
+
+    ck_assert_msg(max_rcv_wnd > TCP_RCVBUF_INITIAL,
+                  "Largest receive window was %u bytes (the receive buffer did not grow)", max_rcv_wnd);
+}
+END_TEST
+
+/* Buffer sizes set before connecting are the ones the connection uses:
+ * the client never sees a window larger than the server's receive
+ * buffer, and never has more data in its send buffer than fits */
+START_TEST (test_setsockopt_before_connect)
+{
+    int rc, nbytes = WINDOW_NBYTES;
+
+    max_snd_wnd = 0;
+    max_send_len = 0;
+
+    rc = chitcp_tester_server_set_buffers(tester, 0, SMALL_RCVBUF);
+    ck_assert_msg(rc == 0, "Error setting buffer sizes (server)");
+
+    rc = chitcp_tester_client_set_buffers(tester, SMALL_SNDBUF, 0);
+    ck_assert_msg(rc == 0, "Error setting buffer sizes (client)");
+
+    rc = chitcp_tester_client_set_debug(tester, track_window,
+            DBG_EVT_INCOMING_PACKET | DBG_EVT_OUTGOING_PACKET);
+    ck_assert_msg(rc == 0, "Error setting debug handler (client)");
+
+    chitcp_tester_client_run_set(tester, client_send_recv, &nbytes);
+    chitcp_tester_server_run_set(tester, server_send_recv, &nbytes);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+
+    ck_assert_msg(max_snd_wnd == SMALL_RCVBUF,
+                  "Largest send window was %u bytes (expected %u)", max_snd_wnd, SMALL_RCVBUF);
+    ck_assert_msg(max_send_len > 0 && max_send_len <= SMALL_SNDBUF,
+                  "Send buffer held up to %i bytes (expected at most %i)", max_send_len, SMALL_SNDBUF);
+}
+END_TEST
+
+START_TEST (test_setsockopt_buffers)
+{
+    chitcp_tester_client_run_set(tester, client_setsockopt_buffers, NULL);
+
+    tester_connect();
+
+    chitcp_tester_client_wait_for_state(tester, ESTABLISHED);
+    chitcp_tester_server_wait_for_state(tester, ESTABLISHED);
+
+    tester_run();
+
+    tester_done();
+}
+END_TEST
+
+Suite* make_window_suite (void)
+{
+  Suite *s = suite_create ("TCP: Window scaling and buffer sizes");
+
+  TCase *tc_options = tcase_create ("Options");
+  tcase_add_test (tc_options, test_wscale_options);
+  suite_add_tcase (s, tc_options);
+
+  TCase *tc_scaling = tcase_create ("Window scaling");
+  tcase_add_checked_fixture (tc_scaling, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_scaling, test_window_scaling);
+  suite_add_tcase (s, tc_scaling);
+
+  TCase *tc_autotuning = tcase_create ("Receive buffer autotuning");
+  tcase_add_checked_fixture (tc_autotuning, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_autotuning, test_rcvbuf_autotuning);
+  tcase_set_timeout (tc_autotuning, 30);
+  suite_add_tcase (s, tc_autotuning);
+
+  TCase *tc_setsockopt = tcase_create ("Socket options");
+  tcase_add_checked_fixture (tc_setsockopt, chitcpd_and_tester_setup, chitcpd_and_tester_teardown);
+  tcase_add_test (tc_setsockopt, test_setsockopt_buffers);
+  tcase_add_test (tc_setsockopt, test_setsockopt_before_connect);
+  suite_add_tcase (s, tc_setsockopt);
+
+  return s;
+}
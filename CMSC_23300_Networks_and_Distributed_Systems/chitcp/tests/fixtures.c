@@ -6,6 +6,7 @@
 #include "chitcp/chitcpd.h"
 #include "chitcp/debug_api.h"
 #include "chitcp/tester.h"
+#include "chitcp/utils.h"
 #include "chitcp/log.h"
 
 serverinfo_t *si;
@@ -116,3 +117,51 @@ void tester_done(void)
     rc = chitcp_tester_server_exit(tester);
     ck_assert_msg(rc == 0, "Tester server did not exit");
 }
+
+uint8_t* generate_msg(int size)
+{
+    uint8_t *buf = malloc(size);
+
+    for(int i=0; i < size; i++)
+        buf[i] = i % 256;
+
+    return buf;
+}
+
+
+int client_send_recv(int sockfd, void *args)
+{
+    int rc;
+    int size = *((int *) args);
+
+    uint8_t *buf = generate_msg(size);
+
+    rc = chitcp_socket_send(sockfd, buf, size);
+    ck_assert_msg(rc == size,
+                  "Socket did not send all the bytes (expected %i, got %i)", size, rc);
+
+    free(buf);
+
+    return 0;
+}
+
+
+int server_send_recv(int sockfd, void *args)
+{
+    int rc;
+    int size = *((int *) args);
+    uint8_t *buf = malloc(size);
+
+    rc = chitcp_socket_recv(sockfd, buf, size);
+    ck_assert_msg(rc == size,
+                  "Socket did not receive all the bytes (expected %i, got %i)", size, rc);
+
+    for (int i = 0; i < size; i++)
+        ck_assert_msg(buf[i] == (i % 256),
+                      "Unexpected value encountered: buf[%i] == %i (expected %i)",
+                      i, buf[i], (i % 256));
+
+    free(buf);
+
+    return 0;
+}
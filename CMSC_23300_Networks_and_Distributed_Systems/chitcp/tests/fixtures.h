@@ -14,4 +14,11 @@ void tester_run(void);
 void tester_close(void);
 void tester_done(void);
 
+/* A message of "size" bytes (byte i is i % 256), and tester run
+ * functions that send it from the client and check that the server
+ * receives it intact. Their argument is a pointer to the size. */
+uint8_t* generate_msg(int size);
+int client_send_recv(int sockfd, void *args);
+int server_send_recv(int sockfd, void *args);
+
 #endif /* FIXTURES_H_ */